@@ -0,0 +1,156 @@
+/* ply-pixel-buffer-test.c - checks the vectorized row kernels
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/* The kernels are private, so this builds the pixel buffer code in */
+#include "ply-pixel-buffer.c"
+
+#include <stdio.h>
+
+#define MAX_ROW_WIDTH 67
+#define NUMBER_OF_ROUNDS 20000
+
+typedef struct
+{
+        const char                          *name;
+        ply_pixel_buffer_blend_row_handler_t blend_row;
+} blend_row_kernel_t;
+
+static uint32_t
+make_random_source_pixel (void)
+{
+        uint32_t alpha, red, green, blue;
+
+        switch (random () % 8) {
+        case 0:
+                return 0;
+        case 1:
+                alpha = 0xff;
+                break;
+        case 2:
+                /* not premultiplied, so the kernels hand it back */
+                return (uint32_t) random ();
+        default:
+                alpha = random () % 256;
+                break;
+        }
+
+        red = alpha > 0 ? random () % (alpha + 1) : 0;
+        green = alpha > 0 ? random () % (alpha + 1) : 0;
+        blue = alpha > 0 ? random () % (alpha + 1) : 0;
+
+        return (alpha << 24) | (red << 16) | (green << 8) | blue;
+}
+
+static uint32_t
+make_random_destination_pixel (void)
+{
+        /* mostly opaque, which is the case the kernels vectorize */
+        if (random () % 16 == 0)
+                return (uint32_t) random ();
+
+        return 0xff000000 | ((uint32_t) random () & 0x00ffffff);
+}
+
+static uint8_t
+make_random_opacity (void)
+{
+        switch (random () % 4) {
+        case 0:
+                return 0xff;
+        case 1:
+                return random () % 2 == 0 ? 0x00 : 0x01;
+        default:
+                return random () % 256;
+        }
+}
+
+static bool
+check_kernel (blend_row_kernel_t *kernel)
+{
+        uint32_t source[MAX_ROW_WIDTH + 1];
+        uint32_t destination[MAX_ROW_WIDTH + 1];
+        uint32_t expected[MAX_ROW_WIDTH + 1];
+        int round;
+
+        for (round = 0; round < NUMBER_OF_ROUNDS; round++) {
+                unsigned long offset, width, i;
+                uint8_t opacity;
+
+                /* odd starting points leave the rows unaligned */
+                offset = random () % 2;
+                width = random () % (MAX_ROW_WIDTH + 1 - offset);
+                opacity = make_random_opacity ();
+
+                for (i = 0; i < MAX_ROW_WIDTH + 1; i++) {
+                        source[i] = make_random_source_pixel ();
+                        destination[i] = make_random_destination_pixel ();
+                }
+                memcpy (expected, destination, sizeof(destination));
+
+                blend_row_at_opacity (expected + offset, source + offset, width, opacity);
+                kernel->blend_row (destination + offset, source + offset, width, opacity);
+
+                for (i = 0; i < MAX_ROW_WIDTH + 1; i++) {
+                        if (destination[i] == expected[i])
+                                continue;
+
+                        fprintf (stderr,
+                                 "%s: pixel %lu of a %lu pixel row at opacity %d is %08x, should be %08x\n",
+                                 kernel->name, i, width, opacity,
+                                 destination[i], expected[i]);
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+        blend_row_kernel_t kernels[3];
+        int number_of_kernels = 0;
+        int number_of_failures = 0;
+        int i;
+
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init ();
+
+        if (__builtin_cpu_supports ("sse2"))
+                kernels[number_of_kernels++] = (blend_row_kernel_t) { "sse2", blend_row_at_opacity_sse2 };
+        if (__builtin_cpu_supports ("avx2"))
+                kernels[number_of_kernels++] = (blend_row_kernel_t) { "avx2", blend_row_at_opacity_avx2 };
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+        kernels[number_of_kernels++] = (blend_row_kernel_t) { "neon", blend_row_at_opacity_neon };
+#endif
+
+        srandom (1);
+
+        for (i = 0; i < number_of_kernels; i++) {
+                if (!check_kernel (&kernels[i]))
+                        number_of_failures++;
+                else
+                        printf ("%s: matches the scalar kernel\n", kernels[i].name);
+        }
+
+        if (number_of_kernels == 0)
+                printf ("no vectorized kernels to check on this machine\n");
+
+        return number_of_failures > 0 ? 1 : 0;
+}
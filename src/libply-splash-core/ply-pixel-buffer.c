@@ -30,6 +30,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <math.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -41,17 +42,30 @@
 
 struct _ply_pixel_buffer
 {
-        uint32_t       *bytes;
+        uint32_t       *bytes; /* always upright, rotated for the device on flush */
+        unsigned long   row_stride; /* in device pixels */
+
+        ply_pixel_buffer_t *parent; /* whose bytes a view shares */
+        int             reference_count;
 
         ply_rectangle_t area; /* in device pixels */
         ply_rectangle_t logical_area; /* in logical pixels */
         ply_list_t     *clip_areas; /* in device pixels */
 
-        ply_region_t   *updated_areas; /* in device pixels */
+        ply_region_t   *updated_areas; /* in device pixels and orientation */
         uint32_t        is_opaque : 1;
         int             device_scale;
 
         ply_pixel_buffer_rotation_t device_rotation;
+
+        ply_list_t     *occluding_areas; /* in device pixels, in drawing order */
+        ply_rectangle_t opaque_area; /* in logical pixels */
+        uint32_t       *spans; /* see ply_pixel_buffer_find_spans */
+
+        uint32_t       *gradient_rows; /* see ply_pixel_buffer_get_gradient_rows */
+        uint32_t        gradient_start;
+        uint32_t        gradient_end;
+        unsigned long   gradient_height;
 };
 
 static inline void ply_pixel_buffer_blend_value_at_pixel (ply_pixel_buffer_t *buffer,
@@ -160,45 +174,14 @@ static inline void ply_pixel_buffer_set_pixel (ply_pixel_buffer_t *buffer,
                                                int                 y,
                                                uint32_t            pixel_value)
 {
-        switch (buffer->device_rotation) {
-        case PLY_PIXEL_BUFFER_ROTATE_UPRIGHT:
-                buffer->bytes[y * buffer->area.width + x] = pixel_value;
-                break;
-        case PLY_PIXEL_BUFFER_ROTATE_UPSIDE_DOWN:
-                x = (buffer->area.width - 1) - x;
-                y = (buffer->area.height - 1) - y;
-                buffer->bytes[y * buffer->area.width + x] = pixel_value;
-                break;
-        case PLY_PIXEL_BUFFER_ROTATE_CLOCKWISE:
-                y = (buffer->area.height - 1) - y;
-                buffer->bytes[x * buffer->area.height + y] = pixel_value;
-                break;
-        case PLY_PIXEL_BUFFER_ROTATE_COUNTER_CLOCKWISE:
-                x = (buffer->area.width - 1) - x;
-                buffer->bytes[x * buffer->area.height + y] = pixel_value;
-                break;
-        }
+        buffer->bytes[y * buffer->row_stride + x] = pixel_value;
 }
 
 static inline uint32_t ply_pixel_buffer_get_pixel (ply_pixel_buffer_t *buffer,
                                                    int                 x,
                                                    int                 y)
 {
-        switch (buffer->device_rotation) {
-        case PLY_PIXEL_BUFFER_ROTATE_UPRIGHT:
-                return buffer->bytes[y * buffer->area.width + x];
-        case PLY_PIXEL_BUFFER_ROTATE_UPSIDE_DOWN:
-                x = (buffer->area.width - 1) - x;
-                y = (buffer->area.height - 1) - y;
-                return buffer->bytes[y * buffer->area.width + x];
-        case PLY_PIXEL_BUFFER_ROTATE_CLOCKWISE:
-                y = (buffer->area.height - 1) - y;
-                return buffer->bytes[x * buffer->area.height + y];
-        case PLY_PIXEL_BUFFER_ROTATE_COUNTER_CLOCKWISE:
-                x = (buffer->area.width - 1) - x;
-                return buffer->bytes[x * buffer->area.height + y];
-        }
-        return 0;
+        return buffer->bytes[y * buffer->row_stride + x];
 }
 
 static inline void
@@ -218,6 +201,315 @@ ply_pixel_buffer_blend_value_at_pixel (ply_pixel_buffer_t *buffer,
         ply_pixel_buffer_set_pixel (buffer, x, y, pixel_value);
 }
 
+/* Composites one row of argb32 source pixels over an upright row of
+ * destination pixels at the given opacity.
+ *
+ * The vectorized variants below only handle the common case of
+ * premultiplied source pixels over an opaque destination, which keeps
+ * every intermediate value within 16 bits. Any group of pixels that
+ * doesn't fit that case is handed to the scalar code, so all variants
+ * produce exactly the same output.
+ */
+typedef void (*ply_pixel_buffer_blend_row_handler_t) (uint32_t       *destination,
+                                                      const uint32_t *source,
+                                                      unsigned long   width,
+                                                      uint8_t         opacity);
+
+static inline uint32_t
+blend_pixel_value_at_opacity (uint32_t destination_value,
+                              uint32_t source_value,
+                              uint8_t  opacity)
+{
+        if ((source_value >> 24) == 0x00)
+                return destination_value;
+
+        source_value = make_pixel_value_translucent (source_value, opacity);
+
+        if ((source_value >> 24) != 0xff)
+                source_value = blend_two_pixel_values (source_value, destination_value);
+
+        return source_value;
+}
+
+static void
+blend_row_at_opacity (uint32_t       *destination,
+                      const uint32_t *source,
+                      unsigned long   width,
+                      uint8_t         opacity)
+{
+        unsigned long i;
+
+        for (i = 0; i < width; i++) {
+                destination[i] = blend_pixel_value_at_opacity (destination[i],
+                                                               source[i],
+                                                               opacity);
+        }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* (value + (value >> 8) + 0x80) >> 8, the same rounded division by
+ * 255 the scalar code uses, on 16-bit lanes */
+__attribute__((target ("sse2")))
+static inline __m128i
+divide_by_255_sse2 (__m128i value)
+{
+        value = _mm_add_epi16 (value, _mm_srli_epi16 (value, 8));
+        value = _mm_add_epi16 (value, _mm_set1_epi16 (0x80));
+        return _mm_srli_epi16 (value, 8);
+}
+
+__attribute__((target ("sse2")))
+static inline __m128i
+broadcast_alpha_sse2 (__m128i pixels)
+{
+        pixels = _mm_shufflelo_epi16 (pixels, _MM_SHUFFLE (3, 3, 3, 3));
+        return _mm_shufflehi_epi16 (pixels, _MM_SHUFFLE (3, 3, 3, 3));
+}
+
+__attribute__((target ("sse2")))
+static inline __m128i
+blend_pixels_sse2 (__m128i source,
+                   __m128i destination,
+                   __m128i opacity)
+{
+        const __m128i max_value = _mm_set1_epi16 (0xff);
+        __m128i inverse_alpha;
+
+        source = divide_by_255_sse2 (_mm_mullo_epi16 (source, opacity));
+        inverse_alpha = _mm_sub_epi16 (max_value, broadcast_alpha_sse2 (source));
+
+        return divide_by_255_sse2 (_mm_add_epi16 (_mm_mullo_epi16 (source, max_value),
+                                                  _mm_mullo_epi16 (destination, inverse_alpha)));
+}
+
+__attribute__((target ("sse2")))
+static void
+blend_row_at_opacity_sse2 (uint32_t       *destination,
+                           const uint32_t *source,
+                           unsigned long   width,
+                           uint8_t         opacity)
+{
+        const __m128i zero = _mm_setzero_si128 ();
+        const __m128i alpha_mask = _mm_set1_epi32 (ALPHA_MASK);
+        const __m128i opacity_vector = _mm_set1_epi16 (opacity);
+        unsigned long i;
+
+        for (i = 0; i + 4 <= width; i += 4) {
+                __m128i source_pixels, destination_pixels;
+                __m128i source_low, source_high;
+                __m128i destination_low, destination_high;
+                __m128i not_premultiplied;
+
+                source_pixels = _mm_loadu_si128 ((const __m128i *) (source + i));
+                destination_pixels = _mm_loadu_si128 ((const __m128i *) (destination + i));
+
+                if (_mm_movemask_epi8 (_mm_cmpeq_epi32 (_mm_and_si128 (destination_pixels, alpha_mask),
+                                                        alpha_mask)) != 0xffff) {
+                        blend_row_at_opacity (destination + i, source + i, 4, opacity);
+                        continue;
+                }
+
+                source_low = _mm_unpacklo_epi8 (source_pixels, zero);
+                source_high = _mm_unpackhi_epi8 (source_pixels, zero);
+
+                not_premultiplied = _mm_or_si128 (_mm_cmpgt_epi16 (source_low, broadcast_alpha_sse2 (source_low)),
+                                                  _mm_cmpgt_epi16 (source_high, broadcast_alpha_sse2 (source_high)));
+                if (_mm_movemask_epi8 (not_premultiplied) != 0) {
+                        blend_row_at_opacity (destination + i, source + i, 4, opacity);
+                        continue;
+                }
+
+                destination_low = _mm_unpacklo_epi8 (destination_pixels, zero);
+                destination_high = _mm_unpackhi_epi8 (destination_pixels, zero);
+
+                _mm_storeu_si128 ((__m128i *) (destination + i),
+                                  _mm_packus_epi16 (blend_pixels_sse2 (source_low, destination_low, opacity_vector),
+                                                    blend_pixels_sse2 (source_high, destination_high, opacity_vector)));
+        }
+
+        blend_row_at_opacity (destination + i, source + i, width - i, opacity);
+}
+
+__attribute__((target ("avx2")))
+static inline __m256i
+divide_by_255_avx2 (__m256i value)
+{
+        value = _mm256_add_epi16 (value, _mm256_srli_epi16 (value, 8));
+        value = _mm256_add_epi16 (value, _mm256_set1_epi16 (0x80));
+        return _mm256_srli_epi16 (value, 8);
+}
+
+__attribute__((target ("avx2")))
+static inline __m256i
+broadcast_alpha_avx2 (__m256i pixels)
+{
+        pixels = _mm256_shufflelo_epi16 (pixels, _MM_SHUFFLE (3, 3, 3, 3));
+        return _mm256_shufflehi_epi16 (pixels, _MM_SHUFFLE (3, 3, 3, 3));
+}
+
+__attribute__((target ("avx2")))
+static inline __m256i
+blend_pixels_avx2 (__m256i source,
+                   __m256i destination,
+                   __m256i opacity)
+{
+        const __m256i max_value = _mm256_set1_epi16 (0xff);
+        __m256i inverse_alpha;
+
+        source = divide_by_255_avx2 (_mm256_mullo_epi16 (source, opacity));
+        inverse_alpha = _mm256_sub_epi16 (max_value, broadcast_alpha_avx2 (source));
+
+        return divide_by_255_avx2 (_mm256_add_epi16 (_mm256_mullo_epi16 (source, max_value),
+                                                     _mm256_mullo_epi16 (destination, inverse_alpha)));
+}
+
+__attribute__((target ("avx2")))
+static void
+blend_row_at_opacity_avx2 (uint32_t       *destination,
+                           const uint32_t *source,
+                           unsigned long   width,
+                           uint8_t         opacity)
+{
+        const __m256i zero = _mm256_setzero_si256 ();
+        const __m256i alpha_mask = _mm256_set1_epi32 (ALPHA_MASK);
+        const __m256i opacity_vector = _mm256_set1_epi16 (opacity);
+        unsigned long i;
+
+        for (i = 0; i + 8 <= width; i += 8) {
+                __m256i source_pixels, destination_pixels;
+                __m256i source_low, source_high;
+                __m256i destination_low, destination_high;
+                __m256i not_premultiplied;
+
+                source_pixels = _mm256_loadu_si256 ((const __m256i *) (source + i));
+                destination_pixels = _mm256_loadu_si256 ((const __m256i *) (destination + i));
+
+                if (_mm256_movemask_epi8 (_mm256_cmpeq_epi32 (_mm256_and_si256 (destination_pixels, alpha_mask),
+                                                              alpha_mask)) != -1) {
+                        blend_row_at_opacity_sse2 (destination + i, source + i, 8, opacity);
+                        continue;
+                }
+
+                /* unpacking and packing both work within 128-bit lanes,
+                 * so the pixel order comes back out unchanged */
+                source_low = _mm256_unpacklo_epi8 (source_pixels, zero);
+                source_high = _mm256_unpackhi_epi8 (source_pixels, zero);
+
+                not_premultiplied = _mm256_or_si256 (_mm256_cmpgt_epi16 (source_low, broadcast_alpha_avx2 (source_low)),
+                                                     _mm256_cmpgt_epi16 (source_high, broadcast_alpha_avx2 (source_high)));
+                if (_mm256_movemask_epi8 (not_premultiplied) != 0) {
+                        blend_row_at_opacity_sse2 (destination + i, source + i, 8, opacity);
+                        continue;
+                }
+
+                destination_low = _mm256_unpacklo_epi8 (destination_pixels, zero);
+                destination_high = _mm256_unpackhi_epi8 (destination_pixels, zero);
+
+                _mm256_storeu_si256 ((__m256i *) (destination + i),
+                                     _mm256_packus_epi16 (blend_pixels_avx2 (source_low, destination_low, opacity_vector),
+                                                          blend_pixels_avx2 (source_high, destination_high, opacity_vector)));
+        }
+
+        blend_row_at_opacity_sse2 (destination + i, source + i, width - i, opacity);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+static inline uint8x8_t
+divide_by_255_neon (uint16x8_t value)
+{
+        value = vaddq_u16 (value, vshrq_n_u16 (value, 8));
+        value = vaddq_u16 (value, vdupq_n_u16 (0x80));
+        return vmovn_u16 (vshrq_n_u16 (value, 8));
+}
+
+static inline bool
+any_lane_set_neon (uint8x8_t lanes)
+{
+        return vget_lane_u64 (vreinterpret_u64_u8 (lanes), 0) != 0;
+}
+
+static void
+blend_row_at_opacity_neon (uint32_t       *destination,
+                           const uint32_t *source,
+                           unsigned long   width,
+                           uint8_t         opacity)
+{
+        const uint8x8_t max_value = vdup_n_u8 (0xff);
+        const uint8x8_t opacity_vector = vdup_n_u8 (opacity);
+        unsigned long i;
+        int channel;
+
+        for (i = 0; i + 8 <= width; i += 8) {
+                uint8x8x4_t source_pixels, destination_pixels;
+                uint8x8_t not_premultiplied, inverse_alpha;
+
+                /* de-interleaves into blue, green, red and alpha planes */
+                source_pixels = vld4_u8 ((const uint8_t *) (source + i));
+                destination_pixels = vld4_u8 ((const uint8_t *) (destination + i));
+
+                if (any_lane_set_neon (vmvn_u8 (destination_pixels.val[3]))) {
+                        blend_row_at_opacity (destination + i, source + i, 8, opacity);
+                        continue;
+                }
+
+                not_premultiplied = vorr_u8 (vcgt_u8 (source_pixels.val[0], source_pixels.val[3]),
+                                             vorr_u8 (vcgt_u8 (source_pixels.val[1], source_pixels.val[3]),
+                                                      vcgt_u8 (source_pixels.val[2], source_pixels.val[3])));
+                if (any_lane_set_neon (not_premultiplied)) {
+                        blend_row_at_opacity (destination + i, source + i, 8, opacity);
+                        continue;
+                }
+
+                for (channel = 0; channel < 4; channel++) {
+                        source_pixels.val[channel] = divide_by_255_neon (vmull_u8 (source_pixels.val[channel],
+                                                                                   opacity_vector));
+                }
+
+                inverse_alpha = vsub_u8 (max_value, source_pixels.val[3]);
+
+                for (channel = 0; channel < 4; channel++) {
+                        destination_pixels.val[channel] =
+                                divide_by_255_neon (vmlal_u8 (vmull_u8 (source_pixels.val[channel], max_value),
+                                                              destination_pixels.val[channel],
+                                                              inverse_alpha));
+                }
+
+                vst4_u8 ((uint8_t *) (destination + i), destination_pixels);
+        }
+
+        blend_row_at_opacity (destination + i, source + i, width - i, opacity);
+}
+#endif
+
+static ply_pixel_buffer_blend_row_handler_t
+get_blend_row_handler (void)
+{
+        static ply_pixel_buffer_blend_row_handler_t handler = NULL;
+
+        if (handler != NULL)
+                return handler;
+
+        handler = blend_row_at_opacity;
+
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init ();
+
+        if (__builtin_cpu_supports ("avx2"))
+                handler = blend_row_at_opacity_avx2;
+        else if (__builtin_cpu_supports ("sse2"))
+                handler = blend_row_at_opacity_sse2;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+        handler = blend_row_at_opacity_neon;
+#endif
+
+        return handler;
+}
+
 static void
 ply_rectangle_upscale (ply_rectangle_t *area,
                        int              scale)
@@ -275,6 +567,10 @@ static void ply_pixel_buffer_add_updated_area (ply_pixel_buffer_t *buffer,
 {
         ply_rectangle_t updated_area = *area;
 
+        /* Whatever just got drawn may not match the spans anymore */
+        free (buffer->spans);
+        buffer->spans = NULL;
+
         switch (buffer->device_rotation) {
         case PLY_PIXEL_BUFFER_ROTATE_UPRIGHT:
                 break;
@@ -299,6 +595,96 @@ static void ply_pixel_buffer_add_updated_area (ply_pixel_buffer_t *buffer,
         ply_region_add_rectangle (buffer->updated_areas, &updated_area);
 }
 
+/* Splits area into the parts not covered by an occluding area, so layers
+ * that are going to be painted over don't get drawn.  If that ever takes
+ * more than MAX_VISIBLE_AREAS rectangles the remaining occluding areas
+ * are ignored, which only costs some overdraw.
+ */
+#define MAX_VISIBLE_AREAS 32
+
+static int
+ply_pixel_buffer_get_visible_areas (ply_pixel_buffer_t *buffer,
+                                    ply_rectangle_t    *area,
+                                    ply_rectangle_t    *visible_areas)
+{
+        ply_list_node_t *node;
+        int count;
+
+        if (area->width == 0 || area->height == 0)
+                return 0;
+
+        visible_areas[0] = *area;
+        count = 1;
+
+        for (node = ply_list_get_first_node (buffer->occluding_areas);
+             node != NULL && count > 0;
+             node = ply_list_get_next_node (buffer->occluding_areas, node)) {
+                ply_rectangle_t *occluding_area = ply_list_node_get_data (node);
+                ply_rectangle_t pieces[MAX_VISIBLE_AREAS];
+                int i, piece_count = 0;
+
+                for (i = 0; i < count; i++) {
+                        ply_rectangle_t *visible_area = &visible_areas[i];
+                        ply_rectangle_t covered_area;
+                        long top, bottom, left, right;
+
+                        ply_rectangle_intersect (visible_area, occluding_area, &covered_area);
+
+                        if (covered_area.width == 0 || covered_area.height == 0) {
+                                if (piece_count == MAX_VISIBLE_AREAS)
+                                        break;
+                                pieces[piece_count++] = *visible_area;
+                                continue;
+                        }
+
+                        if (piece_count + 4 > MAX_VISIBLE_AREAS)
+                                break;
+
+                        /* whatever is above and below the covered rows, then
+                         * whatever is left and right of it on those rows */
+                        top = covered_area.y;
+                        bottom = covered_area.y + (long) covered_area.height;
+                        left = covered_area.x;
+                        right = covered_area.x + (long) covered_area.width;
+
+                        if (top > visible_area->y) {
+                                pieces[piece_count] = *visible_area;
+                                pieces[piece_count].height = top - visible_area->y;
+                                piece_count++;
+                        }
+
+                        if (bottom < visible_area->y + (long) visible_area->height) {
+                                pieces[piece_count] = *visible_area;
+                                pieces[piece_count].y = bottom;
+                                pieces[piece_count].height = visible_area->y + (long) visible_area->height - bottom;
+                                piece_count++;
+                        }
+
+                        if (left > visible_area->x) {
+                                pieces[piece_count] = covered_area;
+                                pieces[piece_count].x = visible_area->x;
+                                pieces[piece_count].width = left - visible_area->x;
+                                piece_count++;
+                        }
+
+                        if (right < visible_area->x + (long) visible_area->width) {
+                                pieces[piece_count] = covered_area;
+                                pieces[piece_count].x = right;
+                                pieces[piece_count].width = visible_area->x + (long) visible_area->width - right;
+                                piece_count++;
+                        }
+                }
+
+                if (i < count)
+                        break;
+
+                memcpy (visible_areas, pieces, piece_count * sizeof(ply_rectangle_t));
+                count = piece_count;
+        }
+
+        return count;
+}
+
 static void
 ply_pixel_buffer_fill_area_with_pixel_value (ply_pixel_buffer_t *buffer,
                                              ply_rectangle_t    *fill_area,
@@ -306,6 +692,8 @@ ply_pixel_buffer_fill_area_with_pixel_value (ply_pixel_buffer_t *buffer,
 {
         unsigned long row, column;
         ply_rectangle_t cropped_area;
+        ply_rectangle_t visible_areas[MAX_VISIBLE_AREAS];
+        int i, visible_area_count;
 
         if (fill_area == NULL)
                 fill_area = &buffer->logical_area;
@@ -320,15 +708,20 @@ ply_pixel_buffer_fill_area_with_pixel_value (ply_pixel_buffer_t *buffer,
                 buffer->is_opaque = true;
         }
 
-        for (row = cropped_area.y; row < cropped_area.y + cropped_area.height; row++) {
-                for (column = cropped_area.x; column < cropped_area.x + cropped_area.width; column++) {
-                        ply_pixel_buffer_blend_value_at_pixel (buffer,
-                                                               column, row,
-                                                               pixel_value);
+        visible_area_count = ply_pixel_buffer_get_visible_areas (buffer, &cropped_area, visible_areas);
+        for (i = 0; i < visible_area_count; i++) {
+                ply_rectangle_t *area = &visible_areas[i];
+
+                for (row = area->y; row < area->y + area->height; row++) {
+                        for (column = area->x; column < area->x + area->width; column++) {
+                                ply_pixel_buffer_blend_value_at_pixel (buffer,
+                                                                       column, row,
+                                                                       pixel_value);
+                        }
                 }
-        }
 
-        ply_pixel_buffer_add_updated_area (buffer, &cropped_area);
+                ply_pixel_buffer_add_updated_area (buffer, area);
+        }
 }
 
 void
@@ -355,6 +748,30 @@ ply_pixel_buffer_pop_clip_area (ply_pixel_buffer_t *buffer)
         ply_list_remove_node (buffer->clip_areas, last_node);
 }
 
+void
+ply_pixel_buffer_queue_occluding_area (ply_pixel_buffer_t *buffer,
+                                       ply_rectangle_t    *occluding_area)
+{
+        ply_rectangle_t *new_occluding_area;
+
+        new_occluding_area = malloc (sizeof(*new_occluding_area));
+
+        *new_occluding_area = *occluding_area;
+        ply_pixel_buffer_adjust_area_for_device_scale (buffer, new_occluding_area);
+
+        ply_list_append_data (buffer->occluding_areas, new_occluding_area);
+}
+
+void
+ply_pixel_buffer_dequeue_occluding_area (ply_pixel_buffer_t *buffer)
+{
+        ply_list_node_t *first_node;
+
+        first_node = ply_list_get_first_node (buffer->occluding_areas);
+        free (ply_list_node_get_data (first_node));
+        ply_list_remove_node (buffer->occluding_areas, first_node);
+}
+
 ply_pixel_buffer_t *
 ply_pixel_buffer_new (unsigned long width,
                       unsigned long height)
@@ -381,6 +798,8 @@ ply_pixel_buffer_new_with_device_rotation (unsigned long               width,
 
         buffer->updated_areas = ply_region_new ();
         buffer->bytes = (uint32_t *) calloc (height, width * sizeof(uint32_t));
+        buffer->row_stride = width;
+        buffer->reference_count = 1;
         buffer->area.width = width;
         buffer->area.height = height;
         buffer->logical_area = buffer->area;
@@ -389,11 +808,69 @@ ply_pixel_buffer_new_with_device_rotation (unsigned long               width,
 
         buffer->clip_areas = ply_list_new ();
         ply_pixel_buffer_push_clip_area (buffer, &buffer->area);
+        buffer->occluding_areas = ply_list_new ();
         buffer->is_opaque = false;
 
         return buffer;
 }
 
+ply_pixel_buffer_t *
+ply_pixel_buffer_new_view (ply_pixel_buffer_t *buffer,
+                           ply_rectangle_t    *area)
+{
+        ply_pixel_buffer_t *view;
+        ply_rectangle_t logical_area;
+        int scale;
+
+        assert (buffer != NULL);
+        assert (area != NULL);
+        assert (buffer->device_rotation == PLY_PIXEL_BUFFER_ROTATE_UPRIGHT);
+
+        ply_rectangle_intersect (area, &buffer->logical_area, &logical_area);
+        if (ply_rectangle_is_empty (&logical_area)) {
+                logical_area.x = 0;
+                logical_area.y = 0;
+                logical_area.width = 0;
+                logical_area.height = 0;
+        }
+
+        scale = buffer->device_scale;
+
+        view = calloc (1, sizeof(ply_pixel_buffer_t));
+
+        view->parent = buffer;
+        buffer->reference_count++;
+        view->reference_count = 1;
+
+        view->updated_areas = ply_region_new ();
+        view->bytes = buffer->bytes + logical_area.y * scale * buffer->row_stride + logical_area.x * scale;
+        view->row_stride = buffer->row_stride;
+        view->area.width = logical_area.width * scale;
+        view->area.height = logical_area.height * scale;
+        view->logical_area.width = logical_area.width;
+        view->logical_area.height = logical_area.height;
+        view->device_scale = scale;
+        view->device_rotation = PLY_PIXEL_BUFFER_ROTATE_UPRIGHT;
+
+        /* Clip areas get scaled up, so this is the logical one */
+        view->clip_areas = ply_list_new ();
+        ply_pixel_buffer_push_clip_area (view, &view->logical_area);
+        view->occluding_areas = ply_list_new ();
+        view->is_opaque = buffer->is_opaque;
+
+        if (!buffer->is_opaque) {
+                ply_rectangle_intersect (&buffer->opaque_area, &logical_area, &view->opaque_area);
+                if (ply_rectangle_is_empty (&view->opaque_area)) {
+                        view->opaque_area.width = 0;
+                        view->opaque_area.height = 0;
+                }
+                view->opaque_area.x -= logical_area.x;
+                view->opaque_area.y -= logical_area.y;
+        }
+
+        return view;
+}
+
 static void
 free_clip_areas (ply_pixel_buffer_t *buffer)
 {
@@ -405,14 +882,36 @@ free_clip_areas (ply_pixel_buffer_t *buffer)
         buffer->clip_areas = NULL;
 }
 
+static void
+free_occluding_areas (ply_pixel_buffer_t *buffer)
+{
+        while (ply_list_get_length (buffer->occluding_areas) > 0) {
+                ply_pixel_buffer_dequeue_occluding_area (buffer);
+        }
+
+        ply_list_free (buffer->occluding_areas);
+        buffer->occluding_areas = NULL;
+}
+
 void
 ply_pixel_buffer_free (ply_pixel_buffer_t *buffer)
 {
         if (buffer == NULL)
                 return;
 
+        /* Views keep the buffer they look into around */
+        buffer->reference_count--;
+        if (buffer->reference_count > 0)
+                return;
+
         free_clip_areas (buffer);
-        free (buffer->bytes);
+        free_occluding_areas (buffer);
+        if (buffer->parent != NULL)
+                ply_pixel_buffer_free (buffer->parent);
+        else
+                free (buffer->bytes);
+        free (buffer->gradient_rows);
+        free (buffer->spans);
         ply_region_free (buffer->updated_areas);
         free (buffer);
 }
@@ -456,18 +955,224 @@ ply_pixel_buffer_set_opaque (ply_pixel_buffer_t *buffer,
         buffer->is_opaque = is_opaque;
 }
 
+void
+ply_pixel_buffer_get_opaque_area (ply_pixel_buffer_t *buffer,
+                                  ply_rectangle_t    *opaque_area)
+{
+        if (buffer->is_opaque)
+                *opaque_area = buffer->logical_area;
+        else
+                *opaque_area = buffer->opaque_area;
+}
+
+/* Finds the largest rectangle of fully opaque pixels with the usual
+ * largest rectangle in a histogram walk, where each column's bar is the
+ * number of opaque pixels ending at the current row.
+ */
+void
+ply_pixel_buffer_find_opaque_area (ply_pixel_buffer_t *buffer)
+{
+        unsigned long width = buffer->area.width;
+        unsigned long height = buffer->area.height;
+        unsigned long *heights, *stack;
+        unsigned long x, y, best_size = 0;
+        ply_rectangle_t best_area = { 0, 0, 0, 0 };
+
+        buffer->opaque_area = best_area;
+
+        if (width == 0 || height == 0)
+                return;
+
+        for (y = 0; y < height; y++) {
+                const uint32_t *row = &buffer->bytes[y * buffer->row_stride];
+
+                for (x = 0; x < width; x++) {
+                        if ((row[x] & ALPHA_MASK) != ALPHA_MASK)
+                                break;
+                }
+
+                if (x < width)
+                        break;
+        }
+
+        if (y == height) {
+                buffer->is_opaque = true;
+                return;
+        }
+
+        heights = calloc (width + 1, sizeof(unsigned long));
+        stack = malloc ((width + 1) * sizeof(unsigned long));
+
+        for (y = 0; y < height; y++) {
+                const uint32_t *row = &buffer->bytes[y * buffer->row_stride];
+                unsigned long depth = 0;
+
+                for (x = 0; x < width; x++) {
+                        if ((row[x] & ALPHA_MASK) == ALPHA_MASK)
+                                heights[x]++;
+                        else
+                                heights[x] = 0;
+                }
+
+                /* heights[width] stays 0 and flushes the stack */
+                for (x = 0; x <= width; x++) {
+                        while (depth > 0 && heights[stack[depth - 1]] >= heights[x]) {
+                                unsigned long bar_height = heights[stack[--depth]];
+                                unsigned long left = depth > 0 ? stack[depth - 1] + 1 : 0;
+
+                                if (bar_height * (x - left) > best_size) {
+                                        best_size = bar_height * (x - left);
+                                        best_area.x = left;
+                                        best_area.y = y + 1 - bar_height;
+                                        best_area.width = x - left;
+                                        best_area.height = bar_height;
+                                }
+                        }
+                        stack[depth++] = x;
+                }
+        }
+
+        free (heights);
+        free (stack);
+
+        /* Shrink to whole logical pixels */
+        if (buffer->device_scale > 1) {
+                long scale = buffer->device_scale;
+                long left = (best_area.x + scale - 1) / scale;
+                long top = (best_area.y + scale - 1) / scale;
+                long right = (best_area.x + (long) best_area.width) / scale;
+                long bottom = (best_area.y + (long) best_area.height) / scale;
+
+                best_area.x = left;
+                best_area.y = top;
+                best_area.width = MAX (right - left, 0);
+                best_area.height = MAX (bottom - top, 0);
+        }
+
+        buffer->opaque_area = best_area;
+}
+
+/* Spans describe each row as runs of transparent, opaque and translucent
+ * pixels, so blits can skip, copy or blend a whole run at once.  They're
+ * stored as height + 1 offsets to where each row's runs start, followed
+ * by the runs themselves, each one (length << SPAN_KIND_BITS) | kind.
+ */
+#define SPAN_TRANSPARENT 0
+#define SPAN_OPAQUE 1
+#define SPAN_TRANSLUCENT 2
+#define SPAN_KIND_BITS 2
+#define SPAN_KIND_MASK ((1 << SPAN_KIND_BITS) - 1)
+
+/* Below this many pixels per run on average, blending every pixel is
+ * about as quick and the spans aren't worth their memory */
+#define SPAN_MIN_AVERAGE_LENGTH 8
+#define SPAN_MIN_VECTOR_LENGTH 8
+
+__attribute__((__const__))
+static inline uint32_t
+get_span_kind (uint32_t pixel_value)
+{
+        switch (pixel_value >> 24) {
+        case 0x00:
+                return SPAN_TRANSPARENT;
+        case 0xff:
+                return SPAN_OPAQUE;
+        default:
+                return SPAN_TRANSLUCENT;
+        }
+}
+
+void
+ply_pixel_buffer_find_spans (ply_pixel_buffer_t *buffer)
+{
+        unsigned long width = buffer->area.width;
+        unsigned long height = buffer->area.height;
+        unsigned long x, y, start, run_count = 0;
+        uint32_t *runs;
+
+        free (buffer->spans);
+        buffer->spans = NULL;
+
+        /* Opaque buffers get copied row by row anyway */
+        if (buffer->is_opaque || width == 0 || height == 0)
+                return;
+
+        for (y = 0; y < height; y++) {
+                const uint32_t *row = &buffer->bytes[y * buffer->row_stride];
+
+                run_count++;
+                for (x = 1; x < width; x++) {
+                        if (get_span_kind (row[x]) != get_span_kind (row[x - 1]))
+                                run_count++;
+                }
+        }
+
+        if (run_count * SPAN_MIN_AVERAGE_LENGTH > width * height)
+                return;
+
+        buffer->spans = malloc ((height + 1 + run_count) * sizeof(uint32_t));
+        runs = buffer->spans + height + 1;
+        run_count = 0;
+
+        for (y = 0; y < height; y++) {
+                const uint32_t *row = &buffer->bytes[y * buffer->row_stride];
+
+                buffer->spans[y] = run_count;
+                for (start = 0, x = 1; x <= width; x++) {
+                        uint32_t kind = get_span_kind (row[start]);
+
+                        if (x < width && get_span_kind (row[x]) == kind)
+                                continue;
+
+                        runs[run_count++] = ((x - start) << SPAN_KIND_BITS) | kind;
+                        start = x;
+                }
+        }
+        buffer->spans[height] = run_count;
+}
+
+/* Blends width pixels of a source row, starting at column x, using the
+ * runs covering that row */
+static void
+blend_row_with_spans (uint32_t                            *destination,
+                      const uint32_t                      *source,
+                      const uint32_t                      *runs,
+                      const uint32_t                      *last_run,
+                      unsigned long                        x,
+                      unsigned long                        width,
+                      uint8_t                              opacity,
+                      ply_pixel_buffer_blend_row_handler_t blend_row)
+{
+        unsigned long start = 0;
+
+        for (; runs < last_run && start < x + width; runs++) {
+                unsigned long length = *runs >> SPAN_KIND_BITS;
+                uint32_t kind = *runs & SPAN_KIND_MASK;
+                unsigned long first = MAX (start, x);
+                unsigned long last = MIN (start + length, x + width);
+
+                start += length;
+
+                if (first >= last || kind == SPAN_TRANSPARENT)
+                        continue;
+
+                /* Calling into the vector handlers costs more than blending
+                 * the pixel or two at the edge of a shape directly */
+                if (kind == SPAN_OPAQUE && opacity == 0xff)
+                        memcpy (destination + first - x, source + first, (last - first) * sizeof(uint32_t));
+                else if (last - first < SPAN_MIN_VECTOR_LENGTH)
+                        blend_row_at_opacity (destination + first - x, source + first, last - first, opacity);
+                else
+                        blend_row (destination + first - x, source + first, last - first, opacity);
+        }
+}
+
 ply_region_t *
 ply_pixel_buffer_get_updated_areas (ply_pixel_buffer_t *buffer)
 {
         return buffer->updated_areas;
 }
 
-void
-ply_pixel_buffer_fill_with_gradient (ply_pixel_buffer_t *buffer,
-                                     ply_rectangle_t    *fill_area,
-                                     uint32_t            start,
-                                     uint32_t            end)
-{
 /* The gradient produced is a linear interpolation of the two passed
  * in color stops: start and end.
  *
@@ -511,18 +1216,39 @@ ply_pixel_buffer_fill_with_gradient (ply_pixel_buffer_t *buffer,
  */
 #define COLOR_MASK (0xff << (24 - NOISE_BITS))
 
-        uint32_t red, green, blue, red_step, green_step, blue_step, t, pixel;
-        uint32_t x, y;
+#define RANDOMIZE(num) (num = (num + (num << 1)) & NOISE_MASK)
+
+/* Each row of the gradient is a short dithered pattern repeated across
+ * the buffer.  The patterns only depend on the color stops and the
+ * buffer height, so they're generated once for the whole buffer and
+ * kept around for redraws of damaged areas.
+ */
+#define GRADIENT_PATTERN_LENGTH 8
+
+static uint32_t *
+ply_pixel_buffer_get_gradient_rows (ply_pixel_buffer_t *buffer,
+                                    uint32_t            start,
+                                    uint32_t            end)
+{
+        uint32_t red, green, blue, red_step, green_step, blue_step, t;
+        uint32_t *pattern;
+        unsigned long x, y;
         /* we use a fixed seed so that the dithering doesn't change on repaints
          * of the same area.
          */
         uint32_t noise = 0x100001;
-        ply_rectangle_t cropped_area;
 
-        if (fill_area == NULL)
-                fill_area = &buffer->logical_area;
+        if (buffer->gradient_rows != NULL &&
+            buffer->gradient_start == start &&
+            buffer->gradient_end == end &&
+            buffer->gradient_height == buffer->area.height)
+                return buffer->gradient_rows;
 
-        ply_pixel_buffer_crop_area_to_clip_area (buffer, fill_area, &cropped_area);
+        free (buffer->gradient_rows);
+        buffer->gradient_rows = malloc (buffer->area.height * GRADIENT_PATTERN_LENGTH * sizeof(uint32_t));
+        buffer->gradient_start = start;
+        buffer->gradient_end = end;
+        buffer->gradient_height = buffer->area.height;
 
         red = (start << RED_SHIFT) & COLOR_MASK;
         green = (start << GREEN_SHIFT) & COLOR_MASK;
@@ -535,43 +1261,17 @@ ply_pixel_buffer_fill_with_gradient (ply_pixel_buffer_t *buffer,
         t = (end << BLUE_SHIFT) & COLOR_MASK;
         blue_step = (int32_t) (t - blue) / (int32_t) buffer->area.height;
 
-
-#define RANDOMIZE(num) (num = (num + (num << 1)) & NOISE_MASK)
-#define UNROLLED_PIXEL_COUNT 8
-
-        for (y = buffer->area.y; y < buffer->area.y + buffer->area.height; y++) {
-                if (cropped_area.y <= y && y < cropped_area.y + cropped_area.height) {
-                        if (cropped_area.width < UNROLLED_PIXEL_COUNT || buffer->device_rotation) {
-                                for (x = cropped_area.x; x < cropped_area.x + cropped_area.width; x++) {
-                                        pixel = 0xff000000;
-                                        RANDOMIZE (noise);
-                                        pixel |= (((red + noise) & COLOR_MASK) >> RED_SHIFT);
-                                        RANDOMIZE (noise);
-                                        pixel |= (((green + noise) & COLOR_MASK) >> GREEN_SHIFT);
-                                        RANDOMIZE (noise);
-                                        pixel |= (((blue + noise) & COLOR_MASK) >> BLUE_SHIFT);
-
-                                        ply_pixel_buffer_set_pixel (buffer, x, y, pixel);
-                                }
-                        } else {
-                                uint32_t shaded_set[UNROLLED_PIXEL_COUNT];
-                                uint32_t *ptr = &buffer->bytes[y * buffer->area.width + cropped_area.x];
-                                for (x = 0; x < UNROLLED_PIXEL_COUNT; x++) {
-                                        shaded_set[x] = 0xff000000;
-                                        RANDOMIZE (noise);
-                                        shaded_set[x] |= (((red + noise) & COLOR_MASK) >> RED_SHIFT);
-                                        RANDOMIZE (noise);
-                                        shaded_set[x] |= (((green + noise) & COLOR_MASK) >> GREEN_SHIFT);
-                                        RANDOMIZE (noise);
-                                        shaded_set[x] |= (((blue + noise) & COLOR_MASK) >> BLUE_SHIFT);
-                                }
-                                for (x = cropped_area.width; x >= UNROLLED_PIXEL_COUNT; x -= UNROLLED_PIXEL_COUNT) {
-                                        memcpy (ptr, (void *) shaded_set, UNROLLED_PIXEL_COUNT * sizeof(uint32_t));
-                                        ptr += UNROLLED_PIXEL_COUNT;
-                                }
-
-                                memcpy (ptr, (void *) shaded_set, x * sizeof(uint32_t));
-                        }
+        for (y = 0; y < buffer->area.height; y++) {
+                pattern = &buffer->gradient_rows[y * GRADIENT_PATTERN_LENGTH];
+
+                for (x = 0; x < GRADIENT_PATTERN_LENGTH; x++) {
+                        pattern[x] = 0xff000000;
+                        RANDOMIZE (noise);
+                        pattern[x] |= (((red + noise) & COLOR_MASK) >> RED_SHIFT);
+                        RANDOMIZE (noise);
+                        pattern[x] |= (((green + noise) & COLOR_MASK) >> GREEN_SHIFT);
+                        RANDOMIZE (noise);
+                        pattern[x] |= (((blue + noise) & COLOR_MASK) >> BLUE_SHIFT);
                 }
 
                 red += red_step;
@@ -579,7 +1279,52 @@ ply_pixel_buffer_fill_with_gradient (ply_pixel_buffer_t *buffer,
                 blue += blue_step;
         }
 
-        ply_pixel_buffer_add_updated_area (buffer, &cropped_area);
+        return buffer->gradient_rows;
+}
+
+void
+ply_pixel_buffer_fill_with_gradient (ply_pixel_buffer_t *buffer,
+                                     ply_rectangle_t    *fill_area,
+                                     uint32_t            start,
+                                     uint32_t            end)
+{
+        const uint32_t *gradient_rows;
+        unsigned long x, y;
+        ply_rectangle_t cropped_area;
+        ply_rectangle_t visible_areas[MAX_VISIBLE_AREAS];
+        int i, visible_area_count;
+
+        if (fill_area == NULL)
+                fill_area = &buffer->logical_area;
+
+        ply_pixel_buffer_crop_area_to_clip_area (buffer, fill_area, &cropped_area);
+
+        visible_area_count = ply_pixel_buffer_get_visible_areas (buffer, &cropped_area, visible_areas);
+        if (visible_area_count == 0)
+                return;
+
+        gradient_rows = ply_pixel_buffer_get_gradient_rows (buffer, start, end);
+
+        /* Patterns are lined up with the left edge of the buffer, so
+         * areas painted separately join up without seams */
+        for (i = 0; i < visible_area_count; i++) {
+                ply_rectangle_t *area = &visible_areas[i];
+
+                for (y = area->y; y < area->y + area->height; y++) {
+                        const uint32_t *pattern = &gradient_rows[y * GRADIENT_PATTERN_LENGTH];
+                        uint32_t *row = &buffer->bytes[y * buffer->row_stride + area->x];
+
+                        for (x = 0; x < MIN (area->width, GRADIENT_PATTERN_LENGTH); x++) {
+                                row[x] = pattern[(area->x + x) % GRADIENT_PATTERN_LENGTH];
+                        }
+
+                        for (x = GRADIENT_PATTERN_LENGTH; x < area->width; x *= 2) {
+                                memcpy (row + x, row, MIN (x, area->width - x) * sizeof(uint32_t));
+                        }
+                }
+
+                ply_pixel_buffer_add_updated_area (buffer, area);
+        }
 }
 
 void
@@ -648,11 +1393,12 @@ ply_pixel_buffer_fill_with_hex_color (ply_pixel_buffer_t *buffer,
 }
 
 static inline uint32_t
-ply_pixels_interpolate (uint32_t *bytes,
-                        int       width,
-                        int       height,
-                        double    x,
-                        double    y)
+ply_pixels_interpolate (uint32_t     *bytes,
+                        int           width,
+                        int           height,
+                        unsigned long row_stride,
+                        double        x,
+                        double        y)
 {
         int ix;
         int iy;
@@ -676,7 +1422,7 @@ ply_pixels_interpolate (uint32_t *bytes,
                         if (ix < 0 || iy < 0)
                                 pixels[offset_y][offset_x] = 0x00000000;
                         else
-                                pixels[offset_y][offset_x] = bytes[ix + iy * width];
+                                pixels[offset_y][offset_x] = bytes[ix + iy * row_stride];
                 }
         }
         if (!pixels[0][0] && !pixels[0][1] && !pixels[1][0] && !pixels[1][1]) return 0;
@@ -697,20 +1443,23 @@ ply_pixels_interpolate (uint32_t *bytes,
         return reply;
 }
 
-void
-ply_pixel_buffer_fill_with_argb32_data_at_opacity_with_clip_and_scale (ply_pixel_buffer_t *buffer,
-                                                                       ply_rectangle_t    *fill_area,
-                                                                       ply_rectangle_t    *clip_area,
-                                                                       uint32_t           *data,
-                                                                       double              opacity,
-                                                                       int                 scale)
+/* spans, if not NULL, are those of data, see ply_pixel_buffer_find_spans */
+static void
+ply_pixel_buffer_fill_with_argb32_data_and_spans (ply_pixel_buffer_t *buffer,
+                                                  ply_rectangle_t    *fill_area,
+                                                  ply_rectangle_t    *clip_area,
+                                                  uint32_t           *data,
+                                                  unsigned long       data_row_stride,
+                                                  const uint32_t     *spans,
+                                                  double              opacity,
+                                                  int                 scale)
 {
         unsigned long row, column;
         uint8_t opacity_as_byte;
         ply_rectangle_t logical_fill_area;
         ply_rectangle_t cropped_area;
-        unsigned long x;
-        unsigned long y;
+        ply_rectangle_t visible_areas[MAX_VISIBLE_AREAS];
+        int i, visible_area_count;
         double scale_factor;
 
         assert (buffer != NULL);
@@ -723,6 +1472,10 @@ ply_pixel_buffer_fill_with_argb32_data_at_opacity_with_clip_and_scale (ply_pixel
                 ply_rectangle_downscale (&logical_fill_area, scale);
         }
 
+        /* 0 for rows packed one after the other */
+        if (data_row_stride == 0)
+                data_row_stride = fill_area->width;
+
         ply_pixel_buffer_crop_area_to_clip_area (buffer, &logical_fill_area, &cropped_area);
 
         if (clip_area) {
@@ -734,13 +1487,49 @@ ply_pixel_buffer_fill_with_argb32_data_at_opacity_with_clip_and_scale (ply_pixel
                 ply_rectangle_intersect (&cropped_area, &device_clip_area, &cropped_area);
         }
 
-        if (cropped_area.width == 0 || cropped_area.height == 0)
+        visible_area_count = ply_pixel_buffer_get_visible_areas (buffer, &cropped_area, visible_areas);
+        if (visible_area_count == 0)
                 return;
 
         opacity_as_byte = (uint8_t) (opacity * 255.0);
         scale_factor = (double)scale / buffer->device_scale;
-        x = cropped_area.x;
-        y = cropped_area.y;
+
+        /* Without scaling, source and destination rows line up, so whole
+         * rows can be handed to the blend row handler
+         */
+        if (buffer->device_scale == scale) {
+                ply_pixel_buffer_blend_row_handler_t blend_row;
+
+                blend_row = get_blend_row_handler ();
+
+                for (i = 0; i < visible_area_count; i++) {
+                        ply_rectangle_t *area = &visible_areas[i];
+
+                        for (row = area->y; row < area->y + area->height; row++) {
+                                unsigned long source_row = row - fill_area->y;
+
+                                if (spans != NULL) {
+                                        blend_row_with_spans (&buffer->bytes[row * buffer->row_stride + area->x],
+                                                              &data[data_row_stride * source_row],
+                                                              spans + fill_area->height + 1 + spans[source_row],
+                                                              spans + fill_area->height + 1 + spans[source_row + 1],
+                                                              area->x - fill_area->x,
+                                                              area->width,
+                                                              opacity_as_byte,
+                                                              blend_row);
+                                        continue;
+                                }
+
+                                blend_row (&buffer->bytes[row * buffer->row_stride + area->x],
+                                           &data[data_row_stride * source_row + area->x - fill_area->x],
+                                           area->width,
+                                           opacity_as_byte);
+                        }
+
+                        ply_pixel_buffer_add_updated_area (buffer, area);
+                }
+                return;
+        }
 
         /* column, row are the point we want to write into, in
            pixel_buffer coordinate space (device pixels)
@@ -748,30 +1537,49 @@ ply_pixel_buffer_fill_with_argb32_data_at_opacity_with_clip_and_scale (ply_pixel
            scale_factor * (column - fill_area->x), scale_factor * (row - fill_area->y)
            is the point we want to source from, in the data coordinate
            space */
-        for (row = y; row < y + cropped_area.height; row++) {
-                for (column = x; column < x + cropped_area.width; column++) {
-                        uint32_t pixel_value;
+        for (i = 0; i < visible_area_count; i++) {
+                ply_rectangle_t *area = &visible_areas[i];
+
+                for (row = area->y; row < area->y + area->height; row++) {
+                        for (column = area->x; column < area->x + area->width; column++) {
+                                uint32_t pixel_value;
 
-                        if (buffer->device_scale == scale)
-                                pixel_value = data[fill_area->width * (row - fill_area->y) +
-                                                   column - fill_area->x];
-                        else
                                 pixel_value = ply_pixels_interpolate (data,
                                                                       fill_area->width,
                                                                       fill_area->height,
+                                                                      data_row_stride,
                                                                       scale_factor * column - fill_area->x,
                                                                       scale_factor * row - fill_area->y);
-                        if ((pixel_value >> 24) == 0x00)
-                                continue;
+                                if ((pixel_value >> 24) == 0x00)
+                                        continue;
 
-                        pixel_value = make_pixel_value_translucent (pixel_value, opacity_as_byte);
-                        ply_pixel_buffer_blend_value_at_pixel (buffer,
-                                                               column, row,
-                                                               pixel_value);
+                                pixel_value = make_pixel_value_translucent (pixel_value, opacity_as_byte);
+                                ply_pixel_buffer_blend_value_at_pixel (buffer,
+                                                                       column, row,
+                                                                       pixel_value);
+                        }
                 }
+
+                ply_pixel_buffer_add_updated_area (buffer, area);
         }
+}
 
-        ply_pixel_buffer_add_updated_area (buffer, &cropped_area);
+void
+ply_pixel_buffer_fill_with_argb32_data_at_opacity_with_clip_and_scale (ply_pixel_buffer_t *buffer,
+                                                                       ply_rectangle_t    *fill_area,
+                                                                       ply_rectangle_t    *clip_area,
+                                                                       uint32_t           *data,
+                                                                       double              opacity,
+                                                                       int                 scale)
+{
+        ply_pixel_buffer_fill_with_argb32_data_and_spans (buffer,
+                                                          fill_area,
+                                                          clip_area,
+                                                          data,
+                                                          0,
+                                                          NULL,
+                                                          opacity,
+                                                          scale);
 }
 
 void
@@ -833,8 +1641,8 @@ ply_pixel_buffer_copy_area (ply_pixel_buffer_t *canvas,
         unsigned long row;
 
         for (row = y; row < y + cropped_area->height; row++) {
-                memcpy (canvas->bytes + (cropped_area->y + row - y) * canvas->area.width + cropped_area->x,
-                        source->bytes + (row * source->area.width) + x,
+                memcpy (canvas->bytes + (cropped_area->y + row - y) * canvas->row_stride + cropped_area->x,
+                        source->bytes + (row * source->row_stride) + x,
                         cropped_area->width * 4);
         }
 }
@@ -856,9 +1664,10 @@ ply_pixel_buffer_fill_with_buffer_at_opacity_with_clip (ply_pixel_buffer_t *canv
 
         /* Fast path to memcpy if we need no blending or scaling */
         if (opacity == 1.0 && ply_pixel_buffer_is_opaque (source) &&
-            canvas->device_scale == source->device_scale &&
-            canvas->device_rotation == PLY_PIXEL_BUFFER_ROTATE_UPRIGHT) {
+            canvas->device_scale == source->device_scale) {
                 ply_rectangle_t cropped_area;
+                ply_rectangle_t visible_areas[MAX_VISIBLE_AREAS];
+                int i, visible_area_count;
 
                 cropped_area.x = x_offset;
                 cropped_area.y = y_offset;
@@ -871,27 +1680,31 @@ ply_pixel_buffer_fill_with_buffer_at_opacity_with_clip (ply_pixel_buffer_t *canv
                 if (clip_area)
                         ply_rectangle_intersect (&cropped_area, clip_area, &cropped_area);
 
-                if (cropped_area.width == 0 || cropped_area.height == 0)
-                        return;
+                visible_area_count = ply_pixel_buffer_get_visible_areas (canvas, &cropped_area, visible_areas);
+                for (i = 0; i < visible_area_count; i++) {
+                        ply_rectangle_t *area = &visible_areas[i];
 
-                x = cropped_area.x - x_offset * canvas->device_scale;
-                y = cropped_area.y - y_offset * canvas->device_scale;
+                        x = area->x - x_offset * canvas->device_scale;
+                        y = area->y - y_offset * canvas->device_scale;
 
-                ply_pixel_buffer_copy_area (canvas, source, x, y, &cropped_area);
+                        ply_pixel_buffer_copy_area (canvas, source, x, y, area);
 
-                ply_region_add_rectangle (canvas->updated_areas, &cropped_area);
+                        ply_pixel_buffer_add_updated_area (canvas, area);
+                }
         } else {
                 fill_area.x = x_offset * source->device_scale;
                 fill_area.y = y_offset * source->device_scale;
                 fill_area.width = source->area.width;
                 fill_area.height = source->area.height;
 
-                ply_pixel_buffer_fill_with_argb32_data_at_opacity_with_clip_and_scale (canvas,
-                                                                                       &fill_area,
-                                                                                       clip_area,
-                                                                                       source->bytes,
-                                                                                       opacity,
-                                                                                       source->device_scale);
+                ply_pixel_buffer_fill_with_argb32_data_and_spans (canvas,
+                                                                  &fill_area,
+                                                                  clip_area,
+                                                                  source->bytes,
+                                                                  source->row_stride,
+                                                                  source->spans,
+                                                                  opacity,
+                                                                  source->device_scale);
         }
 }
 
@@ -945,20 +1758,450 @@ ply_pixel_buffer_get_argb32_data (ply_pixel_buffer_t *buffer)
         return buffer->bytes;
 }
 
-static inline uint32_t
-ply_pixel_buffer_interpolate (ply_pixel_buffer_t *buffer,
-                              double              x,
-                              double              y)
+unsigned long
+ply_pixel_buffer_get_row_stride (ply_pixel_buffer_t *buffer)
 {
-        int width;
-        int height;
-        uint32_t *bytes;
+        return buffer->row_stride;
+}
 
-        width = buffer->area.width;
-        height = buffer->area.height;
-        bytes = ply_pixel_buffer_get_argb32_data (buffer);
+/* Resizing is done separably in fixed point: each source row needed is
+ * scaled horizontally once into a row of 16-bit channels, then pairs
+ * (or runs) of those rows are combined vertically.  Weights have
+ * SCALE_FRACTION_BITS of precision, which keeps every intermediate
+ * product within a signed 16-bit lane for the vector code.
+ *
+ * An axis which shrinks by half or more is box filtered instead of
+ * sampled bilinearly, so large reductions don't alias.
+ */
+#define SCALE_FRACTION_BITS 7
+#define SCALE_ONE (1 << SCALE_FRACTION_BITS)
+#define SCALE_ROUNDING (1 << (2 * SCALE_FRACTION_BITS - 1))
+
+/* outputs at least this big are split into bands of rows across threads */
+#define SCALE_MIN_PIXELS_FOR_THREADS (1024 * 1024)
+#define SCALE_MIN_ROWS_PER_THREAD 64
+#define SCALE_MAX_THREADS 8
+
+typedef struct
+{
+        uint32_t start;      /* first source pixel */
+        uint32_t count;      /* pixels summed when box filtering */
+        uint32_t reciprocal; /* SCALE_ONE / count in 16.16 fixed point */
+        int16_t  weight;     /* weight of start + 1 when sampling bilinearly */
+} ply_pixel_buffer_scale_tap_t;
+
+typedef struct
+{
+        ply_pixel_buffer_scale_tap_t *taps;
+        bool                          is_box_filtered;
+} ply_pixel_buffer_scale_axis_t;
+
+typedef void (*ply_pixel_buffer_scale_row_handler_t) (int16_t                            *destination,
+                                                      const uint32_t                     *source,
+                                                      const ply_pixel_buffer_scale_tap_t *taps,
+                                                      unsigned long                       width);
+typedef void (*ply_pixel_buffer_blend_rows_handler_t) (uint32_t      *destination,
+                                                       const int16_t *upper,
+                                                       const int16_t *lower,
+                                                       int16_t        weight,
+                                                       unsigned long  width);
+
+typedef struct
+{
+        const uint32_t                       *source;
+        unsigned long                         source_width;
+        unsigned long                         source_stride;
+        uint32_t                             *destination;
+        unsigned long                         width;
+        const ply_pixel_buffer_scale_axis_t  *columns;
+        const ply_pixel_buffer_scale_axis_t  *rows;
+        unsigned long                         first_row;
+        unsigned long                         last_row;
+
+        ply_pixel_buffer_scale_row_handler_t  scale_row;
+        ply_pixel_buffer_scale_row_handler_t  box_filter_row;
+        ply_pixel_buffer_blend_rows_handler_t blend_rows;
+} ply_pixel_buffer_scale_job_t;
+
+static void
+ply_pixel_buffer_scale_axis_init (ply_pixel_buffer_scale_axis_t *axis,
+                                  unsigned long                  source_size,
+                                  unsigned long                  size)
+{
+        unsigned long i;
+
+        axis->taps = calloc (size, sizeof(ply_pixel_buffer_scale_tap_t));
+        axis->is_box_filtered = source_size >= 2 * size;
+
+        for (i = 0; i < size; i++) {
+                ply_pixel_buffer_scale_tap_t *tap = &axis->taps[i];
+
+                if (axis->is_box_filtered) {
+                        tap->start = i * source_size / size;
+                        tap->count = (i + 1) * source_size / size - tap->start;
+                        tap->reciprocal = ((SCALE_ONE << 16) + tap->count / 2) / tap->count;
+                        continue;
+                }
+
+                /* same mapping as before: the first and last pixels of
+                 * the source and destination line up */
+                uint64_t position = ((uint64_t) i * (source_size - 1) * SCALE_ONE +
+                                     MAX (size - 1, 1) / 2) / MAX (size - 1, 1);
+
+                tap->start = position >> SCALE_FRACTION_BITS;
+                tap->weight = position & (SCALE_ONE - 1);
+
+                /* never read past the last pixel, the vector code always
+                 * loads two neighbours */
+                if (source_size > 1 && tap->start >= source_size - 1) {
+                        tap->start = source_size - 2;
+                        tap->weight = SCALE_ONE;
+                }
+        }
+}
+
+static void
+scale_row_box_filtered (int16_t                            *destination,
+                        const uint32_t                     *source,
+                        const ply_pixel_buffer_scale_tap_t *taps,
+                        unsigned long                       width)
+{
+        unsigned long i, j;
+        int channel;
+
+        for (i = 0; i < width; i++) {
+                const uint8_t *pixel = (const uint8_t *) (source + taps[i].start);
+                uint32_t sums[4] = { 0, 0, 0, 0 };
+
+                for (j = 0; j < taps[i].count; j++, pixel += 4) {
+                        for (channel = 0; channel < 4; channel++) {
+                                sums[channel] += pixel[channel];
+                        }
+                }
+                for (channel = 0; channel < 4; channel++) {
+                        destination[4 * i + channel] = (sums[channel] * taps[i].reciprocal + (1 << 15)) >> 16;
+                }
+        }
+}
+
+static void
+scale_row (int16_t                            *destination,
+           const uint32_t                     *source,
+           const ply_pixel_buffer_scale_tap_t *taps,
+           unsigned long                       width)
+{
+        unsigned long i;
+        int channel;
+
+        for (i = 0; i < width; i++) {
+                const uint8_t *left = (const uint8_t *) (source + taps[i].start);
+                const uint8_t *right = taps[i].weight ? left + 4 : left;
+
+                for (channel = 0; channel < 4; channel++) {
+                        destination[4 * i + channel] = left[channel] * (SCALE_ONE - taps[i].weight) +
+                                                       right[channel] * taps[i].weight;
+                }
+        }
+}
+
+static void
+blend_rows (uint32_t      *destination,
+            const int16_t *upper,
+            const int16_t *lower,
+            int16_t        weight,
+            unsigned long  width)
+{
+        uint8_t *bytes = (uint8_t *) destination;
+        unsigned long i;
+
+        for (i = 0; i < 4 * width; i++) {
+                bytes[i] = (upper[i] * (SCALE_ONE - weight) + lower[i] * weight + SCALE_ROUNDING) >>
+                           (2 * SCALE_FRACTION_BITS);
+        }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target ("sse2")))
+static void
+scale_row_sse2 (int16_t                            *destination,
+                const uint32_t                     *source,
+                const ply_pixel_buffer_scale_tap_t *taps,
+                unsigned long                       width)
+{
+        const __m128i zero = _mm_setzero_si128 ();
+        unsigned long i;
+
+        for (i = 0; i < width; i++) {
+                __m128i neighbours, weights, products;
+
+                /* both neighbours in one load, widened to 16-bit lanes */
+                neighbours = _mm_unpacklo_epi8 (_mm_loadl_epi64 ((const __m128i *) (source + taps[i].start)),
+                                                zero);
+                weights = _mm_unpacklo_epi64 (_mm_set1_epi16 (SCALE_ONE - taps[i].weight),
+                                              _mm_set1_epi16 (taps[i].weight));
+                products = _mm_mullo_epi16 (neighbours, weights);
+                _mm_storel_epi64 ((__m128i *) (destination + 4 * i),
+                                  _mm_add_epi16 (products, _mm_srli_si128 (products, 8)));
+        }
+}
+
+__attribute__((target ("sse2")))
+static void
+scale_row_box_filtered_sse2 (int16_t                            *destination,
+                             const uint32_t                     *source,
+                             const ply_pixel_buffer_scale_tap_t *taps,
+                             unsigned long                       width)
+{
+        const __m128i zero = _mm_setzero_si128 ();
+        unsigned long i, j;
+        int channel;
+
+        for (i = 0; i < width; i++) {
+                const uint32_t *pixels = source + taps[i].start;
+                uint16_t sums[8];
+                __m128i sum = zero;
+
+                /* 16-bit lanes can only hold the sum of 257 pixels */
+                if (taps[i].count > 256) {
+                        scale_row_box_filtered (destination + 4 * i, source, taps + i, 1);
+                        continue;
+                }
+
+                for (j = 0; j + 2 <= taps[i].count; j += 2) {
+                        sum = _mm_add_epi16 (sum, _mm_unpacklo_epi8 (_mm_loadl_epi64 ((const __m128i *) (pixels + j)),
+                                                                     zero));
+                }
+                if (j < taps[i].count)
+                        sum = _mm_add_epi16 (sum, _mm_unpacklo_epi8 (_mm_cvtsi32_si128 (pixels[j]), zero));
+
+                _mm_storeu_si128 ((__m128i *) sums, _mm_add_epi16 (sum, _mm_srli_si128 (sum, 8)));
+                for (channel = 0; channel < 4; channel++) {
+                        destination[4 * i + channel] = (sums[channel] * taps[i].reciprocal + (1 << 15)) >> 16;
+                }
+        }
+}
+
+__attribute__((target ("sse2")))
+static inline __m128i
+blend_row_pixels_sse2 (const int16_t *upper,
+                       const int16_t *lower,
+                       __m128i        weights)
+{
+        const __m128i rounding = _mm_set1_epi32 (SCALE_ROUNDING);
+        __m128i upper_channels, lower_channels, low, high;
+
+        upper_channels = _mm_loadu_si128 ((const __m128i *) upper);
+        lower_channels = _mm_loadu_si128 ((const __m128i *) lower);
+
+        low = _mm_madd_epi16 (_mm_unpacklo_epi16 (upper_channels, lower_channels), weights);
+        high = _mm_madd_epi16 (_mm_unpackhi_epi16 (upper_channels, lower_channels), weights);
+        low = _mm_srai_epi32 (_mm_add_epi32 (low, rounding), 2 * SCALE_FRACTION_BITS);
+        high = _mm_srai_epi32 (_mm_add_epi32 (high, rounding), 2 * SCALE_FRACTION_BITS);
+
+        return _mm_packs_epi32 (low, high);
+}
+
+__attribute__((target ("sse2")))
+static void
+blend_rows_sse2 (uint32_t      *destination,
+                 const int16_t *upper,
+                 const int16_t *lower,
+                 int16_t        weight,
+                 unsigned long  width)
+{
+        const __m128i weights = _mm_set1_epi32 (((uint32_t) weight << 16) | (SCALE_ONE - weight));
+        unsigned long i;
+
+        for (i = 0; i + 4 <= width; i += 4) {
+                __m128i first_pixels, last_pixels;
+
+                first_pixels = blend_row_pixels_sse2 (upper + 4 * i, lower + 4 * i, weights);
+                last_pixels = blend_row_pixels_sse2 (upper + 4 * i + 8, lower + 4 * i + 8, weights);
+                _mm_storeu_si128 ((__m128i *) (destination + i),
+                                  _mm_packus_epi16 (first_pixels, last_pixels));
+        }
+
+        blend_rows (destination + i, upper + 4 * i, lower + 4 * i, weight, width - i);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static void
+scale_row_neon (int16_t                            *destination,
+                const uint32_t                     *source,
+                const ply_pixel_buffer_scale_tap_t *taps,
+                unsigned long                       width)
+{
+        unsigned long i;
+
+        for (i = 0; i < width; i++) {
+                uint16x8_t neighbours, weights, products;
+
+                neighbours = vmovl_u8 (vld1_u8 ((const uint8_t *) (source + taps[i].start)));
+                weights = vcombine_u16 (vdup_n_u16 (SCALE_ONE - taps[i].weight),
+                                        vdup_n_u16 (taps[i].weight));
+                products = vmulq_u16 (neighbours, weights);
+                vst1_u16 ((uint16_t *) (destination + 4 * i),
+                          vadd_u16 (vget_low_u16 (products), vget_high_u16 (products)));
+        }
+}
+
+static void
+blend_rows_neon (uint32_t      *destination,
+                 const int16_t *upper,
+                 const int16_t *lower,
+                 int16_t        weight,
+                 unsigned long  width)
+{
+        unsigned long i;
+
+        for (i = 0; i + 2 <= width; i += 2) {
+                int16x8_t upper_channels, lower_channels;
+                int32x4_t low, high;
+
+                upper_channels = vld1q_s16 (upper + 4 * i);
+                lower_channels = vld1q_s16 (lower + 4 * i);
+
+                low = vmull_n_s16 (vget_low_s16 (upper_channels), SCALE_ONE - weight);
+                low = vmlal_n_s16 (low, vget_low_s16 (lower_channels), weight);
+                high = vmull_n_s16 (vget_high_s16 (upper_channels), SCALE_ONE - weight);
+                high = vmlal_n_s16 (high, vget_high_s16 (lower_channels), weight);
+
+                vst1_u8 ((uint8_t *) (destination + i),
+                         vqmovun_s16 (vcombine_s16 (vrshrn_n_s32 (low, 2 * SCALE_FRACTION_BITS),
+                                                    vrshrn_n_s32 (high, 2 * SCALE_FRACTION_BITS))));
+        }
+
+        blend_rows (destination + i, upper + 4 * i, lower + 4 * i, weight, width - i);
+}
+#endif
+
+static void
+get_scale_row_handlers (ply_pixel_buffer_scale_row_handler_t  *scale_row_handler,
+                        ply_pixel_buffer_scale_row_handler_t  *box_filter_row_handler,
+                        ply_pixel_buffer_blend_rows_handler_t *blend_rows_handler)
+{
+        *scale_row_handler = scale_row;
+        *box_filter_row_handler = scale_row_box_filtered;
+        *blend_rows_handler = blend_rows;
+
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init ();
+
+        if (__builtin_cpu_supports ("sse2")) {
+                *scale_row_handler = scale_row_sse2;
+                *box_filter_row_handler = scale_row_box_filtered_sse2;
+                *blend_rows_handler = blend_rows_sse2;
+        }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+        *scale_row_handler = scale_row_neon;
+        *blend_rows_handler = blend_rows_neon;
+#endif
+}
+
+static void
+scale_source_row (const ply_pixel_buffer_scale_job_t *job,
+                  int16_t                            *destination,
+                  unsigned long                       source_row)
+{
+        const uint32_t *source = job->source + source_row * job->source_stride;
+
+        if (job->columns->is_box_filtered)
+                job->box_filter_row (destination, source, job->columns->taps, job->width);
+        else if (job->source_width < 2)
+                scale_row (destination, source, job->columns->taps, job->width);
+        else
+                job->scale_row (destination, source, job->columns->taps, job->width);
+}
+
+static void *
+ply_pixel_buffer_run_scale_job (void *user_data)
+{
+        ply_pixel_buffer_scale_job_t *job = user_data;
+        int16_t *scaled_rows[2];
+        long scaled_row_sources[2] = { -1, -1 };
+        int32_t *sums = NULL;
+        unsigned long row, i;
+
+        scaled_rows[0] = malloc (4 * job->width * sizeof(int16_t));
+        scaled_rows[1] = malloc (4 * job->width * sizeof(int16_t));
+        if (job->rows->is_box_filtered)
+                sums = malloc (4 * job->width * sizeof(int32_t));
+
+        for (row = job->first_row; row < job->last_row; row++) {
+                const ply_pixel_buffer_scale_tap_t *tap = &job->rows->taps[row];
+                uint32_t *destination = job->destination + row * job->width;
+                int upper, lower;
+
+                if (job->rows->is_box_filtered) {
+                        uint8_t *bytes = (uint8_t *) destination;
+                        uint64_t reciprocal = ((UINT64_C (1) << 32) + tap->count * SCALE_ONE / 2) /
+                                              (tap->count * SCALE_ONE);
+
+                        memset (sums, 0, 4 * job->width * sizeof(int32_t));
+                        for (i = 0; i < tap->count; i++) {
+                                unsigned long j;
+
+                                scale_source_row (job, scaled_rows[0], tap->start + i);
+                                for (j = 0; j < 4 * job->width; j++) {
+                                        sums[j] += scaled_rows[0][j];
+                                }
+                        }
+                        for (i = 0; i < 4 * job->width; i++) {
+                                bytes[i] = (sums[i] * reciprocal + (UINT64_C (1) << 31)) >> 32;
+                        }
+                        continue;
+                }
+
+                /* Upscaling walks over the same pair of source rows many
+                 * times, so keep the last two scaled rows around */
+                if (scaled_row_sources[0] == tap->start) {
+                        upper = 0;
+                } else if (scaled_row_sources[1] == tap->start) {
+                        upper = 1;
+                } else {
+                        upper = scaled_row_sources[0] == tap->start + 1 ? 1 : 0;
+                        scale_source_row (job, scaled_rows[upper], tap->start);
+                        scaled_row_sources[upper] = tap->start;
+                }
+
+                if (tap->weight == 0) {
+                        job->blend_rows (destination, scaled_rows[upper], scaled_rows[upper], 0, job->width);
+                        continue;
+                }
+
+                lower = !upper;
+                if (scaled_row_sources[lower] != tap->start + 1) {
+                        scale_source_row (job, scaled_rows[lower], tap->start + 1);
+                        scaled_row_sources[lower] = tap->start + 1;
+                }
+                job->blend_rows (destination, scaled_rows[upper], scaled_rows[lower], tap->weight, job->width);
+        }
+
+        free (sums);
+        free (scaled_rows[0]);
+        free (scaled_rows[1]);
+        return NULL;
+}
+
+static int
+ply_pixel_buffer_get_number_of_scale_threads (unsigned long width,
+                                              unsigned long height)
+{
+        long number_of_processors;
+        unsigned long number_of_threads;
 
-        return ply_pixels_interpolate (bytes, width, height, x, y);
+        if (width * height < SCALE_MIN_PIXELS_FOR_THREADS)
+                return 1;
+
+        number_of_processors = sysconf (_SC_NPROCESSORS_ONLN);
+        if (number_of_processors < 1)
+                return 1;
+
+        number_of_threads = MIN ((unsigned long) number_of_processors, SCALE_MAX_THREADS);
+        number_of_threads = MIN (number_of_threads, height / SCALE_MIN_ROWS_PER_THREAD);
+
+        return MAX (number_of_threads, 1);
 }
 
 ply_pixel_buffer_t *
@@ -967,31 +2210,254 @@ ply_pixel_buffer_resize (ply_pixel_buffer_t *old_buffer,
                          long                height)
 {
         ply_pixel_buffer_t *buffer;
-        int x, y;
-        double old_x, old_y;
-        int old_width, old_height;
-        double scale_x, scale_y;
-        uint32_t *bytes;
+        ply_pixel_buffer_scale_axis_t columns, rows;
+        ply_pixel_buffer_scale_job_t jobs[SCALE_MAX_THREADS];
+        pthread_t threads[SCALE_MAX_THREADS];
+        bool thread_started[SCALE_MAX_THREADS] = { false };
+        int number_of_jobs, i;
 
         buffer = ply_pixel_buffer_new (width, height);
 
-        bytes = ply_pixel_buffer_get_argb32_data (buffer);
+        if (width <= 0 || height <= 0 ||
+            old_buffer->area.width == 0 || old_buffer->area.height == 0)
+                return buffer;
+
+        ply_pixel_buffer_scale_axis_init (&columns, old_buffer->area.width, width);
+        ply_pixel_buffer_scale_axis_init (&rows, old_buffer->area.height, height);
+
+        number_of_jobs = ply_pixel_buffer_get_number_of_scale_threads (width, height);
+        get_scale_row_handlers (&jobs[0].scale_row, &jobs[0].box_filter_row, &jobs[0].blend_rows);
+
+        for (i = 0; i < number_of_jobs; i++) {
+                jobs[i].source = ply_pixel_buffer_get_argb32_data (old_buffer);
+                jobs[i].source_width = old_buffer->area.width;
+                jobs[i].source_stride = old_buffer->row_stride;
+                jobs[i].destination = ply_pixel_buffer_get_argb32_data (buffer);
+                jobs[i].width = width;
+                jobs[i].columns = &columns;
+                jobs[i].rows = &rows;
+                jobs[i].first_row = height * i / number_of_jobs;
+                jobs[i].last_row = height * (i + 1) / number_of_jobs;
+                jobs[i].scale_row = jobs[0].scale_row;
+                jobs[i].box_filter_row = jobs[0].box_filter_row;
+                jobs[i].blend_rows = jobs[0].blend_rows;
+        }
 
-        old_width = old_buffer->area.width;
-        old_height = old_buffer->area.height;
+        /* the calling thread takes the first band itself, and any band
+         * whose thread can't be started */
+        for (i = 1; i < number_of_jobs; i++) {
+                thread_started[i] = pthread_create (&threads[i], NULL,
+                                                    ply_pixel_buffer_run_scale_job,
+                                                    &jobs[i]) == 0;
+        }
+        for (i = 0; i < number_of_jobs; i++) {
+                if (!thread_started[i])
+                        ply_pixel_buffer_run_scale_job (&jobs[i]);
+        }
+        for (i = 1; i < number_of_jobs; i++) {
+                if (thread_started[i])
+                        pthread_join (threads[i], NULL);
+        }
+
+        free (columns.taps);
+        free (rows.taps);
+
+        /* Only buffers with opaque pixels to start with can have any
+         * after being resized */
+        if (old_buffer->is_opaque ||
+            (old_buffer->opaque_area.width > 0 && old_buffer->opaque_area.height > 0))
+                ply_pixel_buffer_find_opaque_area (buffer);
+
+        if (old_buffer->spans != NULL)
+                ply_pixel_buffer_find_spans (buffer);
+
+        return buffer;
+}
+
+/* Rotations step through the source in fixed point with this many
+ * fractional bits, which keeps the accumulated error across a row far
+ * below what the interpolation weights can resolve */
+#define ROTATION_FRACTION_BITS 32
+#define ROTATION_WEIGHT_BITS 12
+#define ROTATION_BLOCK_SIZE 32
+
+static inline int64_t
+floor_divide (int64_t dividend,
+              int64_t divisor)
+{
+        int64_t quotient = dividend / divisor;
+
+        if (dividend % divisor != 0 && dividend < 0)
+                quotient--;
+
+        return quotient;
+}
 
-        scale_x = ((double) old_width - 1) / MAX (width - 1, 1);
-        scale_y = ((double) old_height - 1) / MAX (height - 1, 1);
+/* Narrows [*first, *last] to the steps x for which
+ * 0 <= start + x * step <= limit */
+static void
+clip_span_to_limit (int64_t start,
+                    int64_t step,
+                    int64_t limit,
+                    long   *first,
+                    long   *last)
+{
+        int64_t lowest, highest;
+
+        if (step == 0) {
+                if (start < 0 || start > limit)
+                        *last = *first - 1;
+                return;
+        }
+
+        if (step < 0) {
+                start = limit - start;
+                step = -step;
+        }
+
+        lowest = -floor_divide (start, step);
+        highest = floor_divide (limit - start, step);
+
+        if (lowest > *first)
+                *first = lowest;
+        if (highest < *last)
+                *last = highest;
+}
+
+static inline uint32_t
+interpolate_pixels (const uint32_t *top,
+                    const uint32_t *bottom,
+                    unsigned long   right_offset,
+                    uint32_t        x_weight,
+                    uint32_t        y_weight)
+{
+        uint32_t reply = 0;
+        int channel;
+
+        if (!(top[0] | top[right_offset] | bottom[0] | bottom[right_offset]))
+                return 0;
+
+        for (channel = 0; channel < 32; channel += 8) {
+                uint32_t upper, lower;
+
+                upper = ((top[0] >> channel) & 0xff) * ((1 << ROTATION_WEIGHT_BITS) - x_weight) +
+                        ((top[right_offset] >> channel) & 0xff) * x_weight;
+                lower = ((bottom[0] >> channel) & 0xff) * ((1 << ROTATION_WEIGHT_BITS) - x_weight) +
+                        ((bottom[right_offset] >> channel) & 0xff) * x_weight;
+
+                reply |= ((upper * ((1 << ROTATION_WEIGHT_BITS) - y_weight) + lower * y_weight) >>
+                          (2 * ROTATION_WEIGHT_BITS)) << channel;
+        }
+
+        return reply;
+}
+
+/* The source pixel for (x, y) is at start + x * step + y * (-step_y, step_x),
+ * like a rotation about the start point.  Positions exactly on the far
+ * edge read the last row or column, as interpolation there always did.
+ */
+static void
+rotate_by_right_angle (uint32_t       *destination,
+                       const uint32_t *source,
+                       unsigned long   source_stride,
+                       long            width,
+                       long            height,
+                       long            start_x,
+                       long            start_y,
+                       long            step_x,
+                       long            step_y)
+{
+        long firsts[ROTATION_BLOCK_SIZE], lasts[ROTATION_BLOCK_SIZE];
+        long block_x, block_y, x, y;
+
+        /* Work in square blocks, so that when the source is read down
+         * its columns, the rows it touches stay in cache */
+        for (block_y = 0; block_y < height; block_y += ROTATION_BLOCK_SIZE) {
+                long rows = MIN (ROTATION_BLOCK_SIZE, height - block_y);
+
+                for (y = 0; y < rows; y++) {
+                        long row_x = start_x - (block_y + y) * step_y;
+                        long row_y = start_y + (block_y + y) * step_x;
+
+                        firsts[y] = 0;
+                        lasts[y] = width - 1;
+                        clip_span_to_limit (row_x, step_x, width, &firsts[y], &lasts[y]);
+                        clip_span_to_limit (row_y, step_y, height, &firsts[y], &lasts[y]);
+                }
+
+                for (block_x = 0; block_x < width; block_x += ROTATION_BLOCK_SIZE) {
+                        for (y = 0; y < rows; y++) {
+                                uint32_t *row = destination + (block_y + y) * width;
+                                long row_x = start_x - (block_y + y) * step_y;
+                                long row_y = start_y + (block_y + y) * step_x;
+                                long first = MAX (block_x, firsts[y]);
+                                long last = MIN (block_x + ROTATION_BLOCK_SIZE - 1, lasts[y]);
+
+                                for (x = first; x <= last; x++) {
+                                        long source_x = MIN (row_x + x * step_x, width - 1);
+                                        long source_y = MIN (row_y + x * step_y, height - 1);
+
+                                        row[x] = source[source_y * source_stride + source_x];
+                                }
+                        }
+                }
+        }
+}
+
+static void
+rotate_by_angle (uint32_t       *destination,
+                 const uint32_t *source,
+                 unsigned long   source_stride,
+                 long            width,
+                 long            height,
+                 int64_t         start_x,
+                 int64_t         start_y,
+                 int64_t         step_x,
+                 int64_t         step_y)
+{
+        const int64_t one = INT64_C (1) << ROTATION_FRACTION_BITS;
+        long x, y;
 
         for (y = 0; y < height; y++) {
-                old_y = y * scale_y;
-                for (x = 0; x < width; x++) {
-                        old_x = x * scale_x;
-                        bytes[x + y * width] =
-                                ply_pixel_buffer_interpolate (old_buffer, old_x, old_y);
+                int64_t row_x = start_x - y * step_y;
+                int64_t row_y = start_y + y * step_x;
+                long first = 0, last = width - 1;
+                int64_t source_x, source_y;
+
+                clip_span_to_limit (row_x, step_x, width * one, &first, &last);
+                clip_span_to_limit (row_y, step_y, height * one, &first, &last);
+
+                source_x = row_x + first * step_x;
+                source_y = row_y + first * step_y;
+
+                for (x = first; x <= last; x++) {
+                        long column = source_x >> ROTATION_FRACTION_BITS;
+                        long row = source_y >> ROTATION_FRACTION_BITS;
+                        long next_column = MIN (column + 1, width - 1);
+                        long next_row = MIN (row + 1, height - 1);
+
+                        column = MIN (column, width - 1);
+                        row = MIN (row, height - 1);
+
+                        destination[y * width + x] =
+                                interpolate_pixels (source + row * source_stride + column,
+                                                    source + next_row * source_stride + column,
+                                                    next_column - column,
+                                                    (source_x >> (ROTATION_FRACTION_BITS - ROTATION_WEIGHT_BITS)) &
+                                                    ((1 << ROTATION_WEIGHT_BITS) - 1),
+                                                    (source_y >> (ROTATION_FRACTION_BITS - ROTATION_WEIGHT_BITS)) &
+                                                    ((1 << ROTATION_WEIGHT_BITS) - 1));
+
+                        source_x += step_x;
+                        source_y += step_y;
                 }
         }
-        return buffer;
+}
+
+static inline bool
+is_nearly_integer (double value)
+{
+        return fabs (value - round (value)) < 1e-6;
 }
 
 ply_pixel_buffer_t *
@@ -1001,8 +2467,6 @@ ply_pixel_buffer_rotate (ply_pixel_buffer_t *old_buffer,
                          double              theta_offset)
 {
         ply_pixel_buffer_t *buffer;
-        int x, y;
-        double old_x, old_y;
         int width;
         int height;
         uint32_t *bytes;
@@ -1022,31 +2486,103 @@ ply_pixel_buffer_rotate (ply_pixel_buffer_t *old_buffer,
         double step_x = cos (-theta_offset);
         double step_y = sin (-theta_offset);
 
-        for (y = 0; y < height; y++) {
-                old_y = start_y;
-                old_x = start_x;
-                start_y += step_x;
-                start_x -= step_y;
-                for (x = 0; x < width; x++) {
-                        if (old_x < 0 || old_x > width || old_y < 0 || old_y > height)
-                                bytes[x + y * width] = 0;
-                        else
-                                bytes[x + y * width] =
-                                        ply_pixel_buffer_interpolate (old_buffer, old_x, old_y);
-                        old_x += step_x;
-                        old_y += step_y;
-                }
+        if (width == 0 || height == 0)
+                return buffer;
+
+        /* Quarter turns about a pixel corner land every sample exactly
+         * on a source pixel, so they're just copies */
+        if (is_nearly_integer (step_x) && is_nearly_integer (step_y) &&
+            is_nearly_integer (start_x) && is_nearly_integer (start_y)) {
+                rotate_by_right_angle (bytes, old_buffer->bytes, old_buffer->row_stride,
+                                       width, height,
+                                       lround (start_x), lround (start_y),
+                                       lround (step_x), lround (step_y));
+                return buffer;
         }
+
+        rotate_by_angle (bytes, old_buffer->bytes, old_buffer->row_stride,
+                         width, height,
+                         llround (ldexp (start_x, ROTATION_FRACTION_BITS)),
+                         llround (ldexp (start_y, ROTATION_FRACTION_BITS)),
+                         llround (ldexp (step_x, ROTATION_FRACTION_BITS)),
+                         llround (ldexp (step_y, ROTATION_FRACTION_BITS)));
         return buffer;
 }
 
+/* Copies a width x height area of pixels, laid out the way a device with
+ * the given rotation scans them out, into upright rows, so
+ * destination[y][x] is the pixel seen at (x, y) with the device upright */
+static void
+ply_pixel_buffer_copy_rotated (uint32_t                   *destination,
+                               unsigned long               destination_stride,
+                               const uint32_t             *source,
+                               unsigned long               source_stride,
+                               unsigned long               width,
+                               unsigned long               height,
+                               ply_pixel_buffer_rotation_t rotation)
+{
+        unsigned long block_x, block_y, x, y;
+
+        switch (rotation) {
+        case PLY_PIXEL_BUFFER_ROTATE_UPRIGHT:
+                if (destination_stride == width && source_stride == width) {
+                        memcpy (destination, source, width * height * sizeof(uint32_t));
+                        return;
+                }
+
+                for (y = 0; y < height; y++) {
+                        memcpy (destination + y * destination_stride,
+                                source + y * source_stride,
+                                width * sizeof(uint32_t));
+                }
+                return;
+
+        case PLY_PIXEL_BUFFER_ROTATE_UPSIDE_DOWN:
+                for (y = 0; y < height; y++) {
+                        const uint32_t *source_row = source + (height - 1 - y) * source_stride + width - 1;
+                        uint32_t *destination_row = destination + y * destination_stride;
+
+                        for (x = 0; x < width; x++) {
+                                destination_row[x] = *(source_row - x);
+                        }
+                }
+                return;
+
+        case PLY_PIXEL_BUFFER_ROTATE_CLOCKWISE:
+        case PLY_PIXEL_BUFFER_ROTATE_COUNTER_CLOCKWISE:
+                break;
+        }
+
+        /* Quarter turns are transposes, done in square blocks so the
+         * source rows being read down stay in cache */
+        for (block_y = 0; block_y < height; block_y += ROTATION_BLOCK_SIZE) {
+                for (block_x = 0; block_x < width; block_x += ROTATION_BLOCK_SIZE) {
+                        unsigned long last_x = MIN (block_x + ROTATION_BLOCK_SIZE, width);
+                        unsigned long last_y = MIN (block_y + ROTATION_BLOCK_SIZE, height);
+
+                        for (y = block_y; y < last_y; y++) {
+                                uint32_t *destination_row = destination + y * destination_stride;
+
+                                if (rotation == PLY_PIXEL_BUFFER_ROTATE_CLOCKWISE) {
+                                        for (x = block_x; x < last_x; x++) {
+                                                destination_row[x] = source[x * source_stride + (height - 1 - y)];
+                                        }
+                                } else {
+                                        for (x = block_x; x < last_x; x++) {
+                                                destination_row[x] = source[(width - 1 - x) * source_stride + y];
+                                        }
+                                }
+                        }
+                }
+        }
+}
+
 ply_pixel_buffer_t *
 ply_pixel_buffer_tile (ply_pixel_buffer_t *old_buffer,
                        long                width,
                        long                height)
 {
         long x, y;
-        long old_x, old_y;
         long old_width, old_height;
         uint32_t *bytes, *old_bytes;
         ply_pixel_buffer_t *buffer;
@@ -1059,13 +2595,33 @@ ply_pixel_buffer_tile (ply_pixel_buffer_t *old_buffer,
         old_width = old_buffer->area.width;
         old_height = old_buffer->area.height;
 
-        for (y = 0; y < height; y++) {
-                old_y = y % old_height;
-                for (x = 0; x < width; x++) {
-                        old_x = x % old_width;
-                        bytes[x + y * width] = old_bytes[old_x + old_y * old_width];
+        if (old_width == 0 || old_height == 0)
+                return buffer;
+
+        /* Build the first old_height rows by repeating each source row
+         * across, then every row after that is a copy of the row one tile
+         * above it */
+        for (y = 0; y < MIN (height, old_height); y++) {
+                uint32_t *row = &bytes[y * width];
+
+                memcpy (row, &old_bytes[y * old_buffer->row_stride], MIN (old_width, width) * sizeof(uint32_t));
+                for (x = old_width; x < width; x *= 2) {
+                        memcpy (row + x, row, MIN (x, width - x) * sizeof(uint32_t));
                 }
         }
+
+        for (; y < height; y++) {
+                memcpy (&bytes[y * width], &bytes[(y - old_height) * width], width * sizeof(uint32_t));
+        }
+
+        if (old_buffer->is_opaque)
+                buffer->is_opaque = true;
+        else if (old_buffer->opaque_area.width > 0 && old_buffer->opaque_area.height > 0)
+                ply_pixel_buffer_find_opaque_area (buffer);
+
+        if (old_buffer->spans != NULL)
+                ply_pixel_buffer_find_spans (buffer);
+
         return buffer;
 }
 
@@ -1091,24 +2647,132 @@ ply_pixel_buffer_get_device_rotation (ply_pixel_buffer_t *buffer)
         return buffer->device_rotation;
 }
 
+static ply_pixel_buffer_rotation_t
+get_inverse_rotation (ply_pixel_buffer_rotation_t rotation)
+{
+        switch (rotation) {
+        case PLY_PIXEL_BUFFER_ROTATE_UPRIGHT:
+        case PLY_PIXEL_BUFFER_ROTATE_UPSIDE_DOWN:
+                break;
+        case PLY_PIXEL_BUFFER_ROTATE_CLOCKWISE:
+                return PLY_PIXEL_BUFFER_ROTATE_COUNTER_CLOCKWISE;
+        case PLY_PIXEL_BUFFER_ROTATE_COUNTER_CLOCKWISE:
+                return PLY_PIXEL_BUFFER_ROTATE_CLOCKWISE;
+        }
+
+        return rotation;
+}
+
+static bool
+is_quarter_turn (ply_pixel_buffer_rotation_t rotation)
+{
+        return rotation == PLY_PIXEL_BUFFER_ROTATE_CLOCKWISE ||
+               rotation == PLY_PIXEL_BUFFER_ROTATE_COUNTER_CLOCKWISE;
+}
+
+void
+ply_pixel_buffer_copy_device_area (ply_pixel_buffer_t *buffer,
+                                   ply_rectangle_t    *device_area,
+                                   uint32_t           *destination,
+                                   unsigned long       destination_row_stride)
+{
+        ply_rectangle_t area;
+
+        /* The upright area that ply_pixel_buffer_add_updated_area turned
+         * into device_area */
+        area = *device_area;
+        switch (buffer->device_rotation) {
+        case PLY_PIXEL_BUFFER_ROTATE_UPRIGHT:
+                break;
+        case PLY_PIXEL_BUFFER_ROTATE_UPSIDE_DOWN:
+                area.x = buffer->area.width - device_area->width - device_area->x;
+                area.y = buffer->area.height - device_area->height - device_area->y;
+                break;
+        case PLY_PIXEL_BUFFER_ROTATE_CLOCKWISE:
+                area.x = device_area->y;
+                area.y = buffer->area.height - device_area->width - device_area->x;
+                area.width = device_area->height;
+                area.height = device_area->width;
+                break;
+        case PLY_PIXEL_BUFFER_ROTATE_COUNTER_CLOCKWISE:
+                area.x = buffer->area.width - device_area->height - device_area->y;
+                area.y = device_area->x;
+                area.width = device_area->height;
+                area.height = device_area->width;
+                break;
+        }
+
+        /* Seen from the device, the upright data is stored turned the
+         * other way round */
+        ply_pixel_buffer_copy_rotated (destination,
+                                       destination_row_stride / sizeof(uint32_t),
+                                       &buffer->bytes[area.y * buffer->row_stride + area.x],
+                                       buffer->row_stride,
+                                       device_area->width, device_area->height,
+                                       get_inverse_rotation (buffer->device_rotation));
+}
+
 void
 ply_pixel_buffer_set_device_rotation (ply_pixel_buffer_t *buffer,
                                       ply_pixel_buffer_rotation_t device_rotation)
 {
+        ply_rectangle_t device_area;
+        uint32_t *old_bytes, *device_bytes;
+        unsigned long width, height;
+
         if (buffer->device_rotation == device_rotation)
                 return;
 
-        buffer->device_rotation = device_rotation;
+        /* the bytes get replaced, which views would be left pointing into */
+        assert (buffer->parent == NULL && buffer->reference_count == 1);
 
-        if (device_rotation == PLY_PIXEL_BUFFER_ROTATE_CLOCKWISE ||
-            device_rotation == PLY_PIXEL_BUFFER_ROTATE_COUNTER_CLOCKWISE) {
-                unsigned long tmp = buffer->area.width;
-                buffer->area.width = buffer->area.height;
-                buffer->area.height = tmp;
+        device_area.x = 0;
+        device_area.y = 0;
+        device_area.width = buffer->area.width;
+        device_area.height = buffer->area.height;
+        if (is_quarter_turn (buffer->device_rotation)) {
+                device_area.width = buffer->area.height;
+                device_area.height = buffer->area.width;
+        }
 
-                ply_pixel_buffer_set_device_scale (buffer, buffer->device_scale);
+        /* Get the contents as the old device would scan them out... */
+        old_bytes = buffer->bytes;
+        if (buffer->device_rotation == PLY_PIXEL_BUFFER_ROTATE_UPRIGHT) {
+                device_bytes = old_bytes;
+        } else {
+                device_bytes = malloc (device_area.width * device_area.height * sizeof(uint32_t));
+                ply_pixel_buffer_copy_device_area (buffer, &device_area, device_bytes,
+                                                   device_area.width * sizeof(uint32_t));
         }
 
+        /* ...and turn them upright for the new one */
+        width = device_area.width;
+        height = device_area.height;
+        if (is_quarter_turn (device_rotation)) {
+                width = device_area.height;
+                height = device_area.width;
+        }
+
+        buffer->bytes = malloc (width * height * sizeof(uint32_t));
+        ply_pixel_buffer_copy_rotated (buffer->bytes, width,
+                                       device_bytes, device_area.width,
+                                       width, height,
+                                       device_rotation);
+
+        if (device_bytes != old_bytes)
+                free (device_bytes);
+        free (old_bytes);
+
+        buffer->device_rotation = device_rotation;
+        buffer->row_stride = width;
+        buffer->area.width = width;
+        buffer->area.height = height;
+        buffer->opaque_area.width = 0;
+        buffer->opaque_area.height = 0;
+        free (buffer->spans);
+        buffer->spans = NULL;
+        ply_pixel_buffer_set_device_scale (buffer, buffer->device_scale);
+
         while (ply_list_get_length (buffer->clip_areas) > 0) {
                 ply_pixel_buffer_pop_clip_area (buffer);
         }
@@ -1119,20 +2783,13 @@ ply_pixel_buffer_t *
 ply_pixel_buffer_rotate_upright (ply_pixel_buffer_t *old_buffer)
 {
         ply_pixel_buffer_t *buffer;
-        int x,y, width, height;
-        uint32_t pixel;
 
-        width = old_buffer->area.width;
-        height = old_buffer->area.height;
+        buffer = ply_pixel_buffer_new (old_buffer->area.width, old_buffer->area.height);
 
-        buffer = ply_pixel_buffer_new (width, height);
-
-        for (y = 0; y < height; y++) {
-                for (x = 0; x < width; x++) {
-                        pixel = ply_pixel_buffer_get_pixel (old_buffer, x, y);
-                        ply_pixel_buffer_set_pixel (buffer, x, y, pixel);
-                }
-        }
+        ply_pixel_buffer_copy_rotated (buffer->bytes, buffer->row_stride,
+                                       old_buffer->bytes, old_buffer->row_stride,
+                                       old_buffer->area.width, old_buffer->area.height,
+                                       PLY_PIXEL_BUFFER_ROTATE_UPRIGHT);
 
         ply_pixel_buffer_set_device_scale (buffer, old_buffer->device_scale);
         ply_pixel_buffer_set_opaque (buffer, old_buffer->is_opaque);
@@ -52,6 +52,13 @@ ply_pixel_buffer_t *
 ply_pixel_buffer_new_with_device_rotation (unsigned long width,
                                            unsigned long height,
                                            ply_pixel_buffer_rotation_t device_rotation);
+/* Returns a buffer for area of buffer, in logical pixels, sharing its
+ * pixels rather than copying them.  Whatever gets drawn into one shows in
+ * the other, but spans and opaque areas are worked out separately, so
+ * views are meant for drawing from.  buffer stays around until its last
+ * view is freed */
+ply_pixel_buffer_t *ply_pixel_buffer_new_view (ply_pixel_buffer_t *buffer,
+                                               ply_rectangle_t    *area);
 void ply_pixel_buffer_free (ply_pixel_buffer_t *buffer);
 void ply_pixel_buffer_get_size (ply_pixel_buffer_t *buffer,
                                 ply_rectangle_t    *size);
@@ -61,7 +68,9 @@ void ply_pixel_buffer_set_device_scale (ply_pixel_buffer_t *buffer,
 
 ply_pixel_buffer_rotation_t
 ply_pixel_buffer_get_device_rotation (ply_pixel_buffer_t *buffer);
-/* Note calling this removes all pushed clip-areas */
+/* The current contents are taken to be in the old device orientation
+ * and are turned upright for the new one.
+ * Note calling this removes all pushed clip-areas */
 void ply_pixel_buffer_set_device_rotation (ply_pixel_buffer_t *buffer,
                                            ply_pixel_buffer_rotation_t rotation);
 
@@ -72,6 +81,20 @@ bool ply_pixel_buffer_is_opaque (ply_pixel_buffer_t *buffer);
 void ply_pixel_buffer_set_opaque (ply_pixel_buffer_t *buffer,
                                   bool                is_opaque);
 
+/* Area of pixels, in logical pixels, known to be fully opaque.  Empty
+ * unless the buffer is opaque or ply_pixel_buffer_find_opaque_area has
+ * looked for one */
+void ply_pixel_buffer_get_opaque_area (ply_pixel_buffer_t *buffer,
+                                       ply_rectangle_t    *opaque_area);
+void ply_pixel_buffer_find_opaque_area (ply_pixel_buffer_t *buffer);
+
+/* Encodes each row as runs of transparent, opaque and translucent pixels,
+ * which lets fill_with_buffer skip, copy or blend whole runs when this
+ * buffer is drawn somewhere at the same scale.  The runs are dropped again
+ * when anything gets drawn into the buffer, or kept from the start when
+ * they wouldn't save any work */
+void ply_pixel_buffer_find_spans (ply_pixel_buffer_t *buffer);
+
 ply_region_t *ply_pixel_buffer_get_updated_areas (ply_pixel_buffer_t *buffer);
 
 void ply_pixel_buffer_fill_with_color (ply_pixel_buffer_t *buffer,
@@ -144,7 +167,27 @@ void ply_pixel_buffer_push_clip_area (ply_pixel_buffer_t *buffer,
                                       ply_rectangle_t    *clip_area);
 void ply_pixel_buffer_pop_clip_area (ply_pixel_buffer_t *buffer);
 
+/* Occluding areas are areas, in logical pixels, that layers drawn later
+ * will cover with fully opaque pixels.  Fills skip them, so queue them in
+ * the order the layers get drawn and dequeue each one right before
+ * drawing its layer. */
+void ply_pixel_buffer_queue_occluding_area (ply_pixel_buffer_t *buffer,
+                                            ply_rectangle_t    *occluding_area);
+void ply_pixel_buffer_dequeue_occluding_area (ply_pixel_buffer_t *buffer);
+
+/* The data is always stored upright, whatever the device rotation, with
+ * rows ply_pixel_buffer_get_row_stride pixels apart.  That's the width in
+ * device pixels, except for views */
 uint32_t *ply_pixel_buffer_get_argb32_data (ply_pixel_buffer_t *buffer);
+unsigned long ply_pixel_buffer_get_row_stride (ply_pixel_buffer_t *buffer);
+
+/* Copies an area in device pixels and orientation, like the updated areas,
+ * out of the upright data turned to face the device.  destination points
+ * at the top left corner of the area, and its row stride is in bytes */
+void ply_pixel_buffer_copy_device_area (ply_pixel_buffer_t *buffer,
+                                        ply_rectangle_t    *device_area,
+                                        uint32_t           *destination,
+                                        unsigned long       destination_row_stride);
 
 ply_pixel_buffer_t *ply_pixel_buffer_resize (ply_pixel_buffer_t *old_buffer,
                                              long                width,
@@ -159,9 +202,8 @@ ply_pixel_buffer_t *ply_pixel_buffer_tile (ply_pixel_buffer_t *old_buffer,
                                            long                width,
                                            long                height);
 
-/* Return the upright version of a buffer which is non upright.
- * This is the *only* ply_pixel_buffer function which works correctly with a
- * non upright buffer as source.
+/* Return a copy of a buffer with its device rotation dropped, so it can be
+ * drawn into buffers for other devices.
  */
 ply_pixel_buffer_t *ply_pixel_buffer_rotate_upright (ply_pixel_buffer_t *old_buffer);
 
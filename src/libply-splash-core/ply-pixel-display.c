@@ -42,6 +42,12 @@
 #include "ply-renderer.h"
 #include "ply-utils.h"
 
+typedef struct
+{
+        ply_pixel_display_frame_done_handler_t handler;
+        void                                  *user_data;
+} ply_pixel_display_frame_done_watch_t;
+
 struct _ply_pixel_display
 {
         ply_event_loop_t                *loop;
@@ -57,6 +63,10 @@ struct _ply_pixel_display
         void                            *draw_handler_user_data;
 
         int                              pause_count;
+
+        ply_list_t                      *frame_done_watches;
+        ply_list_t                      *dispatched_frame_done_watches;
+        uint32_t                         is_watching_for_frame_done : 1;
 };
 
 ply_pixel_display_t *
@@ -72,6 +82,7 @@ ply_pixel_display_new (ply_renderer_t      *renderer,
         display->loop = ply_event_loop_get_default ();
         display->renderer = renderer;
         display->head = head;
+        display->frame_done_watches = ply_list_new ();
 
         pixel_buffer = ply_renderer_get_buffer_for_head (renderer, head);
         ply_pixel_buffer_get_size (pixel_buffer, &size);
@@ -169,12 +180,125 @@ ply_pixel_display_draw_area (ply_pixel_display_t *display,
         ply_pixel_display_flush (display);
 }
 
+static void
+free_frame_done_watches (ply_list_t *watches)
+{
+        ply_list_node_t *node;
+
+        node = ply_list_get_first_node (watches);
+        while (node != NULL) {
+                free (ply_list_node_get_data (node));
+                node = ply_list_get_next_node (watches, node);
+        }
+
+        ply_list_free (watches);
+}
+
+static void
+on_frame_done (ply_pixel_display_t *display,
+               ply_renderer_head_t *head)
+{
+        ply_pixel_display_frame_done_watch_t *watch;
+        ply_list_node_t *node;
+
+        display->is_watching_for_frame_done = false;
+
+        /* Handlers usually queue up a new watch for the next frame, so
+         * dispatch from a separate list
+         */
+        display->dispatched_frame_done_watches = display->frame_done_watches;
+        display->frame_done_watches = ply_list_new ();
+
+        while ((node = ply_list_get_first_node (display->dispatched_frame_done_watches)) != NULL) {
+                watch = ply_list_node_get_data (node);
+                ply_list_remove_node (display->dispatched_frame_done_watches, node);
+
+                watch->handler (watch->user_data, display);
+                free (watch);
+        }
+
+        ply_list_free (display->dispatched_frame_done_watches);
+        display->dispatched_frame_done_watches = NULL;
+}
+
+bool
+ply_pixel_display_watch_for_frame_done (ply_pixel_display_t                   *display,
+                                        ply_pixel_display_frame_done_handler_t handler,
+                                        void                                  *user_data)
+{
+        ply_pixel_display_frame_done_watch_t *watch;
+
+        assert (display != NULL);
+        assert (handler != NULL);
+
+        if (!display->is_watching_for_frame_done) {
+                if (!ply_renderer_watch_for_frame_done (display->renderer,
+                                                        display->head,
+                                                        (ply_renderer_frame_done_handler_t)
+                                                        on_frame_done,
+                                                        display))
+                        return false;
+
+                display->is_watching_for_frame_done = true;
+        }
+
+        watch = calloc (1, sizeof(ply_pixel_display_frame_done_watch_t));
+        watch->handler = handler;
+        watch->user_data = user_data;
+
+        ply_list_append_data (display->frame_done_watches, watch);
+
+        return true;
+}
+
+static void
+remove_frame_done_watch (ply_list_t                            *watches,
+                         ply_pixel_display_frame_done_handler_t handler,
+                         void                                  *user_data)
+{
+        ply_list_node_t *node;
+
+        node = ply_list_get_first_node (watches);
+        while (node != NULL) {
+                ply_pixel_display_frame_done_watch_t *watch;
+                ply_list_node_t *next_node;
+
+                watch = ply_list_node_get_data (node);
+                next_node = ply_list_get_next_node (watches, node);
+
+                if (watch->handler == handler && watch->user_data == user_data) {
+                        free (watch);
+                        ply_list_remove_node (watches, node);
+                }
+
+                node = next_node;
+        }
+}
+
+void
+ply_pixel_display_stop_watching_for_frame_done (ply_pixel_display_t                   *display,
+                                                ply_pixel_display_frame_done_handler_t handler,
+                                                void                                  *user_data)
+{
+        assert (display != NULL);
+
+        remove_frame_done_watch (display->frame_done_watches, handler, user_data);
+
+        if (display->dispatched_frame_done_watches != NULL)
+                remove_frame_done_watch (display->dispatched_frame_done_watches, handler, user_data);
+}
+
 void
 ply_pixel_display_free (ply_pixel_display_t *display)
 {
         if (display == NULL)
                 return;
 
+        if (display->is_watching_for_frame_done)
+                ply_renderer_stop_watching_for_frame_done (display->renderer,
+                                                           display->head);
+
+        free_frame_done_watches (display->frame_done_watches);
         free (display);
 }
 
@@ -40,6 +40,9 @@ typedef void (*ply_pixel_display_draw_handler_t) (void                *user_data
                                                   int                  height,
                                                   ply_pixel_display_t *pixel_display);
 
+typedef void (*ply_pixel_display_frame_done_handler_t) (void                *user_data,
+                                                        ply_pixel_display_t *pixel_display);
+
 #ifndef PLY_HIDE_FUNCTION_DECLARATIONS
 ply_pixel_display_t *ply_pixel_display_new (ply_renderer_t      *renderer,
                                             ply_renderer_head_t *head);
@@ -66,6 +69,17 @@ void ply_pixel_display_draw_area (ply_pixel_display_t *display,
 void ply_pixel_display_pause_updates (ply_pixel_display_t *display);
 void ply_pixel_display_unpause_updates (ply_pixel_display_t *display);
 
+/* One-shot notification for when the last drawn frame reaches the screen.
+ * Returns false if the renderer can't report that, in which case callers
+ * should fall back to pacing themselves with timeouts.
+ */
+bool ply_pixel_display_watch_for_frame_done (ply_pixel_display_t                   *display,
+                                             ply_pixel_display_frame_done_handler_t handler,
+                                             void                                  *user_data);
+void ply_pixel_display_stop_watching_for_frame_done (ply_pixel_display_t                   *display,
+                                                     ply_pixel_display_frame_done_handler_t handler,
+                                                     void                                  *user_data);
+
 #endif
 
 #endif /* PLY_PIXEL_DISPLAY_H */
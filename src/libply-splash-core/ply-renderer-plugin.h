@@ -76,6 +76,10 @@ typedef struct
                                      int                         *scale);
         bool (*get_capslock_state)(ply_renderer_backend_t *backend);
         const char * (*get_keymap)(ply_renderer_backend_t *backend);
+        bool (*watch_for_frame_done)(ply_renderer_backend_t           *backend,
+                                     ply_renderer_head_t              *head,
+                                     ply_renderer_frame_done_handler_t handler,
+                                     void                             *user_data);
 } ply_renderer_plugin_interface_t;
 
 #endif /* PLY_RENDERER_PLUGIN_H */
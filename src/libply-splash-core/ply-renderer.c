@@ -368,6 +368,41 @@ ply_renderer_flush_head (ply_renderer_t      *renderer,
         renderer->plugin_interface->flush_head (renderer->backend, head);
 }
 
+bool
+ply_renderer_watch_for_frame_done (ply_renderer_t                   *renderer,
+                                   ply_renderer_head_t              *head,
+                                   ply_renderer_frame_done_handler_t handler,
+                                   void                             *user_data)
+{
+        assert (renderer != NULL);
+        assert (renderer->plugin_interface != NULL);
+        assert (head != NULL);
+        assert (handler != NULL);
+
+        if (!renderer->plugin_interface->watch_for_frame_done)
+                return false;
+
+        return renderer->plugin_interface->watch_for_frame_done (renderer->backend,
+                                                                 head,
+                                                                 handler,
+                                                                 user_data);
+}
+
+void
+ply_renderer_stop_watching_for_frame_done (ply_renderer_t      *renderer,
+                                           ply_renderer_head_t *head)
+{
+        assert (renderer != NULL);
+        assert (renderer->plugin_interface != NULL);
+        assert (head != NULL);
+
+        if (!renderer->plugin_interface->watch_for_frame_done)
+                return;
+
+        renderer->plugin_interface->watch_for_frame_done (renderer->backend,
+                                                          head, NULL, NULL);
+}
+
 ply_renderer_input_source_t *
 ply_renderer_get_input_source (ply_renderer_t *renderer)
 {
@@ -49,6 +49,9 @@ typedef void (*ply_renderer_input_source_handler_t) (void
                                                      ply_buffer_t                *key_buffer,
                                                      ply_renderer_input_source_t *input_source);
 
+typedef void (*ply_renderer_frame_done_handler_t) (void                *user_data,
+                                                   ply_renderer_head_t *head);
+
 #ifndef PLY_HIDE_FUNCTION_DECLARATIONS
 ply_renderer_t *ply_renderer_new (ply_renderer_type_t renderer_type,
                                   const char         *device_name,
@@ -69,6 +72,16 @@ ply_pixel_buffer_t *ply_renderer_get_buffer_for_head (ply_renderer_t      *rende
 void ply_renderer_flush_head (ply_renderer_t      *renderer,
                               ply_renderer_head_t *head);
 
+/* Calls handler once the frame last flushed to head is on screen.
+ * Returns false if the renderer can't tell, or has no frame in flight.
+ */
+bool ply_renderer_watch_for_frame_done (ply_renderer_t                   *renderer,
+                                        ply_renderer_head_t              *head,
+                                        ply_renderer_frame_done_handler_t handler,
+                                        void                             *user_data);
+void ply_renderer_stop_watching_for_frame_done (ply_renderer_t      *renderer,
+                                                ply_renderer_head_t *head);
+
 ply_renderer_input_source_t *ply_renderer_get_input_source (ply_renderer_t *renderer);
 bool ply_renderer_open_input_source (ply_renderer_t              *renderer,
                                      ply_renderer_input_source_t *input_source);
@@ -42,9 +42,10 @@
 
 #include "ply-animation.h"
 #include "ply-event-loop.h"
-#include "ply-array.h"
+#include "ply-frame-cache.h"
 #include "ply-logger.h"
 #include "ply-image.h"
+#include "ply-image-loader.h"
 #include "ply-pixel-buffer.h"
 #include "ply-utils.h"
 
@@ -56,8 +57,11 @@
 
 struct _ply_animation
 {
-        ply_array_t         *frames;
+        ply_frame_cache_t   *frames;
+        ply_image_loader_t  *loader;
+        size_t               memory_budget;
         ply_event_loop_t    *loop;
+        ply_timeout_watch_t *timeout_watch; /* or NULL */
         char                *image_dir;
         char                *frames_prefix;
 
@@ -65,6 +69,7 @@ struct _ply_animation
         ply_trigger_t       *stop_trigger;
 
         int                  frame_number;
+        int                  shown_frame_number; /* or -1 */
         long                 x, y;
         long                 width, height;
         double               start_time, previous_time, now;
@@ -86,7 +91,6 @@ ply_animation_new (const char *image_dir,
 
         animation = calloc (1, sizeof(ply_animation_t));
 
-        animation->frames = ply_array_new (PLY_ARRAY_ELEMENT_TYPE_POINTER);
         animation->frames_prefix = strdup (frames_prefix);
         animation->image_dir = strdup (image_dir);
         animation->frame_number = 0;
@@ -101,14 +105,8 @@ ply_animation_new (const char *image_dir,
 static void
 ply_animation_remove_frames (ply_animation_t *animation)
 {
-        int i;
-        ply_pixel_buffer_t **frames;
-
-        frames = (ply_pixel_buffer_t **) ply_array_steal_pointer_elements (animation->frames);
-        for (i = 0; frames[i] != NULL; i++) {
-                ply_pixel_buffer_free (frames[i]);
-        }
-        free (frames);
+        ply_frame_cache_free (animation->frames);
+        animation->frames = NULL;
 }
 
 void
@@ -120,28 +118,57 @@ ply_animation_free (ply_animation_t *animation)
         if (!animation->is_stopped)
                 ply_animation_stop_now (animation);
 
+        ply_image_loader_free (animation->loader);
         ply_animation_remove_frames (animation);
-        ply_array_free (animation->frames);
 
         free (animation->frames_prefix);
         free (animation->image_dir);
         free (animation);
 }
 
+static void
+ply_animation_draw_changes (ply_animation_t *animation)
+{
+        ply_region_t *changed_area;
+        ply_list_t *rectangles;
+        ply_list_node_t *node;
+
+        changed_area = ply_frame_cache_get_changed_area (animation->frames,
+                                                         animation->shown_frame_number,
+                                                         animation->frame_number);
+        animation->shown_frame_number = animation->frame_number;
+
+        rectangles = ply_region_get_rectangle_list (changed_area);
+
+        ply_pixel_display_pause_updates (animation->display);
+        for (node = ply_list_get_first_node (rectangles);
+             node != NULL;
+             node = ply_list_get_next_node (rectangles, node)) {
+                ply_rectangle_t *rectangle = ply_list_node_get_data (node);
+
+                ply_pixel_display_draw_area (animation->display,
+                                             animation->x + rectangle->x,
+                                             animation->y + rectangle->y,
+                                             rectangle->width,
+                                             rectangle->height);
+        }
+        ply_pixel_display_unpause_updates (animation->display);
+
+        ply_region_free (changed_area);
+}
+
 static bool
 animate_at_time (ply_animation_t *animation,
                  double           time)
 {
         int number_of_frames;
-        ply_pixel_buffer_t *const *frames;
-        ply_rectangle_t frame_area;
         bool should_continue;
 
-        number_of_frames = ply_array_get_size (animation->frames);
-
-        if (number_of_frames == 0)
+        if (animation->frames == NULL)
                 return false;
 
+        number_of_frames = ply_frame_cache_get_number_of_frames (animation->frames);
+
         should_continue = true;
 
         if (animation->frame_number > number_of_frames - 1) {
@@ -154,25 +181,24 @@ animate_at_time (ply_animation_t *animation,
                 should_continue = false;
         }
 
-        frames = (ply_pixel_buffer_t *const *) ply_array_get_pointer_elements (animation->frames);
-        ply_pixel_buffer_get_size (frames[animation->frame_number], &frame_area);
-
-        ply_pixel_display_draw_area (animation->display,
-                                     animation->x, animation->y,
-                                     frame_area.width,
-                                     frame_area.height);
+        ply_animation_draw_changes (animation);
 
         animation->frame_number++;
 
         return should_continue;
 }
 
+static void on_frame_done (ply_animation_t     *animation,
+                           ply_pixel_display_t *display);
+
 static void
 on_timeout (ply_animation_t *animation)
 {
         double sleep_time;
         bool should_continue;
 
+        animation->timeout_watch = NULL;
+
         animation->previous_time = animation->now;
         animation->now = ply_get_timestamp ();
 
@@ -189,105 +215,105 @@ on_timeout (ply_animation_t *animation)
                         ply_trigger_pull (animation->stop_trigger, NULL);
                         animation->stop_trigger = NULL;
                 }
-        } else {
+        } else if (!ply_pixel_display_watch_for_frame_done (animation->display,
+                                                            (ply_pixel_display_frame_done_handler_t)
+                                                            on_frame_done, animation)) {
+                animation->timeout_watch =
+                        ply_event_loop_watch_for_timeout (animation->loop,
+                                                          sleep_time,
+                                                          (ply_event_loop_timeout_handler_t)
+                                                          on_timeout, animation);
+        }
+}
+
+static void
+on_frame_done (ply_animation_t     *animation,
+               ply_pixel_display_t *display)
+{
+        double sleep_time;
+
+        /* The renderer can tell when frames reach the screen, so don't
+         * start on the next frame until the current one has
+         */
+        sleep_time = 1.0 / FRAMES_PER_SECOND;
+        sleep_time = MAX (sleep_time - (ply_get_timestamp () - animation->now),
+                          0.005);
+
+        animation->timeout_watch =
                 ply_event_loop_watch_for_timeout (animation->loop,
                                                   sleep_time,
                                                   (ply_event_loop_timeout_handler_t)
                                                   on_timeout, animation);
-        }
 }
 
-static bool
+static void
 ply_animation_add_frame (ply_animation_t *animation,
-                         const char      *filename)
+                         ply_image_t     *image)
 {
-        ply_image_t *image;
-        ply_pixel_buffer_t *frame;
-
-        image = ply_image_new (filename);
-
-        if (!ply_image_load (image)) {
-                ply_image_free (image);
-                return false;
-        }
-
-        frame = ply_image_convert_to_pixel_buffer (image);
-
-        ply_array_add_pointer_element (animation->frames, frame);
+        animation->width = MAX (animation->width, ply_image_get_width (image));
+        animation->height = MAX (animation->height, ply_image_get_height (image));
 
-        animation->width = MAX (animation->width, (long) ply_pixel_buffer_get_width (frame));
-        animation->height = MAX (animation->height, (long) ply_pixel_buffer_get_height (frame));
-
-        return true;
+        ply_frame_cache_add_frame (animation->frames, image);
 }
 
 static bool
 ply_animation_add_frames (ply_animation_t *animation)
 {
-        struct dirent **entries;
-        int number_of_entries;
-        int number_of_frames;
+        ply_image_loader_t *loader;
+        int number_of_images;
         int i;
         bool load_finished;
 
-        entries = NULL;
-
-        number_of_entries = scandir (animation->image_dir, &entries, NULL, versionsort);
-
-        if (number_of_entries <= 0)
-                return false;
-
-        load_finished = false;
-        for (i = 0; i < number_of_entries; i++) {
-                if (strncmp (entries[i]->d_name,
-                             animation->frames_prefix,
-                             strlen (animation->frames_prefix)) == 0
-                    && (strlen (entries[i]->d_name) > 4)
-                    && strcmp (entries[i]->d_name + strlen (entries[i]->d_name) - 4, ".png") == 0) {
-                        char *filename;
+        ply_animation_start_loading (animation);
+        loader = animation->loader;
+        animation->loader = NULL;
 
-                        filename = NULL;
-                        asprintf (&filename, "%s/%s", animation->image_dir, entries[i]->d_name);
-
-                        if (!ply_animation_add_frame (animation, filename))
-                                goto out;
-
-                        free (filename);
-                }
-
-                free (entries[i]);
-                entries[i] = NULL;
-        }
+        load_finished = ply_image_loader_wait (loader);
+        number_of_images = ply_image_loader_get_number_of_images (loader);
 
-        number_of_frames = ply_array_get_size (animation->frames);
-        if (number_of_frames == 0) {
+        if (number_of_images == 0) {
                 ply_trace ("%s directory had no files starting with %s",
                            animation->image_dir, animation->frames_prefix);
-                goto out;
-        } else {
-                ply_trace ("animation has %d frames", number_of_frames);
+        } else if (load_finished) {
+                animation->frames = ply_frame_cache_new (animation->memory_budget);
+                for (i = 0; i < number_of_images; i++) {
+                        ply_animation_add_frame (animation,
+                                                 ply_image_loader_steal_image (loader, i));
+                }
+                ply_trace ("animation has %d frames", number_of_images);
         }
+        ply_image_loader_free (loader);
 
-        load_finished = true;
+        return load_finished;
+}
 
-out:
-        if (!load_finished) {
-                ply_animation_remove_frames (animation);
+void
+ply_animation_start_loading (ply_animation_t *animation)
+{
+        if (animation->loader != NULL)
+                return;
 
-                while (i < number_of_entries) {
-                        free (entries[i]);
-                        i++;
-                }
-        }
-        free (entries);
+        animation->loader = ply_image_loader_new (animation->image_dir,
+                                                  animation->frames_prefix);
+        if (animation->memory_budget > 0)
+                ply_image_loader_keep_compressed (animation->loader);
+        ply_image_loader_start (animation->loader);
+}
 
-        return (ply_array_get_size (animation->frames) > 0);
+void
+ply_animation_set_memory_budget (ply_animation_t *animation,
+                                 size_t           memory_budget)
+{
+        assert (animation->loader == NULL);
+        assert (animation->frames == NULL);
+
+        animation->memory_budget = memory_budget;
 }
 
 bool
 ply_animation_load (ply_animation_t *animation)
 {
-        if (ply_array_get_size (animation->frames) != 0) {
+        if (animation->frames != NULL) {
                 ply_animation_remove_frames (animation);
                 ply_trace ("reloading animation with new set of frames");
         } else {
@@ -300,6 +326,17 @@ ply_animation_load (ply_animation_t *animation)
         return true;
 }
 
+/* Queued timeouts are freed when the loop exits, so the watch has to be
+ * forgotten before then */
+static void
+ply_animation_detach_from_event_loop (ply_animation_t *animation)
+{
+        assert (animation != NULL);
+
+        animation->timeout_watch = NULL;
+        animation->loop = NULL;
+}
+
 bool
 ply_animation_start (ply_animation_t     *animation,
                      ply_pixel_display_t *display,
@@ -323,12 +360,18 @@ ply_animation_start (ply_animation_t     *animation,
         animation->x = x;
         animation->y = y;
 
+        animation->shown_frame_number = -1;
         animation->start_time = ply_get_timestamp ();
 
-        ply_event_loop_watch_for_timeout (animation->loop,
-                                          1.0 / FRAMES_PER_SECOND,
-                                          (ply_event_loop_timeout_handler_t)
-                                          on_timeout, animation);
+        ply_event_loop_watch_for_exit (animation->loop, (ply_event_loop_exit_handler_t)
+                                       ply_animation_detach_from_event_loop,
+                                       animation);
+
+        animation->timeout_watch =
+                ply_event_loop_watch_for_timeout (animation->loop,
+                                                  1.0 / FRAMES_PER_SECOND,
+                                                  (ply_event_loop_timeout_handler_t)
+                                                  on_timeout, animation);
 
         return true;
 }
@@ -340,13 +383,26 @@ ply_animation_stop_now (ply_animation_t *animation)
 
         ply_trace ("stopping animation now");
 
+        if (animation->frames != NULL && animation->display != NULL)
+                ply_trace ("animation damaged %.0f pixels per frame on average",
+                           ply_frame_cache_get_average_damage (animation->frames));
+
         if (animation->loop != NULL) {
-                ply_event_loop_stop_watching_for_timeout (animation->loop,
-                                                          (ply_event_loop_timeout_handler_t)
-                                                          on_timeout, animation);
-                animation->loop = NULL;
+                if (animation->timeout_watch != NULL)
+                        ply_event_loop_cancel_timeout (animation->loop,
+                                                       animation->timeout_watch);
+                ply_event_loop_stop_watching_for_exit (animation->loop,
+                                                       (ply_event_loop_exit_handler_t)
+                                                       ply_animation_detach_from_event_loop,
+                                                       animation);
+                ply_animation_detach_from_event_loop (animation);
         }
 
+        if (animation->display != NULL)
+                ply_pixel_display_stop_watching_for_frame_done (animation->display,
+                                                                (ply_pixel_display_frame_done_handler_t)
+                                                                on_frame_done, animation);
+
         animation->display = NULL;
 }
 
@@ -381,19 +437,22 @@ ply_animation_draw_area (ply_animation_t    *animation,
                          unsigned long       width,
                          unsigned long       height)
 {
-        ply_pixel_buffer_t *const *frames;
+        ply_pixel_buffer_t *frame;
         int number_of_frames;
         int frame_index;
 
-        if (animation->is_stopped)
+        if (animation->is_stopped || animation->frames == NULL)
                 return;
 
-        number_of_frames = ply_array_get_size (animation->frames);
+        number_of_frames = ply_frame_cache_get_number_of_frames (animation->frames);
         frame_index = MIN (animation->frame_number, number_of_frames - 1);
 
-        frames = (ply_pixel_buffer_t *const *) ply_array_get_pointer_elements (animation->frames);
+        frame = ply_frame_cache_get_frame (animation->frames, frame_index);
+        if (frame == NULL)
+                return;
+
         ply_pixel_buffer_fill_with_buffer (buffer,
-                                           frames[frame_index],
+                                           frame,
                                            animation->x, animation->y);
 }
 
@@ -37,6 +37,13 @@ ply_animation_t *ply_animation_new (const char *image_dir,
                                     const char *frames_prefix);
 void ply_animation_free (ply_animation_t *animation);
 
+/* Starts decoding the frames in the background, ply_animation_load then
+ * waits for them */
+void ply_animation_start_loading (ply_animation_t *animation);
+/* Only decodes frames as the animation gets to them, keeping at most
+ * memory_budget bytes of them around, or all of them up front for 0 */
+void ply_animation_set_memory_budget (ply_animation_t *animation,
+                                      size_t           memory_budget);
 bool ply_animation_load (ply_animation_t *animation);
 bool ply_animation_start (ply_animation_t     *animation,
                           ply_pixel_display_t *display,
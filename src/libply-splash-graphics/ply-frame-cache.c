@@ -0,0 +1,517 @@
+/* ply-frame-cache.c - animation frames decoded on demand within a budget
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "config.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ply-frame-cache.h"
+#include "ply-utils.h"
+
+/* how many frames past the one being shown get decoded in the background */
+#define FRAME_CACHE_PREFETCH_FRAMES 4
+
+/* Changed rows get grouped into at most this many rectangles per frame,
+ * since each one is drawn separately */
+#define FRAME_CACHE_MAX_CHANGED_AREAS 8
+
+typedef struct
+{
+        ply_image_t        *image; /* compressed, NULL if decoded for good */
+        ply_pixel_buffer_t *buffer;
+        ply_rectangle_t     size;
+        unsigned long       last_used;
+
+        /* what differs from the frame before, or -1 if not known yet */
+        ply_rectangle_t    *changed_areas;
+        int                 number_of_changed_areas;
+} ply_frame_cache_frame_t;
+
+/* Frames get decoded either by whoever asks for them or, a few frames
+ * ahead, by the prefetch thread.  When that takes the decoded frames over
+ * budget, the least recently used ones are thrown away, except for the one
+ * handed out last.  The mutex covers everything but the compressed images,
+ * which are only ever read.
+ */
+struct _ply_frame_cache
+{
+        ply_frame_cache_frame_t *frames;
+        int                      number_of_frames;
+        int                      current_frame;
+
+        size_t                   memory_budget;
+        size_t                   decoded_size;
+        size_t                   largest_frame_size;
+        unsigned long            clock;
+
+        pthread_mutex_t          mutex;
+        pthread_cond_t           prefetch_requested;
+        pthread_t                prefetch_thread;
+        int                      prefetch_frame; /* or -1 */
+
+        unsigned long long       damaged_pixels;
+        unsigned long            number_of_damaged_frames;
+
+        uint32_t                 has_prefetch_thread : 1;
+        uint32_t                 prefetch_failed : 1;
+        uint32_t                 is_closing : 1;
+};
+
+static size_t
+get_frame_size_in_bytes (ply_frame_cache_frame_t *frame)
+{
+        return frame->size.width * frame->size.height * sizeof(uint32_t);
+}
+
+/* Runs of changed rows become one rectangle each, as wide as the widest
+ * row in the run.  When there are too many, the neighbours that add the
+ * fewest unchanged pixels between them get merged.
+ */
+static void
+find_changed_areas (ply_frame_cache_frame_t *previous_frame,
+                    ply_frame_cache_frame_t *frame)
+{
+        ply_rectangle_t *areas;
+        uint32_t *previous_pixels, *pixels;
+        unsigned long previous_stride, stride;
+        long width, height, x, y, left, right;
+        int number_of_areas, i, best;
+        bool in_area;
+
+        width = frame->size.width;
+        height = frame->size.height;
+        previous_pixels = ply_pixel_buffer_get_argb32_data (previous_frame->buffer);
+        pixels = ply_pixel_buffer_get_argb32_data (frame->buffer);
+        previous_stride = ply_pixel_buffer_get_row_stride (previous_frame->buffer);
+        stride = ply_pixel_buffer_get_row_stride (frame->buffer);
+
+        areas = NULL;
+        number_of_areas = 0;
+        in_area = false;
+        for (y = 0; y < height; y++) {
+                uint32_t *previous_row = previous_pixels + y * previous_stride;
+                uint32_t *row = pixels + y * stride;
+                ply_rectangle_t *area;
+
+                if (memcmp (previous_row, row, width * sizeof(uint32_t)) == 0) {
+                        in_area = false;
+                        continue;
+                }
+
+                for (left = 0; previous_row[left] == row[left]; left++) {
+                }
+                for (right = width - 1; previous_row[right] == row[right]; right--) {
+                }
+
+                if (!in_area) {
+                        areas = realloc (areas, (number_of_areas + 1) * sizeof(ply_rectangle_t));
+                        area = &areas[number_of_areas++];
+                        area->x = left;
+                        area->y = y;
+                        area->width = right - left + 1;
+                        area->height = 1;
+                        in_area = true;
+                        continue;
+                }
+
+                area = &areas[number_of_areas - 1];
+                x = MIN (area->x, left);
+                area->width = MAX (area->x + (long) area->width, right + 1) - x;
+                area->x = x;
+                area->height++;
+        }
+
+        while (number_of_areas > FRAME_CACHE_MAX_CHANGED_AREAS) {
+                unsigned long waste, least_waste = 0;
+                ply_rectangle_t merged;
+
+                best = -1;
+                for (i = 0; i < number_of_areas - 1; i++) {
+                        ply_rectangle_t *top = &areas[i], *bottom = &areas[i + 1];
+
+                        x = MIN (top->x, bottom->x);
+                        waste = (MAX (top->x + top->width, bottom->x + bottom->width) - x) *
+                                (bottom->y + bottom->height - top->y) -
+                                top->width * top->height - bottom->width * bottom->height;
+
+                        if (best < 0 || waste < least_waste) {
+                                best = i;
+                                least_waste = waste;
+                        }
+                }
+
+                merged.x = MIN (areas[best].x, areas[best + 1].x);
+                merged.y = areas[best].y;
+                merged.width = MAX (areas[best].x + areas[best].width,
+                                    areas[best + 1].x + areas[best + 1].width) - merged.x;
+                merged.height = areas[best + 1].y + areas[best + 1].height - merged.y;
+                areas[best] = merged;
+
+                memmove (&areas[best + 1], &areas[best + 2],
+                         (number_of_areas - best - 2) * sizeof(ply_rectangle_t));
+                number_of_areas--;
+        }
+
+        frame->changed_areas = areas;
+        frame->number_of_changed_areas = number_of_areas;
+}
+
+ply_frame_cache_t *
+ply_frame_cache_new (size_t memory_budget)
+{
+        ply_frame_cache_t *cache;
+
+        cache = calloc (1, sizeof(ply_frame_cache_t));
+        cache->memory_budget = memory_budget;
+        cache->current_frame = -1;
+        cache->prefetch_frame = -1;
+
+        pthread_mutex_init (&cache->mutex, NULL);
+        pthread_cond_init (&cache->prefetch_requested, NULL);
+
+        return cache;
+}
+
+void
+ply_frame_cache_free (ply_frame_cache_t *cache)
+{
+        int i;
+
+        if (cache == NULL)
+                return;
+
+        if (cache->has_prefetch_thread) {
+                pthread_mutex_lock (&cache->mutex);
+                cache->is_closing = true;
+                pthread_cond_signal (&cache->prefetch_requested);
+                pthread_mutex_unlock (&cache->mutex);
+
+                pthread_join (cache->prefetch_thread, NULL);
+        }
+
+        for (i = 0; i < cache->number_of_frames; i++) {
+                ply_image_free (cache->frames[i].image);
+                ply_pixel_buffer_free (cache->frames[i].buffer);
+                free (cache->frames[i].changed_areas);
+        }
+
+        pthread_cond_destroy (&cache->prefetch_requested);
+        pthread_mutex_destroy (&cache->mutex);
+        free (cache->frames);
+        free (cache);
+}
+
+void
+ply_frame_cache_add_frame (ply_frame_cache_t *cache,
+                           ply_image_t       *image)
+{
+        ply_frame_cache_frame_t *frame;
+
+        assert (!cache->has_prefetch_thread);
+
+        cache->frames = realloc (cache->frames,
+                                 (cache->number_of_frames + 1) * sizeof(ply_frame_cache_frame_t));
+        frame = &cache->frames[cache->number_of_frames++];
+        memset (frame, 0, sizeof(ply_frame_cache_frame_t));
+        frame->number_of_changed_areas = -1;
+
+        frame->size.width = ply_image_get_width (image);
+        frame->size.height = ply_image_get_height (image);
+        cache->largest_frame_size = MAX (cache->largest_frame_size,
+                                         get_frame_size_in_bytes (frame));
+
+        if (ply_image_get_buffer (image) != NULL) {
+                frame->buffer = ply_image_convert_to_pixel_buffer (image);
+                cache->decoded_size += get_frame_size_in_bytes (frame);
+        } else {
+                frame->image = image;
+        }
+
+        /* Figure out what changes while everything's decoded anyway.  Going
+         * back around to the first frame is left for later, since there may
+         * be more frames to come */
+        if (frame->buffer != NULL && cache->number_of_frames > 1) {
+                ply_frame_cache_frame_t *previous_frame = frame - 1;
+
+                if (previous_frame->buffer != NULL &&
+                    previous_frame->size.width == frame->size.width &&
+                    previous_frame->size.height == frame->size.height)
+                        find_changed_areas (previous_frame, frame);
+        }
+}
+
+int
+ply_frame_cache_get_number_of_frames (ply_frame_cache_t *cache)
+{
+        return cache->number_of_frames;
+}
+
+void
+ply_frame_cache_get_frame_size (ply_frame_cache_t *cache,
+                                int                index,
+                                ply_rectangle_t   *size)
+{
+        assert (index >= 0 && index < cache->number_of_frames);
+
+        *size = cache->frames[index].size;
+}
+
+/* Called with the mutex held */
+static void
+ply_frame_cache_evict_frames (ply_frame_cache_t *cache)
+{
+        int i, oldest;
+
+        if (cache->memory_budget == 0)
+                return;
+
+        while (cache->decoded_size > cache->memory_budget) {
+                oldest = -1;
+                for (i = 0; i < cache->number_of_frames; i++) {
+                        ply_frame_cache_frame_t *frame = &cache->frames[i];
+
+                        if (frame->image == NULL || frame->buffer == NULL ||
+                            i == cache->current_frame)
+                                continue;
+
+                        if (oldest < 0 || frame->last_used < cache->frames[oldest].last_used)
+                                oldest = i;
+                }
+
+                if (oldest < 0)
+                        break;
+
+                ply_pixel_buffer_free (cache->frames[oldest].buffer);
+                cache->frames[oldest].buffer = NULL;
+                cache->decoded_size -= get_frame_size_in_bytes (&cache->frames[oldest]);
+        }
+}
+
+/* Called with the mutex held, which gets dropped while decoding */
+static ply_pixel_buffer_t *
+ply_frame_cache_decode_frame (ply_frame_cache_t *cache,
+                              int                index)
+{
+        ply_frame_cache_frame_t *frame = &cache->frames[index];
+        ply_pixel_buffer_t *buffer;
+
+        pthread_mutex_unlock (&cache->mutex);
+        buffer = ply_image_decode_to_pixel_buffer (frame->image);
+        pthread_mutex_lock (&cache->mutex);
+
+        if (buffer == NULL)
+                return NULL;
+
+        /* The other thread may have got there first */
+        if (frame->buffer != NULL) {
+                ply_pixel_buffer_free (buffer);
+                return frame->buffer;
+        }
+
+        frame->buffer = buffer;
+        frame->last_used = ++cache->clock;
+        cache->decoded_size += get_frame_size_in_bytes (frame);
+        ply_frame_cache_evict_frames (cache);
+
+        return buffer;
+}
+
+static void *
+ply_frame_cache_prefetch (ply_frame_cache_t *cache)
+{
+        int number_of_frames_to_prefetch;
+        int i, index;
+
+        /* Leave room for the frame being shown */
+        number_of_frames_to_prefetch = cache->memory_budget / cache->largest_frame_size - 1;
+        number_of_frames_to_prefetch = MIN (number_of_frames_to_prefetch, FRAME_CACHE_PREFETCH_FRAMES);
+
+        pthread_mutex_lock (&cache->mutex);
+        while (!cache->is_closing) {
+                int first_frame = cache->prefetch_frame;
+
+                if (first_frame < 0) {
+                        pthread_cond_wait (&cache->prefetch_requested, &cache->mutex);
+                        continue;
+                }
+                cache->prefetch_frame = -1;
+
+                for (i = 0; i < number_of_frames_to_prefetch; i++) {
+                        /* start over if the animation has moved on already */
+                        if (cache->is_closing || cache->prefetch_frame >= 0)
+                                break;
+
+                        index = (first_frame + i) % cache->number_of_frames;
+
+                        if (cache->frames[index].buffer != NULL) {
+                                cache->frames[index].last_used = ++cache->clock;
+                                continue;
+                        }
+
+                        if (cache->frames[index].image != NULL)
+                                ply_frame_cache_decode_frame (cache, index);
+                }
+        }
+        pthread_mutex_unlock (&cache->mutex);
+
+        return NULL;
+}
+
+/* Called with the mutex held */
+static void
+ply_frame_cache_request_prefetch (ply_frame_cache_t *cache,
+                                  int                index)
+{
+        /* Without a budget everything stays decoded once it's been shown,
+         * and with room for just one frame there's nowhere to put more */
+        if (cache->memory_budget == 0 || cache->prefetch_failed ||
+            cache->memory_budget < 2 * cache->largest_frame_size)
+                return;
+
+        if (!cache->has_prefetch_thread) {
+                if (pthread_create (&cache->prefetch_thread, NULL,
+                                    (void *(*)(void *)) ply_frame_cache_prefetch,
+                                    cache) != 0) {
+                        cache->prefetch_failed = true;
+                        return;
+                }
+                cache->has_prefetch_thread = true;
+        }
+
+        cache->prefetch_frame = index % cache->number_of_frames;
+        pthread_cond_signal (&cache->prefetch_requested);
+}
+
+ply_pixel_buffer_t *
+ply_frame_cache_get_frame (ply_frame_cache_t *cache,
+                           int                index)
+{
+        ply_frame_cache_frame_t *frame;
+        ply_pixel_buffer_t *buffer;
+
+        assert (index >= 0 && index < cache->number_of_frames);
+
+        frame = &cache->frames[index];
+
+        pthread_mutex_lock (&cache->mutex);
+        cache->current_frame = index;
+        frame->last_used = ++cache->clock;
+
+        buffer = frame->buffer;
+        if (buffer == NULL)
+                buffer = ply_frame_cache_decode_frame (cache, index);
+
+        ply_frame_cache_request_prefetch (cache, index + 1);
+        pthread_mutex_unlock (&cache->mutex);
+
+        return buffer;
+}
+
+/* Called with the mutex held.  Frames that were kept compressed get
+ * compared whenever they happen to be decoded next to each other */
+static bool
+ply_frame_cache_get_changed_areas_of_frame (ply_frame_cache_t *cache,
+                                            int                index)
+{
+        ply_frame_cache_frame_t *frame = &cache->frames[index];
+        ply_frame_cache_frame_t *previous_frame;
+
+        if (frame->number_of_changed_areas >= 0)
+                return true;
+
+        previous_frame = &cache->frames[(index + cache->number_of_frames - 1) % cache->number_of_frames];
+
+        if (frame->buffer == NULL || previous_frame->buffer == NULL ||
+            previous_frame->size.width != frame->size.width ||
+            previous_frame->size.height != frame->size.height)
+                return false;
+
+        find_changed_areas (previous_frame, frame);
+        return true;
+}
+
+ply_region_t *
+ply_frame_cache_get_changed_area (ply_frame_cache_t *cache,
+                                  int                from_index,
+                                  int                to_index)
+{
+        ply_region_t *region;
+        ply_list_t *rectangles;
+        ply_list_node_t *node;
+        int i, index, number_of_steps;
+
+        assert (from_index >= -1 && from_index < cache->number_of_frames);
+        assert (to_index >= 0 && to_index < cache->number_of_frames);
+
+        region = ply_region_new ();
+
+        if (from_index < 0) {
+                ply_region_add_rectangle (region, &cache->frames[to_index].size);
+                number_of_steps = 0;
+        } else {
+                number_of_steps = (to_index - from_index + cache->number_of_frames) % cache->number_of_frames;
+        }
+
+        pthread_mutex_lock (&cache->mutex);
+        index = from_index;
+        for (i = 0; i < number_of_steps; i++) {
+                ply_frame_cache_frame_t *frame;
+                int j;
+
+                index = (index + 1) % cache->number_of_frames;
+                frame = &cache->frames[index];
+
+                if (!ply_frame_cache_get_changed_areas_of_frame (cache, index)) {
+                        int previous_index = (index + cache->number_of_frames - 1) % cache->number_of_frames;
+
+                        ply_region_add_rectangle (region, &cache->frames[previous_index].size);
+                        ply_region_add_rectangle (region, &frame->size);
+                        continue;
+                }
+
+                for (j = 0; j < frame->number_of_changed_areas; j++) {
+                        ply_region_add_rectangle (region, &frame->changed_areas[j]);
+                }
+        }
+        pthread_mutex_unlock (&cache->mutex);
+
+        rectangles = ply_region_get_rectangle_list (region);
+        for (node = ply_list_get_first_node (rectangles);
+             node != NULL;
+             node = ply_list_get_next_node (rectangles, node)) {
+                ply_rectangle_t *rectangle = ply_list_node_get_data (node);
+
+                cache->damaged_pixels += rectangle->width * rectangle->height;
+        }
+        cache->number_of_damaged_frames++;
+
+        return region;
+}
+
+double
+ply_frame_cache_get_average_damage (ply_frame_cache_t *cache)
+{
+        if (cache->number_of_damaged_frames == 0)
+                return 0.0;
+
+        return (double) cache->damaged_pixels / cache->number_of_damaged_frames;
+}
@@ -0,0 +1,63 @@
+/* ply-frame-cache.h - animation frames decoded on demand within a budget
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifndef PLY_FRAME_CACHE_H
+#define PLY_FRAME_CACHE_H
+
+#include "ply-image.h"
+#include "ply-pixel-buffer.h"
+#include "ply-rectangle.h"
+#include "ply-region.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct _ply_frame_cache ply_frame_cache_t;
+
+#ifndef PLY_HIDE_FUNCTION_DECLARATIONS
+/* At most memory_budget bytes of frames loaded with
+ * ply_image_load_compressed are kept decoded at a time, or all of them
+ * for a budget of 0 */
+ply_frame_cache_t *ply_frame_cache_new (size_t memory_budget);
+void ply_frame_cache_free (ply_frame_cache_t *cache);
+
+/* Takes over image, which can be decoded already or compressed */
+void ply_frame_cache_add_frame (ply_frame_cache_t *cache,
+                                ply_image_t       *image);
+int ply_frame_cache_get_number_of_frames (ply_frame_cache_t *cache);
+void ply_frame_cache_get_frame_size (ply_frame_cache_t *cache,
+                                     int                index,
+                                     ply_rectangle_t   *size);
+
+/* Decodes the frame if need be, and starts decoding the ones after it in
+ * the background.  The frame stays valid until the next call, and is NULL
+ * if it couldn't be decoded */
+ply_pixel_buffer_t *ply_frame_cache_get_frame (ply_frame_cache_t *cache,
+                                               int                index);
+
+/* Returns a new region covering what changes going from frame from_index
+ * to frame to_index, in frame coordinates.  Frames in between count too,
+ * and a from_index of -1 means nothing has been shown yet.  Parts that
+ * can't be told apart get the whole frame.  Every call counts towards the
+ * average damage. */
+ply_region_t *ply_frame_cache_get_changed_area (ply_frame_cache_t *cache,
+                                                int                from_index,
+                                                int                to_index);
+double ply_frame_cache_get_average_damage (ply_frame_cache_t *cache);
+#endif
+
+#endif /* PLY_FRAME_CACHE_H */
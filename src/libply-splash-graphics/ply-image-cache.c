@@ -0,0 +1,149 @@
+/* ply-image-cache.c - scaled copies of images shared between views
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "config.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ply-image-cache.h"
+#include "ply-list.h"
+#include "ply-logger.h"
+
+/* Drawing a buffer onto one with a different device scale interpolates
+ * every pixel, every frame, so views keep copies scaled to their heads
+ * instead.  Heads usually share a scale, and often a size, so the copies
+ * are shared too.  Splash plugins only run on the main thread, so there
+ * is no locking.
+ */
+typedef struct
+{
+        char               *filename;
+        long                source_width, source_height;
+        long                width, height;
+        int                 device_scale;
+
+        ply_pixel_buffer_t *buffer;
+        int                 reference_count;
+} ply_image_cache_entry_t;
+
+static ply_list_t *entries;
+
+static ply_image_cache_entry_t *
+find_entry_for_image (ply_image_t *image,
+                      long         width,
+                      long         height,
+                      int          device_scale)
+{
+        ply_list_node_t *node;
+
+        for (node = ply_list_get_first_node (entries);
+             node != NULL;
+             node = ply_list_get_next_node (entries, node)) {
+                ply_image_cache_entry_t *entry = ply_list_node_get_data (node);
+
+                if (entry->width == width && entry->height == height &&
+                    entry->device_scale == device_scale &&
+                    entry->source_width == ply_image_get_width (image) &&
+                    entry->source_height == ply_image_get_height (image) &&
+                    strcmp (entry->filename, ply_image_get_filename (image)) == 0)
+                        return entry;
+        }
+
+        return NULL;
+}
+
+ply_pixel_buffer_t *
+ply_image_cache_get_buffer (ply_image_t *image,
+                            long         width,
+                            long         height,
+                            int          device_scale)
+{
+        ply_image_cache_entry_t *entry;
+
+        assert (image != NULL);
+        assert (device_scale > 0);
+
+        if (width == ply_image_get_width (image) &&
+            height == ply_image_get_height (image) &&
+            device_scale == 1)
+                return ply_image_get_buffer (image);
+
+        if (entries == NULL)
+                entries = ply_list_new ();
+
+        entry = find_entry_for_image (image, width, height, device_scale);
+        if (entry != NULL) {
+                entry->reference_count++;
+                return entry->buffer;
+        }
+
+        ply_trace ("scaling %s to %ldx%ld at scale %d",
+                   ply_image_get_filename (image), width, height, device_scale);
+
+        entry = calloc (1, sizeof(ply_image_cache_entry_t));
+        entry->filename = strdup (ply_image_get_filename (image));
+        entry->source_width = ply_image_get_width (image);
+        entry->source_height = ply_image_get_height (image);
+        entry->width = width;
+        entry->height = height;
+        entry->device_scale = device_scale;
+        entry->reference_count = 1;
+
+        entry->buffer = ply_pixel_buffer_resize (ply_image_get_buffer (image),
+                                                 width * device_scale,
+                                                 height * device_scale);
+        ply_pixel_buffer_set_device_scale (entry->buffer, device_scale);
+
+        ply_list_append_data (entries, entry);
+
+        return entry->buffer;
+}
+
+void
+ply_image_cache_release_buffer (ply_pixel_buffer_t *buffer)
+{
+        ply_list_node_t *node;
+
+        if (buffer == NULL || entries == NULL)
+                return;
+
+        for (node = ply_list_get_first_node (entries);
+             node != NULL;
+             node = ply_list_get_next_node (entries, node)) {
+                ply_image_cache_entry_t *entry = ply_list_node_get_data (node);
+
+                if (entry->buffer != buffer)
+                        continue;
+
+                entry->reference_count--;
+                if (entry->reference_count == 0) {
+                        ply_list_remove_node (entries, node);
+                        ply_pixel_buffer_free (entry->buffer);
+                        free (entry->filename);
+                        free (entry);
+                }
+                break;
+        }
+
+        if (ply_list_get_length (entries) == 0) {
+                ply_list_free (entries);
+                entries = NULL;
+        }
+}
@@ -0,0 +1,38 @@
+/* ply-image-cache.h - scaled copies of images shared between views
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifndef PLY_IMAGE_CACHE_H
+#define PLY_IMAGE_CACHE_H
+
+#include "ply-image.h"
+#include "ply-pixel-buffer.h"
+
+#ifndef PLY_HIDE_FUNCTION_DECLARATIONS
+/* Returns image scaled to width x height logical pixels at device_scale,
+ * made once and shared with everyone asking for the same.  Images are
+ * told apart by file name and size, so pixels must not be changed after
+ * loading.  The buffer is the image's own if it needs no scaling, and
+ * must not be drawn into either way.
+ */
+ply_pixel_buffer_t *ply_image_cache_get_buffer (ply_image_t *image,
+                                                long         width,
+                                                long         height,
+                                                int          device_scale);
+void ply_image_cache_release_buffer (ply_pixel_buffer_t *buffer);
+#endif
+
+#endif /* PLY_IMAGE_CACHE_H */
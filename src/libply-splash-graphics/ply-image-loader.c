@@ -0,0 +1,394 @@
+/* ply-image-loader.c - decodes a set of animation frames in parallel
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "config.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ply-image-loader.h"
+#include "ply-image-pack.h"
+#include "ply-array.h"
+#include "ply-logger.h"
+#include "ply-utils.h"
+
+#define IMAGE_LOADER_MAX_THREADS 8
+
+/* Themes can put every frame into one image, frames_prefix "atlas.png",
+ * and list where each one is in frames_prefix "atlas.frames", one
+ * "x y width height" line per frame in order.  Then there's just the one
+ * file to open and decode, and the frames all share its pixels.
+ */
+#define IMAGE_LOADER_ATLAS_NAME "atlas"
+
+/* Worker threads and the thread waiting on the loader all take the next
+ * frame to decode from next_image, so frames get spread out however long
+ * each one takes.  Nothing but next_image is shared: each frame is only
+ * ever touched by the thread which took it, until the loader is waited on.
+ */
+struct _ply_image_loader
+{
+        ply_image_t   **images;
+        bool           *image_loaded;
+        int             number_of_images;
+
+        ply_image_t    *atlas; /* NULL unless the frames come from one */
+        ply_rectangle_t *atlas_frames;
+        bool            atlas_loaded;
+
+        pthread_mutex_t mutex;
+        int             next_image;
+
+        pthread_t       threads[IMAGE_LOADER_MAX_THREADS];
+        int             number_of_threads;
+
+        uint32_t        is_started : 1;
+        uint32_t        keep_compressed : 1;
+        uint32_t        atlas_is_split : 1;
+};
+
+static bool
+is_frame_filename (const char *filename,
+                   const char *frames_prefix)
+{
+        size_t length = strlen (filename);
+        size_t prefix_length = strlen (frames_prefix);
+
+        if (strncmp (filename, frames_prefix, prefix_length) != 0)
+                return false;
+
+        /* An atlas whose list of frames couldn't be read isn't a frame */
+        if (strcmp (filename + prefix_length, IMAGE_LOADER_ATLAS_NAME ".png") == 0)
+                return false;
+
+        return length > 4 &&
+               strcmp (filename + length - 4, ".png") == 0;
+}
+
+static bool
+ply_image_loader_find_atlas (ply_image_loader_t *loader,
+                             const char         *image_dir,
+                             const char         *frames_prefix)
+{
+        ply_rectangle_t *frames;
+        int number_of_frames;
+        char *filename, *line;
+        size_t line_size;
+        bool is_valid;
+        FILE *fp;
+
+        filename = NULL;
+        asprintf (&filename, "%s/%s" IMAGE_LOADER_ATLAS_NAME ".frames",
+                  image_dir, frames_prefix);
+        fp = fopen (filename, "re");
+        if (fp == NULL) {
+                free (filename);
+                return false;
+        }
+
+        frames = NULL;
+        number_of_frames = 0;
+        is_valid = true;
+        line = NULL;
+        line_size = 0;
+        while (getline (&line, &line_size, fp) != -1) {
+                ply_rectangle_t frame;
+                char *start = line + strspn (line, " \t\r\n");
+
+                if (*start == '\0' || *start == '#')
+                        continue;
+
+                if (sscanf (start, "%ld %ld %lu %lu",
+                            &frame.x, &frame.y, &frame.width, &frame.height) != 4 ||
+                    frame.x < 0 || frame.y < 0 || ply_rectangle_is_empty (&frame)) {
+                        is_valid = false;
+                        break;
+                }
+
+                frames = realloc (frames, (number_of_frames + 1) * sizeof(ply_rectangle_t));
+                frames[number_of_frames++] = frame;
+        }
+        free (line);
+        fclose (fp);
+
+        if (!is_valid || number_of_frames == 0) {
+                ply_trace ("ignoring %s, it doesn't list any frames properly", filename);
+                free (filename);
+                free (frames);
+                return false;
+        }
+        free (filename);
+
+        filename = NULL;
+        asprintf (&filename, "%s/%s" IMAGE_LOADER_ATLAS_NAME ".png",
+                  image_dir, frames_prefix);
+        loader->atlas = ply_image_new (filename);
+        free (filename);
+
+        loader->atlas_frames = frames;
+        loader->number_of_images = number_of_frames;
+        loader->images = calloc (number_of_frames, sizeof(ply_image_t *));
+        loader->image_loaded = calloc (number_of_frames + 1, sizeof(bool));
+
+        return true;
+}
+
+ply_image_loader_t *
+ply_image_loader_new (const char *image_dir,
+                      const char *frames_prefix)
+{
+        ply_image_loader_t *loader;
+        struct dirent **entries;
+        ply_array_t *images;
+        int number_of_entries;
+        int i;
+
+        assert (image_dir != NULL);
+        assert (frames_prefix != NULL);
+
+        loader = calloc (1, sizeof(ply_image_loader_t));
+        pthread_mutex_init (&loader->mutex, NULL);
+
+        if (ply_image_loader_find_atlas (loader, image_dir, frames_prefix))
+                return loader;
+
+        images = ply_array_new (PLY_ARRAY_ELEMENT_TYPE_POINTER);
+
+        entries = NULL;
+        number_of_entries = scandir (image_dir, &entries, NULL, versionsort);
+
+        for (i = 0; i < number_of_entries; i++) {
+                if (is_frame_filename (entries[i]->d_name, frames_prefix)) {
+                        char *filename;
+
+                        filename = NULL;
+                        asprintf (&filename, "%s/%s", image_dir, entries[i]->d_name);
+                        ply_array_add_pointer_element (images, ply_image_new (filename));
+                        free (filename);
+                }
+
+                free (entries[i]);
+        }
+        free (entries);
+
+        loader->number_of_images = ply_array_get_size (images);
+        loader->images = (ply_image_t **) ply_array_steal_pointer_elements (images);
+        loader->image_loaded = calloc (loader->number_of_images + 1, sizeof(bool));
+        ply_array_free (images);
+
+        return loader;
+}
+
+/* An atlas is decoded as a whole, by one thread */
+static int
+ply_image_loader_get_number_of_jobs (ply_image_loader_t *loader)
+{
+        if (loader->atlas != NULL)
+                return 1;
+
+        return loader->number_of_images;
+}
+
+static void *
+ply_image_loader_run (ply_image_loader_t *loader)
+{
+        int number_of_jobs;
+        int index;
+
+        number_of_jobs = ply_image_loader_get_number_of_jobs (loader);
+
+        while (true) {
+                pthread_mutex_lock (&loader->mutex);
+                index = loader->next_image;
+                if (index < number_of_jobs)
+                        loader->next_image++;
+                pthread_mutex_unlock (&loader->mutex);
+
+                if (index >= number_of_jobs)
+                        break;
+
+                /* The frames point into the atlas, so it's decoded for
+                 * good whatever keep_compressed says */
+                if (loader->atlas != NULL)
+                        loader->atlas_loaded = ply_image_load (loader->atlas);
+                else if (loader->keep_compressed)
+                        loader->image_loaded[index] = ply_image_load_compressed (loader->images[index]);
+                else
+                        loader->image_loaded[index] = ply_image_load (loader->images[index]);
+        }
+
+        return NULL;
+}
+
+static int
+ply_image_loader_get_number_of_threads (ply_image_loader_t *loader)
+{
+        long number_of_processors;
+
+        number_of_processors = sysconf (_SC_NPROCESSORS_ONLN);
+        if (number_of_processors < 1)
+                number_of_processors = 1;
+
+        return MIN (MIN (number_of_processors, IMAGE_LOADER_MAX_THREADS),
+                    ply_image_loader_get_number_of_jobs (loader));
+}
+
+void
+ply_image_loader_keep_compressed (ply_image_loader_t *loader)
+{
+        assert (loader != NULL);
+        assert (!loader->is_started);
+
+        loader->keep_compressed = true;
+}
+
+void
+ply_image_loader_start (ply_image_loader_t *loader)
+{
+        int i, number_of_threads;
+
+        assert (loader != NULL);
+
+        if (loader->is_started)
+                return;
+
+        loader->is_started = true;
+
+        number_of_threads = ply_image_loader_get_number_of_threads (loader);
+        for (i = 0; i < number_of_threads; i++) {
+                if (pthread_create (&loader->threads[loader->number_of_threads], NULL,
+                                    (void *(*)(void *)) ply_image_loader_run,
+                                    loader) != 0)
+                        break;
+                loader->number_of_threads++;
+        }
+}
+
+static void
+ply_image_loader_split_atlas (ply_image_loader_t *loader)
+{
+        long atlas_width, atlas_height;
+        int i;
+
+        loader->atlas_is_split = true;
+
+        if (!loader->atlas_loaded)
+                return;
+
+        atlas_width = ply_image_get_width (loader->atlas);
+        atlas_height = ply_image_get_height (loader->atlas);
+
+        for (i = 0; i < loader->number_of_images; i++) {
+                ply_rectangle_t *frame = &loader->atlas_frames[i];
+
+                if (frame->x + (long) frame->width > atlas_width ||
+                    frame->y + (long) frame->height > atlas_height) {
+                        ply_trace ("frame %d lies outside of %s", i,
+                                   ply_image_get_filename (loader->atlas));
+                        continue;
+                }
+
+                loader->images[i] = ply_image_new_sub_image (loader->atlas, frame);
+                loader->image_loaded[i] = true;
+        }
+}
+
+bool
+ply_image_loader_wait (ply_image_loader_t *loader)
+{
+        int i;
+
+        assert (loader != NULL);
+
+        ply_image_loader_start (loader);
+
+        /* Rather than sit idle, help out with whatever frames are left,
+         * which also covers any threads that couldn't be started */
+        ply_image_loader_run (loader);
+
+        for (i = 0; i < loader->number_of_threads; i++) {
+                pthread_join (loader->threads[i], NULL);
+        }
+        loader->number_of_threads = 0;
+
+        /* The threads can't trace, so say what they ran into here */
+        ply_image_pack_trace_problems ();
+
+        if (loader->atlas != NULL && !loader->atlas_is_split)
+                ply_image_loader_split_atlas (loader);
+
+        if (loader->number_of_images == 0)
+                return false;
+
+        for (i = 0; i < loader->number_of_images; i++) {
+                if (!loader->image_loaded[i])
+                        return false;
+        }
+
+        return true;
+}
+
+void
+ply_image_loader_free (ply_image_loader_t *loader)
+{
+        int i;
+
+        if (loader == NULL)
+                return;
+
+        if (loader->is_started)
+                ply_image_loader_wait (loader);
+
+        for (i = 0; i < loader->number_of_images; i++) {
+                ply_image_free (loader->images[i]);
+        }
+
+        /* whatever frames were stolen keep its pixels around */
+        ply_image_free (loader->atlas);
+        free (loader->atlas_frames);
+
+        pthread_mutex_destroy (&loader->mutex);
+        free (loader->images);
+        free (loader->image_loaded);
+        free (loader);
+}
+
+int
+ply_image_loader_get_number_of_images (ply_image_loader_t *loader)
+{
+        return loader->number_of_images;
+}
+
+ply_image_t *
+ply_image_loader_steal_image (ply_image_loader_t *loader,
+                              int                 index)
+{
+        ply_image_t *image;
+
+        assert (index >= 0 && index < loader->number_of_images);
+
+        image = loader->images[index];
+        loader->images[index] = NULL;
+
+        return image;
+}
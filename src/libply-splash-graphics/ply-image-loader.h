@@ -0,0 +1,50 @@
+/* ply-image-loader.h - decodes a set of animation frames in parallel
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifndef PLY_IMAGE_LOADER_H
+#define PLY_IMAGE_LOADER_H
+
+#include "ply-image.h"
+
+#include <stdbool.h>
+
+typedef struct _ply_image_loader ply_image_loader_t;
+
+#ifndef PLY_HIDE_FUNCTION_DECLARATIONS
+/* Finds the files in image_dir named frames_prefix*.png, in version order,
+ * or the frames of the atlas frames_prefix "atlas.png" if there's a list
+ * of them in frames_prefix "atlas.frames" */
+ply_image_loader_t *ply_image_loader_new (const char *image_dir,
+                                          const char *frames_prefix);
+/* Waits for any frames still being decoded, and frees the ones not stolen */
+void ply_image_loader_free (ply_image_loader_t *loader);
+
+/* Only read the files in, see ply_image_load_compressed */
+void ply_image_loader_keep_compressed (ply_image_loader_t *loader);
+
+/* Starts decoding the frames on worker threads and returns right away */
+void ply_image_loader_start (ply_image_loader_t *loader);
+/* Decodes whatever is left, starting first if need be, and returns false
+ * unless there was at least one frame and all of them loaded */
+bool ply_image_loader_wait (ply_image_loader_t *loader);
+
+int ply_image_loader_get_number_of_images (ply_image_loader_t *loader);
+ply_image_t *ply_image_loader_steal_image (ply_image_loader_t *loader,
+                                           int                 index);
+#endif
+
+#endif /* PLY_IMAGE_LOADER_H */
@@ -0,0 +1,634 @@
+/* ply-image-pack.c - theme images decoded ahead of time
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/* A pack holds the decoded pixels of all the PNG files in a theme
+ * directory, so the splash can skip inflating them at boot.  It is written
+ * with plymouth-pack-images when the initrd is built, and mapped in whole
+ * the first time an image from that directory gets loaded.
+ *
+ * Like script caches, packs don't depend on the machine which wrote them:
+ * integers and pixels are little endian.  Each image is recorded with the
+ * size and a hash of its file, and the pack copy is ignored if the file has
+ * changed since.  Modification times aren't trusted for that, since image
+ * builders often clamp them.
+ *
+ * The header is followed by an index with, for each image, the length of
+ * its name, the name, the size and hash of its file, its
+ * width and height and the offset of its pixels.  The pixels come after
+ * the index, premultiplied ARGB32 like ply_image_load makes them, each
+ * image starting on a 16 byte boundary.
+ */
+#include "config.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ply-image-pack.h"
+#include "ply-image.h"
+#include "ply-buffer.h"
+#include "ply-hashtable.h"
+#include "ply-list.h"
+#include "ply-logger.h"
+#include "ply-utils.h"
+
+#define IMAGE_PACK_FILENAME "images.pack"
+#define IMAGE_PACK_MAGIC "PLYIMAGE"
+#define IMAGE_PACK_MAGIC_SIZE 8
+#define IMAGE_PACK_VERSION 2
+#define IMAGE_PACK_HEADER_SIZE (IMAGE_PACK_MAGIC_SIZE + 4 + 4)
+#define IMAGE_PACK_ALIGNMENT 16
+
+typedef struct
+{
+        char          *name;
+        uint64_t       source_size;
+        uint64_t       source_hash;
+        uint32_t       width, height;
+        const uint8_t *pixels;
+} ply_image_pack_entry_t;
+
+typedef struct
+{
+        char            *image_dir;
+        void            *data;
+        size_t           size;
+        ply_hashtable_t *entries; /* NULL if there is no usable pack */
+
+        /* Images get loaded on worker threads, which mustn't trace, so
+         * what's worth saying is kept for ply_image_pack_trace_problems */
+        ply_list_t      *changed_image_filenames;
+        uint32_t         is_corrupt : 1;
+        uint32_t         is_traced : 1;
+} ply_image_pack_t;
+
+/* An image on its way into a pack */
+typedef struct
+{
+        char        *name;
+        uint64_t     size;
+        uint64_t     hash;
+        ply_image_t *image;
+} ply_image_pack_source_t;
+
+typedef struct
+{
+        const uint8_t *data;
+        const uint8_t *end;
+        bool           failed;
+} ply_image_pack_reader_t;
+
+/* Packs stay mapped once opened, and are never changed after, so only
+ * finding or adding them, and noting problems, needs the lock */
+static pthread_mutex_t image_packs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ply_list_t *image_packs;
+
+char *
+ply_image_pack_get_filename (const char *image_dir)
+{
+        char *pack_filename;
+
+        asprintf (&pack_filename, "%s/%s", image_dir, IMAGE_PACK_FILENAME);
+        return pack_filename;
+}
+
+static void
+write_uint (ply_buffer_t *buffer,
+            uint64_t      value,
+            int           size)
+{
+        unsigned char bytes[8];
+        int i;
+
+        for (i = 0; i < size; i++) {
+                bytes[i] = value & 0xff;
+                value >>= 8;
+        }
+        ply_buffer_append_bytes (buffer, bytes, size);
+}
+
+static size_t
+get_aligned_size (size_t size)
+{
+        return (size + IMAGE_PACK_ALIGNMENT - 1) & ~(size_t) (IMAGE_PACK_ALIGNMENT - 1);
+}
+
+static bool
+write_pixels (int          fd,
+              ply_image_t *image)
+{
+        static const uint8_t padding[IMAGE_PACK_ALIGNMENT] = { 0 };
+        uint32_t *pixels;
+        size_t size;
+        bool written;
+
+        pixels = ply_image_get_data (image);
+        size = ply_image_get_width (image) * ply_image_get_height (image) * sizeof(uint32_t);
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        written = ply_write (fd, pixels, size);
+#else
+        {
+                uint8_t *bytes;
+                size_t i;
+
+                bytes = malloc (size);
+                for (i = 0; i < size / sizeof(uint32_t); i++) {
+                        bytes[4 * i + 0] = pixels[i] & 0xff;
+                        bytes[4 * i + 1] = (pixels[i] >> 8) & 0xff;
+                        bytes[4 * i + 2] = (pixels[i] >> 16) & 0xff;
+                        bytes[4 * i + 3] = pixels[i] >> 24;
+                }
+                written = ply_write (fd, bytes, size);
+                free (bytes);
+        }
+#endif
+
+        if (written && get_aligned_size (size) != size)
+                written = ply_write (fd, padding, get_aligned_size (size) - size);
+
+        return written;
+}
+
+/* Hashes the whole file, like script caches do their source */
+static bool
+hash_file (const char *filename,
+           uint64_t   *size,
+           uint64_t   *hash)
+{
+        struct stat file_info;
+        const uint8_t *data;
+        size_t i;
+        int fd;
+
+        fd = open (filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return false;
+
+        if (fstat (fd, &file_info) < 0 || !S_ISREG (file_info.st_mode)) {
+                close (fd);
+                return false;
+        }
+
+        *size = file_info.st_size;
+        *hash = 0xcbf29ce484222325ULL;   /* FNV-1a */
+        if (file_info.st_size == 0) {
+                close (fd);
+                return true;
+        }
+
+        data = mmap (NULL, file_info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close (fd);
+        if (data == MAP_FAILED)
+                return false;
+
+        for (i = 0; i < (size_t) file_info.st_size; i++) {
+                *hash ^= data[i];
+                *hash *= 0x100000001b3ULL;
+        }
+        munmap ((void *) data, file_info.st_size);
+
+        return true;
+}
+
+static bool
+is_png_filename (const char *filename)
+{
+        size_t length = strlen (filename);
+
+        return length > 4 && strcmp (filename + length - 4, ".png") == 0;
+}
+
+static size_t
+get_index_entry_size (const char *name)
+{
+        return 4 + strlen (name) + 8 + 8 + 4 + 4 + 8;
+}
+
+static void
+free_source (ply_image_pack_source_t *source)
+{
+        ply_image_free (source->image);
+        free (source->name);
+        free (source);
+}
+
+static ply_list_t *
+load_sources (const char *image_dir)
+{
+        struct dirent **dir_entries;
+        int number_of_dir_entries;
+        ply_list_t *sources;
+        int i;
+
+        dir_entries = NULL;
+        number_of_dir_entries = scandir (image_dir, &dir_entries, NULL, alphasort);
+        if (number_of_dir_entries < 0) {
+                ply_trace ("could not read %s: %m", image_dir);
+                return NULL;
+        }
+
+        sources = ply_list_new ();
+        for (i = 0; i < number_of_dir_entries; i++) {
+                ply_image_pack_source_t *source;
+                char *filename;
+
+                if (!is_png_filename (dir_entries[i]->d_name)) {
+                        free (dir_entries[i]);
+                        continue;
+                }
+
+                asprintf (&filename, "%s/%s", image_dir, dir_entries[i]->d_name);
+
+                source = calloc (1, sizeof(ply_image_pack_source_t));
+                source->name = strdup (dir_entries[i]->d_name);
+                source->image = ply_image_new (filename);
+
+                if (hash_file (filename, &source->size, &source->hash) &&
+                    ply_image_load (source->image)) {
+                        ply_list_append_data (sources, source);
+                } else {
+                        ply_trace ("could not load %s, leaving it out", filename);
+                        free_source (source);
+                }
+
+                free (filename);
+                free (dir_entries[i]);
+        }
+        free (dir_entries);
+
+        return sources;
+}
+
+bool
+ply_image_pack_save (const char *pack_filename,
+                     const char *image_dir)
+{
+        ply_list_t *sources;
+        ply_list_node_t *node;
+        ply_buffer_t *header;
+        char *temporary_filename;
+        size_t offset;
+        bool written;
+        int fd;
+
+        sources = load_sources (image_dir);
+        if (sources == NULL)
+                return false;
+
+        offset = IMAGE_PACK_HEADER_SIZE;
+        for (node = ply_list_get_first_node (sources);
+             node != NULL;
+             node = ply_list_get_next_node (sources, node)) {
+                ply_image_pack_source_t *source = ply_list_node_get_data (node);
+
+                offset += get_index_entry_size (source->name);
+        }
+        offset = get_aligned_size (offset);
+
+        header = ply_buffer_new ();
+        ply_buffer_append_bytes (header, IMAGE_PACK_MAGIC, IMAGE_PACK_MAGIC_SIZE);
+        write_uint (header, IMAGE_PACK_VERSION, 4);
+        write_uint (header, ply_list_get_length (sources), 4);
+        for (node = ply_list_get_first_node (sources);
+             node != NULL;
+             node = ply_list_get_next_node (sources, node)) {
+                ply_image_pack_source_t *source = ply_list_node_get_data (node);
+
+                write_uint (header, strlen (source->name), 4);
+                ply_buffer_append_bytes (header, source->name, strlen (source->name));
+                write_uint (header, source->size, 8);
+                write_uint (header, source->hash, 8);
+                write_uint (header, ply_image_get_width (source->image), 4);
+                write_uint (header, ply_image_get_height (source->image), 4);
+                write_uint (header, offset, 8);
+
+                offset += get_aligned_size (ply_image_get_width (source->image) *
+                                            ply_image_get_height (source->image) *
+                                            sizeof(uint32_t));
+        }
+        while (ply_buffer_get_size (header) % IMAGE_PACK_ALIGNMENT != 0)
+                write_uint (header, 0, 1);
+
+        /* Write to the side and rename so a reader never sees half a file */
+        asprintf (&temporary_filename, "%s.XXXXXX", pack_filename);
+        fd = mkstemp (temporary_filename);
+        if (fd < 0) {
+                ply_trace ("could not create %s: %m", temporary_filename);
+                written = false;
+                goto out;
+        }
+
+        written = ply_write (fd, ply_buffer_get_bytes (header), ply_buffer_get_size (header));
+        for (node = ply_list_get_first_node (sources);
+             node != NULL && written;
+             node = ply_list_get_next_node (sources, node)) {
+                ply_image_pack_source_t *source = ply_list_node_get_data (node);
+
+                written = write_pixels (fd, source->image);
+        }
+
+        fchmod (fd, 0644);
+        if (close (fd) < 0)
+                written = false;
+        if (written && rename (temporary_filename, pack_filename) < 0)
+                written = false;
+        if (!written) {
+                ply_trace ("could not write %s: %m", pack_filename);
+                unlink (temporary_filename);
+        }
+
+out:
+        free (temporary_filename);
+        ply_buffer_free (header);
+        for (node = ply_list_get_first_node (sources);
+             node != NULL;
+             node = ply_list_get_next_node (sources, node)) {
+                free_source (ply_list_node_get_data (node));
+        }
+        ply_list_free (sources);
+
+        return written;
+}
+
+static uint64_t
+read_uint (ply_image_pack_reader_t *reader,
+           int                      size)
+{
+        uint64_t value = 0;
+        int i;
+
+        if (reader->failed || reader->end - reader->data < size) {
+                reader->failed = true;
+                return 0;
+        }
+
+        for (i = size - 1; i >= 0; i--) {
+                value = (value << 8) | reader->data[i];
+        }
+        reader->data += size;
+
+        return value;
+}
+
+static void
+free_entry (void *key,
+            void *data,
+            void *user_data)
+{
+        ply_image_pack_entry_t *entry = data;
+
+        free (entry->name);
+        free (entry);
+}
+
+static bool
+ply_image_pack_read_index (ply_image_pack_t *pack)
+{
+        ply_image_pack_reader_t reader = { 0 };
+        uint32_t number_of_images, i;
+
+        reader.data = pack->data;
+        reader.end = reader.data + pack->size;
+
+        if (memcmp (reader.data, IMAGE_PACK_MAGIC, IMAGE_PACK_MAGIC_SIZE) != 0)
+                return false;
+        reader.data += IMAGE_PACK_MAGIC_SIZE;
+
+        if (read_uint (&reader, 4) != IMAGE_PACK_VERSION)
+                return false;
+
+        number_of_images = read_uint (&reader, 4);
+        for (i = 0; i < number_of_images && !reader.failed; i++) {
+                ply_image_pack_entry_t *entry;
+                uint32_t name_length;
+                uint64_t offset;
+
+                name_length = read_uint (&reader, 4);
+                if (reader.failed || (size_t) (reader.end - reader.data) < name_length)
+                        return false;
+
+                entry = calloc (1, sizeof(ply_image_pack_entry_t));
+                entry->name = strndup ((const char *) reader.data, name_length);
+                reader.data += name_length;
+                entry->source_size = read_uint (&reader, 8);
+                entry->source_hash = read_uint (&reader, 8);
+                entry->width = read_uint (&reader, 4);
+                entry->height = read_uint (&reader, 4);
+                offset = read_uint (&reader, 8);
+
+                /* Divide rather than multiply, which could wrap around */
+                if (reader.failed || strlen (entry->name) != name_length ||
+                    offset % IMAGE_PACK_ALIGNMENT != 0 || offset > pack->size ||
+                    (entry->width != 0 &&
+                     entry->height > (pack->size - offset) / sizeof(uint32_t) / entry->width) ||
+                    ply_hashtable_lookup (pack->entries, entry->name) != NULL) {
+                        free_entry (NULL, entry, NULL);
+                        return false;
+                }
+                entry->pixels = (const uint8_t *) pack->data + offset;
+
+                ply_hashtable_insert (pack->entries, entry->name, entry);
+        }
+
+        return !reader.failed;
+}
+
+static ply_image_pack_t *
+ply_image_pack_open (const char *image_dir)
+{
+        ply_image_pack_t *pack;
+        struct stat file_info;
+        char *pack_filename;
+        int fd;
+
+        pack = calloc (1, sizeof(ply_image_pack_t));
+        pack->image_dir = strdup (image_dir);
+        pack->changed_image_filenames = ply_list_new ();
+
+        pack_filename = ply_image_pack_get_filename (image_dir);
+        fd = open (pack_filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                free (pack_filename);
+                return pack;
+        }
+
+        if (fstat (fd, &file_info) < 0 || file_info.st_size < IMAGE_PACK_HEADER_SIZE) {
+                close (fd);
+                free (pack_filename);
+                return pack;
+        }
+
+        pack->data = mmap (NULL, file_info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close (fd);
+        if (pack->data == MAP_FAILED) {
+                pack->data = NULL;
+                free (pack_filename);
+                return pack;
+        }
+        pack->size = file_info.st_size;
+
+        pack->entries = ply_hashtable_new (ply_hashtable_string_hash,
+                                           ply_hashtable_string_compare);
+        if (!ply_image_pack_read_index (pack)) {
+                pack->is_corrupt = true;
+                ply_hashtable_foreach (pack->entries, free_entry, NULL);
+                ply_hashtable_free (pack->entries);
+                pack->entries = NULL;
+                munmap (pack->data, pack->size);
+                pack->data = NULL;
+        }
+
+        free (pack_filename);
+        return pack;
+}
+
+static ply_image_pack_t *
+ply_image_pack_get (const char *image_dir)
+{
+        ply_image_pack_t *pack = NULL;
+        ply_list_node_t *node;
+
+        pthread_mutex_lock (&image_packs_mutex);
+        if (image_packs == NULL)
+                image_packs = ply_list_new ();
+
+        for (node = ply_list_get_first_node (image_packs);
+             node != NULL;
+             node = ply_list_get_next_node (image_packs, node)) {
+                pack = ply_list_node_get_data (node);
+                if (strcmp (pack->image_dir, image_dir) == 0)
+                        break;
+        }
+
+        if (node == NULL) {
+                pack = ply_image_pack_open (image_dir);
+                ply_list_append_data (image_packs, pack);
+        }
+        pthread_mutex_unlock (&image_packs_mutex);
+
+        return pack;
+}
+
+ply_pixel_buffer_t *
+ply_image_pack_load_image (const char *image_filename)
+{
+        ply_image_pack_t *pack;
+        ply_image_pack_entry_t *entry;
+        ply_pixel_buffer_t *buffer;
+        uint64_t source_size, source_hash;
+        const char *name;
+        char *image_dir;
+
+        name = strrchr (image_filename, '/');
+        if (name != NULL) {
+                image_dir = strndup (image_filename, MAX (name - image_filename, 1));
+                name++;
+        } else {
+                image_dir = strdup (".");
+                name = image_filename;
+        }
+
+        pack = ply_image_pack_get (image_dir);
+        free (image_dir);
+
+        if (pack->entries == NULL)
+                return NULL;
+
+        entry = ply_hashtable_lookup (pack->entries, (void *) name);
+        if (entry == NULL)
+                return NULL;
+
+        if (!hash_file (image_filename, &source_size, &source_hash) ||
+            source_size != entry->source_size ||
+            source_hash != entry->source_hash) {
+                pthread_mutex_lock (&image_packs_mutex);
+                ply_list_append_data (pack->changed_image_filenames, strdup (image_filename));
+                pthread_mutex_unlock (&image_packs_mutex);
+                return NULL;
+        }
+
+        buffer = ply_pixel_buffer_new (entry->width, entry->height);
+        if (ply_pixel_buffer_get_argb32_data (buffer) == NULL) {
+                ply_pixel_buffer_free (buffer);
+                return NULL;
+        }
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        memcpy (ply_pixel_buffer_get_argb32_data (buffer), entry->pixels,
+                (size_t) entry->width * entry->height * sizeof(uint32_t));
+#else
+        {
+                uint32_t *pixels = ply_pixel_buffer_get_argb32_data (buffer);
+                size_t i;
+
+                for (i = 0; i < (size_t) entry->width * entry->height; i++) {
+                        pixels[i] = (uint32_t) entry->pixels[4 * i] |
+                                    (uint32_t) entry->pixels[4 * i + 1] << 8 |
+                                    (uint32_t) entry->pixels[4 * i + 2] << 16 |
+                                    (uint32_t) entry->pixels[4 * i + 3] << 24;
+                }
+        }
+#endif
+
+        return buffer;
+}
+
+void
+ply_image_pack_trace_problems (void)
+{
+        ply_list_node_t *node;
+
+        pthread_mutex_lock (&image_packs_mutex);
+        for (node = ply_list_get_first_node (image_packs);
+             node != NULL;
+             node = ply_list_get_next_node (image_packs, node)) {
+                ply_image_pack_t *pack = ply_list_node_get_data (node);
+                ply_list_node_t *filename_node;
+
+                if (!pack->is_traced) {
+                        char *pack_filename = ply_image_pack_get_filename (pack->image_dir);
+
+                        if (pack->is_corrupt)
+                                ply_trace ("%s is corrupt, ignoring", pack_filename);
+                        else if (pack->entries != NULL)
+                                ply_trace ("using %d decoded images from %s",
+                                           ply_hashtable_get_size (pack->entries), pack_filename);
+                        free (pack_filename);
+
+                        pack->is_traced = true;
+                }
+
+                while ((filename_node = ply_list_get_first_node (pack->changed_image_filenames)) != NULL) {
+                        char *image_filename = ply_list_node_get_data (filename_node);
+
+                        ply_trace ("%s has changed since it was packed", image_filename);
+                        free (image_filename);
+                        ply_list_remove_node (pack->changed_image_filenames, filename_node);
+                }
+        }
+        pthread_mutex_unlock (&image_packs_mutex);
+}
@@ -0,0 +1,43 @@
+/* ply-image-pack.h - theme images decoded ahead of time
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifndef PLY_IMAGE_PACK_H
+#define PLY_IMAGE_PACK_H
+
+#include "ply-pixel-buffer.h"
+
+#include <stdbool.h>
+
+#ifndef PLY_HIDE_FUNCTION_DECLARATIONS
+char *ply_image_pack_get_filename (const char *image_dir);
+
+/* Decodes every PNG file in image_dir into one pack file */
+bool ply_image_pack_save (const char *pack_filename,
+                          const char *image_dir);
+
+/* Returns the pixels for image_filename if the pack in its directory has
+ * them and the file hasn't changed since, or NULL.  It's safe to call
+ * from any thread, since it doesn't trace.
+ */
+ply_pixel_buffer_t *ply_image_pack_load_image (const char *image_filename);
+
+/* Traces which packs got used, and which images in them had changed,
+ * since the last call.  Only from the main thread, like all tracing. */
+void ply_image_pack_trace_problems (void);
+#endif
+
+#endif /* PLY_IMAGE_PACK_H */
@@ -27,6 +27,7 @@
  */
 #include "config.h"
 #include "ply-image.h"
+#include "ply-image-pack.h"
 #include "ply-pixel-buffer.h"
 
 #include <assert.h>
@@ -35,6 +36,7 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -53,6 +55,10 @@ struct _ply_image
 {
         char               *filename;
         ply_pixel_buffer_t *buffer;
+
+        uint8_t            *compressed_data; /* see ply_image_load_compressed */
+        size_t              compressed_size;
+        long                width, height;
 };
 
 struct bmp_file_header {
@@ -102,6 +108,7 @@ ply_image_free (ply_image_t *image)
         assert (image->filename != NULL);
 
         ply_pixel_buffer_free (image->buffer);
+        free (image->compressed_data);
         free (image->filename);
         free (image);
 }
@@ -207,6 +214,11 @@ ply_image_load_png (ply_image_t *image, FILE *fp)
         png_read_end (png, info);
         png_destroy_read_struct (&png, &info, NULL);
 
+        /* Work out once which part of the image hides whatever is below it,
+         * and which runs of pixels can be skipped or copied when drawing it */
+        ply_pixel_buffer_find_opaque_area (image->buffer);
+        ply_pixel_buffer_find_spans (image->buffer);
+
         return true;
 }
 
@@ -273,18 +285,12 @@ out:
         return ret;
 }
 
-bool
-ply_image_load (ply_image_t *image)
+static bool
+ply_image_load_from_stream (ply_image_t *image,
+                            FILE        *fp)
 {
         uint8_t header[16];
         bool ret = false;
-        FILE *fp;
-
-        assert (image != NULL);
-
-        fp = fopen (image->filename, "re");
-        if (fp == NULL)
-                return false;
 
         if (fread (header, 1, 16, fp) != 16)
                 goto out;
@@ -301,10 +307,125 @@ ply_image_load (ply_image_t *image)
                 ret = ply_image_load_bmp (image, fp);
 
 out:
+        return ret;
+}
+
+ply_pixel_buffer_t *
+ply_image_decode_to_pixel_buffer (ply_image_t *image)
+{
+        ply_image_t decoded_image = { .filename = image->filename };
+        FILE *fp;
+
+        assert (image != NULL);
+        assert (image->compressed_data != NULL);
+
+        fp = fmemopen (image->compressed_data, image->compressed_size, "r");
+        if (fp == NULL)
+                return NULL;
+
+        if (!ply_image_load_from_stream (&decoded_image, fp)) {
+                ply_pixel_buffer_free (decoded_image.buffer);
+                decoded_image.buffer = NULL;
+        }
         fclose (fp);
+
+        return decoded_image.buffer;
+}
+
+bool
+ply_image_load (ply_image_t *image)
+{
+        ply_pixel_buffer_t *buffer;
+        bool ret;
+        FILE *fp;
+
+        assert (image != NULL);
+
+        if (image->compressed_data != NULL) {
+                ply_pixel_buffer_free (image->buffer);
+                image->buffer = ply_image_decode_to_pixel_buffer (image);
+                return image->buffer != NULL;
+        }
+
+        /* Use the pixels from an image pack if the theme has one */
+        buffer = ply_image_pack_load_image (image->filename);
+        if (buffer != NULL) {
+                ply_pixel_buffer_free (image->buffer);
+                image->buffer = buffer;
+
+                ply_pixel_buffer_find_opaque_area (image->buffer);
+                ply_pixel_buffer_find_spans (image->buffer);
+                return true;
+        }
+
+        fp = fopen (image->filename, "re");
+        if (fp == NULL)
+                return false;
+
+        ret = ply_image_load_from_stream (image, fp);
+        fclose (fp);
+
         return ret;
 }
 
+static uint32_t
+read_big_endian_uint32 (const uint8_t *bytes)
+{
+        return ((uint32_t) bytes[0] << 24) | ((uint32_t) bytes[1] << 16) |
+               ((uint32_t) bytes[2] << 8) | (uint32_t) bytes[3];
+}
+
+bool
+ply_image_load_compressed (ply_image_t *image)
+{
+        struct stat file_info;
+        uint8_t *data;
+        int fd;
+
+        assert (image != NULL);
+
+        fd = open (image->filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return false;
+
+        if (fstat (fd, &file_info) < 0 || file_info.st_size < 24) {
+                close (fd);
+                return false;
+        }
+
+        data = malloc (file_info.st_size);
+        if (!ply_read (fd, data, file_info.st_size)) {
+                free (data);
+                close (fd);
+                return false;
+        }
+        close (fd);
+
+        /* Only PNG files have their size right at the start, in the IHDR
+         * chunk which must come first.  Anything else is decoded now */
+        if (memcmp (data, png_header, sizeof(png_header)) != 0 ||
+            memcmp (data + 12, "IHDR", 4) != 0) {
+                free (data);
+                return ply_image_load (image);
+        }
+
+        free (image->compressed_data);
+        image->compressed_data = data;
+        image->compressed_size = file_info.st_size;
+        image->width = read_big_endian_uint32 (data + 16);
+        image->height = read_big_endian_uint32 (data + 20);
+
+        return true;
+}
+
+const char *
+ply_image_get_filename (ply_image_t *image)
+{
+        assert (image != NULL);
+
+        return image->filename;
+}
+
 uint32_t *
 ply_image_get_data (ply_image_t *image)
 {
@@ -319,6 +440,10 @@ ply_image_get_width (ply_image_t *image)
         ply_rectangle_t size;
 
         assert (image != NULL);
+
+        if (image->buffer == NULL)
+                return image->width;
+
         ply_pixel_buffer_get_size (image->buffer, &size);
 
         return size.width;
@@ -330,11 +455,24 @@ ply_image_get_height (ply_image_t *image)
         ply_rectangle_t size;
 
         assert (image != NULL);
+
+        if (image->buffer == NULL)
+                return image->height;
+
         ply_pixel_buffer_get_size (image->buffer, &size);
 
         return size.height;
 }
 
+void
+ply_image_get_opaque_area (ply_image_t     *image,
+                           ply_rectangle_t *opaque_area)
+{
+        assert (image != NULL);
+
+        ply_pixel_buffer_get_opaque_area (image->buffer, opaque_area);
+}
+
 ply_image_t *
 ply_image_resize (ply_image_t *image,
                   long         width,
@@ -382,6 +520,30 @@ ply_image_tile (ply_image_t *image,
         return new_image;
 }
 
+ply_image_t *
+ply_image_new_sub_image (ply_image_t     *image,
+                         ply_rectangle_t *area)
+{
+        ply_image_t *sub_image;
+
+        assert (image != NULL);
+        assert (image->buffer != NULL);
+        assert (area != NULL);
+
+        sub_image = calloc (1, sizeof(ply_image_t));
+
+        /* Named after the area as well, so sub-images of the same size
+         * don't get mistaken for one another */
+        asprintf (&sub_image->filename, "%s:%ld,%ld",
+                  image->filename, area->x, area->y);
+
+        sub_image->buffer = ply_pixel_buffer_new_view (image->buffer, area);
+        ply_pixel_buffer_find_opaque_area (sub_image->buffer);
+        ply_pixel_buffer_find_spans (sub_image->buffer);
+
+        return sub_image;
+}
+
 ply_pixel_buffer_t *
 ply_image_get_buffer (ply_image_t *image)
 {
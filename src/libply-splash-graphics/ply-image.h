@@ -33,10 +33,20 @@ typedef struct _ply_image ply_image_t;
 #ifndef PLY_HIDE_FUNCTION_DECLARATIONS
 ply_image_t *ply_image_new (const char *filename);
 void ply_image_free (ply_image_t *image);
+/* Doesn't trace, so image loaders can run it on worker threads */
 bool ply_image_load (ply_image_t *image);
+/* Reads the file in without decoding it, so it takes up little memory
+ * until ply_image_load.  Width and height are known right away.
+ * ply_image_decode_to_pixel_buffer then hands out freshly decoded copies
+ * while leaving the image itself alone, so it can run on any thread */
+bool ply_image_load_compressed (ply_image_t *image);
+ply_pixel_buffer_t *ply_image_decode_to_pixel_buffer (ply_image_t *image);
+const char *ply_image_get_filename (ply_image_t *image);
 uint32_t *ply_image_get_data (ply_image_t *image);
 long ply_image_get_width (ply_image_t *image);
 long ply_image_get_height (ply_image_t *image);
+void ply_image_get_opaque_area (ply_image_t     *image,
+                                ply_rectangle_t *opaque_area);
 ply_image_t *ply_image_resize (ply_image_t *image,
                                long         width,
                                long         height);
@@ -47,6 +57,11 @@ ply_image_t *ply_image_rotate (ply_image_t *oldimage,
 ply_image_t *ply_image_tile (ply_image_t *image,
                              long         width,
                              long         height);
+/* Returns an image of area of the loaded image, sharing its pixels, so
+ * the rows of its data are further apart than its width, see
+ * ply_pixel_buffer_new_view */
+ply_image_t *ply_image_new_sub_image (ply_image_t     *image,
+                                      ply_rectangle_t *area);
 ply_pixel_buffer_t *ply_image_get_buffer (ply_image_t *image);
 ply_pixel_buffer_t *ply_image_convert_to_pixel_buffer (ply_image_t *image);
 
@@ -45,6 +45,7 @@
 #include "ply-array.h"
 #include "ply-logger.h"
 #include "ply-image.h"
+#include "ply-image-loader.h"
 #include "ply-utils.h"
 
 #include <linux/kd.h>
@@ -52,6 +53,7 @@
 struct _ply_progress_animation
 {
         ply_array_t                        *frames;
+        ply_image_loader_t                 *loader;
         char                               *image_dir;
         char                               *frames_prefix;
 
@@ -131,6 +133,7 @@ ply_progress_animation_free (ply_progress_animation_t *progress_animation)
         if (progress_animation == NULL)
                 return;
 
+        ply_image_loader_free (progress_animation->loader);
         ply_progress_animation_remove_frames (progress_animation);
         ply_array_free (progress_animation->frames);
 
@@ -152,6 +155,10 @@ image_fade_merge (ply_image_t *frame0,
         int frame1_width = ply_image_get_width (frame1);
         int frame1_height = ply_image_get_height (frame1);
 
+        /* frames from an atlas have rows further apart than their width */
+        unsigned long frame0_stride = ply_pixel_buffer_get_row_stride (ply_image_get_buffer (frame0));
+        unsigned long frame1_stride = ply_pixel_buffer_get_row_stride (ply_image_get_buffer (frame1));
+
         uint32_t *frame0_data = ply_image_get_data (frame0);
         uint32_t *frame1_data = ply_image_get_data (frame1);
 
@@ -162,12 +169,12 @@ image_fade_merge (ply_image_t *frame0,
                         uint32_t pixel0, pixel1, pixelout;
 
                         if (y < frame0_height && x < frame0_width)
-                                pixel0 = frame0_data[y * frame0_width + x];
+                                pixel0 = frame0_data[y * frame0_stride + x];
                         else
                                 pixel0 = 0;
 
                         if (y < frame1_height && x < frame1_width)
-                                pixel1 = frame1_data[y * frame1_width + x];
+                                pixel1 = frame1_data[y * frame1_stride + x];
                         else
                                 pixel1 = 0;
 
@@ -308,89 +315,56 @@ ply_progress_animation_draw (ply_progress_animation_t *progress_animation)
                                      progress_animation->frame_area.height);
 }
 
-static bool
+static void
 ply_progress_animation_add_frame (ply_progress_animation_t *progress_animation,
-                                  const char               *filename)
+                                  ply_image_t              *image)
 {
-        ply_image_t *image;
-
-        image = ply_image_new (filename);
-
-        if (!ply_image_load (image)) {
-                ply_image_free (image);
-                return false;
-        }
-
         ply_array_add_pointer_element (progress_animation->frames, image);
 
         progress_animation->area.width = MAX (progress_animation->area.width, (size_t) ply_image_get_width (image));
         progress_animation->area.height = MAX (progress_animation->area.height, (size_t) ply_image_get_height (image));
-
-        return true;
 }
 
 static bool
 ply_progress_animation_add_frames (ply_progress_animation_t *progress_animation)
 {
-        struct dirent **entries;
-        int number_of_entries;
-        int number_of_frames;
+        ply_image_loader_t *loader;
+        int number_of_images;
         int i;
         bool load_finished;
 
-        entries = NULL;
-
-        number_of_entries = scandir (progress_animation->image_dir, &entries, NULL, versionsort);
+        ply_progress_animation_start_loading (progress_animation);
+        loader = progress_animation->loader;
+        progress_animation->loader = NULL;
 
-        if (number_of_entries < 0)
-                return false;
-
-        load_finished = false;
-        for (i = 0; i < number_of_entries; i++) {
-                if (strncmp (entries[i]->d_name,
-                             progress_animation->frames_prefix,
-                             strlen (progress_animation->frames_prefix)) == 0
-                    && (strlen (entries[i]->d_name) > 4)
-                    && strcmp (entries[i]->d_name + strlen (entries[i]->d_name) - 4, ".png") == 0) {
-                        char *filename;
-                        bool r;
-
-                        filename = NULL;
-                        asprintf (&filename, "%s/%s", progress_animation->image_dir, entries[i]->d_name);
-
-                        r = ply_progress_animation_add_frame (progress_animation, filename);
-                        free (filename);
-                        if (!r)
-                                goto out;
-                }
+        load_finished = ply_image_loader_wait (loader);
+        number_of_images = ply_image_loader_get_number_of_images (loader);
 
-                free (entries[i]);
-                entries[i] = NULL;
-        }
-
-        number_of_frames = ply_array_get_size (progress_animation->frames);
-        if (number_of_frames == 0) {
+        if (number_of_images == 0) {
                 ply_trace ("could not find any progress animation frames");
-                load_finished = false;
-        } else {
-                ply_trace ("found %d progress animation frames", number_of_frames);
-                load_finished = true;
-        }
-
-out:
-        if (!load_finished) {
-                ply_progress_animation_remove_frames (progress_animation);
-
-                while (i < number_of_entries) {
-                        free (entries[i]);
-                        i++;
+        } else if (load_finished) {
+                for (i = 0; i < number_of_images; i++) {
+                        ply_progress_animation_add_frame (progress_animation,
+                                                          ply_image_loader_steal_image (loader, i));
                 }
+                ply_trace ("found %d progress animation frames", number_of_images);
         }
-        free (entries);
+        ply_image_loader_free (loader);
 
         return load_finished;
 }
 
+void
+ply_progress_animation_start_loading (ply_progress_animation_t *progress_animation)
+{
+        if (progress_animation->loader != NULL)
+                return;
+
+        progress_animation->loader = ply_image_loader_new (progress_animation->image_dir,
+                                                           progress_animation->frames_prefix);
+        ply_image_loader_start (progress_animation->loader);
+}
+
 bool
 ply_progress_animation_load (ply_progress_animation_t *progress_animation)
 {
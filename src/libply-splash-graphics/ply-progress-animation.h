@@ -43,6 +43,9 @@ ply_progress_animation_t *ply_progress_animation_new (const char *image_dir,
                                                       const char *frames_prefix);
 void ply_progress_animation_free (ply_progress_animation_t *progress_animation);
 
+/* Starts decoding the frames in the background,
+ * ply_progress_animation_load then waits for them */
+void ply_progress_animation_start_loading (ply_progress_animation_t *progress_animation);
 bool ply_progress_animation_load (ply_progress_animation_t *progress_animation);
 void ply_progress_animation_set_transition (ply_progress_animation_t           *progress_animation,
                                             ply_progress_animation_transition_t transition,
@@ -44,9 +44,10 @@
 #include "ply-event-loop.h"
 #include "ply-pixel-buffer.h"
 #include "ply-pixel-display.h"
-#include "ply-array.h"
+#include "ply-frame-cache.h"
 #include "ply-logger.h"
 #include "ply-image.h"
+#include "ply-image-loader.h"
 #include "ply-utils.h"
 
 #include <linux/kd.h>
@@ -61,8 +62,11 @@
 
 struct _ply_throbber
 {
-        ply_array_t         *frames;
+        ply_frame_cache_t   *frames;
+        ply_image_loader_t  *loader;
+        size_t               memory_budget;
         ply_event_loop_t    *loop;
+        ply_timeout_watch_t *timeout_watch; /* or NULL */
         char                *image_dir;
         char                *frames_prefix;
 
@@ -75,6 +79,7 @@ struct _ply_throbber
         double               start_time, now;
 
         int                  frame_number;
+        int                  shown_frame_number; /* or -1 */
         uint32_t             is_stopped : 1;
 };
 
@@ -91,7 +96,6 @@ ply_throbber_new (const char *image_dir,
 
         throbber = calloc (1, sizeof(ply_throbber_t));
 
-        throbber->frames = ply_array_new (PLY_ARRAY_ELEMENT_TYPE_POINTER);
         throbber->frames_prefix = strdup (frames_prefix);
         throbber->image_dir = strdup (image_dir);
         throbber->is_stopped = true;
@@ -109,14 +113,8 @@ ply_throbber_new (const char *image_dir,
 static void
 ply_throbber_remove_frames (ply_throbber_t *throbber)
 {
-        int i;
-        ply_pixel_buffer_t **frames;
-
-        frames = (ply_pixel_buffer_t **) ply_array_steal_pointer_elements (throbber->frames);
-        for (i = 0; frames[i] != NULL; i++) {
-                ply_pixel_buffer_free (frames[i]);
-        }
-        free (frames);
+        ply_frame_cache_free (throbber->frames);
+        throbber->frames = NULL;
 }
 
 void
@@ -128,29 +126,59 @@ ply_throbber_free (ply_throbber_t *throbber)
         if (!throbber->is_stopped)
                 ply_throbber_stop_now (throbber, false);
 
+        ply_image_loader_free (throbber->loader);
         ply_throbber_remove_frames (throbber);
-        ply_array_free (throbber->frames);
 
         free (throbber->frames_prefix);
         free (throbber->image_dir);
         free (throbber);
 }
 
+static void
+ply_throbber_draw_changes (ply_throbber_t *throbber)
+{
+        ply_region_t *changed_area;
+        ply_list_t *rectangles;
+        ply_list_node_t *node;
+
+        changed_area = ply_frame_cache_get_changed_area (throbber->frames,
+                                                         throbber->shown_frame_number,
+                                                         throbber->frame_number);
+        throbber->shown_frame_number = throbber->frame_number;
+
+        rectangles = ply_region_get_rectangle_list (changed_area);
+
+        ply_pixel_display_pause_updates (throbber->display);
+        for (node = ply_list_get_first_node (rectangles);
+             node != NULL;
+             node = ply_list_get_next_node (rectangles, node)) {
+                ply_rectangle_t *rectangle = ply_list_node_get_data (node);
+
+                ply_pixel_display_draw_area (throbber->display,
+                                             throbber->x + rectangle->x,
+                                             throbber->y + rectangle->y,
+                                             rectangle->width,
+                                             rectangle->height);
+        }
+        ply_pixel_display_unpause_updates (throbber->display);
+
+        ply_region_free (changed_area);
+}
+
 static bool
 animate_at_time (ply_throbber_t *throbber,
                  double          time)
 {
         int number_of_frames;
-        ply_pixel_buffer_t *const *frames;
         bool should_continue;
         double percent_in_sequence;
         int last_frame_number;
 
-        number_of_frames = ply_array_get_size (throbber->frames);
-
-        if (number_of_frames == 0)
+        if (throbber->frames == NULL)
                 return true;
 
+        number_of_frames = ply_frame_cache_get_number_of_frames (throbber->frames);
+
         should_continue = true;
         percent_in_sequence = fmod (time, THROBBER_DURATION) / THROBBER_DURATION;
         last_frame_number = throbber->frame_number;
@@ -167,24 +195,26 @@ animate_at_time (ply_throbber_t *throbber,
                         should_continue = false;
         }
 
-        frames = (ply_pixel_buffer_t *const *) ply_array_get_pointer_elements (throbber->frames);
-        ply_pixel_buffer_get_size (frames[throbber->frame_number], &throbber->frame_area);
+        ply_frame_cache_get_frame_size (throbber->frames, throbber->frame_number,
+                                        &throbber->frame_area);
         throbber->frame_area.x = throbber->x;
         throbber->frame_area.y = throbber->y;
-        ply_pixel_display_draw_area (throbber->display,
-                                     throbber->x, throbber->y,
-                                     throbber->frame_area.width,
-                                     throbber->frame_area.height);
+        ply_throbber_draw_changes (throbber);
 
         return should_continue;
 }
 
+static void on_frame_done (ply_throbber_t      *throbber,
+                           ply_pixel_display_t *display);
+
 static void
 on_timeout (ply_throbber_t *throbber)
 {
         double sleep_time;
         bool should_continue;
 
+        throbber->timeout_watch = NULL;
+
         throbber->now = ply_get_timestamp ();
 
         should_continue = animate_at_time (throbber,
@@ -200,94 +230,101 @@ on_timeout (ply_throbber_t *throbber)
                         ply_trigger_pull (throbber->stop_trigger, NULL);
                         throbber->stop_trigger = NULL;
                 }
-        } else {
+        } else if (!ply_pixel_display_watch_for_frame_done (throbber->display,
+                                                            (ply_pixel_display_frame_done_handler_t)
+                                                            on_frame_done, throbber)) {
+                throbber->timeout_watch =
+                        ply_event_loop_watch_for_timeout (throbber->loop,
+                                                          sleep_time,
+                                                          (ply_event_loop_timeout_handler_t)
+                                                          on_timeout, throbber);
+        }
+}
+
+static void
+on_frame_done (ply_throbber_t      *throbber,
+               ply_pixel_display_t *display)
+{
+        double sleep_time;
+
+        /* The renderer can tell when frames reach the screen, so don't
+         * start on the next frame until the current one has
+         */
+        sleep_time = 1.0 / FRAMES_PER_SECOND;
+        sleep_time = MAX (sleep_time - (ply_get_timestamp () - throbber->now),
+                          0.005);
+
+        throbber->timeout_watch =
                 ply_event_loop_watch_for_timeout (throbber->loop,
                                                   sleep_time,
                                                   (ply_event_loop_timeout_handler_t)
                                                   on_timeout, throbber);
-        }
 }
 
-static bool
+static void
 ply_throbber_add_frame (ply_throbber_t *throbber,
-                        const char     *filename)
+                        ply_image_t    *image)
 {
-        ply_image_t *image;
-        ply_pixel_buffer_t *frame;
-
-        image = ply_image_new (filename);
-
-        if (!ply_image_load (image)) {
-                ply_image_free (image);
-                return false;
-        }
+        throbber->width = MAX (throbber->width, ply_image_get_width (image));
+        throbber->height = MAX (throbber->height, ply_image_get_height (image));
 
-        frame = ply_image_convert_to_pixel_buffer (image);
-
-        ply_array_add_pointer_element (throbber->frames, frame);
-
-        throbber->width = MAX (throbber->width, (long) ply_pixel_buffer_get_width (frame));
-        throbber->height = MAX (throbber->height, (long) ply_pixel_buffer_get_height (frame));
-
-        return true;
+        ply_frame_cache_add_frame (throbber->frames, image);
 }
 
 static bool
 ply_throbber_add_frames (ply_throbber_t *throbber)
 {
-        struct dirent **entries;
-        int number_of_entries;
+        ply_image_loader_t *loader;
+        int number_of_images;
         int i;
         bool load_finished;
 
-        entries = NULL;
-
-        number_of_entries = scandir (throbber->image_dir, &entries, NULL, versionsort);
+        ply_throbber_start_loading (throbber);
+        loader = throbber->loader;
+        throbber->loader = NULL;
 
-        if (number_of_entries <= 0)
-                return false;
-
-        load_finished = false;
-        for (i = 0; i < number_of_entries; i++) {
-                if (strncmp (entries[i]->d_name,
-                             throbber->frames_prefix,
-                             strlen (throbber->frames_prefix)) == 0
-                    && (strlen (entries[i]->d_name) > 4)
-                    && strcmp (entries[i]->d_name + strlen (entries[i]->d_name) - 4, ".png") == 0) {
-                        char *filename;
-
-                        filename = NULL;
-                        asprintf (&filename, "%s/%s", throbber->image_dir, entries[i]->d_name);
+        load_finished = ply_image_loader_wait (loader);
 
-                        if (!ply_throbber_add_frame (throbber, filename))
-                                goto out;
-
-                        free (filename);
+        if (load_finished) {
+                throbber->frames = ply_frame_cache_new (throbber->memory_budget);
+                number_of_images = ply_image_loader_get_number_of_images (loader);
+                for (i = 0; i < number_of_images; i++) {
+                        ply_throbber_add_frame (throbber,
+                                                ply_image_loader_steal_image (loader, i));
                 }
-
-                free (entries[i]);
-                entries[i] = NULL;
         }
-        load_finished = true;
+        ply_image_loader_free (loader);
 
-out:
-        if (!load_finished) {
-                ply_throbber_remove_frames (throbber);
+        return load_finished;
+}
 
-                while (entries[i] != NULL) {
-                        free (entries[i]);
-                        i++;
-                }
-        }
-        free (entries);
+void
+ply_throbber_start_loading (ply_throbber_t *throbber)
+{
+        if (throbber->loader != NULL)
+                return;
 
-        return (ply_array_get_size (throbber->frames) > 0);
+        throbber->loader = ply_image_loader_new (throbber->image_dir,
+                                                 throbber->frames_prefix);
+        if (throbber->memory_budget > 0)
+                ply_image_loader_keep_compressed (throbber->loader);
+        ply_image_loader_start (throbber->loader);
+}
+
+void
+ply_throbber_set_memory_budget (ply_throbber_t *throbber,
+                                size_t          memory_budget)
+{
+        assert (throbber->loader == NULL);
+        assert (throbber->frames == NULL);
+
+        throbber->memory_budget = memory_budget;
 }
 
 bool
 ply_throbber_load (ply_throbber_t *throbber)
 {
-        if (ply_array_get_size (throbber->frames) != 0)
+        if (throbber->frames != NULL)
                 ply_throbber_remove_frames (throbber);
 
         if (!ply_throbber_add_frames (throbber))
@@ -296,6 +333,17 @@ ply_throbber_load (ply_throbber_t *throbber)
         return true;
 }
 
+/* Queued timeouts are freed when the loop exits, so the watch has to be
+ * forgotten before then */
+static void
+ply_throbber_detach_from_event_loop (ply_throbber_t *throbber)
+{
+        assert (throbber != NULL);
+
+        throbber->timeout_watch = NULL;
+        throbber->loop = NULL;
+}
+
 bool
 ply_throbber_start (ply_throbber_t      *throbber,
                     ply_event_loop_t    *loop,
@@ -313,12 +361,18 @@ ply_throbber_start (ply_throbber_t      *throbber,
         throbber->x = x;
         throbber->y = y;
 
+        throbber->shown_frame_number = -1;
         throbber->start_time = ply_get_timestamp ();
 
-        ply_event_loop_watch_for_timeout (throbber->loop,
-                                          1.0 / FRAMES_PER_SECOND,
-                                          (ply_event_loop_timeout_handler_t)
-                                          on_timeout, throbber);
+        ply_event_loop_watch_for_exit (throbber->loop, (ply_event_loop_exit_handler_t)
+                                       ply_throbber_detach_from_event_loop,
+                                       throbber);
+
+        throbber->timeout_watch =
+                ply_event_loop_watch_for_timeout (throbber->loop,
+                                                  1.0 / FRAMES_PER_SECOND,
+                                                  (ply_event_loop_timeout_handler_t)
+                                                  on_timeout, throbber);
 
         return true;
 }
@@ -328,6 +382,10 @@ ply_throbber_stop_now (ply_throbber_t *throbber, bool redraw)
 {
         throbber->is_stopped = true;
 
+        if (throbber->frames != NULL && throbber->display != NULL)
+                ply_trace ("throbber damaged %.0f pixels per frame on average",
+                           ply_frame_cache_get_average_damage (throbber->frames));
+
         if (redraw) {
                 ply_pixel_display_draw_area (throbber->display,
                                              throbber->x,
@@ -337,11 +395,20 @@ ply_throbber_stop_now (ply_throbber_t *throbber, bool redraw)
         }
 
         if (throbber->loop != NULL) {
-                ply_event_loop_stop_watching_for_timeout (throbber->loop,
-                                                          (ply_event_loop_timeout_handler_t)
-                                                          on_timeout, throbber);
-                throbber->loop = NULL;
+                if (throbber->timeout_watch != NULL)
+                        ply_event_loop_cancel_timeout (throbber->loop,
+                                                       throbber->timeout_watch);
+                ply_event_loop_stop_watching_for_exit (throbber->loop,
+                                                       (ply_event_loop_exit_handler_t)
+                                                       ply_throbber_detach_from_event_loop,
+                                                       throbber);
+                ply_throbber_detach_from_event_loop (throbber);
         }
+
+        if (throbber->display != NULL)
+                ply_pixel_display_stop_watching_for_frame_done (throbber->display,
+                                                                (ply_pixel_display_frame_done_handler_t)
+                                                                on_frame_done, throbber);
         throbber->display = NULL;
 }
 
@@ -380,14 +447,17 @@ ply_throbber_draw_area (ply_throbber_t     *throbber,
                         unsigned long       width,
                         unsigned long       height)
 {
-        ply_pixel_buffer_t *const *frames;
+        ply_pixel_buffer_t *frame;
+
+        if (throbber->is_stopped || throbber->frames == NULL)
+                return;
 
-        if (throbber->is_stopped)
+        frame = ply_frame_cache_get_frame (throbber->frames, throbber->frame_number);
+        if (frame == NULL)
                 return;
 
-        frames = (ply_pixel_buffer_t *const *) ply_array_get_pointer_elements (throbber->frames);
         ply_pixel_buffer_fill_with_buffer (buffer,
-                                           frames[throbber->frame_number],
+                                           frame,
                                            throbber->x,
                                            throbber->y);
 }
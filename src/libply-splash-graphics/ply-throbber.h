@@ -38,6 +38,13 @@ ply_throbber_t *ply_throbber_new (const char *image_dir,
                                   const char *frames_prefix);
 void ply_throbber_free (ply_throbber_t *throbber);
 
+/* Starts decoding the frames in the background, ply_throbber_load then
+ * waits for them */
+void ply_throbber_start_loading (ply_throbber_t *throbber);
+/* Keeps at most memory_budget bytes of frames decoded, decoding the rest
+ * as they come up.  0, the default, decodes them all up front */
+void ply_throbber_set_memory_budget (ply_throbber_t *throbber,
+                                     size_t          memory_budget);
 bool ply_throbber_load (ply_throbber_t *throbber);
 bool ply_throbber_start (ply_throbber_t      *throbber,
                          ply_event_loop_t    *loop,
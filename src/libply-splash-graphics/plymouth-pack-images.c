@@ -0,0 +1,50 @@
+/* plymouth-pack-images.c - writes the image pack for a theme directory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ply-logger.h"
+#include "ply-image-pack.h"
+
+int
+main (int    argc,
+      char **argv)
+{
+        char *pack_filename;
+        bool saved;
+
+        if (argc != 2 && argc != 3) {
+                ply_error ("usage: %s IMAGE-DIR [PACK-FILE]", argv[0]);
+                return 1;
+        }
+
+        if (argc == 3)
+                pack_filename = strdup (argv[2]);
+        else
+                pack_filename = ply_image_pack_get_filename (argv[1]);
+
+        saved = ply_image_pack_save (pack_filename, argv[1]);
+        if (!saved)
+                ply_error ("%s: could not write %s: %m", argv[0], pack_filename);
+
+        free (pack_filename);
+        return saved ? 0 : 1;
+}
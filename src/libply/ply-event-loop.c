@@ -35,6 +35,7 @@
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/termios.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include "ply-logger.h"
@@ -97,22 +98,42 @@ typedef struct
         void                         *user_data;
 } ply_event_loop_exit_closure_t;
 
-typedef struct
+/* Marks timeout watches that aren't in the heap, because they're firing */
+#define PLY_EVENT_LOOP_TIMEOUT_NOT_QUEUED ((size_t) -1)
+
+struct _ply_timeout_watch
 {
         double                           timeout;
         ply_event_loop_timeout_handler_t handler;
         void                            *user_data;
-} ply_event_loop_timeout_watch_t;
 
+        unsigned long                    sequence;
+        size_t                           heap_index;
+};
+
+/* Timeout watches are kept in a binary min-heap ordered by when they're
+ * due, and then by when they were added, so ones due at the same time
+ * fire in order.  Each watch knows where it is in the heap, so it can be
+ * taken out without looking for it.
+ *
+ * epoll_wait only takes whole milliseconds, so a timerfd set for the
+ * earliest timeout wakes the loop instead, where there is one.
+ */
 struct _ply_event_loop
 {
         int                      epoll_fd;
         int                      exit_code;
-        double                   wakeup_time;
 
         ply_list_t              *sources;
         ply_list_t              *exit_closures;
-        ply_list_t              *timeout_watches;
+
+        ply_timeout_watch_t    **timeout_heap;
+        size_t                   number_of_timeouts;
+        size_t                   timeout_heap_size;
+        unsigned long            next_timeout_sequence;
+
+        int                      timer_fd; /* or -1 */
+        double                   timer_fd_wakeup_time;
 
         ply_signal_dispatcher_t *signal_dispatcher;
 
@@ -483,16 +504,28 @@ ply_event_loop_new (void)
         loop = calloc (1, sizeof(ply_event_loop_t));
 
         loop->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
-        loop->wakeup_time = PLY_EVENT_LOOP_NO_TIMED_WAKEUP;
 
         assert (loop->epoll_fd >= 0);
 
+        loop->timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        loop->timer_fd_wakeup_time = PLY_EVENT_LOOP_NO_TIMED_WAKEUP;
+        if (loop->timer_fd >= 0) {
+                struct epoll_event event = { 0 };
+
+                /* It has no event source, see ply_event_loop_drop_timer_events */
+                event.events = EPOLLIN;
+                event.data.ptr = NULL;
+                if (epoll_ctl (loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &event) < 0) {
+                        close (loop->timer_fd);
+                        loop->timer_fd = -1;
+                }
+        }
+
         loop->should_exit = false;
         loop->exit_code = 0;
 
         loop->sources = ply_list_new ();
         loop->exit_closures = ply_list_new ();
-        loop->timeout_watches = ply_list_new ();
 
         loop->signal_dispatcher = ply_signal_dispatcher_new ();
 
@@ -571,14 +604,16 @@ ply_event_loop_free (ply_event_loop_t *loop)
                 return;
 
         assert (ply_list_get_length (loop->sources) == 0);
-        assert (ply_list_get_length (loop->timeout_watches) == 0);
+        assert (loop->number_of_timeouts == 0);
 
         ply_signal_dispatcher_free (loop->signal_dispatcher);
         ply_event_loop_free_exit_closures (loop);
 
         ply_list_free (loop->sources);
-        ply_list_free (loop->timeout_watches);
+        free (loop->timeout_heap);
 
+        if (loop->timer_fd >= 0)
+                close (loop->timer_fd);
         close (loop->epoll_fd);
         free (loop);
 }
@@ -904,67 +939,193 @@ ply_event_loop_stop_watching_for_exit (ply_event_loop_t             *loop,
         }
 }
 
-void
+static bool
+ply_timeout_watch_is_due_before (ply_timeout_watch_t *watch,
+                                 ply_timeout_watch_t *other_watch)
+{
+        if (watch->timeout != other_watch->timeout)
+                return watch->timeout < other_watch->timeout;
+
+        return watch->sequence < other_watch->sequence;
+}
+
+static void
+ply_event_loop_place_timeout (ply_event_loop_t    *loop,
+                              ply_timeout_watch_t *watch,
+                              size_t               index)
+{
+        loop->timeout_heap[index] = watch;
+        watch->heap_index = index;
+}
+
+static void
+ply_event_loop_move_timeout_up (ply_event_loop_t *loop,
+                                size_t            index)
+{
+        ply_timeout_watch_t *watch = loop->timeout_heap[index];
+
+        while (index > 0) {
+                size_t parent = (index - 1) / 2;
+
+                if (!ply_timeout_watch_is_due_before (watch, loop->timeout_heap[parent]))
+                        break;
+
+                ply_event_loop_place_timeout (loop, loop->timeout_heap[parent], index);
+                index = parent;
+        }
+
+        ply_event_loop_place_timeout (loop, watch, index);
+}
+
+static void
+ply_event_loop_move_timeout_down (ply_event_loop_t *loop,
+                                  size_t            index)
+{
+        ply_timeout_watch_t *watch = loop->timeout_heap[index];
+
+        while (true) {
+                size_t child = 2 * index + 1;
+
+                if (child >= loop->number_of_timeouts)
+                        break;
+
+                if (child + 1 < loop->number_of_timeouts &&
+                    ply_timeout_watch_is_due_before (loop->timeout_heap[child + 1],
+                                                     loop->timeout_heap[child]))
+                        child++;
+
+                if (!ply_timeout_watch_is_due_before (loop->timeout_heap[child], watch))
+                        break;
+
+                ply_event_loop_place_timeout (loop, loop->timeout_heap[child], index);
+                index = child;
+        }
+
+        ply_event_loop_place_timeout (loop, watch, index);
+}
+
+static void
+ply_event_loop_queue_timeout (ply_event_loop_t    *loop,
+                              ply_timeout_watch_t *watch)
+{
+        if (loop->number_of_timeouts == loop->timeout_heap_size) {
+                loop->timeout_heap_size = MAX (2 * loop->timeout_heap_size, 16);
+                loop->timeout_heap = realloc (loop->timeout_heap,
+                                              loop->timeout_heap_size * sizeof(ply_timeout_watch_t *));
+        }
+
+        ply_event_loop_place_timeout (loop, watch, loop->number_of_timeouts++);
+        ply_event_loop_move_timeout_up (loop, watch->heap_index);
+}
+
+static void
+ply_event_loop_dequeue_timeout (ply_event_loop_t    *loop,
+                                ply_timeout_watch_t *watch)
+{
+        ply_timeout_watch_t *last_watch;
+        size_t index = watch->heap_index;
+
+        assert (index < loop->number_of_timeouts);
+        assert (loop->timeout_heap[index] == watch);
+
+        watch->heap_index = PLY_EVENT_LOOP_TIMEOUT_NOT_QUEUED;
+
+        last_watch = loop->timeout_heap[--loop->number_of_timeouts];
+        if (last_watch == watch)
+                return;
+
+        /* The last watch fills the hole, and then moves whichever way
+         * it's out of order */
+        ply_event_loop_place_timeout (loop, last_watch, index);
+        if (index > 0 &&
+            ply_timeout_watch_is_due_before (last_watch, loop->timeout_heap[(index - 1) / 2]))
+                ply_event_loop_move_timeout_up (loop, index);
+        else
+                ply_event_loop_move_timeout_down (loop, index);
+}
+
+static double
+ply_event_loop_get_wakeup_time (ply_event_loop_t *loop)
+{
+        if (loop->number_of_timeouts == 0)
+                return PLY_EVENT_LOOP_NO_TIMED_WAKEUP;
+
+        return loop->timeout_heap[0]->timeout;
+}
+
+ply_timeout_watch_t *
 ply_event_loop_watch_for_timeout (ply_event_loop_t                *loop,
                                   double                           seconds,
                                   ply_event_loop_timeout_handler_t timeout_handler,
                                   void                            *user_data)
 {
-        ply_event_loop_timeout_watch_t *timeout_watch;
+        ply_timeout_watch_t *timeout_watch;
 
         assert (loop != NULL);
         assert (timeout_handler != NULL);
         assert (seconds > 0.0);
 
-        timeout_watch = calloc (1, sizeof(ply_event_loop_timeout_watch_t));
+        timeout_watch = calloc (1, sizeof(ply_timeout_watch_t));
         timeout_watch->timeout = ply_get_timestamp () + seconds;
         timeout_watch->handler = timeout_handler;
         timeout_watch->user_data = user_data;
+        timeout_watch->sequence = loop->next_timeout_sequence++;
 
-        if (fabs (loop->wakeup_time - PLY_EVENT_LOOP_NO_TIMED_WAKEUP) <= 0)
-                loop->wakeup_time = timeout_watch->timeout;
-        else
-                loop->wakeup_time = MIN (loop->wakeup_time, timeout_watch->timeout);
+        ply_event_loop_queue_timeout (loop, timeout_watch);
 
-        ply_list_append_data (loop->timeout_watches, timeout_watch);
+        return timeout_watch;
 }
 
 void
-ply_event_loop_stop_watching_for_timeout (ply_event_loop_t                *loop,
-                                          ply_event_loop_timeout_handler_t timeout_handler,
-                                          void                            *user_data)
+ply_event_loop_cancel_timeout (ply_event_loop_t    *loop,
+                               ply_timeout_watch_t *watch)
 {
-        ply_list_node_t *node;
-        bool timeout_removed;
+        assert (loop != NULL);
+        assert (watch != NULL);
 
-        loop->wakeup_time = PLY_EVENT_LOOP_NO_TIMED_WAKEUP;
+        /* Its handler is running, and it gets freed after */
+        if (watch->heap_index == PLY_EVENT_LOOP_TIMEOUT_NOT_QUEUED)
+                return;
 
-        timeout_removed = false;
-        node = ply_list_get_first_node (loop->timeout_watches);
-        while (node != NULL) {
-                ply_list_node_t *next_node;
-                ply_event_loop_timeout_watch_t *timeout_watch;
+        ply_event_loop_dequeue_timeout (loop, watch);
+        free (watch);
+}
 
-                timeout_watch = (ply_event_loop_timeout_watch_t *) ply_list_node_get_data (node);
-                next_node = ply_list_get_next_node (loop->timeout_watches, node);
+static ply_timeout_watch_t *
+ply_event_loop_find_timeout (ply_event_loop_t                *loop,
+                             ply_event_loop_timeout_handler_t timeout_handler,
+                             void                            *user_data)
+{
+        size_t i;
+
+        for (i = 0; i < loop->number_of_timeouts; i++) {
+                ply_timeout_watch_t *timeout_watch = loop->timeout_heap[i];
 
                 if (timeout_watch->handler == timeout_handler &&
-                    timeout_watch->user_data == user_data) {
-                        ply_list_remove_node (loop->timeout_watches, node);
-                        free (timeout_watch);
+                    timeout_watch->user_data == user_data)
+                        return timeout_watch;
+        }
 
-                        if (timeout_removed)
-                                ply_trace ("multiple matching timeouts found for removal");
+        return NULL;
+}
 
-                        timeout_removed = true;
-                } else {
-                        if (fabs (loop->wakeup_time - PLY_EVENT_LOOP_NO_TIMED_WAKEUP) <= 0)
-                                loop->wakeup_time = timeout_watch->timeout;
-                        else
-                                loop->wakeup_time = MIN (loop->wakeup_time, timeout_watch->timeout);
-                }
+void
+ply_event_loop_stop_watching_for_timeout (ply_event_loop_t                *loop,
+                                          ply_event_loop_timeout_handler_t timeout_handler,
+                                          void                            *user_data)
+{
+        ply_timeout_watch_t *timeout_watch;
+        bool timeout_removed;
 
-                node = next_node;
+        timeout_removed = false;
+        while ((timeout_watch = ply_event_loop_find_timeout (loop, timeout_handler, user_data)) != NULL) {
+                ply_event_loop_dequeue_timeout (loop, timeout_watch);
+                free (timeout_watch);
+
+                if (timeout_removed)
+                        ply_trace ("multiple matching timeouts found for removal");
+
+                timeout_removed = true;
         }
 
         if (!timeout_removed)
@@ -1097,26 +1258,14 @@ ply_event_loop_free_watches_for_source (ply_event_loop_t   *loop,
 static void
 ply_event_loop_free_timeout_watches (ply_event_loop_t *loop)
 {
-        ply_list_node_t *node;
+        size_t i;
 
         assert (loop != NULL);
 
-        node = ply_list_get_first_node (loop->timeout_watches);
-        while (node != NULL) {
-                ply_list_node_t *next_node;
-                ply_event_loop_timeout_watch_t *watch;
-
-                watch = (ply_event_loop_timeout_watch_t *) ply_list_node_get_data (node);
-                next_node = ply_list_get_next_node (loop->timeout_watches, node);
-
-                free (watch);
-                ply_list_remove_node (loop->timeout_watches, node);
-
-                node = next_node;
+        for (i = 0; i < loop->number_of_timeouts; i++) {
+                free (loop->timeout_heap[i]);
         }
-
-        assert (ply_list_get_length (loop->timeout_watches) == 0);
-        loop->wakeup_time = PLY_EVENT_LOOP_NO_TIMED_WAKEUP;
+        loop->number_of_timeouts = 0;
 }
 
 static void
@@ -1169,41 +1318,101 @@ ply_event_loop_disconnect_source (ply_event_loop_t   *loop,
 static void
 ply_event_loop_handle_timeouts (ply_event_loop_t *loop)
 {
-        ply_list_node_t *node;
         double now;
 
         assert (loop != NULL);
 
+        /* Handlers may add and remove timeouts, so look at the heap afresh
+         * after each one.  Timeouts they add are due after now, so this
+         * ends */
         now = ply_get_timestamp ();
-        node = ply_list_get_first_node (loop->timeout_watches);
-        loop->wakeup_time = PLY_EVENT_LOOP_NO_TIMED_WAKEUP;
-        while (node != NULL) {
-                ply_list_node_t *next_node;
-                ply_event_loop_timeout_watch_t *watch;
+        while (loop->number_of_timeouts > 0) {
+                ply_timeout_watch_t *watch = loop->timeout_heap[0];
 
-                watch = (ply_event_loop_timeout_watch_t *) ply_list_node_get_data (node);
-                next_node = ply_list_get_next_node (loop->timeout_watches, node);
+                if (watch->timeout > now)
+                        break;
 
-                if (watch->timeout <= now) {
-                        assert (watch->handler != NULL);
+                assert (watch->handler != NULL);
 
-                        ply_list_remove_node (loop->timeout_watches, node);
+                ply_event_loop_dequeue_timeout (loop, watch);
+                watch->handler (watch->user_data, loop);
+                free (watch);
+        }
+}
 
-                        watch->handler (watch->user_data, loop);
-                        free (watch);
+/* Returns the epoll_wait timeout for the earliest timeout watch, after
+ * setting the timer fd for it if there is one */
+static int
+ply_event_loop_set_timer (ply_event_loop_t *loop)
+{
+        double wakeup_time;
+        int timeout;
 
-                        /* start over in case the handler invalidated the list
-                         */
-                        next_node = ply_list_get_first_node (loop->timeout_watches);
-                } else {
-                        if (fabs (loop->wakeup_time - PLY_EVENT_LOOP_NO_TIMED_WAKEUP) <= 0)
-                                loop->wakeup_time = watch->timeout;
-                        else
-                                loop->wakeup_time = MIN (loop->wakeup_time, watch->timeout);
+        wakeup_time = ply_event_loop_get_wakeup_time (loop);
+
+        if (loop->timer_fd >= 0) {
+                struct itimerspec timer_spec = { { 0, 0 }, { 0, 0 } };
+
+                if (loop->timer_fd_wakeup_time == wakeup_time)
+                        return -1;
+
+                /* Round up, so it never goes off before the watch is due;
+                 * all zeroes disarms it */
+                if (fabs (wakeup_time - PLY_EVENT_LOOP_NO_TIMED_WAKEUP) > 0) {
+                        timer_spec.it_value.tv_sec = (time_t) wakeup_time;
+                        timer_spec.it_value.tv_nsec = (long) ceil ((wakeup_time - timer_spec.it_value.tv_sec) * 1000000000.0);
+                        if (timer_spec.it_value.tv_nsec >= 1000000000) {
+                                timer_spec.it_value.tv_sec++;
+                                timer_spec.it_value.tv_nsec -= 1000000000;
+                        }
                 }
 
-                node = next_node;
+                if (timerfd_settime (loop->timer_fd, TFD_TIMER_ABSTIME, &timer_spec, NULL) == 0) {
+                        loop->timer_fd_wakeup_time = wakeup_time;
+                        return -1;
+                }
+
+                ply_trace ("could not set timer, falling back to epoll timeouts: %m");
+                epoll_ctl (loop->epoll_fd, EPOLL_CTL_DEL, loop->timer_fd, NULL);
+                close (loop->timer_fd);
+                loop->timer_fd = -1;
         }
+
+        if (fabs (wakeup_time - PLY_EVENT_LOOP_NO_TIMED_WAKEUP) <= 0)
+                return -1;
+
+        /* Likewise rounded up, rather than waking up early and spinning */
+        timeout = (int) ceil ((wakeup_time - ply_get_timestamp ()) * 1000);
+        return MAX (timeout, 0);
+}
+
+/* The timer fd has no event source, it's only there to cut epoll_wait
+ * short, so it gets taken out of the events */
+static int
+ply_event_loop_drop_timer_events (ply_event_loop_t   *loop,
+                                  struct epoll_event *events,
+                                  int                 number_of_events)
+{
+        int i, number_of_source_events;
+
+        number_of_source_events = 0;
+        for (i = 0; i < number_of_events; i++) {
+                if (events[i].data.ptr == NULL) {
+                        uint64_t number_of_expirations;
+
+                        if (read (loop->timer_fd, &number_of_expirations,
+                                  sizeof(number_of_expirations)) < 0)
+                                ply_trace ("could not read timer: %m");
+
+                        /* It's disarmed now, so it needs setting again */
+                        loop->timer_fd_wakeup_time = PLY_EVENT_LOOP_NO_TIMED_WAKEUP;
+                        continue;
+                }
+
+                events[number_of_source_events++] = events[i];
+        }
+
+        return number_of_source_events;
 }
 
 void
@@ -1220,16 +1429,16 @@ ply_event_loop_process_pending_events (ply_event_loop_t *loop)
         do {
                 int timeout;
 
-                if (fabs (loop->wakeup_time - PLY_EVENT_LOOP_NO_TIMED_WAKEUP) <= 0) {
-                        timeout = -1;
-                } else {
-                        timeout = (int) ((loop->wakeup_time - ply_get_timestamp ()) * 1000);
-                        timeout = MAX (timeout, 0);
-                }
+                timeout = ply_event_loop_set_timer (loop);
 
                 number_of_received_events = epoll_wait (loop->epoll_fd, events,
                                                         PLY_EVENT_LOOP_NUM_EVENT_HANDLERS,
                                                         timeout);
+                if (number_of_received_events > 0)
+                        number_of_received_events = ply_event_loop_drop_timer_events (loop,
+                                                                                      events,
+                                                                                      number_of_received_events);
+
                 if (number_of_received_events < 0) {
                         if (errno != EINTR && errno != EAGAIN) {
                                 ply_event_loop_exit (loop, 255);
@@ -28,6 +28,7 @@
 
 typedef struct _ply_event_loop ply_event_loop_t;
 typedef struct _ply_fd_watch ply_fd_watch_t;
+typedef struct _ply_timeout_watch ply_timeout_watch_t;
 
 typedef enum
 {
@@ -71,11 +72,19 @@ void ply_event_loop_watch_for_exit (ply_event_loop_t             *loop,
 void ply_event_loop_stop_watching_for_exit (ply_event_loop_t             *loop,
                                             ply_event_loop_exit_handler_t exit_handler,
                                             void                         *user_data);
-void ply_event_loop_watch_for_timeout (ply_event_loop_t                *loop,
-                                       double                           seconds,
-                                       ply_event_loop_timeout_handler_t timeout_handler,
-                                       void                            *user_data);
+/* The returned watch belongs to the loop.  It can be cancelled until its
+ * handler gets called, or until ply_event_loop_run returns, which drops
+ * all queued timeouts; it's freed after either.  Keepers of watches
+ * should forget them from a ply_event_loop_watch_for_exit handler.
+ */
+ply_timeout_watch_t *ply_event_loop_watch_for_timeout (ply_event_loop_t                *loop,
+                                                       double                           seconds,
+                                                       ply_event_loop_timeout_handler_t timeout_handler,
+                                                       void                            *user_data);
+void ply_event_loop_cancel_timeout (ply_event_loop_t    *loop,
+                                    ply_timeout_watch_t *watch);
 
+/* Has to look through every timeout, cancelling a watch doesn't */
 void ply_event_loop_stop_watching_for_timeout (ply_event_loop_t                *loop,
                                                ply_event_loop_timeout_handler_t timeout_handler,
                                                void                            *user_data);
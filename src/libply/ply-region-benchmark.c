@@ -0,0 +1,97 @@
+/* ply-region-benchmark.c - times regions collecting sprite damage
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ply-list.h"
+#include "ply-region.h"
+#include "ply-utils.h"
+
+/* Each frame, every sprite damages where it was and where it moved to,
+ * somewhere on a 1920x1080 screen, and then the damage is flushed the
+ * way renderers do it.  Only the public API is used, so this builds
+ * against older ply-region.c too, for comparison.
+ */
+#define NUMBER_OF_FRAMES 2000
+#define SCREEN_WIDTH 1920
+#define SCREEN_HEIGHT 1080
+#define MIN_SPRITE_SIZE 64
+#define MAX_SPRITE_SIZE 128
+
+static void
+time_sprites (int number_of_sprites)
+{
+        ply_region_t *region;
+        double start_time, elapsed_time;
+        long number_of_rectangles;
+        int frame, i;
+
+        region = ply_region_new ();
+        number_of_rectangles = 0;
+        srandom (2);
+
+        start_time = ply_get_timestamp ();
+        for (frame = 0; frame < NUMBER_OF_FRAMES; frame++) {
+                ply_list_t *rectangles;
+
+                for (i = 0; i < 2 * number_of_sprites; i++) {
+                        ply_rectangle_t area;
+
+                        area.x = random () % (SCREEN_WIDTH - MAX_SPRITE_SIZE);
+                        area.y = random () % (SCREEN_HEIGHT - MAX_SPRITE_SIZE);
+                        area.width = MIN_SPRITE_SIZE + random () % (MAX_SPRITE_SIZE - MIN_SPRITE_SIZE);
+                        area.height = MIN_SPRITE_SIZE + random () % (MAX_SPRITE_SIZE - MIN_SPRITE_SIZE);
+
+                        ply_region_add_rectangle (region, &area);
+                }
+
+                rectangles = ply_region_get_sorted_rectangle_list (region);
+                number_of_rectangles += ply_list_get_length (rectangles);
+                ply_region_clear (region);
+        }
+        elapsed_time = ply_get_timestamp () - start_time;
+
+        printf ("%4d sprites: %.3f ms per frame, %.1f rectangles per frame\n",
+                number_of_sprites,
+                1000.0 * elapsed_time / NUMBER_OF_FRAMES,
+                (double) number_of_rectangles / NUMBER_OF_FRAMES);
+
+        ply_region_free (region);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+        int i;
+
+        if (argc < 2) {
+                time_sprites (10);
+                time_sprites (40);
+                time_sprites (100);
+                return 0;
+        }
+
+        for (i = 1; i < argc; i++) {
+                time_sprites (atoi (argv[i]));
+        }
+
+        return 0;
+}
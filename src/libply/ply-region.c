@@ -28,15 +28,58 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "ply-list.h"
 #include "ply-rectangle.h"
 
+/* Once a region gets this fragmented, tracking it exactly costs more
+ * than drawing a little too much, so it gets coalesced down to half as
+ * many, larger rectangles.
+ */
+#define PLY_REGION_MAX_RECTANGLES 256
+
+/* Rectangles are kept in one array, sorted into horizontal bands the
+ * way pixman does it:
+ *
+ *  - every rectangle in a band has the same y and height,
+ *  - bands are sorted top to bottom and never overlap,
+ *  - rectangles in a band are sorted left to right and neither
+ *    overlap nor touch,
+ *  - two touching bands never have the same horizontal spans, they
+ *    get coalesced into one taller band instead.
+ *
+ * Rectangles never overlap, and the array is already in the order
+ * flushes want, so it only needs mirroring into rectangle_list when
+ * somebody asks for it.
+ */
 struct _ply_region
 {
-        ply_list_t *rectangle_list;
+        ply_rectangle_t *rectangles;
+        size_t           number_of_rectangles;
+        size_t           number_of_allocated_rectangles;
+
+        /* bands being rebuilt by the current addition */
+        ply_rectangle_t *scratch_rectangles;
+        size_t           number_of_scratch_rectangles;
+        size_t           number_of_allocated_scratch_rectangles;
+
+        ply_list_t      *rectangle_list;
+        uint32_t         rectangle_list_is_stale : 1;
 };
 
+static inline long
+get_bottom (const ply_rectangle_t *rectangle)
+{
+        return rectangle->y + (long) rectangle->height;
+}
+
+static inline long
+get_right (const ply_rectangle_t *rectangle)
+{
+        return rectangle->x + (long) rectangle->width;
+}
+
 ply_region_t *
 ply_region_new (void)
 {
@@ -52,412 +95,385 @@ ply_region_new (void)
 void
 ply_region_clear (ply_region_t *region)
 {
-        ply_list_node_t *node;
+        region->number_of_rectangles = 0;
+        ply_list_remove_all_nodes (region->rectangle_list);
+        region->rectangle_list_is_stale = false;
+}
 
-        node = ply_list_get_first_node (region->rectangle_list);
-        while (node != NULL) {
-                ply_list_node_t *next_node;
-                ply_rectangle_t *rectangle;
+void
+ply_region_free (ply_region_t *region)
+{
+        ply_list_free (region->rectangle_list);
+        free (region->rectangles);
+        free (region->scratch_rectangles);
+        free (region);
+}
+
+static void
+reserve_rectangles (ply_rectangle_t **rectangles,
+                    size_t           *number_of_allocated_rectangles,
+                    size_t            number_of_rectangles)
+{
+        size_t new_size;
 
-                rectangle = (ply_rectangle_t *) ply_list_node_get_data (node);
+        if (number_of_rectangles <= *number_of_allocated_rectangles)
+                return;
+
+        new_size = MAX (*number_of_allocated_rectangles * 2, 16);
+        while (new_size < number_of_rectangles) {
+                new_size *= 2;
+        }
 
-                next_node = ply_list_get_next_node (region->rectangle_list, node);
+        *rectangles = realloc (*rectangles, new_size * sizeof(ply_rectangle_t));
+        *number_of_allocated_rectangles = new_size;
+}
 
-                free (rectangle);
-                ply_list_remove_node (region->rectangle_list, node);
+/* Returns the index one past the band starting at index */
+static size_t
+get_band_end (ply_rectangle_t *rectangles,
+              size_t           number_of_rectangles,
+              size_t           index)
+{
+        size_t end;
 
-                node = next_node;
+        for (end = index + 1; end < number_of_rectangles; end++) {
+                if (rectangles[end].y != rectangles[index].y)
+                        break;
         }
+
+        return end;
 }
 
-void
-ply_region_free (ply_region_t *region)
+static size_t
+get_band_start (ply_rectangle_t *rectangles,
+                size_t           index)
 {
-        ply_region_clear (region);
-        ply_list_free (region->rectangle_list);
-        free (region);
+        while (index > 0 && rectangles[index - 1].y == rectangles[index].y) {
+                index--;
+        }
+
+        return index;
 }
 
-static ply_rectangle_t *
-copy_rectangle (ply_rectangle_t *rectangle)
+static bool
+bands_have_same_spans (ply_rectangle_t *band_a,
+                       size_t           band_a_length,
+                       ply_rectangle_t *band_b,
+                       size_t           band_b_length)
 {
-        ply_rectangle_t *new_rectangle;
+        size_t i;
+
+        if (band_a_length != band_b_length)
+                return false;
 
-        new_rectangle = malloc (sizeof(*rectangle));
-        *new_rectangle = *rectangle;
+        for (i = 0; i < band_a_length; i++) {
+                if (band_a[i].x != band_b[i].x || band_a[i].width != band_b[i].width)
+                        return false;
+        }
 
-        return new_rectangle;
+        return true;
 }
 
+/* Appends a band covering [y1, y2) to the scratch array, or grows the
+ * previously appended band if it touches and has the same spans
+ */
 static void
-merge_rectangle_with_sub_list (ply_region_t    *region,
-                               ply_rectangle_t *new_area,
-                               ply_list_node_t *node)
+append_band (ply_region_t    *region,
+             long             y1,
+             long             y2,
+             ply_rectangle_t *spans,
+             size_t           number_of_spans)
 {
-        if (ply_rectangle_is_empty (new_area)) {
-                free (new_area);
+        ply_rectangle_t *scratch;
+        size_t i, last_band_start;
+
+        if (y1 >= y2 || number_of_spans == 0)
                 return;
-        }
 
-        while (node != NULL) {
-                ply_list_node_t *next_node;
-                ply_rectangle_t *old_area;
-                ply_rectangle_overlap_t overlap;
+        scratch = region->scratch_rectangles;
 
-                old_area = (ply_rectangle_t *) ply_list_node_get_data (node);
+        if (region->number_of_scratch_rectangles > 0) {
+                last_band_start = get_band_start (scratch, region->number_of_scratch_rectangles - 1);
 
-                next_node = ply_list_get_next_node (region->rectangle_list, node);
+                if (get_bottom (&scratch[last_band_start]) == y1 &&
+                    bands_have_same_spans (&scratch[last_band_start],
+                                           region->number_of_scratch_rectangles - last_band_start,
+                                           spans, number_of_spans)) {
+                        for (i = last_band_start; i < region->number_of_scratch_rectangles; i++) {
+                                scratch[i].height = y2 - scratch[i].y;
+                        }
+                        return;
+                }
+        }
 
-                if (ply_rectangle_is_empty (new_area))
-                        overlap = PLY_RECTANGLE_OVERLAP_NO_EDGES;
-                else if (ply_rectangle_is_empty (old_area))
-                        overlap = PLY_RECTANGLE_OVERLAP_ALL_EDGES;
-                else
-                        overlap = ply_rectangle_find_overlap (old_area, new_area);
-
-                switch (overlap) {
-                /* NNNN      The new rectangle and node rectangle don't touch,
-                 * NNNN OOOO so let's move on to the next one.
-                 *      OOOO
-                 */
-                case PLY_RECTANGLE_OVERLAP_NONE:
-                        break;
+        reserve_rectangles (&region->scratch_rectangles,
+                            &region->number_of_allocated_scratch_rectangles,
+                            region->number_of_scratch_rectangles + number_of_spans);
+        scratch = region->scratch_rectangles;
 
-                /* NNNNN   We need to split the new rectangle into
-                 * NNOOOOO two rectangles:  The top row of Ns and
-                 * NNOOOOO the left side of Ns.
-                 *   OOOOO
-                 */
-                case PLY_RECTANGLE_OVERLAP_TOP_AND_LEFT_EDGES:
-                {
-                        ply_rectangle_t *rectangle;
+        for (i = 0; i < number_of_spans; i++) {
+                ply_rectangle_t *rectangle;
 
-                        rectangle = copy_rectangle (new_area);
-                        rectangle->y = old_area->y;
-                        rectangle->width = old_area->x - new_area->x;
-                        rectangle->height = (new_area->y + new_area->height) - old_area->y;
+                rectangle = &scratch[region->number_of_scratch_rectangles++];
+                rectangle->x = spans[i].x;
+                rectangle->width = spans[i].width;
+                rectangle->y = y1;
+                rectangle->height = y2 - y1;
+        }
+}
 
-                        merge_rectangle_with_sub_list (region, rectangle, next_node);
+/* Same as append_band, but with the span from x1 to x2 merged into the
+ * band's spans
+ */
+static void
+append_band_with_span (ply_region_t    *region,
+                       long             y1,
+                       long             y2,
+                       ply_rectangle_t *spans,
+                       size_t           number_of_spans,
+                       long             x1,
+                       long             x2)
+{
+        ply_rectangle_t merged_spans[number_of_spans + 1];
+        size_t i, number_of_merged_spans = 0;
 
-                        new_area->height = old_area->y - new_area->y;
-                }
-                break;
-
-                /*   NNNNN We need to split the new rectangle into
-                 * OOOOONN two rectangles:  The top row of Ns and
-                 * OOOOONN the right side of Ns.
-                 * OOOOO
-                 */
-                case PLY_RECTANGLE_OVERLAP_TOP_AND_RIGHT_EDGES:
-                {
-                        ply_rectangle_t *rectangle;
-
-                        rectangle = copy_rectangle (new_area);
-                        rectangle->x = old_area->x + old_area->width;
-                        rectangle->y = old_area->y;
-                        rectangle->width = (new_area->x + new_area->width) - (old_area->x + old_area->width);
-                        rectangle->height = (new_area->y + new_area->height) - old_area->y;
-
-                        merge_rectangle_with_sub_list (region, rectangle, next_node);
-
-                        new_area->height = old_area->y - new_area->y;
-                }
-                break;
-
-                /* NNNNNNN We need to trim out the part of
-                 * NOOOOON old rectangle that overlaps the new
-                 * NOOOOON rectangle by shrinking and moving it
-                 *  OOOOO  and then we need to add the new rectangle.
-                 */
-                case PLY_RECTANGLE_OVERLAP_TOP_AND_SIDE_EDGES:
-                {
-                        old_area->height = (old_area->y + old_area->height)
-                                           - (new_area->y + new_area->height);
-                        old_area->y = new_area->y + new_area->height;
-                }
-                break;
-
-                /*   NNN  We only care about the top row of Ns,
-                 *  ONNNO everything below that is already handled by
-                 *  ONNNO the old rectangle.
-                 *  OOOOO
-                 */
-                case PLY_RECTANGLE_OVERLAP_TOP_EDGE:
-                        new_area->height = old_area->y - new_area->y;
-                        break;
+        for (i = 0; i < number_of_spans && get_right (&spans[i]) < x1; i++) {
+                merged_spans[number_of_merged_spans++] = spans[i];
+        }
 
-                /*   OOOOO We need to split the new rectangle into
-                 * NNOOOOO two rectangles:  The left side of Ns and
-                 * NNOOOOO the bottom row of Ns.
-                 * NNOOOOO
-                 * NNNNN
-                 */
-                case PLY_RECTANGLE_OVERLAP_BOTTOM_AND_LEFT_EDGES:
-                {
-                        ply_rectangle_t *rectangle;
+        for (; i < number_of_spans && spans[i].x <= x2; i++) {
+                x1 = MIN (x1, spans[i].x);
+                x2 = MAX (x2, get_right (&spans[i]));
+        }
 
-                        rectangle = copy_rectangle (new_area);
+        merged_spans[number_of_merged_spans].x = x1;
+        merged_spans[number_of_merged_spans].width = x2 - x1;
+        number_of_merged_spans++;
 
-                        rectangle->width = old_area->x - new_area->x;
-                        rectangle->height = (old_area->y + old_area->height) - new_area->y;
+        for (; i < number_of_spans; i++) {
+                merged_spans[number_of_merged_spans++] = spans[i];
+        }
 
-                        merge_rectangle_with_sub_list (region, rectangle, next_node);
+        append_band (region, y1, y2, merged_spans, number_of_merged_spans);
+}
 
-                        new_area->height = (new_area->y + new_area->height) - (old_area->y + old_area->height);
-                        new_area->y = old_area->y + old_area->height;
-                }
-                break;
+/* Finds the first rectangle whose band ends below y */
+static size_t
+find_first_band_ending_below (ply_region_t *region,
+                              long          y)
+{
+        size_t low = 0, high = region->number_of_rectangles;
 
-                /*   OOOOO   We need to split the new rectangle into
-                 *   OOOOONN two rectangles:  The right side of Ns and
-                 *   OOOOONN the bottom row of Ns.
-                 *   OOOOONN
-                 *     NNNNN
-                 */
-                case PLY_RECTANGLE_OVERLAP_BOTTOM_AND_RIGHT_EDGES:
-                {
-                        ply_rectangle_t *rectangle;
+        while (low < high) {
+                size_t middle = low + (high - low) / 2;
 
-                        rectangle = copy_rectangle (new_area);
+                if (get_bottom (&region->rectangles[middle]) <= y)
+                        low = middle + 1;
+                else
+                        high = middle;
+        }
 
-                        rectangle->x = old_area->x + old_area->width;
-                        rectangle->width = (new_area->x + new_area->width) - (old_area->x + old_area->width);
-                        rectangle->height = (old_area->y + old_area->height) - new_area->y;
+        return low;
+}
 
-                        merge_rectangle_with_sub_list (region, rectangle, next_node);
+/* Finds the first rectangle whose band starts at or below y */
+static size_t
+find_first_band_starting_at_or_below (ply_region_t *region,
+                                      long          y)
+{
+        size_t low = 0, high = region->number_of_rectangles;
 
-                        new_area->height = (new_area->y + new_area->height) - (old_area->y + old_area->height);
-                        new_area->y = old_area->y + old_area->height;
-                }
-                break;
-
-                /*  OOOOO  We need to trim out the part of
-                 * NOOOOON old rectangle that overlaps the new
-                 * NOOOOON rectangle by shrinking it
-                 * NNNNNNN and then we need to add the new rectangle.
-                 */
-                case PLY_RECTANGLE_OVERLAP_BOTTOM_AND_SIDE_EDGES:
-                {
-                        old_area->height = new_area->y - old_area->y;
-                }
-                break;
-
-                /*  OOOOO We only care about the bottom row of Ns,
-                 *  ONNNO everything above that is already handled by
-                 *  ONNNO the old rectangle.
-                 *   NNN
-                 */
-                case PLY_RECTANGLE_OVERLAP_BOTTOM_EDGE:
-                {
-                        new_area->height = (new_area->y + new_area->height) - (old_area->y + old_area->height);
-                        new_area->y = old_area->y + old_area->height;
-                }
-                break;
-
-                /*  NNNN   We need to trim out the part of
-                 *  NNNNO  old rectangle that overlaps the new
-                 *  NNNNO  rectangle by shrinking it and moving it
-                 *  NNNN   and then we need to add the new rectangle.
-                 */
-                case PLY_RECTANGLE_OVERLAP_TOP_LEFT_AND_BOTTOM_EDGES:
-                {
-                        old_area->width = (old_area->x + old_area->width)
-                                          - (new_area->x + new_area->width);
-                        old_area->x = new_area->x + new_area->width;
-                }
-                break;
-
-                /*  NNNN  We need to trim out the part of
-                 * ONNNN  old rectangle that overlaps the new
-                 * ONNNN  rectangle by shrinking it and then we
-                 *  NNNN  need to add the new rectangle.
-                 */
-                case PLY_RECTANGLE_OVERLAP_TOP_RIGHT_AND_BOTTOM_EDGES:
-                        old_area->width = new_area->x - old_area->x;
-                        break;
+        while (low < high) {
+                size_t middle = low + (high - low) / 2;
 
-                /* NNNNNNN The old rectangle is completely inside the new rectangle
-                 * NOOOOON so replace the old rectangle with the new rectangle.
-                 * NOOOOON
-                 * NNNNNNN
-                 */
-                case PLY_RECTANGLE_OVERLAP_ALL_EDGES:
-                        merge_rectangle_with_sub_list (region, new_area, next_node);
-                        free (old_area);
-                        ply_list_remove_node (region->rectangle_list, node);
-                        return;
+                if (region->rectangles[middle].y < y)
+                        low = middle + 1;
+                else
+                        high = middle;
+        }
 
-                /*  NNN  We need to split the new rectangle into
-                 * ONNNO two rectangles: the top and bottom row of Ns
-                 * ONNNO
-                 *  NNN
-                 */
-                case PLY_RECTANGLE_OVERLAP_TOP_AND_BOTTOM_EDGES:
-                {
-                        ply_rectangle_t *rectangle;
-
-                        rectangle = copy_rectangle (new_area);
-                        rectangle->y = old_area->y + old_area->height;
-                        rectangle->width = new_area->width;
-                        rectangle->height = (new_area->y + new_area->height) - (old_area->y + old_area->height);
-                        merge_rectangle_with_sub_list (region, rectangle, next_node);
-
-                        new_area->height = old_area->y - new_area->y;
-                }
-                break;
-
-                /*  OOOOO We only care about the side row of Ns,
-                 * NNNNOO everything rigth of that is already handled by
-                 * NNNNOO the old rectangle.
-                 *  OOOOO
-                 */
-                case PLY_RECTANGLE_OVERLAP_LEFT_EDGE:
-                        new_area->width = old_area->x - new_area->x;
-                        break;
+        return low;
+}
 
-                /* OOOOO  We only care about the side row of Ns,
-                 * NNNNNN everything left of that is already handled by
-                 * NNNNNN the old rectangle.
-                 * OOOOO
-                 */
-                case PLY_RECTANGLE_OVERLAP_RIGHT_EDGE:
-                {
-                        long temp = new_area->x;
-                        new_area->x = old_area->x + old_area->width;
-                        new_area->width = (temp + new_area->width) - (old_area->x + old_area->width);
-                }
-                break;
+static size_t
+get_band_area (ply_rectangle_t *rectangle)
+{
+        return rectangle->width * rectangle->height;
+}
 
-                /*  OOOOO  We need to split the new rectangle into
-                 * NNNNNNN two rectangles: the side columns of Ns
-                 * NNNNNNN
-                 *  OOOOO
-                 */
-                case PLY_RECTANGLE_OVERLAP_SIDE_EDGES:
-                {
-                        ply_rectangle_t *rectangle;
+/* Shrinks every band down to one rectangle spanning it, then merges
+ * the neighboring bands that waste the least area until the region is
+ * back under half the limit
+ */
+static void
+coalesce_rectangles (ply_region_t *region)
+{
+        ply_rectangle_t *rectangles = region->rectangles;
+        size_t i, start, end, number_of_bands = 0;
 
-                        rectangle = copy_rectangle (new_area);
+        for (start = 0; start < region->number_of_rectangles; start = end) {
+                ply_rectangle_t band;
 
-                        rectangle->x = old_area->x + old_area->width;
-                        rectangle->width = (new_area->x + new_area->width) - (old_area->x + old_area->width);
+                end = get_band_end (rectangles, region->number_of_rectangles, start);
 
-                        merge_rectangle_with_sub_list (region, rectangle, next_node);
+                band = rectangles[start];
+                band.width = get_right (&rectangles[end - 1]) - band.x;
 
-                        new_area->width = old_area->x - new_area->x;
-                }
-                break;
-
-                /* OOOOOOO The new rectangle is completely inside an old rectangle
-                 * ONNNNNO so return early without adding the new rectangle.
-                 * ONNNNNO
-                 * OOOOOOO
-                 */
-                case PLY_RECTANGLE_OVERLAP_NO_EDGES:
-                        free (new_area);
-                        return;
+                if (number_of_bands > 0 &&
+                    get_bottom (&rectangles[number_of_bands - 1]) == band.y &&
+                    rectangles[number_of_bands - 1].x == band.x &&
+                    rectangles[number_of_bands - 1].width == band.width)
+                        rectangles[number_of_bands - 1].height += band.height;
+                else
+                        rectangles[number_of_bands++] = band;
+        }
 
-                /*  NNNNN We expand the old rectangle up and throw away the new.
-                 *  NNNNN We must merge it because the new region may have overlapped
-                 *  NNNNN something further down the list.
-                 *  OOOOO
-                 */
-                case PLY_RECTANGLE_OVERLAP_EXACT_TOP_EDGE:
-                {
-                        old_area->height = (old_area->y + old_area->height) - new_area->y;
-                        old_area->y = new_area->y;
-                        free (new_area);
-                        merge_rectangle_with_sub_list (region, old_area, next_node);
-                        ply_list_remove_node (region->rectangle_list, node);
-                }
-                        return;
+        while (number_of_bands > PLY_REGION_MAX_RECTANGLES / 2) {
+                size_t best_index = 0, best_waste = (size_t) -1;
+                ply_rectangle_t merged;
 
-                /*  OOOOO We expand the old rectangle down and throw away the new.
-                 *  NNNNN We must merge it because the new region may have overlapped
-                 *  NNNNN something further down the list.
-                 *  NNNNN
-                 */
-                case PLY_RECTANGLE_OVERLAP_EXACT_BOTTOM_EDGE:
-                {
-                        old_area->height = (new_area->y + new_area->height) - old_area->y;
-                        free (new_area);
-                        merge_rectangle_with_sub_list (region, old_area, next_node);
-                        ply_list_remove_node (region->rectangle_list, node);
-                }
-                        return;
+                for (i = 0; i + 1 < number_of_bands; i++) {
+                        long x1, x2;
+                        size_t waste;
 
-                /*  NNNNNO We expand the old rectangle left and throw away the new.
-                 *  NNNNNO We must merge it because the new region may have overlapped
-                 *  NNNNNO something further down the list.
-                 */
-                case PLY_RECTANGLE_OVERLAP_EXACT_LEFT_EDGE:
-                {
-                        old_area->width = (old_area->x + old_area->width) - new_area->x;
-                        old_area->x = new_area->x;
-                        free (new_area);
-                        merge_rectangle_with_sub_list (region, old_area, next_node);
-                        ply_list_remove_node (region->rectangle_list, node);
-                }
-                        return;
+                        x1 = MIN (rectangles[i].x, rectangles[i + 1].x);
+                        x2 = MAX (get_right (&rectangles[i]), get_right (&rectangles[i + 1]));
+                        waste = (x2 - x1) * (get_bottom (&rectangles[i + 1]) - rectangles[i].y) -
+                                get_band_area (&rectangles[i]) - get_band_area (&rectangles[i + 1]);
 
-                /*  ONNNNN We expand the old rectangle right and throw away the new.
-                 *  ONNNNN We must merge it because the new region may have overlapped
-                 *  ONNNNN something further down the list.
-                 */
-                case PLY_RECTANGLE_OVERLAP_EXACT_RIGHT_EDGE:
-                {
-                        old_area->width = (new_area->x + new_area->width) - old_area->x;
-                        free (new_area);
-                        merge_rectangle_with_sub_list (region, old_area, next_node);
-                        ply_list_remove_node (region->rectangle_list, node);
-                }
-                        return;
+                        if (waste < best_waste) {
+                                best_waste = waste;
+                                best_index = i;
+                        }
                 }
 
-                node = ply_list_get_next_node (region->rectangle_list, node);
+                merged.x = MIN (rectangles[best_index].x, rectangles[best_index + 1].x);
+                merged.y = rectangles[best_index].y;
+                merged.width = MAX (get_right (&rectangles[best_index]),
+                                    get_right (&rectangles[best_index + 1])) - merged.x;
+                merged.height = get_bottom (&rectangles[best_index + 1]) - merged.y;
+
+                rectangles[best_index] = merged;
+                memmove (&rectangles[best_index + 1], &rectangles[best_index + 2],
+                         (number_of_bands - best_index - 2) * sizeof(ply_rectangle_t));
+                number_of_bands--;
         }
 
-        ply_list_append_data (region->rectangle_list, new_area);
+        region->number_of_rectangles = number_of_bands;
 }
 
 void
 ply_region_add_rectangle (ply_region_t    *region,
                           ply_rectangle_t *rectangle)
 {
-        ply_list_node_t *first_node;
-        ply_rectangle_t *rectangle_copy;
+        ply_rectangle_t *rectangles;
+        size_t start, end, band_start, band_end;
+        long x1, y1, x2, y2, y;
 
         assert (region != NULL);
         assert (rectangle != NULL);
 
-        first_node = ply_list_get_first_node (region->rectangle_list);
+        if (ply_rectangle_is_empty (rectangle))
+                return;
+
+        x1 = rectangle->x;
+        y1 = rectangle->y;
+        x2 = get_right (rectangle);
+        y2 = get_bottom (rectangle);
+
+        rectangles = region->rectangles;
+
+        /* Only the bands the new rectangle overlaps need rebuilding,
+         * plus the bands right above and below it, which the rebuilt
+         * ones may get coalesced with
+         */
+        start = find_first_band_ending_below (region, y1);
+        if (start > 0)
+                start = get_band_start (rectangles, start - 1);
+
+        end = find_first_band_starting_at_or_below (region, y2);
+        if (end < region->number_of_rectangles)
+                end = get_band_end (rectangles, region->number_of_rectangles, end);
+
+        region->number_of_scratch_rectangles = 0;
+        y = y1;
+
+        for (band_start = start; band_start < end; band_start = band_end) {
+                ply_rectangle_t *band = &rectangles[band_start];
+                long band_y1, band_y2;
+
+                band_end = get_band_end (rectangles, end, band_start);
+                band_y1 = band->y;
+                band_y2 = get_bottom (band);
+
+                /* part of the new rectangle above this band */
+                if (y < y2 && y < band_y1) {
+                        append_band_with_span (region, y, MIN (band_y1, y2), NULL, 0, x1, x2);
+                        y = MIN (band_y1, y2);
+                }
+
+                if (band_y2 <= y1 || band_y1 >= y2) {
+                        append_band (region, band_y1, band_y2, band, band_end - band_start);
+                        continue;
+                }
+
+                append_band (region, band_y1, MAX (band_y1, y1), band, band_end - band_start);
+                append_band_with_span (region, MAX (band_y1, y1), MIN (band_y2, y2),
+                                       band, band_end - band_start, x1, x2);
+                append_band (region, MIN (band_y2, y2), band_y2, band, band_end - band_start);
 
-        rectangle_copy = copy_rectangle (rectangle);
-        merge_rectangle_with_sub_list (region,
-                                       rectangle_copy,
-                                       first_node);
+                y = MIN (band_y2, y2);
+        }
+
+        if (y < y2)
+                append_band_with_span (region, y, y2, NULL, 0, x1, x2);
+
+        reserve_rectangles (&region->rectangles,
+                            &region->number_of_allocated_rectangles,
+                            region->number_of_rectangles - (end - start) +
+                            region->number_of_scratch_rectangles);
+        rectangles = region->rectangles;
+
+        memmove (&rectangles[start + region->number_of_scratch_rectangles],
+                 &rectangles[end],
+                 (region->number_of_rectangles - end) * sizeof(ply_rectangle_t));
+        memcpy (&rectangles[start], region->scratch_rectangles,
+                region->number_of_scratch_rectangles * sizeof(ply_rectangle_t));
+        region->number_of_rectangles += region->number_of_scratch_rectangles - (end - start);
+
+        if (region->number_of_rectangles > PLY_REGION_MAX_RECTANGLES)
+                coalesce_rectangles (region);
+
+        region->rectangle_list_is_stale = true;
 }
 
 ply_list_t *
 ply_region_get_rectangle_list (ply_region_t *region)
 {
-        return region->rectangle_list;
-}
+        size_t i;
 
-static int
-rectangle_compare_y (void *element_a, void *element_b)
-{
-        ply_rectangle_t *rectangle_a = element_a;
-        ply_rectangle_t *rectangle_b = element_b;
+        if (!region->rectangle_list_is_stale)
+                return region->rectangle_list;
+
+        ply_list_remove_all_nodes (region->rectangle_list);
+        for (i = 0; i < region->number_of_rectangles; i++) {
+                ply_list_append_data (region->rectangle_list, &region->rectangles[i]);
+        }
+        region->rectangle_list_is_stale = false;
 
-        return rectangle_a->y - rectangle_b->y;
+        return region->rectangle_list;
 }
 
 ply_list_t *
 ply_region_get_sorted_rectangle_list (ply_region_t *region)
 {
-        ply_list_sort (region->rectangle_list, &rectangle_compare_y);
-        return region->rectangle_list;
+        /* bands are already kept sorted top to bottom */
+        return ply_region_get_rectangle_list (region);
 }
 
+bool
+ply_region_is_empty (ply_region_t *region)
+{
+        return region->number_of_rectangles == 0;
+}
 /* vim: set ts=4 sw=4 expandtab autoindent cindent cino={.5s,(0: */
@@ -30,6 +30,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <string.h>
 #include <stdbool.h>
@@ -86,8 +87,22 @@ struct _ply_renderer_head
         bool                    scan_out_buffer_needs_reset;
         bool                    uses_hw_rotation;
 
+        /* Only set up when page flipping, in which case scan_out_buffer_id
+         * is the front buffer
+         */
+        uint32_t                back_buffer_id;
+        ply_region_t           *back_buffer_stale_areas;
+        bool                    flip_pending;
+        bool                    needs_flush;
+
+        ply_renderer_frame_done_handler_t frame_done_handler;
+        void                   *frame_done_handler_user_data;
+
         int                     gamma_size;
         uint16_t                *gamma;
+
+        unsigned long long      bytes_flushed;
+        unsigned long           frames_flushed;
 };
 
 struct _ply_renderer_input_source
@@ -142,6 +157,7 @@ struct _ply_renderer_backend
         drmModeRes                      *resources;
 
         ply_renderer_input_source_t      input_source;
+        ply_fd_watch_t                  *device_watch;
         ply_list_t                      *heads;
         ply_hashtable_t                 *heads_by_controller_id;
 
@@ -158,6 +174,7 @@ struct _ply_renderer_backend
         uint32_t                         is_active : 1;
         uint32_t        requires_explicit_flushing : 1;
         uint32_t                use_preferred_mode : 1;
+        uint32_t                use_page_flipping : 1;
 
         int                              panel_width;
         int                              panel_height;
@@ -188,6 +205,22 @@ should_use_preferred_mode (void)
         return use_preferred_mode;
 }
 
+/* Rendering straight into the buffer being scanned out can tear, so
+ * optionally draw into a second buffer and flip to it on vblank.
+ */
+static bool
+should_use_page_flipping (void)
+{
+        bool use_page_flipping = false;
+
+        if (ply_kernel_command_line_has_argument ("plymouth.use-page-flipping"))
+                use_page_flipping = true;
+
+        ply_trace ("should_use_page_flipping: %d", use_page_flipping);
+
+        return use_page_flipping;
+}
+
 static bool
 ply_renderer_buffer_map (ply_renderer_backend_t *backend,
                          ply_renderer_buffer_t  *buffer)
@@ -375,9 +408,72 @@ begin_flush (ply_renderer_backend_t *backend,
         return buffer->map_address;
 }
 
+/* Drivers that need explicit flushing walk the clip rects one at a time,
+ * so past a handful of rects it is cheaper to flush a bit of undamaged
+ * area than to issue more rects.
+ */
+#define MAX_FLUSH_CLIP_RECTS 16
+
+static unsigned long
+get_clip_rect_area (struct drm_clip_rect *clip_rect)
+{
+        return (unsigned long) (clip_rect->x2 - clip_rect->x1) *
+               (clip_rect->y2 - clip_rect->y1);
+}
+
+static void
+get_clip_rect_union (struct drm_clip_rect *clip_rect_1,
+                     struct drm_clip_rect *clip_rect_2,
+                     struct drm_clip_rect *result)
+{
+        result->x1 = MIN (clip_rect_1->x1, clip_rect_2->x1);
+        result->y1 = MIN (clip_rect_1->y1, clip_rect_2->y1);
+        result->x2 = MAX (clip_rect_1->x2, clip_rect_2->x2);
+        result->y2 = MAX (clip_rect_1->y2, clip_rect_2->y2);
+}
+
+/* Repeatedly merges the pair of neighboring rects (the list is sorted,
+ * so neighbors are usually close to each other) whose bounding box adds
+ * the least undamaged area, until at most max_clip_rects remain.
+ */
+static int
+merge_clip_rects (struct drm_clip_rect *clip_rects,
+                  int                   number_of_clip_rects,
+                  int                   max_clip_rects)
+{
+        while (number_of_clip_rects > max_clip_rects) {
+                struct drm_clip_rect merged_clip_rect;
+                unsigned long cost, best_cost = ULONG_MAX;
+                int i, best_index = 0;
+
+                for (i = 0; i < number_of_clip_rects - 1; i++) {
+                        get_clip_rect_union (&clip_rects[i], &clip_rects[i + 1], &merged_clip_rect);
+
+                        cost = get_clip_rect_area (&merged_clip_rect) -
+                               MIN (get_clip_rect_area (&merged_clip_rect),
+                                    get_clip_rect_area (&clip_rects[i]) +
+                                    get_clip_rect_area (&clip_rects[i + 1]));
+
+                        if (cost < best_cost) {
+                                best_cost = cost;
+                                best_index = i;
+                        }
+                }
+
+                get_clip_rect_union (&clip_rects[best_index], &clip_rects[best_index + 1],
+                                     &clip_rects[best_index]);
+                memmove (&clip_rects[best_index + 1], &clip_rects[best_index + 2],
+                         (number_of_clip_rects - best_index - 2) * sizeof(struct drm_clip_rect));
+                number_of_clip_rects--;
+        }
+
+        return number_of_clip_rects;
+}
+
 static void
 end_flush (ply_renderer_backend_t *backend,
-           uint32_t                buffer_id)
+           uint32_t                buffer_id,
+           ply_list_t             *areas_to_flush)
 {
         ply_renderer_buffer_t *buffer;
 
@@ -386,18 +482,48 @@ end_flush (ply_renderer_backend_t *backend,
         assert (buffer != NULL);
 
         if (backend->requires_explicit_flushing) {
-                struct drm_clip_rect flush_area;
+                struct drm_clip_rect *flush_areas;
+                ply_list_node_t *node;
+                int number_of_flush_areas = 0;
                 int ret;
 
-                flush_area.x1 = 0;
-                flush_area.y1 = 0;
-                flush_area.x2 = buffer->width;
-                flush_area.y2 = buffer->height;
+                flush_areas = calloc (ply_list_get_length (areas_to_flush),
+                                      sizeof(struct drm_clip_rect));
+
+                node = ply_list_get_first_node (areas_to_flush);
+                while (node != NULL) {
+                        ply_rectangle_t *area_to_flush;
+                        struct drm_clip_rect *flush_area;
+
+                        area_to_flush = (ply_rectangle_t *) ply_list_node_get_data (node);
+                        flush_area = &flush_areas[number_of_flush_areas];
 
-                ret = drmModeDirtyFB (backend->device_fd, buffer->id, &flush_area, 1);
+                        flush_area->x1 = CLAMP (area_to_flush->x, 0, (long) buffer->width);
+                        flush_area->y1 = CLAMP (area_to_flush->y, 0, (long) buffer->height);
+                        flush_area->x2 = CLAMP (area_to_flush->x + (long) area_to_flush->width,
+                                                0, (long) buffer->width);
+                        flush_area->y2 = CLAMP (area_to_flush->y + (long) area_to_flush->height,
+                                                0, (long) buffer->height);
 
-                if (ret == -ENOSYS)
-                        backend->requires_explicit_flushing = false;
+                        if (flush_area->x2 > flush_area->x1 && flush_area->y2 > flush_area->y1)
+                                number_of_flush_areas++;
+
+                        node = ply_list_get_next_node (areas_to_flush, node);
+                }
+
+                number_of_flush_areas = merge_clip_rects (flush_areas,
+                                                          number_of_flush_areas,
+                                                          MAX_FLUSH_CLIP_RECTS);
+
+                if (number_of_flush_areas > 0) {
+                        ret = drmModeDirtyFB (backend->device_fd, buffer->id,
+                                              flush_areas, number_of_flush_areas);
+
+                        if (ret == -ENOSYS)
+                                backend->requires_explicit_flushing = false;
+                }
+
+                free (flush_areas);
         }
 }
 
@@ -415,6 +541,60 @@ destroy_output_buffer (ply_renderer_backend_t *backend,
         ply_renderer_buffer_free (backend, buffer);
 }
 
+static void
+on_page_flip (int           fd,
+              unsigned int  frame,
+              unsigned int  sec,
+              unsigned int  usec,
+              void         *user_data)
+{
+        ply_renderer_head_t *head = user_data;
+        ply_renderer_frame_done_handler_t frame_done_handler;
+
+        head->flip_pending = false;
+
+        if (head->needs_flush) {
+                head->needs_flush = false;
+                flush_head (head->backend, head);
+
+                /* Whoever is waiting for a frame to finish drew into
+                 * the one that just got queued
+                 */
+                if (head->flip_pending)
+                        return;
+        }
+
+        frame_done_handler = head->frame_done_handler;
+        head->frame_done_handler = NULL;
+
+        if (frame_done_handler != NULL)
+                frame_done_handler (head->frame_done_handler_user_data, head);
+}
+
+static bool
+handle_device_events (ply_renderer_backend_t *backend)
+{
+        drmEventContext event_context;
+
+        memset (&event_context, 0, sizeof(drmEventContext));
+        event_context.version = 2;
+        event_context.page_flip_handler = on_page_flip;
+
+        if (drmHandleEvent (backend->device_fd, &event_context) != 0) {
+                ply_trace ("Could not handle events from drm device: %m");
+                return false;
+        }
+
+        return true;
+}
+
+static void
+on_device_event (ply_renderer_backend_t *backend,
+                 int                     device_fd)
+{
+        handle_device_events (backend);
+}
+
 static bool
 get_primary_plane_rotation (ply_renderer_backend_t *backend,
                             uint32_t               controller_id,
@@ -636,6 +816,8 @@ ply_renderer_head_new (ply_renderer_backend_t     *backend,
         ply_renderer_head_add_connector (head, output);
         assert (ply_array_get_size (head->connector_ids) > 0);
 
+        head->back_buffer_stale_areas = ply_region_new ();
+
         head->pixel_buffer = ply_pixel_buffer_new_with_device_rotation (head->area.width, head->area.height, output->rotation);
         ply_pixel_buffer_set_device_scale (head->pixel_buffer, output->device_scale);
 
@@ -666,6 +848,7 @@ ply_renderer_head_free (ply_renderer_head_t *head)
 {
         ply_trace ("freeing %ldx%ld renderer head", head->area.width, head->area.height);
         ply_pixel_buffer_free (head->pixel_buffer);
+        ply_region_free (head->back_buffer_stale_areas);
 
         ply_array_free (head->connector_ids);
         free (head->gamma);
@@ -736,6 +919,32 @@ ply_renderer_head_set_scan_out_buffer (ply_renderer_backend_t *backend,
         return true;
 }
 
+static void
+ply_renderer_head_map_back_buffer (ply_renderer_backend_t *backend,
+                                   ply_renderer_head_t    *head)
+{
+        unsigned long row_stride;
+
+        ply_trace ("Creating back buffer for %ldx%ld renderer head", head->area.width, head->area.height);
+        head->back_buffer_id = create_output_buffer (backend,
+                                                     head->area.width, head->area.height,
+                                                     &row_stride);
+
+        if (head->back_buffer_id == 0) {
+                ply_trace ("Could not create back buffer, not page flipping");
+                return;
+        }
+
+        /* Both buffers get flushed through the same shadow buffer
+         * offsets, so their layouts have to match
+         */
+        if (row_stride != head->row_stride || !map_buffer (backend, head->back_buffer_id)) {
+                ply_trace ("Could not set up back buffer, not page flipping");
+                destroy_output_buffer (backend, head->back_buffer_id);
+                head->back_buffer_id = 0;
+        }
+}
+
 static bool
 ply_renderer_head_map (ply_renderer_backend_t *backend,
                        ply_renderer_head_t    *head)
@@ -761,6 +970,9 @@ ply_renderer_head_map (ply_renderer_backend_t *backend,
                 return false;
         }
 
+        if (backend->use_page_flipping)
+                ply_renderer_head_map_back_buffer (backend, head);
+
         head->scan_out_buffer_needs_reset = true;
         return true;
 }
@@ -770,10 +982,29 @@ ply_renderer_head_unmap (ply_renderer_backend_t *backend,
                          ply_renderer_head_t    *head)
 {
         ply_trace ("unmapping %ldx%ld renderer head", head->area.width, head->area.height);
+
+        /* Don't pull buffers out from under a pending flip, and don't
+         * leave an event around that refers to this head
+         */
+        head->needs_flush = false;
+        while (head->flip_pending) {
+                if (!handle_device_events (backend))
+                        break;
+        }
+        head->flip_pending = false;
+
         unmap_buffer (backend, head->scan_out_buffer_id);
 
         destroy_output_buffer (backend, head->scan_out_buffer_id);
         head->scan_out_buffer_id = 0;
+
+        if (head->back_buffer_id != 0) {
+                unmap_buffer (backend, head->back_buffer_id);
+                destroy_output_buffer (backend, head->back_buffer_id);
+                head->back_buffer_id = 0;
+        }
+
+        ply_region_clear (head->back_buffer_stale_areas);
 }
 
 static void
@@ -817,45 +1048,19 @@ ply_renderer_head_remove_connector (ply_renderer_backend_t *backend,
         free (connector_ids);
 }
 
-static void
-flush_area (const char      *src,
-            unsigned long    src_row_stride,
-            char            *dst,
-            unsigned long    dst_row_stride,
-            ply_rectangle_t *area_to_flush)
-{
-        unsigned long y1, y2, y;
-
-        y1 = area_to_flush->y;
-        y2 = y1 + area_to_flush->height;
-
-        if (area_to_flush->width * 4 == src_row_stride &&
-            area_to_flush->width * 4 == dst_row_stride) {
-                memcpy (dst, src, area_to_flush->width * area_to_flush->height * 4);
-                return;
-        }
-
-        for (y = y1; y < y2; y++) {
-                memcpy (dst, src, area_to_flush->width * 4);
-                dst += dst_row_stride;
-                src += src_row_stride;
-        }
-}
-
 static void
 ply_renderer_head_flush_area (ply_renderer_head_t *head,
                               ply_rectangle_t     *area_to_flush,
                               char                *map_address)
 {
-        uint32_t *shadow_buffer;
-        char *dst, *src;
-
-        shadow_buffer = ply_pixel_buffer_get_argb32_data (head->pixel_buffer);
+        char *dst;
 
         dst = &map_address[area_to_flush->y * head->row_stride + area_to_flush->x * BYTES_PER_PIXEL];
-        src = (char *) &shadow_buffer[area_to_flush->y * head->area.width + area_to_flush->x];
 
-        flush_area (src, head->area.width * 4, dst, head->row_stride, area_to_flush);
+        /* The shadow buffer is kept upright, this turns it to face the
+         * panel */
+        ply_pixel_buffer_copy_device_area (head->pixel_buffer, area_to_flush,
+                                           (uint32_t *) dst, head->row_stride);
 }
 
 static void
@@ -904,6 +1109,7 @@ create_backend (const char     *device_name,
                                                      ply_hashtable_direct_compare);
         backend->heads_by_controller_id = ply_hashtable_new (NULL, NULL);
         backend->use_preferred_mode = should_use_preferred_mode ();
+        backend->use_page_flipping = should_use_page_flipping ();
 
         return backend;
 }
@@ -941,6 +1147,13 @@ activate (ply_renderer_backend_t *backend)
         node = ply_list_get_first_node (backend->heads);
         while (node != NULL) {
                 head = (ply_renderer_head_t *) ply_list_node_get_data (node);
+
+                /* When page flipping, the controller isn't polled on every
+                 * flush, so make sure it's pointed back at our buffers
+                 */
+                if (head->back_buffer_id != 0)
+                        head->scan_out_buffer_needs_reset = true;
+
                 /* Flush out any pending drawing to the buffer */
                 flush_head (backend, head);
                 node = ply_list_get_next_node (backend->heads, node);
@@ -1586,6 +1799,15 @@ map_to_device (ply_renderer_backend_t *backend)
         bool head_mapped;
 
         head_mapped = false;
+
+        if (backend->use_page_flipping && backend->device_watch == NULL)
+                backend->device_watch = ply_event_loop_watch_fd (backend->loop,
+                                                                 backend->device_fd,
+                                                                 PLY_EVENT_LOOP_FD_STATUS_HAS_DATA,
+                                                                 (ply_event_handler_t)
+                                                                 on_device_event,
+                                                                 NULL, backend);
+
         node = ply_list_get_first_node (backend->heads);
         while (node != NULL) {
                 head = (ply_renderer_head_t *) ply_list_node_get_data (node);
@@ -1620,6 +1842,11 @@ unmap_from_device (ply_renderer_backend_t *backend)
                 ply_renderer_head_unmap (backend, head);
                 node = ply_list_get_next_node (backend->heads, node);
         }
+
+        if (backend->device_watch != NULL) {
+                ply_event_loop_stop_watching_fd (backend->loop, backend->device_watch);
+                backend->device_watch = NULL;
+        }
 }
 
 static bool
@@ -1656,6 +1883,88 @@ reset_scan_out_buffer_if_needed (ply_renderer_backend_t *backend,
         return did_reset;
 }
 
+static void
+account_bytes_flushed (ply_renderer_head_t *head,
+                       unsigned long        bytes_flushed,
+                       int                  number_of_areas)
+{
+        head->bytes_flushed += bytes_flushed;
+        head->frames_flushed++;
+        ply_trace ("flushed %lu bytes in %d areas on %ldx%ld renderer head (%llu bytes over %lu frames)",
+                   bytes_flushed, number_of_areas,
+                   head->area.width, head->area.height,
+                   head->bytes_flushed, head->frames_flushed);
+}
+
+static void
+flip_to_back_buffer (ply_renderer_backend_t *backend,
+                     ply_renderer_head_t    *head,
+                     ply_list_t             *areas_to_flush)
+{
+        ply_rectangle_t *area_to_flush;
+        ply_list_t *stale_areas;
+        ply_list_node_t *node;
+        char *map_address;
+        unsigned long bytes_flushed = 0;
+        uint32_t buffer_id;
+
+        if (ply_list_get_length (areas_to_flush) == 0)
+                return;
+
+        /* The back buffer is a frame behind, so on top of what changed
+         * this time, it's also missing what changed last time
+         */
+        node = ply_list_get_first_node (areas_to_flush);
+        while (node != NULL) {
+                area_to_flush = (ply_rectangle_t *) ply_list_node_get_data (node);
+                ply_region_add_rectangle (head->back_buffer_stale_areas, area_to_flush);
+                node = ply_list_get_next_node (areas_to_flush, node);
+        }
+
+        map_address = begin_flush (backend, head->back_buffer_id);
+
+        stale_areas = ply_region_get_sorted_rectangle_list (head->back_buffer_stale_areas);
+        node = ply_list_get_first_node (stale_areas);
+        while (node != NULL) {
+                area_to_flush = (ply_rectangle_t *) ply_list_node_get_data (node);
+
+                ply_renderer_head_flush_area (head, area_to_flush, map_address);
+                bytes_flushed += area_to_flush->width * area_to_flush->height * BYTES_PER_PIXEL;
+
+                node = ply_list_get_next_node (stale_areas, node);
+        }
+
+        account_bytes_flushed (head, bytes_flushed, ply_list_get_length (stale_areas));
+
+        /* After the flip, the old front buffer becomes the back buffer,
+         * and it's missing this frame's changes
+         */
+        ply_region_clear (head->back_buffer_stale_areas);
+        node = ply_list_get_first_node (areas_to_flush);
+        while (node != NULL) {
+                area_to_flush = (ply_rectangle_t *) ply_list_node_get_data (node);
+                ply_region_add_rectangle (head->back_buffer_stale_areas, area_to_flush);
+                node = ply_list_get_next_node (areas_to_flush, node);
+        }
+
+        if (drmModePageFlip (backend->device_fd, head->controller_id,
+                             head->back_buffer_id, DRM_MODE_PAGE_FLIP_EVENT,
+                             head) == 0) {
+                head->flip_pending = true;
+        } else {
+                ply_trace ("Could not queue page flip on %ldx%ld renderer head, setting scan out buffer directly: %m",
+                           head->area.width, head->area.height);
+
+                if (!ply_renderer_head_set_scan_out_buffer (backend, head,
+                                                            head->back_buffer_id))
+                        return;
+        }
+
+        buffer_id = head->scan_out_buffer_id;
+        head->scan_out_buffer_id = head->back_buffer_id;
+        head->back_buffer_id = buffer_id;
+}
+
 static void
 flush_head (ply_renderer_backend_t *backend,
             ply_renderer_head_t    *head)
@@ -1666,6 +1975,7 @@ flush_head (ply_renderer_backend_t *backend,
         ply_list_node_t *node;
         ply_pixel_buffer_t *pixel_buffer;
         char *map_address;
+        unsigned long bytes_flushed = 0;
         bool dirty = false;
 
         assert (backend != NULL);
@@ -1673,6 +1983,14 @@ flush_head (ply_renderer_backend_t *backend,
         if (!backend->is_active)
                 return;
 
+        /* Both buffers are spoken for until the flip completes, so hold
+         * on to the damage and flush it from the flip handler
+         */
+        if (head->flip_pending) {
+                head->needs_flush = true;
+                return;
+        }
+
         if (backend->terminal != NULL) {
                 ply_terminal_set_mode (backend->terminal, PLY_TERMINAL_MODE_GRAPHICS);
                 ply_terminal_set_unbuffered_input (backend->terminal);
@@ -1687,6 +2005,12 @@ flush_head (ply_renderer_backend_t *backend,
                         return;
         }
 
+        if (head->back_buffer_id != 0 && !head->scan_out_buffer_needs_reset) {
+                flip_to_back_buffer (backend, head, areas_to_flush);
+                ply_region_clear (updated_region);
+                return;
+        }
+
         map_address = begin_flush (backend, head->scan_out_buffer_id);
 
         node = ply_list_get_first_node (areas_to_flush);
@@ -1694,6 +2018,7 @@ flush_head (ply_renderer_backend_t *backend,
                 area_to_flush = (ply_rectangle_t *) ply_list_node_get_data (node);
 
                 ply_renderer_head_flush_area (head, area_to_flush, map_address);
+                bytes_flushed += area_to_flush->width * area_to_flush->height * BYTES_PER_PIXEL;
                 dirty = true;
 
                 node = ply_list_get_next_node (areas_to_flush, node);
@@ -1704,12 +2029,35 @@ flush_head (ply_renderer_backend_t *backend,
                         ply_trace ("Needed to reset scan out buffer on %ldx%ld renderer head",
                                    head->area.width, head->area.height);
 
-                end_flush (backend, head->scan_out_buffer_id);
+                end_flush (backend, head->scan_out_buffer_id, areas_to_flush);
+
+                account_bytes_flushed (head, bytes_flushed, ply_list_get_length (areas_to_flush));
+
+                /* We don't know what the back buffer holds at this point,
+                 * so bring all of it up to date on the first flip
+                 */
+                if (head->back_buffer_id != 0)
+                        ply_region_add_rectangle (head->back_buffer_stale_areas, &head->area);
         }
 
         ply_region_clear (updated_region);
 }
 
+static bool
+watch_for_frame_done (ply_renderer_backend_t           *backend,
+                      ply_renderer_head_t              *head,
+                      ply_renderer_frame_done_handler_t handler,
+                      void                             *user_data)
+{
+        if (handler != NULL && !head->flip_pending)
+                return false;
+
+        head->frame_done_handler = handler;
+        head->frame_done_handler_user_data = user_data;
+
+        return true;
+}
+
 static ply_list_t *
 get_heads (ply_renderer_backend_t *backend)
 {
@@ -1869,6 +2217,7 @@ ply_renderer_backend_get_interface (void)
                 .get_panel_properties         = get_panel_properties,
                 .get_capslock_state           = get_capslock_state,
                 .get_keymap                   = get_keymap,
+                .watch_for_frame_done         = watch_for_frame_done,
         };
 
         return &plugin_interface;
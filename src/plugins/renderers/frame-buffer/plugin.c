@@ -65,6 +65,9 @@ struct _ply_renderer_head
         ply_rectangle_t     area;
         char               *map_address;
         size_t              size;
+
+        /* scratch space for converting a row to the device's pixel format */
+        char               *row_buffer;
 };
 
 struct _ply_renderer_input_source
@@ -112,6 +115,12 @@ struct _ply_renderer_backend
         void                        (*flush_area) (ply_renderer_backend_t *backend,
                                                    ply_renderer_head_t    *head,
                                                    ply_rectangle_t        *area_to_flush);
+        void                        (*convert_row) (ply_renderer_backend_t *backend,
+                                                    char                   *destination,
+                                                    const uint32_t         *source,
+                                                    unsigned long           x,
+                                                    unsigned long           y,
+                                                    unsigned long           width);
 };
 
 ply_renderer_plugin_interface_t *ply_renderer_backend_get_interface (void);
@@ -167,44 +176,545 @@ argb32_pixel_value_to_device_pixel_value (ply_renderer_backend_t *backend,
                | (b << backend->blue_bit_position);
 }
 
+/* The converters below write whole vectors at a time, so they may touch
+ * a few bytes past the end of the row they convert */
+#define ROW_BUFFER_SLACK 16
+
+static void
+convert_row_to_any_device (ply_renderer_backend_t *backend,
+                           char                   *destination,
+                           const uint32_t         *source,
+                           unsigned long           x,
+                           unsigned long           y,
+                           unsigned long           width)
+{
+        unsigned long i;
+
+        for (i = 0; i < width; i++) {
+                uint_fast32_t device_pixel_value;
+
+                device_pixel_value = argb32_pixel_value_to_device_pixel_value (backend,
+                                                                               source[i]);
+
+                memcpy (destination + i * backend->bytes_per_pixel,
+                        &device_pixel_value, backend->bytes_per_pixel);
+        }
+}
+
+/* Unlike the error diffusion above, ordered dithering only depends on
+ * where a pixel is, so it can be done a vector at a time and doesn't
+ * change with the order areas get flushed in. Entries get scaled down
+ * to the step size of 5 and 6 bit channels.
+ */
+static const uint8_t dither_matrix[4][4] =
+{
+        { 0,  8,  2,  10 },
+        { 12, 4,  14, 6  },
+        { 3,  11, 1,  9  },
+        { 15, 7,  13, 5  }
+};
+
+static inline uint16_t
+argb32_pixel_value_to_565_pixel_value (uint32_t pixel_value,
+                                       uint8_t  dither,
+                                       bool     red_is_high)
+{
+        uint32_t r, g, b;
+
+        r = MIN (((pixel_value >> 16) & 0xff) + (dither >> 1), 255) >> 3;
+        g = MIN (((pixel_value >> 8) & 0xff) + (dither >> 2), 255) >> 2;
+        b = MIN ((pixel_value & 0xff) + (dither >> 1), 255) >> 3;
+
+        if (red_is_high)
+                return (r << 11) | (g << 5) | b;
+
+        return (b << 11) | (g << 5) | r;
+}
+
+static inline void
+convert_row_to_565_device (uint16_t       *destination,
+                           const uint32_t *source,
+                           unsigned long   x,
+                           unsigned long   y,
+                           unsigned long   width,
+                           bool            red_is_high)
+{
+        const uint8_t *dither_row = dither_matrix[y & 3];
+        unsigned long i;
+
+        for (i = 0; i < width; i++) {
+                destination[i] = argb32_pixel_value_to_565_pixel_value (source[i],
+                                                                        dither_row[(x + i) & 3],
+                                                                        red_is_high);
+        }
+}
+
+static void
+convert_row_to_rgb565_device (ply_renderer_backend_t *backend,
+                              char                   *destination,
+                              const uint32_t         *source,
+                              unsigned long           x,
+                              unsigned long           y,
+                              unsigned long           width)
+{
+        convert_row_to_565_device ((uint16_t *) destination, source, x, y, width, true);
+}
+
+static void
+convert_row_to_bgr565_device (ply_renderer_backend_t *backend,
+                              char                   *destination,
+                              const uint32_t         *source,
+                              unsigned long           x,
+                              unsigned long           y,
+                              unsigned long           width)
+{
+        convert_row_to_565_device ((uint16_t *) destination, source, x, y, width, false);
+}
+
+static void
+convert_row_to_rgb888_device (ply_renderer_backend_t *backend,
+                              char                   *destination,
+                              const uint32_t         *source,
+                              unsigned long           x,
+                              unsigned long           y,
+                              unsigned long           width)
+{
+        unsigned long i;
+
+        for (i = 0; i < width; i++) {
+                destination[3 * i] = source[i] & 0xff;
+                destination[3 * i + 1] = (source[i] >> 8) & 0xff;
+                destination[3 * i + 2] = (source[i] >> 16) & 0xff;
+        }
+}
+
+static inline uint32_t
+get_alpha_mask (ply_renderer_backend_t *backend)
+{
+        return backend->bits_for_alpha == 8 ? 0xff000000 : 0;
+}
+
+static void
+convert_row_to_xbgr8888_device (ply_renderer_backend_t *backend,
+                                char                   *destination,
+                                const uint32_t         *source,
+                                unsigned long           x,
+                                unsigned long           y,
+                                unsigned long           width)
+{
+        uint32_t *device_pixels = (uint32_t *) destination;
+        uint32_t alpha_mask = get_alpha_mask (backend);
+        unsigned long i;
+
+        for (i = 0; i < width; i++) {
+                uint32_t pixel_value = source[i];
+
+                device_pixels[i] = ((pixel_value & 0xff) << 16) |
+                                   (pixel_value & 0xff00) |
+                                   ((pixel_value >> 16) & 0xff) |
+                                   (pixel_value & alpha_mask);
+        }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target ("sse2")))
+static inline __m128i
+get_565_dither_sse2 (unsigned long x,
+                     unsigned long y)
+{
+        const uint8_t *dither_row = dither_matrix[y & 3];
+        uint8_t dither[16];
+        int i;
+
+        for (i = 0; i < 4; i++) {
+                dither[4 * i] = dither_row[(x + i) & 3] >> 1;
+                dither[4 * i + 1] = dither_row[(x + i) & 3] >> 2;
+                dither[4 * i + 2] = dither_row[(x + i) & 3] >> 1;
+                dither[4 * i + 3] = 0;
+        }
+
+        return _mm_loadu_si128 ((const __m128i *) dither);
+}
+
+__attribute__((target ("sse2")))
+static inline __m128i
+pack_565_sse2 (__m128i pixels,
+               bool    red_is_high)
+{
+        __m128i high, green, low;
+
+        if (red_is_high) {
+                high = _mm_and_si128 (_mm_srli_epi32 (pixels, 8), _mm_set1_epi32 (0xf800));
+                low = _mm_and_si128 (_mm_srli_epi32 (pixels, 3), _mm_set1_epi32 (0x001f));
+        } else {
+                high = _mm_and_si128 (_mm_slli_epi32 (pixels, 8), _mm_set1_epi32 (0xf800));
+                low = _mm_and_si128 (_mm_srli_epi32 (pixels, 19), _mm_set1_epi32 (0x001f));
+        }
+        green = _mm_and_si128 (_mm_srli_epi32 (pixels, 5), _mm_set1_epi32 (0x07e0));
+
+        /* sign extend, so the saturating pack leaves the values alone */
+        pixels = _mm_or_si128 (high, _mm_or_si128 (green, low));
+        return _mm_srai_epi32 (_mm_slli_epi32 (pixels, 16), 16);
+}
+
+__attribute__((target ("sse2")))
+static inline void
+convert_row_to_565_device_sse2 (uint16_t       *destination,
+                                const uint32_t *source,
+                                unsigned long   x,
+                                unsigned long   y,
+                                unsigned long   width,
+                                bool            red_is_high)
+{
+        const __m128i dither = get_565_dither_sse2 (x, y);
+        unsigned long i;
+
+        /* the dither pattern repeats every four pixels, so one vector of
+         * it lines up with every group */
+        for (i = 0; i + 8 <= width; i += 8) {
+                __m128i low_pixels, high_pixels;
+
+                low_pixels = _mm_adds_epu8 (_mm_loadu_si128 ((const __m128i *) (source + i)), dither);
+                high_pixels = _mm_adds_epu8 (_mm_loadu_si128 ((const __m128i *) (source + i + 4)), dither);
+
+                _mm_storeu_si128 ((__m128i *) (destination + i),
+                                  _mm_packs_epi32 (pack_565_sse2 (low_pixels, red_is_high),
+                                                   pack_565_sse2 (high_pixels, red_is_high)));
+        }
+
+        convert_row_to_565_device (destination + i, source + i, x + i, y, width - i, red_is_high);
+}
+
+__attribute__((target ("sse2")))
+static void
+convert_row_to_rgb565_device_sse2 (ply_renderer_backend_t *backend,
+                                   char                   *destination,
+                                   const uint32_t         *source,
+                                   unsigned long           x,
+                                   unsigned long           y,
+                                   unsigned long           width)
+{
+        convert_row_to_565_device_sse2 ((uint16_t *) destination, source, x, y, width, true);
+}
+
+__attribute__((target ("sse2")))
+static void
+convert_row_to_bgr565_device_sse2 (ply_renderer_backend_t *backend,
+                                   char                   *destination,
+                                   const uint32_t         *source,
+                                   unsigned long           x,
+                                   unsigned long           y,
+                                   unsigned long           width)
+{
+        convert_row_to_565_device_sse2 ((uint16_t *) destination, source, x, y, width, false);
+}
+
+__attribute__((target ("ssse3")))
+static void
+convert_row_to_rgb888_device_ssse3 (ply_renderer_backend_t *backend,
+                                    char                   *destination,
+                                    const uint32_t         *source,
+                                    unsigned long           x,
+                                    unsigned long           y,
+                                    unsigned long           width)
+{
+        const __m128i shuffle_mask = _mm_setr_epi8 (0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+                                                    -1, -1, -1, -1);
+        unsigned long i;
+
+        /* each store spills four bytes into the next group, which gets
+         * written over right after */
+        for (i = 0; i + 4 <= width; i += 4) {
+                _mm_storeu_si128 ((__m128i *) (destination + 3 * i),
+                                  _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (source + i)),
+                                                    shuffle_mask));
+        }
+
+        convert_row_to_rgb888_device (backend, destination + 3 * i, source + i, x + i, y, width - i);
+}
+
+__attribute__((target ("ssse3")))
+static void
+convert_row_to_xbgr8888_device_ssse3 (ply_renderer_backend_t *backend,
+                                      char                   *destination,
+                                      const uint32_t         *source,
+                                      unsigned long           x,
+                                      unsigned long           y,
+                                      unsigned long           width)
+{
+        const __m128i shuffle_mask = _mm_setr_epi8 (2, 1, 0, 3, 6, 5, 4, 7,
+                                                    10, 9, 8, 11, 14, 13, 12, 15);
+        const __m128i keep_mask = _mm_set1_epi32 (0x00ffffff | get_alpha_mask (backend));
+        unsigned long i;
+
+        for (i = 0; i + 4 <= width; i += 4) {
+                __m128i pixels;
+
+                pixels = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (source + i)), shuffle_mask);
+                _mm_storeu_si128 ((__m128i *) (destination + 4 * i), _mm_and_si128 (pixels, keep_mask));
+        }
+
+        convert_row_to_xbgr8888_device (backend, destination + 4 * i, source + i, x + i, y, width - i);
+}
+
+__attribute__((target ("avx2")))
+static void
+convert_row_to_xbgr8888_device_avx2 (ply_renderer_backend_t *backend,
+                                     char                   *destination,
+                                     const uint32_t         *source,
+                                     unsigned long           x,
+                                     unsigned long           y,
+                                     unsigned long           width)
+{
+        const __m256i shuffle_mask = _mm256_setr_epi8 (2, 1, 0, 3, 6, 5, 4, 7,
+                                                       10, 9, 8, 11, 14, 13, 12, 15,
+                                                       2, 1, 0, 3, 6, 5, 4, 7,
+                                                       10, 9, 8, 11, 14, 13, 12, 15);
+        const __m256i keep_mask = _mm256_set1_epi32 (0x00ffffff | get_alpha_mask (backend));
+        unsigned long i;
+
+        for (i = 0; i + 8 <= width; i += 8) {
+                __m256i pixels;
+
+                pixels = _mm256_shuffle_epi8 (_mm256_loadu_si256 ((const __m256i *) (source + i)), shuffle_mask);
+                _mm256_storeu_si256 ((__m256i *) (destination + 4 * i), _mm256_and_si256 (pixels, keep_mask));
+        }
+
+        convert_row_to_xbgr8888_device_ssse3 (backend, destination + 4 * i, source + i, x + i, y, width - i);
+}
+#endif
+
+#if (defined(__ARM_NEON) || defined(__ARM_NEON__)) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+
+static inline void
+convert_row_to_565_device_neon (uint16_t       *destination,
+                                const uint32_t *source,
+                                unsigned long   x,
+                                unsigned long   y,
+                                unsigned long   width,
+                                bool            red_is_high)
+{
+        const uint8_t *dither_row = dither_matrix[y & 3];
+        uint8_t dither_5[8], dither_6[8];
+        uint8x8_t dither_5_vector, dither_6_vector;
+        unsigned long i;
+
+        for (i = 0; i < 8; i++) {
+                dither_5[i] = dither_row[(x + i) & 3] >> 1;
+                dither_6[i] = dither_row[(x + i) & 3] >> 2;
+        }
+        dither_5_vector = vld1_u8 (dither_5);
+        dither_6_vector = vld1_u8 (dither_6);
+
+        for (i = 0; i + 8 <= width; i += 8) {
+                uint8x8x4_t pixels;
+                uint8x8_t red, green, blue;
+                uint16x8_t device_pixels;
+
+                /* de-interleaves into blue, green, red and alpha planes */
+                pixels = vld4_u8 ((const uint8_t *) (source + i));
+
+                red = vqadd_u8 (pixels.val[2], dither_5_vector);
+                green = vqadd_u8 (pixels.val[1], dither_6_vector);
+                blue = vqadd_u8 (pixels.val[0], dither_5_vector);
+
+                device_pixels = vshll_n_u8 (red_is_high ? red : blue, 8);
+                device_pixels = vsriq_n_u16 (device_pixels, vshll_n_u8 (green, 8), 5);
+                device_pixels = vsriq_n_u16 (device_pixels, vshll_n_u8 (red_is_high ? blue : red, 8), 11);
+
+                vst1q_u16 (destination + i, device_pixels);
+        }
+
+        convert_row_to_565_device (destination + i, source + i, x + i, y, width - i, red_is_high);
+}
+
+static void
+convert_row_to_rgb565_device_neon (ply_renderer_backend_t *backend,
+                                   char                   *destination,
+                                   const uint32_t         *source,
+                                   unsigned long           x,
+                                   unsigned long           y,
+                                   unsigned long           width)
+{
+        convert_row_to_565_device_neon ((uint16_t *) destination, source, x, y, width, true);
+}
+
+static void
+convert_row_to_bgr565_device_neon (ply_renderer_backend_t *backend,
+                                   char                   *destination,
+                                   const uint32_t         *source,
+                                   unsigned long           x,
+                                   unsigned long           y,
+                                   unsigned long           width)
+{
+        convert_row_to_565_device_neon ((uint16_t *) destination, source, x, y, width, false);
+}
+
+static void
+convert_row_to_rgb888_device_neon (ply_renderer_backend_t *backend,
+                                   char                   *destination,
+                                   const uint32_t         *source,
+                                   unsigned long           x,
+                                   unsigned long           y,
+                                   unsigned long           width)
+{
+        unsigned long i;
+
+        for (i = 0; i + 8 <= width; i += 8) {
+                uint8x8x4_t pixels;
+                uint8x8x3_t device_pixels;
+
+                pixels = vld4_u8 ((const uint8_t *) (source + i));
+
+                device_pixels.val[0] = pixels.val[0];
+                device_pixels.val[1] = pixels.val[1];
+                device_pixels.val[2] = pixels.val[2];
+
+                vst3_u8 ((uint8_t *) (destination + 3 * i), device_pixels);
+        }
+
+        convert_row_to_rgb888_device (backend, destination + 3 * i, source + i, x + i, y, width - i);
+}
+
+static void
+convert_row_to_xbgr8888_device_neon (ply_renderer_backend_t *backend,
+                                     char                   *destination,
+                                     const uint32_t         *source,
+                                     unsigned long           x,
+                                     unsigned long           y,
+                                     unsigned long           width)
+{
+        const uint8x8_t alpha_mask = vdup_n_u8 (backend->bits_for_alpha == 8 ? 0xff : 0x00);
+        unsigned long i;
+
+        for (i = 0; i + 8 <= width; i += 8) {
+                uint8x8x4_t pixels;
+                uint8x8_t blue;
+
+                pixels = vld4_u8 ((const uint8_t *) (source + i));
+
+                blue = pixels.val[0];
+                pixels.val[0] = pixels.val[2];
+                pixels.val[2] = blue;
+                pixels.val[3] = vand_u8 (pixels.val[3], alpha_mask);
+
+                vst4_u8 ((uint8_t *) (destination + 4 * i), pixels);
+        }
+
+        convert_row_to_xbgr8888_device (backend, destination + 4 * i, source + i, x + i, y, width - i);
+}
+#endif
+
+static bool
+device_has_layout (ply_renderer_backend_t *backend,
+                   unsigned int            bytes_per_pixel,
+                   uint32_t                red_bit_position,
+                   uint32_t                bits_for_red,
+                   uint32_t                green_bit_position,
+                   uint32_t                bits_for_green,
+                   uint32_t                blue_bit_position,
+                   uint32_t                bits_for_blue)
+{
+        return backend->bytes_per_pixel == bytes_per_pixel &&
+               backend->red_bit_position == red_bit_position &&
+               backend->bits_for_red == bits_for_red &&
+               backend->green_bit_position == green_bit_position &&
+               backend->bits_for_green == bits_for_green &&
+               backend->blue_bit_position == blue_bit_position &&
+               backend->bits_for_blue == bits_for_blue;
+}
+
+static void
+choose_row_converter (ply_renderer_backend_t *backend)
+{
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init ();
+#endif
+
+        backend->convert_row = convert_row_to_any_device;
+
+        if (device_has_layout (backend, 2, 11, 5, 5, 6, 0, 5) &&
+            backend->bits_for_alpha == 0) {
+                ply_trace ("using RGB565 pixel conversion");
+                backend->convert_row = convert_row_to_rgb565_device;
+#if defined(__x86_64__) || defined(__i386__)
+                if (__builtin_cpu_supports ("sse2"))
+                        backend->convert_row = convert_row_to_rgb565_device_sse2;
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                backend->convert_row = convert_row_to_rgb565_device_neon;
+#endif
+        } else if (device_has_layout (backend, 2, 0, 5, 5, 6, 11, 5) &&
+                   backend->bits_for_alpha == 0) {
+                ply_trace ("using BGR565 pixel conversion");
+                backend->convert_row = convert_row_to_bgr565_device;
+#if defined(__x86_64__) || defined(__i386__)
+                if (__builtin_cpu_supports ("sse2"))
+                        backend->convert_row = convert_row_to_bgr565_device_sse2;
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                backend->convert_row = convert_row_to_bgr565_device_neon;
+#endif
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        } else if (device_has_layout (backend, 3, 16, 8, 8, 8, 0, 8) &&
+                   backend->bits_for_alpha == 0) {
+                ply_trace ("using RGB888 pixel conversion");
+                backend->convert_row = convert_row_to_rgb888_device;
+#if defined(__x86_64__) || defined(__i386__)
+                if (__builtin_cpu_supports ("ssse3"))
+                        backend->convert_row = convert_row_to_rgb888_device_ssse3;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+                backend->convert_row = convert_row_to_rgb888_device_neon;
+#endif
+#endif
+        } else if (device_has_layout (backend, 4, 0, 8, 8, 8, 16, 8) &&
+                   (backend->bits_for_alpha == 0 ||
+                    (backend->bits_for_alpha == 8 && backend->alpha_bit_position == 24))) {
+                ply_trace ("using XBGR8888 pixel conversion");
+                backend->convert_row = convert_row_to_xbgr8888_device;
+#if defined(__x86_64__) || defined(__i386__)
+                if (__builtin_cpu_supports ("avx2"))
+                        backend->convert_row = convert_row_to_xbgr8888_device_avx2;
+                else if (__builtin_cpu_supports ("ssse3"))
+                        backend->convert_row = convert_row_to_xbgr8888_device_ssse3;
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                backend->convert_row = convert_row_to_xbgr8888_device_neon;
+#endif
+        } else {
+                ply_trace ("using generic pixel conversion");
+        }
+}
+
 static void
 flush_area_to_any_device (ply_renderer_backend_t *backend,
                           ply_renderer_head_t    *head,
                           ply_rectangle_t        *area_to_flush)
 {
-        unsigned long row, column;
+        unsigned long row;
         uint32_t *shadow_buffer;
-        char *row_backend;
-        unsigned long x1, y1, x2, y2;
+        unsigned long x1, y1, y2;
 
         x1 = area_to_flush->x;
         y1 = area_to_flush->y;
-        x2 = x1 + area_to_flush->width;
         y2 = y1 + area_to_flush->height;
 
-        row_backend = malloc (backend->row_stride);
+        if (head->row_buffer == NULL)
+                head->row_buffer = malloc (backend->row_stride + ROW_BUFFER_SLACK);
+
         shadow_buffer = ply_pixel_buffer_get_argb32_data (backend->head.pixel_buffer);
         for (row = y1; row < y2; row++) {
                 unsigned long offset;
 
-                for (column = x1; column < x2; column++) {
-                        uint32_t pixel_value;
-                        uint_fast32_t device_pixel_value;
-
-                        pixel_value = shadow_buffer[row * head->area.width + column];
-
-                        device_pixel_value = argb32_pixel_value_to_device_pixel_value (backend,
-                                                                                       pixel_value);
-
-                        memcpy (row_backend + column * backend->bytes_per_pixel,
-                                &device_pixel_value, backend->bytes_per_pixel);
-                }
+                backend->convert_row (backend,
+                                      head->row_buffer + x1 * backend->bytes_per_pixel,
+                                      &shadow_buffer[row * head->area.width + x1],
+                                      x1, row, area_to_flush->width);
 
                 offset = row * backend->row_stride + x1 * backend->bytes_per_pixel;
-                memcpy (head->map_address + offset, row_backend + x1 * backend->bytes_per_pixel,
+                memcpy (head->map_address + offset, head->row_buffer + x1 * backend->bytes_per_pixel,
                         area_to_flush->width * backend->bytes_per_pixel);
         }
-        free (row_backend);
 }
 
 static void
@@ -290,6 +800,9 @@ uninitialize_head (ply_renderer_backend_t *backend,
 
                 ply_list_remove_data (backend->heads, head);
         }
+
+        free (head->row_buffer);
+        head->row_buffer = NULL;
 }
 
 static void
@@ -515,6 +1028,9 @@ query_device (ply_renderer_backend_t *backend)
         else
                 backend->flush_area = flush_area_to_any_device;
 
+        if (backend->flush_area == flush_area_to_any_device)
+                choose_row_converter (backend);
+
         initialize_head (backend, &backend->head);
 
         return true;
@@ -397,6 +397,41 @@ gr_flip(void)
 
 /* ------------------------------------------------------------------------ */
 
+void
+gr_flip_rects(const GRRect *rects, int count)
+{
+	if (gr_backend->flip_rects)
+		gr_draw = gr_backend->flip_rects(gr_backend, rects, count);
+	else
+		gr_draw = gr_backend->flip(gr_backend);
+}
+
+/* ------------------------------------------------------------------------ */
+
+gr_surface
+gr_draw_surface(void)
+{
+	return gr_draw;
+}
+
+/* ------------------------------------------------------------------------ */
+
+void
+gr_fb_pixel_format(GRPixelFormat *format)
+{
+	if (gr_backend->get_pixel_format) {
+		gr_backend->get_pixel_format(gr_backend, format);
+		return;
+	}
+
+	format->red_shift = 16;
+	format->green_shift = 8;
+	format->blue_shift = 0;
+	format->alpha_shift = 24;
+}
+
+/* ------------------------------------------------------------------------ */
+
 int
 gr_init(bool blank)
 {
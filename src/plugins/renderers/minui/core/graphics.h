@@ -34,6 +34,17 @@ typedef struct minui_backend {
 	 * drawing surface. */
 	gr_surface (*flip)(struct minui_backend *backend);
 
+	/* Like flip(), but only the given rectangles of the drawing surface
+	 * changed since the previous frame. May be NULL, in which case
+	 * flip() is used instead. */
+	gr_surface (*flip_rects)(struct minui_backend *backend,
+				 const GRRect *rects, int count);
+
+	/* Reports the layout of 32-bit pixels on the drawing surface. May
+	 * be NULL, in which case pixels are stored as 0xAARRGGBB values. */
+	void (*get_pixel_format)(struct minui_backend *backend,
+				 GRPixelFormat *format);
+
 	/* Blank (or unblank) the screen. */
 	void (*blank)(struct minui_backend *backend, bool blank);
 
@@ -32,10 +32,10 @@
 #include "minui.h"
 #include "graphics.h"
 
-#define RECOVERY_BGRA 1
-
 static gr_surface fbdev_init(minui_backend *, bool);
 static gr_surface fbdev_flip(minui_backend *);
+static gr_surface fbdev_flip_rects(minui_backend *, const GRRect *, int);
+static void fbdev_get_pixel_format(minui_backend *, GRPixelFormat *);
 static void fbdev_blank(minui_backend *, bool);
 static void fbdev_exit(minui_backend *);
 static void fbdev_save(minui_backend *);
@@ -50,12 +50,14 @@ static struct fb_var_screeninfo vi;
 static int fb_fd = -1;
 
 static minui_backend my_backend = {
-	.init    = fbdev_init,
-	.flip    = fbdev_flip,
-	.blank   = fbdev_blank,
-	.exit    = fbdev_exit,
-	.save    = fbdev_save,
-	.restore = fbdev_restore,
+	.init             = fbdev_init,
+	.flip             = fbdev_flip,
+	.flip_rects       = fbdev_flip_rects,
+	.get_pixel_format = fbdev_get_pixel_format,
+	.blank            = fbdev_blank,
+	.exit             = fbdev_exit,
+	.save             = fbdev_save,
+	.restore          = fbdev_restore,
 };
 
 /* ------------------------------------------------------------------------ */
@@ -128,16 +130,12 @@ fbdev_init(minui_backend *backend, bool blank)
 		return NULL;
 	}
 
-	/* We print this out for informational purposes only, but
-	 * throughout we assume that the framebuffer device uses an RGBX
-	 * pixel format.  This is the case for every development device I
-	 * have access to.  For some of those devices (eg, hammerhead aka
-	 * Nexus 5), FBIOGET_VSCREENINFO *reports* that it wants a
-	 * different format (XBGR) but actually produces the correct
-	 * results on the display when you write RGBX.
-	 *
-	 * If you have a device that actually *needs* another pixel format
-	 * (ie, BGRX, or 565), patches welcome... */
+	/* We print this out for informational purposes only.  Below we
+	 * ask for an RGBX pixel format, and whatever the device reports
+	 * afterwards is what fbdev_get_pixel_format() hands out.  Some
+	 * devices (eg, hammerhead aka Nexus 5) *report* a different
+	 * format (XBGR) than they end up displaying, but they also accept
+	 * the RGBX layout we ask for. */
 
 	printf("fb0 reports (possibly inaccurate):\n"
 	       "  vi.bits_per_pixel = %d\n"
@@ -173,6 +171,9 @@ fbdev_init(minui_backend *backend, bool blank)
 		ioctl(fd, FBIOPUT_VSCREENINFO, &vi);
 	}
 
+	/* pick up the layout the device settled on */
+	ioctl(fd, FBIOGET_VSCREENINFO, &vi);
+
 	bits = mmap(0, fi.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
 		    0);
 	if (bits == MAP_FAILED) {
@@ -240,47 +241,10 @@ fbdev_init(minui_backend *backend, bool blank)
 /* ------------------------------------------------------------------------ */
 
 static gr_surface
-fbdev_flip(minui_backend *backend __attribute__((unused)))
+fbdev_flip_rects(minui_backend *backend __attribute__((unused)),
+		 const GRRect *rects, int count)
 {
-	/* the framebuffer does not always switch to the selected mode,
-	 * so let's keep these work-arounds in mind */
-#if defined(RECOVERY_BGRA)
-	/* In case of BGRA, do some byte swapping */
-	unsigned int idx;
-	unsigned char tmp;
-	unsigned char *ucfb_vaddr = (unsigned char *)gr_draw->data;
-
-	for (idx = 0 ; idx < gr_draw->height * gr_draw->row_bytes; idx += 4) {
-		tmp = ucfb_vaddr[idx];
-		ucfb_vaddr[idx ] = ucfb_vaddr[idx + 2];
-		ucfb_vaddr[idx + 2] = tmp;
-	}
-#endif /* defined(RECOVERY_BGRA) */
-
-#if defined(RECOVERY_ARGB)
-	/* In case of ARGB, do some byte swapping */
-	unsigned int idx;
-	unsigned char tmp;
-	unsigned char *ucfb_vaddr = (unsigned char*)gr_draw->data;
-
-	for (idx = 0 ; idx < (gr_draw->height * gr_draw->row_bytes); idx += 4) {
-		tmp = ucfb_vaddr[idx];
-		ucfb_vaddr[idx ] = ucfb_vaddr[idx + 1];
-		ucfb_vaddr[idx + 1] = ucfb_vaddr[idx + 2];
-		ucfb_vaddr[idx + 2] = ucfb_vaddr[idx + 3];
-		ucfb_vaddr[idx + 3] = tmp;
-	}
-#endif /* defined(RECOVERY_ARGB) */
-
-#if defined(RECOVERY_ALPHA)
-	/* we sometimes really need to set an alpha channel */
-	unsigned int idx;
-	unsigned char *ucfb_vaddr = (unsigned char *)gr_draw->data;
-
-	for (idx = 0 ; idx < gr_draw->height * gr_draw->row_bytes; idx += 4)
-		ucfb_vaddr[idx + 3] = 0xff;
-
-#endif /* defined(RECOVERY_ALPHA) */
+	int i, y;
 
 	if (double_buffered) {
 		/* Change gr_draw to point to the buffer currently displayed,
@@ -289,9 +253,19 @@ fbdev_flip(minui_backend *backend __attribute__((unused)))
 		gr_draw = gr_framebuffer + displayed_buffer;
 		set_displayed_framebuffer(1 - displayed_buffer);
 	} else {
-		/* Copy from the in-memory surface to the framebuffer. */
-		memcpy(gr_framebuffer[0].data, gr_draw->data,
-		       gr_draw->height * gr_draw->row_bytes);
+		/* Copy the changed parts of the in-memory surface to the
+		 * framebuffer. */
+		for (i = 0; i < count; i++) {
+			size_t offset = rects[i].y * gr_draw->row_bytes +
+					rects[i].x * gr_draw->pixel_bytes;
+
+			for (y = 0; y < rects[i].height; y++) {
+				memcpy(gr_framebuffer[0].data + offset,
+				       gr_draw->data + offset,
+				       rects[i].width * gr_draw->pixel_bytes);
+				offset += gr_draw->row_bytes;
+			}
+		}
 	}
 
 	return gr_draw;
@@ -299,6 +273,54 @@ fbdev_flip(minui_backend *backend __attribute__((unused)))
 
 /* ------------------------------------------------------------------------ */
 
+static bool
+is_byte_channel(const struct fb_bitfield *channel)
+{
+	return channel->length == 8 && channel->offset % 8 == 0 &&
+	       channel->offset < 32;
+}
+
+static void
+fbdev_get_pixel_format(minui_backend *backend __attribute__((unused)),
+		       GRPixelFormat *format)
+{
+	int used_bytes = 0;
+
+	if (vi.bits_per_pixel == 32 && is_byte_channel(&vi.red) &&
+	    is_byte_channel(&vi.green) && is_byte_channel(&vi.blue))
+		used_bytes = (1 << (vi.red.offset / 8)) |
+			     (1 << (vi.green.offset / 8)) |
+			     (1 << (vi.blue.offset / 8));
+
+	if (__builtin_popcount(used_bytes) != 3) {
+		/* fall back to the RGBX layout we asked for */
+		format->red_shift = 0;
+		format->green_shift = 8;
+		format->blue_shift = 16;
+		format->alpha_shift = 24;
+		return;
+	}
+
+	format->red_shift = vi.red.offset;
+	format->green_shift = vi.green.offset;
+	format->blue_shift = vi.blue.offset;
+
+	/* alpha, used or not, lives in whichever byte is left over */
+	format->alpha_shift = 8 * __builtin_ctz(~used_bytes);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static gr_surface
+fbdev_flip(minui_backend *backend)
+{
+	GRRect rect = { 0, 0, gr_draw->width, gr_draw->height };
+
+	return fbdev_flip_rects(backend, &rect, 1);
+}
+
+/* ------------------------------------------------------------------------ */
+
 static void
 fbdev_exit(minui_backend *backend __attribute__((unused)))
 {
@@ -35,6 +35,22 @@ typedef struct {
 
 typedef GRSurface *gr_surface;
 
+typedef struct {
+	int x;
+	int y;
+	int width;
+	int height;
+} GRRect;
+
+/* Bit offsets of each 8-bit channel within a 32-bit pixel value. The
+ * alpha offset names the remaining byte even if the display ignores it. */
+typedef struct {
+	int red_shift;
+	int green_shift;
+	int blue_shift;
+	int alpha_shift;
+} GRPixelFormat;
+
 /* To clear FB content during initialization set blank to true. */
 int  gr_init(bool blank);
 void gr_exit(void);
@@ -43,6 +59,11 @@ int  gr_fb_width(void);
 int  gr_fb_height(void);
 
 void gr_flip(void);
+/* Like gr_flip(), but only the given non-overlapping rectangles of the
+ * drawing surface were changed since the previous flip. */
+void gr_flip_rects(const GRRect *rects, int count);
+gr_surface gr_draw_surface(void); /* surface the next frame is drawn into */
+void gr_fb_pixel_format(GRPixelFormat *format);
 void gr_fb_blank(bool blank);
 
 void gr_clear(void); /* clear entire surface to current color */
@@ -54,14 +54,36 @@
 #include "ply-renderer.h"
 #include "ply-renderer-plugin.h"
 
-#define SURFACE_DATA_ALIGNMENT 8
+typedef struct _pixel_converter pixel_converter_t;
+
+/* Converts a row of argb32 shadow buffer pixels to the layout of the
+ * draw surface, always making them opaque */
+typedef void (*convert_row_handler_t) (uint32_t                *destination,
+                                       const uint32_t          *source,
+                                       unsigned long            width,
+                                       const pixel_converter_t *converter);
+
+struct _pixel_converter
+{
+        convert_row_handler_t convert_row; /* NULL if no conversion is needed */
+        GRPixelFormat         format;
+
+        /* For each destination byte of four pixels, the source byte it
+         * comes from, or 0x80 for the alpha byte */
+        uint8_t               shuffle_mask[16];
+};
 
 struct _ply_renderer_head
 {
         ply_renderer_backend_t *backend;
         ply_pixel_buffer_t     *pixel_buffer;
         ply_rectangle_t         area; /* in device pixels */
-        gr_surface              surface;
+        pixel_converter_t       converter;
+
+        /* Areas the current draw surface is missing because they were
+         * only flushed to the other buffer of a double buffered device */
+        ply_region_t           *stale_areas;
+        ply_region_t           *areas_to_flush;
 };
 
 struct _ply_renderer_input_source
@@ -147,6 +169,8 @@ initialize_head (ply_renderer_backend_t *backend,
                    head->area.width, head->area.height);
         head->pixel_buffer = ply_pixel_buffer_new (head->area.width,
                                                    head->area.height);
+        head->stale_areas = ply_region_new ();
+        head->areas_to_flush = ply_region_new ();
         ply_pixel_buffer_fill_with_color (backend->head.pixel_buffer, NULL,
                                           0.0, 0.0, 0.0, 1.0);
         ply_list_append_data (backend->heads, head);
@@ -188,39 +212,154 @@ deactivate (ply_renderer_backend_t *backend)
         backend->is_active = false;
 }
 
-static gr_surface
-malloc_surface(size_t data_size)
+static void
+convert_row (uint32_t                *destination,
+             const uint32_t          *source,
+             unsigned long            width,
+             const pixel_converter_t *converter)
 {
-        unsigned char *temp;
-        gr_surface surface;
+        unsigned long i;
 
-        temp = malloc(sizeof(GRSurface) + data_size + SURFACE_DATA_ALIGNMENT);
-        if (!temp)
-                return NULL;
+        for (i = 0; i < width; i++) {
+                uint32_t pixel_value = source[i];
 
-        surface = (gr_surface)temp;
-        surface->data = temp + sizeof(GRSurface) +
-                        (SURFACE_DATA_ALIGNMENT -
-                         (sizeof(GRSurface) % SURFACE_DATA_ALIGNMENT));
-        return surface;
+                destination[i] = (((pixel_value >> 16) & 0xff) << converter->format.red_shift) |
+                                 (((pixel_value >> 8) & 0xff) << converter->format.green_shift) |
+                                 ((pixel_value & 0xff) << converter->format.blue_shift) |
+                                 (0xffu << converter->format.alpha_shift);
+        }
 }
 
-static bool
-map_to_device (ply_renderer_backend_t *backend)
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target ("ssse3")))
+static void
+convert_row_ssse3 (uint32_t                *destination,
+                   const uint32_t          *source,
+                   unsigned long            width,
+                   const pixel_converter_t *converter)
 {
-        ply_renderer_head_t *head;
+        const __m128i shuffle_mask = _mm_loadu_si128 ((const __m128i *) converter->shuffle_mask);
+        const __m128i alpha_mask = _mm_set1_epi32 (0xffu << converter->format.alpha_shift);
+        unsigned long i;
 
-        assert (backend != NULL);
+        for (i = 0; i + 4 <= width; i += 4) {
+                __m128i pixels;
 
-        head = &backend->head;
+                pixels = _mm_loadu_si128 ((const __m128i *) (source + i));
+                pixels = _mm_or_si128 (_mm_shuffle_epi8 (pixels, shuffle_mask), alpha_mask);
+                _mm_storeu_si128 ((__m128i *) (destination + i), pixels);
+        }
+
+        convert_row (destination + i, source + i, width - i, converter);
+}
+
+__attribute__((target ("avx2")))
+static void
+convert_row_avx2 (uint32_t                *destination,
+                  const uint32_t          *source,
+                  unsigned long            width,
+                  const pixel_converter_t *converter)
+{
+        const __m256i shuffle_mask = _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i *) converter->shuffle_mask));
+        const __m256i alpha_mask = _mm256_set1_epi32 (0xffu << converter->format.alpha_shift);
+        unsigned long i;
+
+        for (i = 0; i + 8 <= width; i += 8) {
+                __m256i pixels;
+
+                /* the shuffle works within 128-bit lanes, which is fine
+                 * since pixels never cross them */
+                pixels = _mm256_loadu_si256 ((const __m256i *) (source + i));
+                pixels = _mm256_or_si256 (_mm256_shuffle_epi8 (pixels, shuffle_mask), alpha_mask);
+                _mm256_storeu_si256 ((__m256i *) (destination + i), pixels);
+        }
+
+        convert_row_ssse3 (destination + i, source + i, width - i, converter);
+}
+#endif
+
+#if (defined(__ARM_NEON) || defined(__ARM_NEON__)) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+
+static void
+convert_row_neon (uint32_t                *destination,
+                  const uint32_t          *source,
+                  unsigned long            width,
+                  const pixel_converter_t *converter)
+{
+        const GRPixelFormat *format = &converter->format;
+        unsigned long i;
+
+        for (i = 0; i + 8 <= width; i += 8) {
+                uint8x8x4_t source_pixels, destination_pixels;
+
+                /* de-interleaves into blue, green, red and alpha planes */
+                source_pixels = vld4_u8 ((const uint8_t *) (source + i));
+
+                destination_pixels.val[format->red_shift / 8] = source_pixels.val[2];
+                destination_pixels.val[format->green_shift / 8] = source_pixels.val[1];
+                destination_pixels.val[format->blue_shift / 8] = source_pixels.val[0];
+                destination_pixels.val[format->alpha_shift / 8] = vdup_n_u8 (0xff);
+
+                vst4_u8 ((uint8_t *) (destination + i), destination_pixels);
+        }
+
+        convert_row (destination + i, source + i, width - i, converter);
+}
+#endif
+
+static void
+initialize_pixel_converter (pixel_converter_t *converter)
+{
+        int i;
 
-        if (!(head->surface = malloc_surface(head->area.width * head->area.height * 4)))
-                return false;
+        gr_fb_pixel_format (&converter->format);
 
-        head->surface->width = head->area.width;
-        head->surface->height = head->area.height;
-        head->surface->row_bytes = head->area.width * 4;
-        head->surface->pixel_bytes = 4;
+        ply_trace ("draw surface uses red/green/blue/alpha shifts %d/%d/%d/%d",
+                   converter->format.red_shift, converter->format.green_shift,
+                   converter->format.blue_shift, converter->format.alpha_shift);
+
+        /* The shadow buffer is kept opaque, so argb32 surfaces take its
+         * pixels as they are */
+        if (converter->format.red_shift == 16 &&
+            converter->format.green_shift == 8 &&
+            converter->format.blue_shift == 0 &&
+            converter->format.alpha_shift == 24) {
+                converter->convert_row = NULL;
+                return;
+        }
+
+        /* little-endian byte positions, which is all the vector kernels
+         * get used for */
+        for (i = 0; i < 16; i += 4) {
+                converter->shuffle_mask[i + converter->format.red_shift / 8] = i + 2;
+                converter->shuffle_mask[i + converter->format.green_shift / 8] = i + 1;
+                converter->shuffle_mask[i + converter->format.blue_shift / 8] = i;
+                converter->shuffle_mask[i + converter->format.alpha_shift / 8] = 0x80;
+        }
+
+        converter->convert_row = convert_row;
+
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init ();
+
+        if (__builtin_cpu_supports ("avx2"))
+                converter->convert_row = convert_row_avx2;
+        else if (__builtin_cpu_supports ("ssse3"))
+                converter->convert_row = convert_row_ssse3;
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        converter->convert_row = convert_row_neon;
+#endif
+}
+
+static bool
+map_to_device (ply_renderer_backend_t *backend)
+{
+        assert (backend != NULL);
+
+        initialize_pixel_converter (&backend->head.converter);
 
         activate (backend);
 
@@ -238,7 +377,10 @@ unmap_from_device (ply_renderer_backend_t *backend)
 
         ply_pixel_buffer_free(head->pixel_buffer);
         head->pixel_buffer = NULL;
-        free(head->surface);
+        ply_region_free (head->stale_areas);
+        head->stale_areas = NULL;
+        ply_region_free (head->areas_to_flush);
+        head->areas_to_flush = NULL;
 }
 
 static void
@@ -269,17 +411,46 @@ flush_area (const char      *src,
 static void
 ply_renderer_head_flush_area (ply_renderer_head_t *head,
                               ply_rectangle_t     *area_to_flush,
-                              char                *map_address)
+                              gr_surface           draw_surface)
 {
         uint32_t *shadow_buffer;
         char *dst, *src;
 
         shadow_buffer = ply_pixel_buffer_get_argb32_data (head->pixel_buffer);
 
-        dst = &map_address[area_to_flush->y * head->surface->row_bytes + area_to_flush->x * 4];
+        dst = (char *) &draw_surface->data[area_to_flush->y * draw_surface->row_bytes + area_to_flush->x * 4];
         src = (char *) &shadow_buffer[area_to_flush->y * head->area.width + area_to_flush->x];
 
-        flush_area (src, head->area.width * 4, dst, head->surface->row_bytes, area_to_flush);
+        if (head->converter.convert_row != NULL) {
+                unsigned long y;
+
+                for (y = 0; y < area_to_flush->height; y++) {
+                        head->converter.convert_row ((uint32_t *) dst, (const uint32_t *) src,
+                                                     area_to_flush->width, &head->converter);
+                        dst += draw_surface->row_bytes;
+                        src += head->area.width * 4;
+                }
+                return;
+        }
+
+        flush_area (src, head->area.width * 4, dst, draw_surface->row_bytes, area_to_flush);
+}
+
+static void
+add_areas_to_region (ply_region_t *region,
+                     ply_list_t   *areas)
+{
+        ply_list_node_t *node;
+
+        node = ply_list_get_first_node (areas);
+        while (node != NULL) {
+                ply_rectangle_t *area;
+
+                area = (ply_rectangle_t *) ply_list_node_get_data (node);
+                ply_region_add_rectangle (region, area);
+
+                node = ply_list_get_next_node (areas, node);
+        }
 }
 
 static void
@@ -287,10 +458,12 @@ flush_head (ply_renderer_backend_t *backend,
             ply_renderer_head_t    *head)
 {
         ply_region_t *updated_region;
+        ply_list_t *updated_areas;
         ply_list_t *areas_to_flush;
         ply_list_node_t *node;
-        ply_pixel_buffer_t *pixel_buffer;
-        bool dirty = false;
+        gr_surface draw_surface;
+        GRRect *rects;
+        int number_of_rects;
 
         assert (backend != NULL);
         assert (&backend->head == head);
@@ -298,23 +471,56 @@ flush_head (ply_renderer_backend_t *backend,
         if (!backend->is_active)
                 return;
 
-        pixel_buffer = head->pixel_buffer;
-        updated_region = ply_pixel_buffer_get_updated_areas (pixel_buffer);
-        areas_to_flush = ply_region_get_sorted_rectangle_list (updated_region);
+        draw_surface = gr_draw_surface ();
+        if (draw_surface == NULL || draw_surface->pixel_bytes != 4 ||
+            draw_surface->width < (int) head->area.width ||
+            draw_surface->height < (int) head->area.height)
+                return;
+
+        updated_region = ply_pixel_buffer_get_updated_areas (head->pixel_buffer);
+        updated_areas = ply_region_get_sorted_rectangle_list (updated_region);
+
+        if (ply_list_get_length (updated_areas) == 0)
+                return;
+
+        /* Render straight into the draw surface. Besides this frame's
+         * damage, that has to cover whatever only made it into the other
+         * buffer last frame, if the device is double buffered. */
+        ply_region_clear (head->areas_to_flush);
+        add_areas_to_region (head->areas_to_flush, updated_areas);
+        add_areas_to_region (head->areas_to_flush,
+                             ply_region_get_rectangle_list (head->stale_areas));
+        areas_to_flush = ply_region_get_sorted_rectangle_list (head->areas_to_flush);
+
+        rects = calloc (ply_list_get_length (areas_to_flush), sizeof(GRRect));
+        number_of_rects = 0;
 
         node = ply_list_get_first_node (areas_to_flush);
         while (node != NULL) {
                 ply_rectangle_t *area_to_flush;
                 area_to_flush = (ply_rectangle_t *) ply_list_node_get_data (node);
 
-                ply_renderer_head_flush_area(head, area_to_flush, (char *)head->surface->data);
-                gr_blit(head->surface, 0, 0, head->area.width, head->area.height, 0, 0);
-                dirty = true;
+                ply_renderer_head_flush_area (head, area_to_flush, draw_surface);
 
-                node = ply_list_get_next_node(areas_to_flush, node);
+                rects[number_of_rects].x = area_to_flush->x;
+                rects[number_of_rects].y = area_to_flush->y;
+                rects[number_of_rects].width = area_to_flush->width;
+                rects[number_of_rects].height = area_to_flush->height;
+                number_of_rects++;
+
+                node = ply_list_get_next_node (areas_to_flush, node);
         }
-        if (dirty)
-                gr_flip();
+
+        gr_flip_rects (rects, number_of_rects);
+        free (rects);
+
+        /* A different draw surface means buffers get swapped on flip, so
+         * the new one still lacks this frame's damage. */
+        ply_region_clear (head->stale_areas);
+        if (gr_draw_surface () != NULL &&
+            gr_draw_surface ()->data != draw_surface->data)
+                add_areas_to_region (head->stale_areas, updated_areas);
+
         ply_region_clear (updated_region);
 }
 
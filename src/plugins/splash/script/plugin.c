@@ -327,6 +327,7 @@ stop_script_animation (ply_boot_splash_plugin_t *plugin)
                 plugin->keyboard = NULL;
         }
 
+        script_execute_trace_statistics ();
         script_state_destroy (plugin->script_state);
         script_lib_sprite_destroy (plugin->script_sprite_lib);
         plugin->script_sprite_lib = NULL;
@@ -0,0 +1,72 @@
+/* plymouth-compile-script.c - writes the cache file for a script theme
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ply-logger.h"
+
+#include "script.h"
+#include "script-scan.h"
+#include "script-parse.h"
+#include "script-cache.h"
+
+int
+main (int    argc,
+      char **argv)
+{
+        script_scan_t *scan;
+        script_op_t *op;
+        char *cache_filename;
+        bool saved;
+
+        if (argc != 2 && argc != 3) {
+                ply_error ("usage: %s SCRIPT-FILE [CACHE-FILE]", argv[0]);
+                return 1;
+        }
+
+        if (argc == 3)
+                cache_filename = strdup (argv[2]);
+        else
+                cache_filename = script_cache_get_filename (argv[1]);
+
+        op = script_parse_file (argv[1]);
+        if (!op) {
+                free (cache_filename);
+                return 1;
+        }
+
+        scan = script_scan_file (argv[1]);
+        if (!scan) {
+                ply_error ("%s: could not read %s", argv[0], argv[1]);
+                script_parse_op_free (op);
+                free (cache_filename);
+                return 1;
+        }
+
+        saved = script_cache_save (cache_filename, scan, op);
+        if (!saved)
+                ply_error ("%s: could not write %s: %m", argv[0], cache_filename);
+
+        script_scan_free (scan);
+        script_parse_op_free (op);
+        free (cache_filename);
+        return saved ? 0 : 1;
+}
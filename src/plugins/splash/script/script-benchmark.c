@@ -0,0 +1,164 @@
+/* script-benchmark.c - times the script interpreter on theme-like scripts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "ply-logger.h"
+#include "ply-utils.h"
+
+#include "script.h"
+#include "script-parse.h"
+#include "script-execute.h"
+#include "script-object.h"
+#include "script-lib-math.h"
+#include "script-lib-string.h"
+
+/* Times parsing each script, which is what a theme costs at startup,
+ * then runs it and calls its Refresh function the way the plugin does
+ * every frame, and reports the time per call.  The scripts in
+ * benchmarks/ are the suite; only Math and String are available, so
+ * they don't touch sprites or images.  With -p only parsing is timed,
+ * which works for any theme script.  A cache file next to the script
+ * gets loaded instead of parsing it, as at boot.  Only the long
+ * standing interpreter entry points are used, so this also builds
+ * against older script sources, for comparison.
+ */
+#define DEFAULT_NUMBER_OF_REFRESHES 2000
+#define NUMBER_OF_PARSES 20
+
+static bool
+time_parsing (const char *filename)
+{
+        struct stat file_info;
+        double start_time, elapsed_time;
+        int i;
+
+        if (stat (filename, &file_info) < 0) {
+                ply_error ("could not stat %s: %m", filename);
+                return false;
+        }
+
+        start_time = ply_get_timestamp ();
+        for (i = 0; i < NUMBER_OF_PARSES; i++) {
+                script_op_t *op;
+
+                op = script_parse_file (filename);
+                if (op == NULL) {
+                        ply_error ("could not parse %s", filename);
+                        return false;
+                }
+                script_parse_op_free (op);
+        }
+        elapsed_time = (ply_get_timestamp () - start_time) / NUMBER_OF_PARSES;
+
+        printf ("%s: %ld bytes parsed in %.3f ms, %.3f ms per KB\n", filename,
+                (long) file_info.st_size, 1000.0 * elapsed_time,
+                file_info.st_size > 0 ? 1000.0 * 1024 * elapsed_time / file_info.st_size : 0);
+
+        return true;
+}
+
+static bool
+time_script (const char *filename,
+             int         number_of_refreshes)
+{
+        script_op_t *op;
+        script_state_t *state;
+        script_lib_math_data_t *math_data;
+        script_lib_string_data_t *string_data;
+        script_return_t ret;
+        script_obj_t *refresh_function;
+        double start_time, elapsed_time;
+        int i;
+
+        op = script_parse_file (filename);
+        if (op == NULL) {
+                ply_error ("could not parse %s", filename);
+                return false;
+        }
+
+        state = script_state_new (NULL);
+        math_data = script_lib_math_setup (state);
+        string_data = script_lib_string_setup (state);
+
+        ret = script_execute (state, op);
+        script_obj_unref (ret.object);
+
+        refresh_function = script_obj_hash_peek_element (state->global, "Refresh");
+        if (refresh_function == NULL) {
+                ply_error ("%s has no Refresh function", filename);
+        } else {
+                start_time = ply_get_timestamp ();
+                for (i = 0; i < number_of_refreshes; i++) {
+                        ret = script_execute_object (state, refresh_function, NULL, NULL);
+                        script_obj_unref (ret.object);
+                }
+                elapsed_time = ply_get_timestamp () - start_time;
+
+                printf ("%s: %.1f us per refresh\n", filename,
+                        1000000.0 * elapsed_time / number_of_refreshes);
+                script_obj_unref (refresh_function);
+        }
+
+        script_state_destroy (state);
+        script_lib_math_destroy (math_data);
+        script_lib_string_destroy (string_data);
+        script_parse_op_free (op);
+
+        return refresh_function != NULL;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+        int number_of_refreshes = DEFAULT_NUMBER_OF_REFRESHES;
+        int number_of_failures = 0;
+        bool should_only_parse = false;
+        int i = 1;
+
+        while (i < argc) {
+                if (strcmp (argv[i], "-p") == 0) {
+                        should_only_parse = true;
+                        i++;
+                } else if (strcmp (argv[i], "-n") == 0 && i + 1 < argc) {
+                        number_of_refreshes = atoi (argv[i + 1]);
+                        i += 2;
+                } else {
+                        break;
+                }
+        }
+
+        if (i >= argc || number_of_refreshes <= 0) {
+                ply_error ("usage: %s [-p] [-n REFRESHES] SCRIPT-FILE...", argv[0]);
+                return 1;
+        }
+
+        for (; i < argc; i++) {
+                if (!time_parsing (argv[i]))
+                        number_of_failures++;
+                else if (!should_only_parse && !time_script (argv[i], number_of_refreshes))
+                        number_of_failures++;
+        }
+
+        return number_of_failures > 0 ? 1 : 0;
+}
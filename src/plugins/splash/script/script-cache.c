@@ -0,0 +1,576 @@
+/* script-cache.c - precompiled script files
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/* A cache file holds the parse tree of one script file, so the splash can
+ * skip scanning and parsing at boot.  It is written with
+ * plymouth-compile-script when the initrd is built.
+ *
+ * The format is independent of the machine which wrote it: all integers are
+ * little endian, numbers are stored as their IEEE 754 bits and nodes are
+ * written out in pre-order rather than as pointers.  The header records a
+ * hash and the size of the script source it was made from, and the cache is
+ * ignored if the script has changed since.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "ply-buffer.h"
+#include "ply-list.h"
+#include "ply-logger.h"
+#include "ply-utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "script.h"
+#include "script-debug.h"
+#include "script-scan.h"
+#include "script-parse.h"
+#include "script-cache.h"
+
+#define SCRIPT_CACHE_MAGIC "PLYSCRPT"
+#define SCRIPT_CACHE_MAGIC_SIZE 8
+#define SCRIPT_CACHE_VERSION 1
+#define SCRIPT_CACHE_HEADER_SIZE (SCRIPT_CACHE_MAGIC_SIZE + 4 + 8 + 8)
+#define SCRIPT_CACHE_MAX_DEPTH 1024
+
+typedef struct
+{
+        const unsigned char     *data;
+        const unsigned char     *end;
+        script_debug_location_t  location;
+        int                      depth;
+        bool                     failed;
+} script_cache_reader_t;
+
+static script_op_t *script_cache_read_op (script_cache_reader_t *reader);
+
+static uint64_t script_cache_hash (const unsigned char *data,
+                                   size_t               size)
+{
+        uint64_t hash = 0xcbf29ce484222325ULL;   /* FNV-1a */
+        size_t i;
+
+        for (i = 0; i < size; i++) {
+                hash ^= data[i];
+                hash *= 0x100000001b3ULL;
+        }
+        return hash;
+}
+
+char *script_cache_get_filename (const char *script_filename)
+{
+        char *cache_filename;
+
+        asprintf (&cache_filename, "%s.cache", script_filename);
+        return cache_filename;
+}
+
+static void script_cache_write_uint (ply_buffer_t *buffer,
+                                     uint64_t      value,
+                                     int           size)
+{
+        unsigned char bytes[8];
+        int i;
+
+        for (i = 0; i < size; i++) {
+                bytes[i] = value & 0xff;
+                value >>= 8;
+        }
+        ply_buffer_append_bytes (buffer, bytes, size);
+}
+
+static void script_cache_write_string (ply_buffer_t *buffer,
+                                       const char   *string)
+{
+        size_t length = strlen (string);
+
+        script_cache_write_uint (buffer, length, 4);
+        if (length > 0)
+                ply_buffer_append_bytes (buffer, string, length);
+}
+
+static void script_cache_write_location (ply_buffer_t *buffer,
+                                         void         *element)
+{
+        script_debug_location_t *location = script_debug_lookup_element (element);
+
+        script_cache_write_uint (buffer, location ? location->line_index : 0, 4);
+        script_cache_write_uint (buffer, location ? location->column_index : 0, 4);
+}
+
+static void script_cache_write_op (ply_buffer_t *buffer,
+                                   script_op_t  *op);
+
+static void script_cache_write_exp (ply_buffer_t *buffer,
+                                    script_exp_t *exp)
+{
+        ply_list_node_t *node;
+        union
+        {
+                script_number_t number;
+                uint64_t        bits;
+        } number;
+
+        if (!exp) {
+                script_cache_write_uint (buffer, 0, 1);
+                return;
+        }
+        script_cache_write_uint (buffer, exp->type + 1, 1);
+        script_cache_write_location (buffer, exp);
+
+        switch (exp->type) {
+        case SCRIPT_EXP_TYPE_PLUS:
+        case SCRIPT_EXP_TYPE_MINUS:
+        case SCRIPT_EXP_TYPE_MUL:
+        case SCRIPT_EXP_TYPE_DIV:
+        case SCRIPT_EXP_TYPE_MOD:
+        case SCRIPT_EXP_TYPE_EQ:
+        case SCRIPT_EXP_TYPE_NE:
+        case SCRIPT_EXP_TYPE_GT:
+        case SCRIPT_EXP_TYPE_GE:
+        case SCRIPT_EXP_TYPE_LT:
+        case SCRIPT_EXP_TYPE_LE:
+        case SCRIPT_EXP_TYPE_AND:
+        case SCRIPT_EXP_TYPE_OR:
+        case SCRIPT_EXP_TYPE_EXTEND:
+        case SCRIPT_EXP_TYPE_ASSIGN:
+        case SCRIPT_EXP_TYPE_ASSIGN_PLUS:
+        case SCRIPT_EXP_TYPE_ASSIGN_MINUS:
+        case SCRIPT_EXP_TYPE_ASSIGN_MUL:
+        case SCRIPT_EXP_TYPE_ASSIGN_DIV:
+        case SCRIPT_EXP_TYPE_ASSIGN_MOD:
+        case SCRIPT_EXP_TYPE_ASSIGN_EXTEND:
+        case SCRIPT_EXP_TYPE_HASH:
+                script_cache_write_exp (buffer, exp->data.dual.sub_a);
+                script_cache_write_exp (buffer, exp->data.dual.sub_b);
+                break;
+
+        case SCRIPT_EXP_TYPE_NOT:
+        case SCRIPT_EXP_TYPE_POS:
+        case SCRIPT_EXP_TYPE_NEG:
+        case SCRIPT_EXP_TYPE_PRE_INC:
+        case SCRIPT_EXP_TYPE_PRE_DEC:
+        case SCRIPT_EXP_TYPE_POST_INC:
+        case SCRIPT_EXP_TYPE_POST_DEC:
+                script_cache_write_exp (buffer, exp->data.sub);
+                break;
+
+        case SCRIPT_EXP_TYPE_TERM_NUMBER:
+                number.number = exp->data.number;
+                script_cache_write_uint (buffer, number.bits, 8);
+                break;
+
+        case SCRIPT_EXP_TYPE_TERM_STRING:
+        case SCRIPT_EXP_TYPE_TERM_VAR:
+                script_cache_write_string (buffer, exp->data.string);
+                break;
+
+        case SCRIPT_EXP_TYPE_TERM_NULL:
+        case SCRIPT_EXP_TYPE_TERM_LOCAL:
+        case SCRIPT_EXP_TYPE_TERM_GLOBAL:
+        case SCRIPT_EXP_TYPE_TERM_THIS:
+                break;
+
+        case SCRIPT_EXP_TYPE_TERM_SET:
+                script_cache_write_uint (buffer, ply_list_get_length (exp->data.parameters), 4);
+                for (node = ply_list_get_first_node (exp->data.parameters);
+                     node;
+                     node = ply_list_get_next_node (exp->data.parameters, node)) {
+                        script_cache_write_exp (buffer, ply_list_node_get_data (node));
+                }
+                break;
+
+        case SCRIPT_EXP_TYPE_FUNCTION_EXE:
+                script_cache_write_exp (buffer, exp->data.function_exe.name);
+                script_cache_write_uint (buffer, ply_list_get_length (exp->data.function_exe.parameters), 4);
+                for (node = ply_list_get_first_node (exp->data.function_exe.parameters);
+                     node;
+                     node = ply_list_get_next_node (exp->data.function_exe.parameters, node)) {
+                        script_cache_write_exp (buffer, ply_list_node_get_data (node));
+                }
+                break;
+
+        case SCRIPT_EXP_TYPE_FUNCTION_DEF:
+                script_cache_write_uint (buffer, ply_list_get_length (exp->data.function_def->parameters), 4);
+                for (node = ply_list_get_first_node (exp->data.function_def->parameters);
+                     node;
+                     node = ply_list_get_next_node (exp->data.function_def->parameters, node)) {
+                        script_cache_write_string (buffer, ply_list_node_get_data (node));
+                }
+                script_cache_write_op (buffer, exp->data.function_def->data.script);
+                break;
+        }
+}
+
+static void script_cache_write_op (ply_buffer_t *buffer,
+                                   script_op_t  *op)
+{
+        ply_list_node_t *node;
+
+        if (!op) {
+                script_cache_write_uint (buffer, 0, 1);
+                return;
+        }
+        script_cache_write_uint (buffer, op->type + 1, 1);
+        script_cache_write_location (buffer, op);
+
+        switch (op->type) {
+        case SCRIPT_OP_TYPE_EXPRESSION:
+        case SCRIPT_OP_TYPE_RETURN:
+                script_cache_write_exp (buffer, op->data.exp);
+                break;
+
+        case SCRIPT_OP_TYPE_OP_BLOCK:
+                script_cache_write_uint (buffer, ply_list_get_length (op->data.list), 4);
+                for (node = ply_list_get_first_node (op->data.list);
+                     node;
+                     node = ply_list_get_next_node (op->data.list, node)) {
+                        script_cache_write_op (buffer, ply_list_node_get_data (node));
+                }
+                break;
+
+        case SCRIPT_OP_TYPE_IF:
+        case SCRIPT_OP_TYPE_WHILE:
+        case SCRIPT_OP_TYPE_DO_WHILE:
+        case SCRIPT_OP_TYPE_FOR:
+                script_cache_write_exp (buffer, op->data.cond_op.cond);
+                script_cache_write_op (buffer, op->data.cond_op.op1);
+                script_cache_write_op (buffer, op->data.cond_op.op2);
+                break;
+
+        case SCRIPT_OP_TYPE_FAIL:
+        case SCRIPT_OP_TYPE_BREAK:
+        case SCRIPT_OP_TYPE_CONTINUE:
+                break;
+        }
+}
+
+bool script_cache_save (const char    *cache_filename,
+                        script_scan_t *scan,
+                        script_op_t   *op)
+{
+        ply_buffer_t *buffer;
+        char *temporary_filename;
+        bool written;
+        int fd;
+
+        buffer = ply_buffer_new ();
+        ply_buffer_append_bytes (buffer, SCRIPT_CACHE_MAGIC, SCRIPT_CACHE_MAGIC_SIZE);
+        script_cache_write_uint (buffer, SCRIPT_CACHE_VERSION, 4);
+        script_cache_write_uint (buffer, script_cache_hash (scan->source, scan->source_size), 8);
+        script_cache_write_uint (buffer, scan->source_size, 8);
+        script_cache_write_op (buffer, op);
+
+        /* Write to the side and rename so a reader never sees half a file */
+        asprintf (&temporary_filename, "%s.XXXXXX", cache_filename);
+        fd = mkstemp (temporary_filename);
+        if (fd < 0) {
+                ply_trace ("could not create %s: %m", temporary_filename);
+                free (temporary_filename);
+                ply_buffer_free (buffer);
+                return false;
+        }
+        written = ply_write (fd, ply_buffer_get_bytes (buffer), ply_buffer_get_size (buffer));
+        fchmod (fd, 0644);
+        if (close (fd) < 0)
+                written = false;
+        if (written && rename (temporary_filename, cache_filename) < 0)
+                written = false;
+        if (!written) {
+                ply_trace ("could not write %s: %m", cache_filename);
+                unlink (temporary_filename);
+        }
+        free (temporary_filename);
+        ply_buffer_free (buffer);
+        return written;
+}
+
+static uint64_t script_cache_read_uint (script_cache_reader_t *reader,
+                                        int                    size)
+{
+        uint64_t value = 0;
+        int i;
+
+        if (reader->failed || reader->end - reader->data < size) {
+                reader->failed = true;
+                return 0;
+        }
+        for (i = size - 1; i >= 0; i--) {
+                value = (value << 8) | reader->data[i];
+        }
+        reader->data += size;
+        return value;
+}
+
+static char *script_cache_read_string (script_cache_reader_t *reader)
+{
+        uint64_t length = script_cache_read_uint (reader, 4);
+        char *string;
+
+        if (reader->failed || (uint64_t) (reader->end - reader->data) < length) {
+                reader->failed = true;
+                return strdup ("");
+        }
+        string = strndup ((const char *) reader->data, length);
+        reader->data += length;
+        return string;
+}
+
+/* Lists are never longer than the data left to describe their elements,
+ * so a corrupt count cannot make the reader spin.
+ */
+static uint64_t script_cache_read_count (script_cache_reader_t *reader)
+{
+        uint64_t count = script_cache_read_uint (reader, 4);
+
+        if (count > (uint64_t) (reader->end - reader->data)) {
+                reader->failed = true;
+                return 0;
+        }
+        return count;
+}
+
+static void script_cache_read_location (script_cache_reader_t *reader)
+{
+        reader->location.line_index = script_cache_read_uint (reader, 4);
+        reader->location.column_index = script_cache_read_uint (reader, 4);
+}
+
+static script_exp_t *script_cache_read_exp (script_cache_reader_t *reader)
+{
+        script_exp_t *exp;
+        uint64_t type;
+        uint64_t count;
+        union
+        {
+                script_number_t number;
+                uint64_t        bits;
+        } number;
+
+        type = script_cache_read_uint (reader, 1);
+        if (type == 0 || reader->failed)
+                return NULL;
+        if (type - 1 > SCRIPT_EXP_TYPE_ASSIGN_EXTEND || reader->depth >= SCRIPT_CACHE_MAX_DEPTH) {
+                reader->failed = true;
+                return NULL;
+        }
+        script_cache_read_location (reader);
+
+        exp = malloc (sizeof(script_exp_t));
+        exp->type = type - 1;
+        script_debug_add_element (exp, &reader->location);
+        reader->depth++;
+
+        switch (exp->type) {
+        case SCRIPT_EXP_TYPE_PLUS:
+        case SCRIPT_EXP_TYPE_MINUS:
+        case SCRIPT_EXP_TYPE_MUL:
+        case SCRIPT_EXP_TYPE_DIV:
+        case SCRIPT_EXP_TYPE_MOD:
+        case SCRIPT_EXP_TYPE_EQ:
+        case SCRIPT_EXP_TYPE_NE:
+        case SCRIPT_EXP_TYPE_GT:
+        case SCRIPT_EXP_TYPE_GE:
+        case SCRIPT_EXP_TYPE_LT:
+        case SCRIPT_EXP_TYPE_LE:
+        case SCRIPT_EXP_TYPE_AND:
+        case SCRIPT_EXP_TYPE_OR:
+        case SCRIPT_EXP_TYPE_EXTEND:
+        case SCRIPT_EXP_TYPE_ASSIGN:
+        case SCRIPT_EXP_TYPE_ASSIGN_PLUS:
+        case SCRIPT_EXP_TYPE_ASSIGN_MINUS:
+        case SCRIPT_EXP_TYPE_ASSIGN_MUL:
+        case SCRIPT_EXP_TYPE_ASSIGN_DIV:
+        case SCRIPT_EXP_TYPE_ASSIGN_MOD:
+        case SCRIPT_EXP_TYPE_ASSIGN_EXTEND:
+        case SCRIPT_EXP_TYPE_HASH:
+                exp->data.dual.sub_a = script_cache_read_exp (reader);
+                exp->data.dual.sub_b = script_cache_read_exp (reader);
+                break;
+
+        case SCRIPT_EXP_TYPE_NOT:
+        case SCRIPT_EXP_TYPE_POS:
+        case SCRIPT_EXP_TYPE_NEG:
+        case SCRIPT_EXP_TYPE_PRE_INC:
+        case SCRIPT_EXP_TYPE_PRE_DEC:
+        case SCRIPT_EXP_TYPE_POST_INC:
+        case SCRIPT_EXP_TYPE_POST_DEC:
+                exp->data.sub = script_cache_read_exp (reader);
+                break;
+
+        case SCRIPT_EXP_TYPE_TERM_NUMBER:
+                number.bits = script_cache_read_uint (reader, 8);
+                exp->data.number = number.number;
+                break;
+
+        case SCRIPT_EXP_TYPE_TERM_STRING:
+        case SCRIPT_EXP_TYPE_TERM_VAR:
+                exp->data.string = script_cache_read_string (reader);
+                break;
+
+        case SCRIPT_EXP_TYPE_TERM_NULL:
+        case SCRIPT_EXP_TYPE_TERM_LOCAL:
+        case SCRIPT_EXP_TYPE_TERM_GLOBAL:
+        case SCRIPT_EXP_TYPE_TERM_THIS:
+                break;
+
+        case SCRIPT_EXP_TYPE_TERM_SET:
+                exp->data.parameters = ply_list_new ();
+                count = script_cache_read_count (reader);
+                while (count-- > 0 && !reader->failed) {
+                        ply_list_append_data (exp->data.parameters, script_cache_read_exp (reader));
+                }
+                break;
+
+        case SCRIPT_EXP_TYPE_FUNCTION_EXE:
+                exp->data.function_exe.name = script_cache_read_exp (reader);
+                exp->data.function_exe.parameters = ply_list_new ();
+                count = script_cache_read_count (reader);
+                while (count-- > 0 && !reader->failed) {
+                        ply_list_append_data (exp->data.function_exe.parameters, script_cache_read_exp (reader));
+                }
+                break;
+
+        case SCRIPT_EXP_TYPE_FUNCTION_DEF:
+        {
+                ply_list_t *parameter_list = ply_list_new ();
+
+                count = script_cache_read_count (reader);
+                while (count-- > 0 && !reader->failed) {
+                        ply_list_append_data (parameter_list, script_cache_read_string (reader));
+                }
+                exp->data.function_def = script_function_script_new (NULL, NULL, parameter_list);
+                exp->data.function_def->data.script = script_cache_read_op (reader);
+                break;
+        }
+        }
+        reader->depth--;
+        return exp;
+}
+
+static script_op_t *script_cache_read_op (script_cache_reader_t *reader)
+{
+        script_op_t *op;
+        uint64_t type;
+        uint64_t count;
+
+        type = script_cache_read_uint (reader, 1);
+        if (type == 0 || reader->failed)
+                return NULL;
+        if (type - 1 > SCRIPT_OP_TYPE_CONTINUE || reader->depth >= SCRIPT_CACHE_MAX_DEPTH) {
+                reader->failed = true;
+                return NULL;
+        }
+        script_cache_read_location (reader);
+
+        op = malloc (sizeof(script_op_t));
+        op->type = type - 1;
+        op->code = NULL;
+        script_debug_add_element (op, &reader->location);
+        reader->depth++;
+
+        switch (op->type) {
+        case SCRIPT_OP_TYPE_EXPRESSION:
+        case SCRIPT_OP_TYPE_RETURN:
+                op->data.exp = script_cache_read_exp (reader);
+                break;
+
+        case SCRIPT_OP_TYPE_OP_BLOCK:
+                op->data.list = ply_list_new ();
+                count = script_cache_read_count (reader);
+                while (count-- > 0 && !reader->failed) {
+                        ply_list_append_data (op->data.list, script_cache_read_op (reader));
+                }
+                break;
+
+        case SCRIPT_OP_TYPE_IF:
+        case SCRIPT_OP_TYPE_WHILE:
+        case SCRIPT_OP_TYPE_DO_WHILE:
+        case SCRIPT_OP_TYPE_FOR:
+                op->data.cond_op.cond = script_cache_read_exp (reader);
+                op->data.cond_op.op1 = script_cache_read_op (reader);
+                op->data.cond_op.op2 = script_cache_read_op (reader);
+                break;
+
+        case SCRIPT_OP_TYPE_FAIL:
+        case SCRIPT_OP_TYPE_BREAK:
+        case SCRIPT_OP_TYPE_CONTINUE:
+                break;
+        }
+        reader->depth--;
+        return op;
+}
+
+script_op_t *script_cache_load (const char    *cache_filename,
+                                script_scan_t *scan)
+{
+        script_cache_reader_t reader = { 0 };
+        struct stat file_info;
+        script_op_t *op;
+        void *data;
+        int fd;
+
+        fd = open (cache_filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return NULL;
+        if (fstat (fd, &file_info) < 0 || file_info.st_size < SCRIPT_CACHE_HEADER_SIZE) {
+                close (fd);
+                return NULL;
+        }
+        data = mmap (NULL, file_info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close (fd);
+        if (data == MAP_FAILED)
+                return NULL;
+
+        reader.data = data;
+        reader.end = reader.data + file_info.st_size;
+        reader.location.name = scan->name;
+
+        if (memcmp (reader.data, SCRIPT_CACHE_MAGIC, SCRIPT_CACHE_MAGIC_SIZE) != 0) {
+                ply_trace ("%s is not a script cache", cache_filename);
+                munmap (data, file_info.st_size);
+                return NULL;
+        }
+        reader.data += SCRIPT_CACHE_MAGIC_SIZE;
+        if (script_cache_read_uint (&reader, 4) != SCRIPT_CACHE_VERSION ||
+            script_cache_read_uint (&reader, 8) != script_cache_hash (scan->source, scan->source_size) ||
+            script_cache_read_uint (&reader, 8) != scan->source_size) {
+                ply_trace ("%s is out of date, ignoring", cache_filename);
+                munmap (data, file_info.st_size);
+                return NULL;
+        }
+
+        op = script_cache_read_op (&reader);
+        if (op == NULL || reader.data != reader.end)
+                reader.failed = true;
+        munmap (data, file_info.st_size);
+
+        if (reader.failed) {
+                ply_trace ("%s is corrupt, ignoring", cache_filename);
+                script_parse_op_free (op);
+                return NULL;
+        }
+        return op;
+}
@@ -0,0 +1,901 @@
+/* script-compile.c - compilation of parsed scripts into bytecode
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/* A script op tree (a whole file or a function body) is flattened into a
+ * stack machine program.  Every value on the stack holds one reference,
+ * exactly like the objects returned by script_evaluate, and the ops mirror
+ * the tree walker step by step so both give the same results.
+ *
+ * Expressions built only from literals are folded while compiling.  Each
+ * distinct variable name gets a slot number, which the executor uses to
+ * cache where the name was found for the lifetime of a call.
+ *
+ * The value of the last statement is kept in a separate result register, as
+ * it becomes the return value of a function that ends without "return".
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "ply-hashtable.h"
+#include "ply-list.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "script.h"
+#include "script-compile.h"
+#include "script-object.h"
+
+typedef struct
+{
+        ply_list_t *break_jumps;        /* op indices to patch to the loop end */
+        ply_list_t *continue_jumps;     /* op indices to patch to the next iteration */
+} script_compile_loop_t;
+
+typedef struct
+{
+        script_code_t   *code;
+        int              op_capacity;
+        int              number_capacity;
+        int              string_capacity;
+        int              stack_depth;
+        ply_hashtable_t *slots;         /* variable name -> slot + 1 */
+        ply_list_t      *loops;
+        bool             failed;
+} script_compile_t;
+
+static void script_compile_exp (script_compile_t *compile,
+                                script_exp_t     *exp);
+static void script_compile_op (script_compile_t *compile,
+                               script_op_t      *op,
+                               bool              keep_result);
+
+static int script_compile_stack_effect (script_code_op_type_t type,
+                                        int                   operand)
+{
+        switch (type) {
+        case SCRIPT_CODE_OP_TYPE_PUSH_NULL:
+        case SCRIPT_CODE_OP_TYPE_PUSH_NUMBER:
+        case SCRIPT_CODE_OP_TYPE_PUSH_STRING:
+        case SCRIPT_CODE_OP_TYPE_PUSH_LOCAL:
+        case SCRIPT_CODE_OP_TYPE_PUSH_GLOBAL:
+        case SCRIPT_CODE_OP_TYPE_PUSH_THIS:
+        case SCRIPT_CODE_OP_TYPE_PUSH_VAR:
+        case SCRIPT_CODE_OP_TYPE_PUSH_FUNCTION:
+        case SCRIPT_CODE_OP_TYPE_PUSH_NO_THIS:
+        case SCRIPT_CODE_OP_TYPE_LOOKUP_METHOD_NAME:
+                return 1;
+
+        case SCRIPT_CODE_OP_TYPE_LOOKUP_FUNCTION:
+                return 2;
+
+        case SCRIPT_CODE_OP_TYPE_MAKE_SET:
+                return 1 - operand;
+
+        case SCRIPT_CODE_OP_TYPE_CALL:
+                return -1 - operand;
+
+        case SCRIPT_CODE_OP_TYPE_PLUS:
+        case SCRIPT_CODE_OP_TYPE_MINUS:
+        case SCRIPT_CODE_OP_TYPE_MUL:
+        case SCRIPT_CODE_OP_TYPE_DIV:
+        case SCRIPT_CODE_OP_TYPE_MOD:
+        case SCRIPT_CODE_OP_TYPE_EXTEND:
+        case SCRIPT_CODE_OP_TYPE_CMP:
+        case SCRIPT_CODE_OP_TYPE_ASSIGN:
+        case SCRIPT_CODE_OP_TYPE_ASSIGN_PLUS:
+        case SCRIPT_CODE_OP_TYPE_ASSIGN_MINUS:
+        case SCRIPT_CODE_OP_TYPE_ASSIGN_MUL:
+        case SCRIPT_CODE_OP_TYPE_ASSIGN_DIV:
+        case SCRIPT_CODE_OP_TYPE_ASSIGN_MOD:
+        case SCRIPT_CODE_OP_TYPE_ASSIGN_EXTEND:
+        case SCRIPT_CODE_OP_TYPE_HASH:
+        case SCRIPT_CODE_OP_TYPE_POP:
+        case SCRIPT_CODE_OP_TYPE_SET_RESULT:
+        case SCRIPT_CODE_OP_TYPE_JUMP_IF_FALSE:
+        case SCRIPT_CODE_OP_TYPE_JUMP_IF_TRUE:
+        case SCRIPT_CODE_OP_TYPE_JUMP_IF_FALSE_OR_POP:     /* when falling through */
+        case SCRIPT_CODE_OP_TYPE_JUMP_IF_TRUE_OR_POP:
+        case SCRIPT_CODE_OP_TYPE_RETURN:
+                return -1;
+
+        case SCRIPT_CODE_OP_TYPE_NOT:
+        case SCRIPT_CODE_OP_TYPE_NEG:
+        case SCRIPT_CODE_OP_TYPE_PRE_INC:
+        case SCRIPT_CODE_OP_TYPE_PRE_DEC:
+        case SCRIPT_CODE_OP_TYPE_POST_INC:
+        case SCRIPT_CODE_OP_TYPE_POST_DEC:
+        case SCRIPT_CODE_OP_TYPE_HASH_NAME:
+        case SCRIPT_CODE_OP_TYPE_LOOKUP_METHOD:
+        case SCRIPT_CODE_OP_TYPE_CLEAR_RESULT:
+        case SCRIPT_CODE_OP_TYPE_JUMP:
+        case SCRIPT_CODE_OP_TYPE_FAIL:
+        case SCRIPT_CODE_OP_TYPE_BREAK:
+        case SCRIPT_CODE_OP_TYPE_CONTINUE:
+        case SCRIPT_CODE_OP_TYPE_END:
+                return 0;
+        }
+        return 0;
+}
+
+static int script_compile_emit (script_compile_t     *compile,
+                                script_code_op_type_t type,
+                                int                   operand,
+                                void                 *element)
+{
+        script_code_t *code = compile->code;
+        script_code_op_t *code_op;
+
+        if (code->op_count == compile->op_capacity) {
+                compile->op_capacity = compile->op_capacity * 2 + 16;
+                code->ops = realloc (code->ops, compile->op_capacity * sizeof(script_code_op_t));
+        }
+        code_op = &code->ops[code->op_count];
+        code_op->type = type;
+        code_op->operand = operand;
+        code_op->element = element;
+
+        compile->stack_depth += script_compile_stack_effect (type, operand);
+        if (compile->stack_depth > code->stack_size)
+                code->stack_size = compile->stack_depth;
+
+        return code->op_count++;
+}
+
+static int script_compile_get_position (script_compile_t *compile)
+{
+        return compile->code->op_count;
+}
+
+static void script_compile_patch_jump (script_compile_t *compile,
+                                       int               jump,
+                                       int               target)
+{
+        compile->code->ops[jump].operand = target;
+}
+
+static int script_compile_add_number (script_compile_t *compile,
+                                      script_number_t   number)
+{
+        script_code_t *code = compile->code;
+
+        if (code->number_count == compile->number_capacity) {
+                compile->number_capacity = compile->number_capacity * 2 + 8;
+                code->numbers = realloc (code->numbers, compile->number_capacity * sizeof(script_number_t));
+        }
+        code->numbers[code->number_count] = number;
+        return code->number_count++;
+}
+
+static int script_compile_add_string (script_compile_t *compile,
+                                      const char       *string)
+{
+        script_code_t *code = compile->code;
+        int index;
+
+        for (index = 0; index < code->string_count; index++) {
+                if (strcmp (code->strings[index], string) == 0)
+                        return index;
+        }
+
+        if (code->string_count == compile->string_capacity) {
+                compile->string_capacity = compile->string_capacity * 2 + 8;
+                code->strings = realloc (code->strings, compile->string_capacity * sizeof(char *));
+        }
+        code->strings[code->string_count] = strdup (string);
+        return code->string_count++;
+}
+
+static int script_compile_get_slot (script_compile_t *compile,
+                                    char             *name)
+{
+        intptr_t slot = (intptr_t) ply_hashtable_lookup (compile->slots, name);
+
+        if (slot)
+                return slot - 1;
+
+        slot = compile->code->slot_count++;
+        ply_hashtable_insert (compile->slots, name, (void *) (slot + 1));
+        return slot;
+}
+
+/* Returns a new number, string or null object if the expression only depends
+ * on literals, using the same object functions as the executor so the result
+ * is identical. Anything which could print an error or has side effects is
+ * left for run time.
+ */
+static script_obj_t *script_compile_fold (script_exp_t *exp)
+{
+        script_obj_t *(*function)(script_obj_t *,
+                                  script_obj_t *) = NULL;
+        script_obj_cmp_result_t condition = 0;
+        script_obj_t *obj_a, *obj_b, *obj;
+
+        if (!exp) return NULL;
+
+        switch (exp->type) {
+        case SCRIPT_EXP_TYPE_TERM_NULL:
+                return script_obj_new_null ();
+
+        case SCRIPT_EXP_TYPE_TERM_NUMBER:
+                return script_obj_new_number (exp->data.number);
+
+        case SCRIPT_EXP_TYPE_TERM_STRING:
+                return script_obj_new_string (exp->data.string);
+
+        case SCRIPT_EXP_TYPE_PLUS:
+                function = script_obj_plus;
+                break;
+
+        case SCRIPT_EXP_TYPE_MINUS:
+                function = script_obj_minus;
+                break;
+
+        case SCRIPT_EXP_TYPE_MUL:
+                function = script_obj_mul;
+                break;
+
+        case SCRIPT_EXP_TYPE_DIV:
+                function = script_obj_div;
+                break;
+
+        case SCRIPT_EXP_TYPE_MOD:
+                function = script_obj_mod;
+                break;
+
+        case SCRIPT_EXP_TYPE_EQ:
+                condition = SCRIPT_OBJ_CMP_RESULT_EQ;
+                break;
+
+        case SCRIPT_EXP_TYPE_NE:
+                condition = SCRIPT_OBJ_CMP_RESULT_NE |
+                            SCRIPT_OBJ_CMP_RESULT_LT |
+                            SCRIPT_OBJ_CMP_RESULT_GT;
+                break;
+
+        case SCRIPT_EXP_TYPE_GT:
+                condition = SCRIPT_OBJ_CMP_RESULT_GT;
+                break;
+
+        case SCRIPT_EXP_TYPE_GE:
+                condition = SCRIPT_OBJ_CMP_RESULT_GT | SCRIPT_OBJ_CMP_RESULT_EQ;
+                break;
+
+        case SCRIPT_EXP_TYPE_LT:
+                condition = SCRIPT_OBJ_CMP_RESULT_LT;
+                break;
+
+        case SCRIPT_EXP_TYPE_LE:
+                condition = SCRIPT_OBJ_CMP_RESULT_LT | SCRIPT_OBJ_CMP_RESULT_EQ;
+                break;
+
+        case SCRIPT_EXP_TYPE_AND:
+        case SCRIPT_EXP_TYPE_OR:
+                obj_a = script_compile_fold (exp->data.dual.sub_a);
+                if (!obj_a) return NULL;
+                if (script_obj_as_bool (obj_a) == (exp->type == SCRIPT_EXP_TYPE_OR))
+                        return obj_a;
+                script_obj_unref (obj_a);
+                return script_compile_fold (exp->data.dual.sub_b);
+
+        case SCRIPT_EXP_TYPE_NOT:
+                obj_a = script_compile_fold (exp->data.sub);
+                if (!obj_a) return NULL;
+                obj = script_obj_new_number (!script_obj_as_bool (obj_a));
+                script_obj_unref (obj_a);
+                return obj;
+
+        case SCRIPT_EXP_TYPE_POS:
+                return script_compile_fold (exp->data.sub);
+
+        case SCRIPT_EXP_TYPE_NEG:
+                obj_a = script_compile_fold (exp->data.sub);
+                if (!obj_a) return NULL;
+                obj = NULL;
+                if (script_obj_is_number (obj_a))
+                        obj = script_obj_new_number (-script_obj_as_number (obj_a));
+                script_obj_unref (obj_a);
+                return obj;
+
+        case SCRIPT_EXP_TYPE_TERM_VAR:
+        case SCRIPT_EXP_TYPE_TERM_LOCAL:
+        case SCRIPT_EXP_TYPE_TERM_GLOBAL:
+        case SCRIPT_EXP_TYPE_TERM_THIS:
+        case SCRIPT_EXP_TYPE_TERM_SET:
+        case SCRIPT_EXP_TYPE_EXTEND:
+        case SCRIPT_EXP_TYPE_PRE_INC:
+        case SCRIPT_EXP_TYPE_PRE_DEC:
+        case SCRIPT_EXP_TYPE_POST_INC:
+        case SCRIPT_EXP_TYPE_POST_DEC:
+        case SCRIPT_EXP_TYPE_HASH:
+        case SCRIPT_EXP_TYPE_FUNCTION_EXE:
+        case SCRIPT_EXP_TYPE_FUNCTION_DEF:
+        case SCRIPT_EXP_TYPE_ASSIGN:
+        case SCRIPT_EXP_TYPE_ASSIGN_PLUS:
+        case SCRIPT_EXP_TYPE_ASSIGN_MINUS:
+        case SCRIPT_EXP_TYPE_ASSIGN_MUL:
+        case SCRIPT_EXP_TYPE_ASSIGN_DIV:
+        case SCRIPT_EXP_TYPE_ASSIGN_MOD:
+        case SCRIPT_EXP_TYPE_ASSIGN_EXTEND:
+                return NULL;
+        }
+
+        obj_a = script_compile_fold (exp->data.dual.sub_a);
+        if (!obj_a) return NULL;
+        obj_b = script_compile_fold (exp->data.dual.sub_b);
+        if (!obj_b) {
+                script_obj_unref (obj_a);
+                return NULL;
+        }
+
+        if (function)
+                obj = function (obj_a, obj_b);
+        else
+                obj = script_obj_new_number ((script_obj_cmp (obj_a, obj_b) & condition) ? 1 : 0);
+
+        script_obj_unref (obj_a);
+        script_obj_unref (obj_b);
+        return obj;
+}
+
+static void script_compile_constant (script_compile_t *compile,
+                                     script_obj_t     *obj)
+{
+        if (script_obj_is_number (obj)) {
+                script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_PUSH_NUMBER,
+                                     script_compile_add_number (compile, script_obj_as_number (obj)),
+                                     NULL);
+        } else if (script_obj_is_string (obj)) {
+                script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_PUSH_STRING,
+                                     script_compile_add_string (compile, obj->data.string),
+                                     NULL);
+        } else {
+                script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_PUSH_NULL, 0, NULL);
+        }
+}
+
+/* Hash keys which are literals are looked up without creating a key object */
+static int script_compile_get_constant_key (script_compile_t *compile,
+                                            script_exp_t     *exp)
+{
+        script_obj_t *obj = script_compile_fold (exp);
+        char *name;
+        int index = -1;
+
+        if (!obj) return -1;
+        name = script_obj_as_string (obj);
+        if (name)
+                index = script_compile_add_string (compile, name);
+        free (name);
+        script_obj_unref (obj);
+        return index;
+}
+
+static void script_compile_dual (script_compile_t     *compile,
+                                 script_exp_t         *exp,
+                                 script_code_op_type_t type,
+                                 int                   operand)
+{
+        script_compile_exp (compile, exp->data.dual.sub_a);
+        script_compile_exp (compile, exp->data.dual.sub_b);
+        script_compile_emit (compile, type, operand, exp);
+}
+
+static void script_compile_unary (script_compile_t     *compile,
+                                  script_exp_t         *exp,
+                                  script_code_op_type_t type)
+{
+        script_compile_exp (compile, exp->data.sub);
+        script_compile_emit (compile, type, 0, exp);
+}
+
+static void script_compile_logic (script_compile_t *compile,
+                                  script_exp_t     *exp)
+{
+        script_obj_t *obj = script_compile_fold (exp->data.dual.sub_a);
+        int jump;
+
+        if (obj) {
+                /* a constant left side only decides whether the right side is used */
+                if (script_obj_as_bool (obj) == (exp->type == SCRIPT_EXP_TYPE_OR))
+                        script_compile_constant (compile, obj);
+                else
+                        script_compile_exp (compile, exp->data.dual.sub_b);
+                script_obj_unref (obj);
+                return;
+        }
+
+        script_compile_exp (compile, exp->data.dual.sub_a);
+        jump = script_compile_emit (compile,
+                                    exp->type == SCRIPT_EXP_TYPE_AND ?
+                                    SCRIPT_CODE_OP_TYPE_JUMP_IF_FALSE_OR_POP :
+                                    SCRIPT_CODE_OP_TYPE_JUMP_IF_TRUE_OR_POP,
+                                    0, exp);
+        script_compile_exp (compile, exp->data.dual.sub_b);
+        script_compile_patch_jump (compile, jump, script_compile_get_position (compile));
+}
+
+static void script_compile_set (script_compile_t *compile,
+                                script_exp_t     *exp)
+{
+        ply_list_node_t *node;
+        int count = 0;
+
+        for (node = ply_list_get_first_node (exp->data.parameters);
+             node;
+             node = ply_list_get_next_node (exp->data.parameters, node)) {
+                script_exp_t *data_exp = ply_list_node_get_data (node);
+                script_compile_exp (compile, data_exp);
+                count++;
+        }
+        script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_MAKE_SET, count, exp);
+}
+
+static void script_compile_hash (script_compile_t *compile,
+                                 script_exp_t     *exp)
+{
+        int key = script_compile_get_constant_key (compile, exp->data.dual.sub_b);
+
+        script_compile_exp (compile, exp->data.dual.sub_a);
+        if (key >= 0) {
+                script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_HASH_NAME, key, exp);
+                return;
+        }
+        script_compile_exp (compile, exp->data.dual.sub_b);
+        script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_HASH, 0, exp);
+}
+
+static void script_compile_func (script_compile_t *compile,
+                                 script_exp_t     *exp)
+{
+        script_exp_t *name_exp = exp->data.function_exe.name;
+        ply_list_t *parameter_expressions = exp->data.function_exe.parameters;
+        ply_list_node_t *node;
+        int count = 0;
+
+        if (!name_exp) {
+                compile->failed = true;
+                return;
+        }
+
+        if (name_exp->type == SCRIPT_EXP_TYPE_HASH) {
+                int key = script_compile_get_constant_key (compile, name_exp->data.dual.sub_b);
+
+                if (key >= 0) {
+                        script_compile_exp (compile, name_exp->data.dual.sub_a);
+                        script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_LOOKUP_METHOD_NAME, key, name_exp);
+                } else {
+                        /* the key is evaluated before the object, as in script_evaluate_func */
+                        script_compile_exp (compile, name_exp->data.dual.sub_b);
+                        script_compile_exp (compile, name_exp->data.dual.sub_a);
+                        script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_LOOKUP_METHOD, 0, name_exp);
+                }
+        } else if (name_exp->type == SCRIPT_EXP_TYPE_TERM_VAR) {
+                script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_LOOKUP_FUNCTION,
+                                     script_compile_get_slot (compile, name_exp->data.string),
+                                     name_exp);
+        } else {
+                script_compile_exp (compile, name_exp);
+                script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_PUSH_NO_THIS, 0, NULL);
+        }
+
+        for (node = ply_list_get_first_node (parameter_expressions);
+             node;
+             node = ply_list_get_next_node (parameter_expressions, node)) {
+                script_exp_t *data_exp = ply_list_node_get_data (node);
+                script_compile_exp (compile, data_exp);
+                count++;
+        }
+        script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_CALL, count, exp);
+}
+
+static void script_compile_exp (script_compile_t *compile,
+                                script_exp_t     *exp)
+{
+        script_obj_t *obj;
+
+        if (!exp) {
+                compile->failed = true;
+                return;
+        }
+
+        obj = script_compile_fold (exp);
+        if (obj) {
+                script_compile_constant (compile, obj);
+                script_obj_unref (obj);
+                return;
+        }
+
+        switch (exp->type) {
+        case SCRIPT_EXP_TYPE_PLUS:
+                script_compile_dual (compile, exp, SCRIPT_CODE_OP_TYPE_PLUS, 0);
+                break;
+
+        case SCRIPT_EXP_TYPE_MINUS:
+                script_compile_dual (compile, exp, SCRIPT_CODE_OP_TYPE_MINUS, 0);
+                break;
+
+        case SCRIPT_EXP_TYPE_MUL:
+                script_compile_dual (compile, exp, SCRIPT_CODE_OP_TYPE_MUL, 0);
+                break;
+
+        case SCRIPT_EXP_TYPE_DIV:
+                script_compile_dual (compile, exp, SCRIPT_CODE_OP_TYPE_DIV, 0);
+                break;
+
+        case SCRIPT_EXP_TYPE_MOD:
+                script_compile_dual (compile, exp, SCRIPT_CODE_OP_TYPE_MOD, 0);
+                break;
+
+        case SCRIPT_EXP_TYPE_EQ:
+                script_compile_dual (compile, exp, SCRIPT_CODE_OP_TYPE_CMP,
+                                     SCRIPT_OBJ_CMP_RESULT_EQ);
+                break;
+
+        case SCRIPT_EXP_TYPE_NE:
+                script_compile_dual (compile, exp, SCRIPT_CODE_OP_TYPE_CMP,
+                                     SCRIPT_OBJ_CMP_RESULT_NE |
+                                     SCRIPT_OBJ_CMP_RESULT_LT |
+                                     SCRIPT_OBJ_CMP_RESULT_GT);
+                break;
+
+        case SCRIPT_EXP_TYPE_GT:
+                script_compile_dual (compile, exp, SCRIPT_CODE_OP_TYPE_CMP,
+                                     SCRIPT_OBJ_CMP_RESULT_GT);
+                break;
+
+        case SCRIPT_EXP_TYPE_GE:
+                script_compile_dual (compile, exp, SCRIPT_CODE_OP_TYPE_CMP,
+                                     SCRIPT_OBJ_CMP_RESULT_GT |
+                                     SCRIPT_OBJ_CMP_RESULT_EQ);
+                break;
+
+        case SCRIPT_EXP_TYPE_LT:
+                script_compile_dual (compile, exp, SCRIPT_CODE_OP_TYPE_CMP,
+                                     SCRIPT_OBJ_CMP_RESULT_LT);
+                break;
+
+        case SCRIPT_EXP_TYPE_LE:
+                script_compile_dual (compile, exp, SCRIPT_CODE_OP_TYPE_CMP,
+                                     SCRIPT_OBJ_CMP_RESULT_LT |
+                                     SCRIPT_OBJ_CMP_RESULT_EQ);
+                break;
+
+        case SCRIPT_EXP_TYPE_AND:
+        case SCRIPT_EXP_TYPE_OR:
+                script_compile_logic (compile, exp);
+                break;
+
+        case SCRIPT_EXP_TYPE_EXTEND:
+                script_compile_dual (compile, exp, SCRIPT_CODE_OP_TYPE_EXTEND, 0);
+                break;
+
+        case SCRIPT_EXP_TYPE_NOT:
+                script_compile_unary (compile, exp, SCRIPT_CODE_OP_TYPE_NOT);
+                break;
+
+        case SCRIPT_EXP_TYPE_POS:
+                script_compile_exp (compile, exp->data.sub);
+                break;
+
+        case SCRIPT_EXP_TYPE_NEG:
+                script_compile_unary (compile, exp, SCRIPT_CODE_OP_TYPE_NEG);
+                break;
+
+        case SCRIPT_EXP_TYPE_PRE_INC:
+                script_compile_unary (compile, exp, SCRIPT_CODE_OP_TYPE_PRE_INC);
+                break;
+
+        case SCRIPT_EXP_TYPE_PRE_DEC:
+                script_compile_unary (compile, exp, SCRIPT_CODE_OP_TYPE_PRE_DEC);
+                break;
+
+        case SCRIPT_EXP_TYPE_POST_INC:
+                script_compile_unary (compile, exp, SCRIPT_CODE_OP_TYPE_POST_INC);
+                break;
+
+        case SCRIPT_EXP_TYPE_POST_DEC:
+                script_compile_unary (compile, exp, SCRIPT_CODE_OP_TYPE_POST_DEC);
+                break;
+
+        case SCRIPT_EXP_TYPE_TERM_NULL:
+        case SCRIPT_EXP_TYPE_TERM_NUMBER:
+        case SCRIPT_EXP_TYPE_TERM_STRING:
+                break;                  /* already folded */
+
+        case SCRIPT_EXP_TYPE_TERM_LOCAL:
+                script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_PUSH_LOCAL, 0, exp);
+                break;
+
+        case SCRIPT_EXP_TYPE_TERM_GLOBAL:
+                script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_PUSH_GLOBAL, 0, exp);
+                break;
+
+        case SCRIPT_EXP_TYPE_TERM_THIS:
+                script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_PUSH_THIS, 0, exp);
+                break;
+
+        case SCRIPT_EXP_TYPE_TERM_SET:
+                script_compile_set (compile, exp);
+                break;
+
+        case SCRIPT_EXP_TYPE_TERM_VAR:
+                script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_PUSH_VAR,
+                                     script_compile_get_slot (compile, exp->data.string),
+                                     exp);
+                break;
+
+        case SCRIPT_EXP_TYPE_ASSIGN:
+                script_compile_dual (compile, exp, SCRIPT_CODE_OP_TYPE_ASSIGN, 0);
+                break;
+
+        case SCRIPT_EXP_TYPE_ASSIGN_PLUS:
+                script_compile_dual (compile, exp, SCRIPT_CODE_OP_TYPE_ASSIGN_PLUS, 0);
+                break;
+
+        case SCRIPT_EXP_TYPE_ASSIGN_MINUS:
+                script_compile_dual (compile, exp, SCRIPT_CODE_OP_TYPE_ASSIGN_MINUS, 0);
+                break;
+
+        case SCRIPT_EXP_TYPE_ASSIGN_MUL:
+                script_compile_dual (compile, exp, SCRIPT_CODE_OP_TYPE_ASSIGN_MUL, 0);
+                break;
+
+        case SCRIPT_EXP_TYPE_ASSIGN_DIV:
+                script_compile_dual (compile, exp, SCRIPT_CODE_OP_TYPE_ASSIGN_DIV, 0);
+                break;
+
+        case SCRIPT_EXP_TYPE_ASSIGN_MOD:
+                script_compile_dual (compile, exp, SCRIPT_CODE_OP_TYPE_ASSIGN_MOD, 0);
+                break;
+
+        case SCRIPT_EXP_TYPE_ASSIGN_EXTEND:
+                script_compile_dual (compile, exp, SCRIPT_CODE_OP_TYPE_ASSIGN_EXTEND, 0);
+                break;
+
+        case SCRIPT_EXP_TYPE_HASH:
+                script_compile_hash (compile, exp);
+                break;
+
+        case SCRIPT_EXP_TYPE_FUNCTION_EXE:
+                script_compile_func (compile, exp);
+                break;
+
+        case SCRIPT_EXP_TYPE_FUNCTION_DEF:
+                script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_PUSH_FUNCTION, 0, exp);
+                break;
+        }
+}
+
+static void script_compile_patch_jump_list (script_compile_t *compile,
+                                            ply_list_t       *jumps,
+                                            int               target)
+{
+        ply_list_node_t *node;
+
+        for (node = ply_list_get_first_node (jumps);
+             node;
+             node = ply_list_get_next_node (jumps, node)) {
+                intptr_t jump = (intptr_t) ply_list_node_get_data (node);
+                script_compile_patch_jump (compile, jump, target);
+        }
+        ply_list_free (jumps);
+}
+
+/* Loops keep the value of the last executed body (or increment) op, which is
+ * dropped only once the next iteration starts, just like script_execute.
+ */
+static void script_compile_loop (script_compile_t *compile,
+                                 script_op_t      *op,
+                                 bool              keep_result)
+{
+        script_compile_loop_t loop;
+        script_obj_t *cond_obj = script_compile_fold (op->data.cond_op.cond);
+        bool cond_always = false;
+        int top, body, jump_end = -1, jump_body = -1;
+
+        if (cond_obj) {
+                cond_always = script_obj_as_bool (cond_obj);
+                script_obj_unref (cond_obj);
+                if (!cond_always && op->type != SCRIPT_OP_TYPE_DO_WHILE)
+                        return;
+        }
+
+        loop.break_jumps = ply_list_new ();
+        loop.continue_jumps = ply_list_new ();
+        ply_list_append_data (compile->loops, &loop);
+
+        if (op->type == SCRIPT_OP_TYPE_DO_WHILE && !cond_always)
+                jump_body = script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_JUMP, 0, NULL);
+
+        top = script_compile_get_position (compile);
+        if (!cond_always) {
+                script_compile_exp (compile, op->data.cond_op.cond);
+                jump_end = script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_JUMP_IF_FALSE, 0, op);
+        }
+
+        body = script_compile_get_position (compile);
+        if (jump_body >= 0)
+                script_compile_patch_jump (compile, jump_body, body);
+        if (keep_result)
+                script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_CLEAR_RESULT, 0, NULL);
+        script_compile_op (compile, op->data.cond_op.op1, keep_result);
+
+        script_compile_patch_jump_list (compile, loop.continue_jumps,
+                                        script_compile_get_position (compile));
+        if (op->data.cond_op.op2) {
+                if (keep_result)
+                        script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_CLEAR_RESULT, 0, NULL);
+                script_compile_op (compile, op->data.cond_op.op2, keep_result);
+        }
+        script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_JUMP, top, NULL);
+
+        if (jump_end >= 0)
+                script_compile_patch_jump (compile, jump_end, script_compile_get_position (compile));
+        script_compile_patch_jump_list (compile, loop.break_jumps,
+                                        script_compile_get_position (compile));
+        ply_list_remove_data (compile->loops, &loop);
+}
+
+static void script_compile_if (script_compile_t *compile,
+                               script_op_t      *op,
+                               bool              keep_result)
+{
+        script_obj_t *cond_obj = script_compile_fold (op->data.cond_op.cond);
+        int jump_else, jump_end;
+
+        if (cond_obj) {
+                if (script_obj_as_bool (cond_obj))
+                        script_compile_op (compile, op->data.cond_op.op1, keep_result);
+                else
+                        script_compile_op (compile, op->data.cond_op.op2, keep_result);
+                script_obj_unref (cond_obj);
+                return;
+        }
+
+        script_compile_exp (compile, op->data.cond_op.cond);
+        jump_else = script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_JUMP_IF_FALSE, 0, op);
+        script_compile_op (compile, op->data.cond_op.op1, keep_result);
+        if (op->data.cond_op.op2) {
+                jump_end = script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_JUMP, 0, NULL);
+                script_compile_patch_jump (compile, jump_else, script_compile_get_position (compile));
+                script_compile_op (compile, op->data.cond_op.op2, keep_result);
+                script_compile_patch_jump (compile, jump_end, script_compile_get_position (compile));
+        } else {
+                script_compile_patch_jump (compile, jump_else, script_compile_get_position (compile));
+        }
+}
+
+/* The result register is always empty when an op starts. With keep_result
+ * set the op leaves its value there, otherwise it is discarded straight away.
+ */
+static void script_compile_op (script_compile_t *compile,
+                               script_op_t      *op,
+                               bool              keep_result)
+{
+        script_compile_loop_t *loop;
+
+        if (!op) return;
+
+        switch (op->type) {
+        case SCRIPT_OP_TYPE_EXPRESSION:
+                script_compile_exp (compile, op->data.exp);
+                script_compile_emit (compile,
+                                     keep_result ? SCRIPT_CODE_OP_TYPE_SET_RESULT : SCRIPT_CODE_OP_TYPE_POP,
+                                     0, op);
+                break;
+
+        case SCRIPT_OP_TYPE_OP_BLOCK:
+        {
+                ply_list_node_t *node;
+                for (node = ply_list_get_first_node (op->data.list);
+                     node;
+                     node = ply_list_get_next_node (op->data.list, node)) {
+                        script_op_t *sub_op = ply_list_node_get_data (node);
+                        script_compile_op (compile, sub_op,
+                                           keep_result && !ply_list_get_next_node (op->data.list, node));
+                }
+                break;
+        }
+
+        case SCRIPT_OP_TYPE_IF:
+                script_compile_if (compile, op, keep_result);
+                break;
+
+        case SCRIPT_OP_TYPE_WHILE:
+        case SCRIPT_OP_TYPE_DO_WHILE:
+        case SCRIPT_OP_TYPE_FOR:
+                script_compile_loop (compile, op, keep_result);
+                break;
+
+        case SCRIPT_OP_TYPE_RETURN:
+                if (op->data.exp)
+                        script_compile_exp (compile, op->data.exp);
+                else
+                        script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_PUSH_NULL, 0, NULL);
+                script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_RETURN, 0, op);
+                break;
+
+        case SCRIPT_OP_TYPE_FAIL:
+                script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_FAIL, 0, op);
+                break;
+
+        case SCRIPT_OP_TYPE_BREAK:
+        case SCRIPT_OP_TYPE_CONTINUE:
+        {
+                ply_list_node_t *node = ply_list_get_last_node (compile->loops);
+                int jump;
+
+                if (!node) {
+                        /* outside of a loop these leave the whole function */
+                        script_compile_emit (compile,
+                                             op->type == SCRIPT_OP_TYPE_BREAK ?
+                                             SCRIPT_CODE_OP_TYPE_BREAK : SCRIPT_CODE_OP_TYPE_CONTINUE,
+                                             0, op);
+                        break;
+                }
+                loop = ply_list_node_get_data (node);
+                jump = script_compile_emit (compile, SCRIPT_CODE_OP_TYPE_JUMP, 0, op);
+                ply_list_append_data (op->type == SCRIPT_OP_TYPE_BREAK ?
+                                      loop->break_jumps : loop->continue_jumps,
+                                      (void *) (intptr_t) jump);
+                break;
+        }
+        }
+}
+
+script_code_t *script_compile (script_op_t *op)
+{
+        script_compile_t compile;
+        script_code_t *code = calloc (1, sizeof(script_code_t));
+
+        memset (&compile, 0, sizeof(compile));
+        compile.code = code;
+        compile.slots = ply_hashtable_new (ply_hashtable_string_hash,
+                                           ply_hashtable_string_compare);
+        compile.loops = ply_list_new ();
+
+        script_compile_op (&compile, op, true);
+        script_compile_emit (&compile, SCRIPT_CODE_OP_TYPE_END, 0, NULL);
+
+        ply_hashtable_free (compile.slots);
+        ply_list_free (compile.loops);
+
+        if (compile.failed) {
+                script_code_free (code);
+                return NULL;
+        }
+        return code;
+}
+
+void script_code_free (script_code_t *code)
+{
+        int index;
+
+        if (!code) return;
+
+        for (index = 0; index < code->string_count; index++)
+                free (code->strings[index]);
+        free (code->strings);
+        free (code->numbers);
+        free (code->ops);
+        free (code);
+}
@@ -0,0 +1,98 @@
+/* script-compile.h - compilation of parsed scripts into bytecode
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifndef SCRIPT_COMPILE_H
+#define SCRIPT_COMPILE_H
+
+#include "script.h"
+
+typedef enum
+{
+        SCRIPT_CODE_OP_TYPE_PUSH_NULL,
+        SCRIPT_CODE_OP_TYPE_PUSH_NUMBER,        /* operand: index in numbers */
+        SCRIPT_CODE_OP_TYPE_PUSH_STRING,        /* operand: index in strings */
+        SCRIPT_CODE_OP_TYPE_PUSH_LOCAL,
+        SCRIPT_CODE_OP_TYPE_PUSH_GLOBAL,
+        SCRIPT_CODE_OP_TYPE_PUSH_THIS,
+        SCRIPT_CODE_OP_TYPE_PUSH_VAR,           /* operand: slot, element: TERM_VAR exp */
+        SCRIPT_CODE_OP_TYPE_PUSH_FUNCTION,      /* element: FUNCTION_DEF exp */
+        SCRIPT_CODE_OP_TYPE_MAKE_SET,           /* operand: element count */
+        SCRIPT_CODE_OP_TYPE_PLUS,
+        SCRIPT_CODE_OP_TYPE_MINUS,
+        SCRIPT_CODE_OP_TYPE_MUL,
+        SCRIPT_CODE_OP_TYPE_DIV,
+        SCRIPT_CODE_OP_TYPE_MOD,
+        SCRIPT_CODE_OP_TYPE_EXTEND,
+        SCRIPT_CODE_OP_TYPE_CMP,                /* operand: script_obj_cmp_result_t mask */
+        SCRIPT_CODE_OP_TYPE_NOT,
+        SCRIPT_CODE_OP_TYPE_NEG,
+        SCRIPT_CODE_OP_TYPE_PRE_INC,
+        SCRIPT_CODE_OP_TYPE_PRE_DEC,
+        SCRIPT_CODE_OP_TYPE_POST_INC,
+        SCRIPT_CODE_OP_TYPE_POST_DEC,
+        SCRIPT_CODE_OP_TYPE_ASSIGN,
+        SCRIPT_CODE_OP_TYPE_ASSIGN_PLUS,
+        SCRIPT_CODE_OP_TYPE_ASSIGN_MINUS,
+        SCRIPT_CODE_OP_TYPE_ASSIGN_MUL,
+        SCRIPT_CODE_OP_TYPE_ASSIGN_DIV,
+        SCRIPT_CODE_OP_TYPE_ASSIGN_MOD,
+        SCRIPT_CODE_OP_TYPE_ASSIGN_EXTEND,
+        SCRIPT_CODE_OP_TYPE_HASH,
+        SCRIPT_CODE_OP_TYPE_HASH_NAME,          /* operand: key index in strings */
+        SCRIPT_CODE_OP_TYPE_LOOKUP_FUNCTION,    /* operand: slot, element: TERM_VAR exp */
+        SCRIPT_CODE_OP_TYPE_LOOKUP_METHOD,
+        SCRIPT_CODE_OP_TYPE_LOOKUP_METHOD_NAME, /* operand: key index in strings */
+        SCRIPT_CODE_OP_TYPE_PUSH_NO_THIS,
+        SCRIPT_CODE_OP_TYPE_CALL,               /* operand: argument count */
+        SCRIPT_CODE_OP_TYPE_POP,
+        SCRIPT_CODE_OP_TYPE_SET_RESULT,
+        SCRIPT_CODE_OP_TYPE_CLEAR_RESULT,
+        SCRIPT_CODE_OP_TYPE_JUMP,               /* operand: target op index */
+        SCRIPT_CODE_OP_TYPE_JUMP_IF_FALSE,
+        SCRIPT_CODE_OP_TYPE_JUMP_IF_TRUE,
+        SCRIPT_CODE_OP_TYPE_JUMP_IF_FALSE_OR_POP,
+        SCRIPT_CODE_OP_TYPE_JUMP_IF_TRUE_OR_POP,
+        SCRIPT_CODE_OP_TYPE_RETURN,
+        SCRIPT_CODE_OP_TYPE_FAIL,
+        SCRIPT_CODE_OP_TYPE_BREAK,
+        SCRIPT_CODE_OP_TYPE_CONTINUE,
+        SCRIPT_CODE_OP_TYPE_END,
+} script_code_op_type_t;
+
+typedef struct
+{
+        script_code_op_type_t type;
+        int                   operand;
+        void                 *element;  /* parse tree node, used for error locations */
+} script_code_op_t;
+
+typedef struct script_code_t
+{
+        script_code_op_t *ops;
+        int               op_count;
+        script_number_t  *numbers;
+        int               number_count;
+        char            **strings;
+        int               string_count;
+        int               slot_count;   /* distinct variable names */
+        int               stack_size;
+} script_code_t;
+
+script_code_t *script_compile (script_op_t *op);
+void script_code_free (script_code_t *code);
+
+#endif /* SCRIPT_COMPILE_H */
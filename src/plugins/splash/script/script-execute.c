@@ -38,6 +38,7 @@
 #include <math.h>
 
 #include "script.h"
+#include "script-compile.h"
 #include "script-debug.h"
 #include "script-execute.h"
 #include "script-object.h"
@@ -48,6 +49,8 @@ static script_return_t script_execute_function_with_parlist (script_state_t    *
                                                              script_function_t *function,
                                                              script_obj_t      *this,
                                                              ply_list_t        *parameter_data);
+static script_return_t script_execute_op (script_state_t *state,
+                                          script_op_t    *op);
 
 
 static void script_execute_error (void       *element,
@@ -96,6 +99,18 @@ static script_obj_t *script_evaluate_apply_function_and_assign (script_state_t
         return obj;
 }
 
+static script_obj_t *script_execute_hash_get_element (script_obj_t *hash,
+                                                      const char   *name)
+{
+        if (!script_obj_is_hash (hash)) {
+                script_obj_t *newhash = script_obj_new_hash ();
+                script_obj_assign (hash, newhash);
+                script_obj_unref (newhash);
+        }
+
+        return script_obj_hash_get_element (hash, name);
+}
+
 static script_obj_t *script_evaluate_hash (script_state_t *state,
                                            script_exp_t   *exp)
 {
@@ -104,13 +119,7 @@ static script_obj_t *script_evaluate_hash (script_state_t *state,
         script_obj_t *obj;
         char *name = script_obj_as_string (key);
 
-        if (!script_obj_is_hash (hash)) {
-                script_obj_t *newhash = script_obj_new_hash ();
-                script_obj_assign (hash, newhash);
-                script_obj_unref (newhash);
-        }
-
-        obj = script_obj_hash_get_element (hash, name);
+        obj = script_execute_hash_get_element (hash, name);
         free (name);
 
         script_obj_unref (hash);
@@ -148,6 +157,7 @@ static script_obj_t *script_evaluate_set (script_state_t *state,
                 asprintf (&name, "%d", index);
                 index++;
                 script_obj_hash_add_element (obj, data_obj, name);
+                script_obj_unref (data_obj);
                 free (name);
 
                 node_data = ply_list_get_next_node (parameter_data, node_data);
@@ -197,10 +207,10 @@ static script_obj_t *script_evaluate_logic (script_state_t *state,
         return obj;
 }
 
-static script_obj_t *script_evaluate_unary (script_state_t *state,
-                                            script_exp_t   *exp)
+/* Takes over the reference to obj */
+static script_obj_t *script_execute_apply_unary (script_exp_t *exp,
+                                                 script_obj_t *obj)
 {
-        script_obj_t *obj = script_evaluate (state, exp->data.sub);
         script_obj_t *new_obj;
 
         if (exp->type == SCRIPT_EXP_TYPE_NOT) {
@@ -249,6 +259,15 @@ static script_obj_t *script_evaluate_unary (script_state_t *state,
         script_obj_unref (obj);
         return new_obj;
 }
+
+static script_obj_t *script_evaluate_unary (script_state_t *state,
+                                            script_exp_t   *exp)
+{
+        script_obj_t *obj = script_evaluate (state, exp->data.sub);
+
+        return script_execute_apply_unary (exp, obj);
+}
+
 typedef struct
 {
         script_state_t *state;
@@ -290,6 +309,24 @@ static script_return_t script_execute_object_with_parlist (script_state_t *state
         return script_return_fail ();
 }
 
+static script_obj_t *script_execute_lookup_method (script_state_t *state,
+                                                   script_obj_t   *this_obj,
+                                                   const char     *name)
+{
+        script_obj_t *func_obj = script_obj_hash_peek_element (this_obj, name);
+
+        if (!func_obj && script_obj_is_string (this_obj)) {
+                script_obj_t *string_hash = script_obj_hash_peek_element (state->global, "String");
+                func_obj = script_obj_hash_peek_element (string_hash, name);
+                script_obj_unref (string_hash);
+        }
+
+        if (!func_obj)
+                func_obj = script_obj_hash_get_element (this_obj, name);
+
+        return func_obj;
+}
+
 static script_obj_t *script_evaluate_func (script_state_t *state,
                                            script_exp_t   *exp)
 {
@@ -302,17 +339,7 @@ static script_obj_t *script_evaluate_func (script_state_t *state,
                 this_obj = script_evaluate (state, name_exp->data.dual.sub_a);
                 char *this_key_name = script_obj_as_string (this_key);
                 script_obj_unref (this_key);
-                func_obj = script_obj_hash_peek_element (this_obj, this_key_name);
-
-                if (!func_obj && script_obj_is_string (this_obj)) {
-                        script_obj_t *string_hash = script_obj_hash_peek_element (state->global, "String");
-                        func_obj = script_obj_hash_peek_element (string_hash, this_key_name);
-                        script_obj_unref (string_hash);
-                }
-
-                if (!func_obj)
-                        func_obj = script_obj_hash_get_element (this_obj, this_key_name);
-
+                func_obj = script_execute_lookup_method (state, this_obj, this_key_name);
                 free (this_key_name);
         } else if (name_exp->type == SCRIPT_EXP_TYPE_TERM_VAR) {
                 char *name = name_exp->data.string;
@@ -554,7 +581,7 @@ static script_return_t script_execute_list (script_state_t *state,
              node = ply_list_get_next_node (op_list, node)) {
                 script_op_t *op = ply_list_node_get_data (node);
                 script_obj_unref (reply.object);
-                reply = script_execute (state, op);
+                reply = script_execute_op (state, op);
                 switch (reply.type) {
                 case SCRIPT_RETURN_TYPE_NORMAL:
                         break;
@@ -627,6 +654,652 @@ static script_return_t script_execute_function_with_parlist (script_state_t    *
         return reply;
 }
 
+/* Bytecode execution, see script-compile.c for the code layout */
+
+#define SCRIPT_EXECUTE_STACK_BUFFER_SIZE 32
+#define SCRIPT_EXECUTE_SLOT_BUFFER_SIZE 32
+
+typedef enum
+{
+        SCRIPT_EXECUTE_SCOPE_NONE,
+        SCRIPT_EXECUTE_SCOPE_LOCAL,
+        SCRIPT_EXECUTE_SCOPE_THIS,
+        SCRIPT_EXECUTE_SCOPE_GLOBAL,
+} script_execute_scope_t;
+
+typedef struct
+{
+        script_obj_t          *object;
+        script_execute_scope_t scope;
+        int                    local_version;
+        int                    this_version;
+} script_execute_slot_t;
+
+typedef struct
+{
+        script_state_t        *state;
+        script_obj_t          *local;   /* the scopes the slots were resolved in */
+        script_obj_t          *this;
+        script_obj_t          *global;
+        script_obj_type_t      local_type;
+        script_obj_type_t      this_type;
+        script_obj_type_t      global_type;
+        script_execute_slot_t *slots;
+        int                    slot_count;
+} script_execute_frame_t;
+
+typedef struct
+{
+        script_obj_t   *obj;
+        script_number_t number;
+        bool            immediate;      /* number is valid rather than obj */
+} script_execute_value_t;
+
+static unsigned long script_execute_unboxed_count = 0;
+
+/* Variables are never removed from a hash, so a scope hash which has not
+ * grown cannot have gained a variable hiding one found in an outer scope.
+ * Extended objects search several hashes and are never cached.
+ */
+static int script_execute_scope_get_version (script_obj_t *scope)
+{
+        if (scope->type == SCRIPT_OBJ_TYPE_HASH)
+                return ply_hashtable_get_size (scope->data.hash);
+        if (scope->type == SCRIPT_OBJ_TYPE_EXTEND)
+                return -1;
+        return 0;
+}
+
+static void script_execute_frame_bind (script_execute_frame_t *frame)
+{
+        frame->local = script_obj_deref_direct (frame->state->local);
+        frame->this = script_obj_deref_direct (frame->state->this);
+        frame->global = script_obj_deref_direct (frame->state->global);
+        script_obj_ref (frame->local);
+        script_obj_ref (frame->this);
+        script_obj_ref (frame->global);
+        frame->local_type = frame->local->type;
+        frame->this_type = frame->this->type;
+        frame->global_type = frame->global->type;
+}
+
+static void script_execute_frame_unbind (script_execute_frame_t *frame)
+{
+        int index;
+
+        for (index = 0; index < frame->slot_count; index++) {
+                script_obj_unref (frame->slots[index].object);
+                frame->slots[index].object = NULL;
+        }
+        script_obj_unref (frame->local);
+        script_obj_unref (frame->this);
+        script_obj_unref (frame->global);
+}
+
+/* Assigning to "local", "this" or "global" replaces the whole scope */
+static void script_execute_frame_check (script_execute_frame_t *frame)
+{
+        if (script_obj_deref_direct (frame->state->local) == frame->local &&
+            script_obj_deref_direct (frame->state->this) == frame->this &&
+            script_obj_deref_direct (frame->state->global) == frame->global &&
+            frame->local->type == frame->local_type &&
+            frame->this->type == frame->this_type &&
+            frame->global->type == frame->global_type)
+                return;
+
+        script_execute_frame_unbind (frame);
+        script_execute_frame_bind (frame);
+}
+
+/* Same search as script_evaluate_var, remembering where the name was found */
+static script_obj_t *script_execute_frame_lookup (script_execute_frame_t *frame,
+                                                  int                     slot_index,
+                                                  const char             *name,
+                                                  bool                    create,
+                                                  script_execute_scope_t *scope)
+{
+        script_execute_slot_t *slot = &frame->slots[slot_index];
+        script_state_t *state = frame->state;
+        script_obj_t *obj;
+        int local_version, this_version, global_version;
+        bool cacheable = false;
+
+        script_execute_frame_check (frame);
+        local_version = script_execute_scope_get_version (frame->local);
+        this_version = script_execute_scope_get_version (frame->this);
+
+        if (slot->object) {
+                if (slot->scope == SCRIPT_EXECUTE_SCOPE_LOCAL ||
+                    (slot->local_version == local_version &&
+                     (slot->scope == SCRIPT_EXECUTE_SCOPE_THIS ||
+                      slot->this_version == this_version))) {
+                        *scope = slot->scope;
+                        script_obj_ref (slot->object);
+                        return slot->object;
+                }
+                script_obj_unref (slot->object);
+                slot->object = NULL;
+        }
+
+        *scope = SCRIPT_EXECUTE_SCOPE_LOCAL;
+        obj = script_obj_hash_peek_element (state->local, name);
+        if (!obj) {
+                *scope = SCRIPT_EXECUTE_SCOPE_THIS;
+                obj = script_obj_hash_peek_element (state->this, name);
+        }
+        if (!obj) {
+                *scope = SCRIPT_EXECUTE_SCOPE_GLOBAL;
+                obj = script_obj_hash_peek_element (state->global, name);
+        }
+        if (!obj) {
+                if (!create) {
+                        *scope = SCRIPT_EXECUTE_SCOPE_NONE;
+                        return NULL;
+                }
+                *scope = SCRIPT_EXECUTE_SCOPE_LOCAL;
+                obj = script_obj_hash_get_element (state->local, name);
+        }
+
+        switch (*scope) {
+        case SCRIPT_EXECUTE_SCOPE_LOCAL:
+                cacheable = local_version >= 0;
+                break;
+
+        case SCRIPT_EXECUTE_SCOPE_THIS:
+                cacheable = local_version >= 0 && this_version >= 0;
+                break;
+
+        case SCRIPT_EXECUTE_SCOPE_GLOBAL:
+                global_version = script_execute_scope_get_version (frame->global);
+                cacheable = local_version >= 0 && this_version >= 0 && global_version >= 0;
+                break;
+
+        case SCRIPT_EXECUTE_SCOPE_NONE:
+                cacheable = false;
+                break;
+        }
+
+        if (cacheable) {
+                script_obj_ref (obj);
+                slot->object = obj;
+                slot->scope = *scope;
+                slot->local_version = local_version;
+                slot->this_version = this_version;
+        }
+        return obj;
+}
+
+/* Number values on the stack are kept unboxed and only get an object once
+ * they are stored, passed or returned, so intermediate results and literals
+ * do not allocate.
+ */
+static void script_execute_value_set_obj (script_execute_value_t *value,
+                                          script_obj_t           *obj)
+{
+        value->obj = obj;
+        value->immediate = false;
+}
+
+static void script_execute_value_set_number (script_execute_value_t *value,
+                                             script_number_t         number)
+{
+        value->number = number;
+        value->immediate = true;
+        script_execute_unboxed_count++;
+}
+
+/* Takes over the reference held by the value */
+static script_obj_t *script_execute_value_box (script_execute_value_t *value)
+{
+        if (value->immediate)
+                return script_obj_new_number (value->number);
+        return value->obj;
+}
+
+static void script_execute_value_release (script_execute_value_t *value)
+{
+        if (!value->immediate)
+                script_obj_unref (value->obj);
+}
+
+static bool script_execute_value_get_number (script_execute_value_t *value,
+                                             script_number_t        *number)
+{
+        if (value->immediate) {
+                *number = value->number;
+                return true;
+        }
+        if (!script_obj_is_number (value->obj))
+                return false;
+        *number = script_obj_as_number (value->obj);
+        return true;
+}
+
+static bool script_execute_value_as_bool (script_execute_value_t *value)
+{
+        if (value->immediate) {
+                int num_type = fpclassify (value->number);
+                return num_type != FP_ZERO && num_type != FP_NAN;
+        }
+        return script_obj_as_bool (value->obj);
+}
+
+/* Reply is strdupped, as with script_obj_as_string */
+static char *script_execute_value_as_string (script_execute_value_t *value)
+{
+        char *reply;
+
+        if (!value->immediate)
+                return script_obj_as_string (value->obj);
+        asprintf (&reply, "%g", value->number);
+        return reply;
+}
+
+static script_number_t script_execute_apply_number_function (script_code_op_type_t type,
+                                                             script_number_t       number_a,
+                                                             script_number_t       number_b)
+{
+        if (type == SCRIPT_CODE_OP_TYPE_PLUS || type == SCRIPT_CODE_OP_TYPE_ASSIGN_PLUS)
+                return number_a + number_b;
+        if (type == SCRIPT_CODE_OP_TYPE_MINUS || type == SCRIPT_CODE_OP_TYPE_ASSIGN_MINUS)
+                return number_a - number_b;
+        if (type == SCRIPT_CODE_OP_TYPE_MUL || type == SCRIPT_CODE_OP_TYPE_ASSIGN_MUL)
+                return number_a * number_b;
+        if (type == SCRIPT_CODE_OP_TYPE_DIV || type == SCRIPT_CODE_OP_TYPE_ASSIGN_DIV)
+                return number_a / number_b;
+        return fmodl (number_a, number_b);
+}
+
+static script_obj_t *script_execute_make_set (script_execute_value_t *elements,
+                                              int                     count)
+{
+        script_obj_t *obj = script_obj_new_hash ();
+        int index;
+
+        for (index = 0; index < count; index++) {
+                script_obj_t *element = script_execute_value_box (&elements[index]);
+                char *name;
+                asprintf (&name, "%d", index);
+                script_obj_hash_add_element (obj, element, name);
+                script_obj_unref (element);
+                free (name);
+        }
+        return obj;
+}
+
+static script_obj_t *script_execute_call (script_state_t         *state,
+                                          script_obj_t           *func_obj,
+                                          script_obj_t           *this_obj,
+                                          script_execute_value_t *arguments,
+                                          int                     count)
+{
+        ply_list_t *parameter_data = ply_list_new ();
+        ply_list_node_t *node;
+        script_return_t reply;
+        int index;
+
+        for (index = 0; index < count; index++) {
+                ply_list_append_data (parameter_data,
+                                      script_execute_value_box (&arguments[index]));
+        }
+
+        reply = script_execute_object_with_parlist (state, func_obj, this_obj, parameter_data);
+
+        for (node = ply_list_get_first_node (parameter_data);
+             node;
+             node = ply_list_get_next_node (parameter_data, node)) {
+                script_obj_unref (ply_list_node_get_data (node));
+        }
+        ply_list_free (parameter_data);
+
+        script_obj_unref (func_obj);
+        if (this_obj) script_obj_unref (this_obj);
+
+        return reply.object ? reply.object : script_obj_new_null ();
+}
+
+static script_return_t script_execute_code (script_state_t *state,
+                                            script_code_t  *code)
+{
+        script_execute_value_t stack_buffer[SCRIPT_EXECUTE_STACK_BUFFER_SIZE];
+        script_execute_slot_t slot_buffer[SCRIPT_EXECUTE_SLOT_BUFFER_SIZE];
+        script_execute_value_t *stack = stack_buffer;
+        script_execute_frame_t frame;
+        script_obj_t *result = NULL;
+        script_return_t reply;
+        int sp = 0;
+        int pc = 0;
+
+        if (code->stack_size > SCRIPT_EXECUTE_STACK_BUFFER_SIZE)
+                stack = malloc (code->stack_size * sizeof(script_execute_value_t));
+
+        frame.state = state;
+        frame.slot_count = code->slot_count;
+        frame.slots = slot_buffer;
+        if (code->slot_count > SCRIPT_EXECUTE_SLOT_BUFFER_SIZE)
+                frame.slots = malloc (code->slot_count * sizeof(script_execute_slot_t));
+        memset (frame.slots, 0, code->slot_count * sizeof(script_execute_slot_t));
+        script_execute_frame_bind (&frame);
+
+        while (true) {
+                script_code_op_t *code_op = &code->ops[pc++];
+                script_obj_t *(*function)(script_obj_t *,
+                                          script_obj_t *);
+                script_obj_t *obj_a, *obj_b, *obj;
+                script_number_t number_a, number_b;
+                script_execute_scope_t scope;
+
+                switch (code_op->type) {
+                case SCRIPT_CODE_OP_TYPE_PUSH_NULL:
+                        script_execute_value_set_obj (&stack[sp++], script_obj_new_null ());
+                        break;
+
+                case SCRIPT_CODE_OP_TYPE_PUSH_NUMBER:
+                        script_execute_value_set_number (&stack[sp++], code->numbers[code_op->operand]);
+                        break;
+
+                case SCRIPT_CODE_OP_TYPE_PUSH_STRING:
+                        script_execute_value_set_obj (&stack[sp++],
+                                                      script_obj_new_string (code->strings[code_op->operand]));
+                        break;
+
+                case SCRIPT_CODE_OP_TYPE_PUSH_LOCAL:
+                        script_obj_ref (state->local);
+                        script_execute_value_set_obj (&stack[sp++], state->local);
+                        break;
+
+                case SCRIPT_CODE_OP_TYPE_PUSH_GLOBAL:
+                        script_obj_ref (state->global);
+                        script_execute_value_set_obj (&stack[sp++], state->global);
+                        break;
+
+                case SCRIPT_CODE_OP_TYPE_PUSH_THIS:
+                        script_obj_ref (state->this);
+                        script_execute_value_set_obj (&stack[sp++], state->this);
+                        break;
+
+                case SCRIPT_CODE_OP_TYPE_PUSH_VAR:
+                {
+                        script_exp_t *exp = code_op->element;
+                        obj = script_execute_frame_lookup (&frame, code_op->operand,
+                                                           exp->data.string, true, &scope);
+                        script_execute_value_set_obj (&stack[sp++], obj);
+                        break;
+                }
+
+                case SCRIPT_CODE_OP_TYPE_PUSH_FUNCTION:
+                {
+                        script_exp_t *exp = code_op->element;
+                        script_execute_value_set_obj (&stack[sp++],
+                                                      script_obj_new_function (exp->data.function_def));
+                        break;
+                }
+
+                case SCRIPT_CODE_OP_TYPE_MAKE_SET:
+                        sp -= code_op->operand;
+                        obj = script_execute_make_set (&stack[sp], code_op->operand);
+                        script_execute_value_set_obj (&stack[sp++], obj);
+                        break;
+
+                case SCRIPT_CODE_OP_TYPE_PLUS:
+                case SCRIPT_CODE_OP_TYPE_ASSIGN_PLUS:
+                        function = script_obj_plus;
+                        goto apply_function;
+
+                case SCRIPT_CODE_OP_TYPE_MINUS:
+                case SCRIPT_CODE_OP_TYPE_ASSIGN_MINUS:
+                        function = script_obj_minus;
+                        goto apply_function;
+
+                case SCRIPT_CODE_OP_TYPE_MUL:
+                case SCRIPT_CODE_OP_TYPE_ASSIGN_MUL:
+                        function = script_obj_mul;
+                        goto apply_function;
+
+                case SCRIPT_CODE_OP_TYPE_DIV:
+                case SCRIPT_CODE_OP_TYPE_ASSIGN_DIV:
+                        function = script_obj_div;
+                        goto apply_function;
+
+                case SCRIPT_CODE_OP_TYPE_MOD:
+                case SCRIPT_CODE_OP_TYPE_ASSIGN_MOD:
+                        function = script_obj_mod;
+                        goto apply_function;
+
+                case SCRIPT_CODE_OP_TYPE_EXTEND:
+                case SCRIPT_CODE_OP_TYPE_ASSIGN_EXTEND:
+                        function = script_obj_new_extend;
+apply_function:
+                {
+                        bool assign = code_op->type >= SCRIPT_CODE_OP_TYPE_ASSIGN_PLUS &&
+                                      code_op->type <= SCRIPT_CODE_OP_TYPE_ASSIGN_EXTEND;
+                        sp--;
+                        if (function != script_obj_new_extend &&
+                            script_execute_value_get_number (&stack[sp - 1], &number_a) &&
+                            script_execute_value_get_number (&stack[sp], &number_b)) {
+                                number_a = script_execute_apply_number_function (code_op->type,
+                                                                                 number_a,
+                                                                                 number_b);
+                                script_execute_value_release (&stack[sp]);
+                                if (!assign) {
+                                        script_execute_value_release (&stack[sp - 1]);
+                                        script_execute_value_set_number (&stack[sp - 1], number_a);
+                                        break;
+                                }
+                                obj_a = script_execute_value_box (&stack[sp - 1]);
+                                obj = script_obj_new_number (number_a);
+                        } else {
+                                obj_a = script_execute_value_box (&stack[sp - 1]);
+                                obj_b = script_execute_value_box (&stack[sp]);
+                                obj = function (obj_a, obj_b);
+                                script_obj_unref (obj_b);
+                        }
+                        if (assign)
+                                script_obj_assign (obj_a, obj);
+                        script_obj_unref (obj_a);
+                        script_execute_value_set_obj (&stack[sp - 1], obj);
+                        break;
+                }
+
+                case SCRIPT_CODE_OP_TYPE_CMP:
+                {
+                        script_obj_cmp_result_t cmp_result;
+                        sp--;
+                        if (script_execute_value_get_number (&stack[sp - 1], &number_a) &&
+                            script_execute_value_get_number (&stack[sp], &number_b)) {
+                                if (number_a < number_b) cmp_result = SCRIPT_OBJ_CMP_RESULT_LT;
+                                else if (number_a > number_b) cmp_result = SCRIPT_OBJ_CMP_RESULT_GT;
+                                else if (number_a == number_b) cmp_result = SCRIPT_OBJ_CMP_RESULT_EQ;
+                                else cmp_result = SCRIPT_OBJ_CMP_RESULT_NE;
+                                script_execute_value_release (&stack[sp - 1]);
+                                script_execute_value_release (&stack[sp]);
+                        } else {
+                                obj_a = script_execute_value_box (&stack[sp - 1]);
+                                obj_b = script_execute_value_box (&stack[sp]);
+                                cmp_result = script_obj_cmp (obj_a, obj_b);
+                                script_obj_unref (obj_a);
+                                script_obj_unref (obj_b);
+                        }
+                        script_execute_value_set_number (&stack[sp - 1],
+                                                         (cmp_result & code_op->operand) ? 1 : 0);
+                        break;
+                }
+
+                case SCRIPT_CODE_OP_TYPE_NOT:
+                {
+                        bool cond = script_execute_value_as_bool (&stack[sp - 1]);
+                        script_execute_value_release (&stack[sp - 1]);
+                        script_execute_value_set_number (&stack[sp - 1], !cond);
+                        break;
+                }
+
+                case SCRIPT_CODE_OP_TYPE_NEG:
+                        if (script_execute_value_get_number (&stack[sp - 1], &number_a)) {
+                                script_execute_value_release (&stack[sp - 1]);
+                                script_execute_value_set_number (&stack[sp - 1], -number_a);
+                                break;
+                        }
+                /* fall through */
+                case SCRIPT_CODE_OP_TYPE_PRE_INC:
+                case SCRIPT_CODE_OP_TYPE_PRE_DEC:
+                case SCRIPT_CODE_OP_TYPE_POST_INC:
+                case SCRIPT_CODE_OP_TYPE_POST_DEC:
+                        obj = script_execute_value_box (&stack[sp - 1]);
+                        obj = script_execute_apply_unary (code_op->element, obj);
+                        script_execute_value_set_obj (&stack[sp - 1], obj);
+                        break;
+
+                case SCRIPT_CODE_OP_TYPE_ASSIGN:
+                        obj_b = script_execute_value_box (&stack[--sp]);
+                        obj_a = script_execute_value_box (&stack[sp - 1]);
+                        script_obj_assign (obj_a, obj_b);
+                        script_obj_unref (obj_b);
+                        script_execute_value_set_obj (&stack[sp - 1], obj_a);
+                        break;
+
+                case SCRIPT_CODE_OP_TYPE_HASH:
+                {
+                        char *name;
+                        name = script_execute_value_as_string (&stack[--sp]);
+                        script_execute_value_release (&stack[sp]);
+                        obj_a = script_execute_value_box (&stack[sp - 1]);
+                        obj = script_execute_hash_get_element (obj_a, name);
+                        free (name);
+                        script_obj_unref (obj_a);
+                        script_execute_value_set_obj (&stack[sp - 1], obj);
+                        break;
+                }
+
+                case SCRIPT_CODE_OP_TYPE_HASH_NAME:
+                        obj_a = script_execute_value_box (&stack[sp - 1]);
+                        obj = script_execute_hash_get_element (obj_a, code->strings[code_op->operand]);
+                        script_obj_unref (obj_a);
+                        script_execute_value_set_obj (&stack[sp - 1], obj);
+                        break;
+
+                case SCRIPT_CODE_OP_TYPE_LOOKUP_FUNCTION:
+                {
+                        script_exp_t *exp = code_op->element;
+                        obj = script_execute_frame_lookup (&frame, code_op->operand,
+                                                           exp->data.string, false, &scope);
+                        obj_a = NULL;
+                        if (!obj) {
+                                obj = script_obj_new_null ();
+                        } else if (scope == SCRIPT_EXECUTE_SCOPE_THIS) {
+                                obj_a = state->this;
+                                script_obj_ref (obj_a);
+                        }
+                        script_execute_value_set_obj (&stack[sp++], obj);
+                        script_execute_value_set_obj (&stack[sp++], obj_a);
+                        break;
+                }
+
+                case SCRIPT_CODE_OP_TYPE_LOOKUP_METHOD:
+                {
+                        char *name;
+                        obj_a = script_execute_value_box (&stack[sp - 1]);
+                        name = script_execute_value_as_string (&stack[sp - 2]);
+                        script_execute_value_release (&stack[sp - 2]);
+                        obj = script_execute_lookup_method (state, obj_a, name);
+                        free (name);
+                        script_execute_value_set_obj (&stack[sp - 2], obj);
+                        script_execute_value_set_obj (&stack[sp - 1], obj_a);
+                        break;
+                }
+
+                case SCRIPT_CODE_OP_TYPE_LOOKUP_METHOD_NAME:
+                        obj_a = script_execute_value_box (&stack[sp - 1]);
+                        obj = script_execute_lookup_method (state, obj_a,
+                                                            code->strings[code_op->operand]);
+                        script_execute_value_set_obj (&stack[sp - 1], obj);
+                        script_execute_value_set_obj (&stack[sp++], obj_a);
+                        break;
+
+                case SCRIPT_CODE_OP_TYPE_PUSH_NO_THIS:
+                        script_execute_value_set_obj (&stack[sp++], NULL);
+                        break;
+
+                case SCRIPT_CODE_OP_TYPE_CALL:
+                        sp -= code_op->operand + 2;
+                        obj = script_execute_call (state,
+                                                   script_execute_value_box (&stack[sp]),
+                                                   script_execute_value_box (&stack[sp + 1]),
+                                                   &stack[sp + 2],
+                                                   code_op->operand);
+                        script_execute_value_set_obj (&stack[sp++], obj);
+                        break;
+
+                case SCRIPT_CODE_OP_TYPE_POP:
+                        script_execute_value_release (&stack[--sp]);
+                        break;
+
+                case SCRIPT_CODE_OP_TYPE_SET_RESULT:
+                        script_obj_unref (result);
+                        result = script_execute_value_box (&stack[--sp]);
+                        break;
+
+                case SCRIPT_CODE_OP_TYPE_CLEAR_RESULT:
+                        script_obj_unref (result);
+                        result = NULL;
+                        break;
+
+                case SCRIPT_CODE_OP_TYPE_JUMP:
+                        pc = code_op->operand;
+                        break;
+
+                case SCRIPT_CODE_OP_TYPE_JUMP_IF_FALSE:
+                case SCRIPT_CODE_OP_TYPE_JUMP_IF_TRUE:
+                {
+                        bool cond;
+                        cond = script_execute_value_as_bool (&stack[--sp]);
+                        script_execute_value_release (&stack[sp]);
+                        if (cond == (code_op->type == SCRIPT_CODE_OP_TYPE_JUMP_IF_TRUE))
+                                pc = code_op->operand;
+                        break;
+                }
+
+                case SCRIPT_CODE_OP_TYPE_JUMP_IF_FALSE_OR_POP:
+                case SCRIPT_CODE_OP_TYPE_JUMP_IF_TRUE_OR_POP:
+                        if (script_execute_value_as_bool (&stack[sp - 1]) ==
+                            (code_op->type == SCRIPT_CODE_OP_TYPE_JUMP_IF_TRUE_OR_POP))
+                                pc = code_op->operand;
+                        else
+                                script_execute_value_release (&stack[--sp]);
+                        break;
+
+                case SCRIPT_CODE_OP_TYPE_RETURN:
+                        reply = script_return_obj (script_execute_value_box (&stack[--sp]));
+                        goto out;
+
+                case SCRIPT_CODE_OP_TYPE_FAIL:
+                        reply = script_return_fail ();
+                        goto out;
+
+                case SCRIPT_CODE_OP_TYPE_BREAK:
+                        reply = script_return_break ();
+                        goto out;
+
+                case SCRIPT_CODE_OP_TYPE_CONTINUE:
+                        reply = script_return_continue ();
+                        goto out;
+
+                case SCRIPT_CODE_OP_TYPE_END:
+                        reply = script_return_normal_obj (result);
+                        result = NULL;
+                        goto out;
+                }
+        }
+out:
+        assert (sp == 0);
+        script_obj_unref (result);
+        script_execute_frame_unbind (&frame);
+        if (frame.slots != slot_buffer)
+                free (frame.slots);
+        if (stack != stack_buffer)
+                free (stack);
+        return reply;
+}
+
 script_return_t script_execute_object (script_state_t *state,
                                        script_obj_t   *function,
                                        script_obj_t   *this,
@@ -652,8 +1325,8 @@ script_return_t script_execute_object (script_state_t *state,
         return reply;
 }
 
-script_return_t script_execute (script_state_t *state,
-                                script_op_t    *op)
+static script_return_t script_execute_op (script_state_t *state,
+                                          script_op_t    *op)
 {
         script_return_t reply = script_return_normal ();
 
@@ -675,9 +1348,9 @@ script_return_t script_execute (script_state_t *state,
         {
                 script_obj_t *obj = script_evaluate (state, op->data.cond_op.cond);
                 if (script_obj_as_bool (obj))
-                        reply = script_execute (state, op->data.cond_op.op1);
+                        reply = script_execute_op (state, op->data.cond_op.op1);
                 else
-                        reply = script_execute (state, op->data.cond_op.op2);
+                        reply = script_execute_op (state, op->data.cond_op.op2);
                 script_obj_unref (obj);
                 break;
         }
@@ -698,7 +1371,7 @@ script_return_t script_execute (script_state_t *state,
 
                         if (cond) {
                                 script_obj_unref (reply.object);
-                                reply = script_execute (state, op->data.cond_op.op1);
+                                reply = script_execute_op (state, op->data.cond_op.op1);
                                 switch (reply.type) {
                                 case SCRIPT_RETURN_TYPE_NORMAL:
                                         break;
@@ -711,11 +1384,12 @@ script_return_t script_execute (script_state_t *state,
                                         return script_return_normal ();
 
                                 case SCRIPT_RETURN_TYPE_CONTINUE:
+                                        reply.type = SCRIPT_RETURN_TYPE_NORMAL;
                                         break;
                                 }
                                 if (op->data.cond_op.op2) {
                                         script_obj_unref (reply.object);
-                                        reply = script_execute (state, op->data.cond_op.op2);
+                                        reply = script_execute_op (state, op->data.cond_op.op2);
                                 }
                         } else {
                                 break;
@@ -754,3 +1428,22 @@ script_return_t script_execute (script_state_t *state,
         }
         return reply;
 }
+
+script_return_t script_execute (script_state_t *state,
+                                script_op_t    *op)
+{
+        if (!op) return script_return_normal ();
+
+        if (!op->code)
+                op->code = script_compile (op);
+        if (op->code)
+                return script_execute_code (state, op->code);
+
+        return script_execute_op (state, op);
+}
+
+void script_execute_trace_statistics (void)
+{
+        ply_trace ("script numbers: %lu results kept unboxed", script_execute_unboxed_count);
+        script_obj_trace_statistics ();
+}
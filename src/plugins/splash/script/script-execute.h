@@ -31,5 +31,6 @@ script_return_t script_execute_object (script_state_t * state,
                                        script_obj_t * this,
                                        script_obj_t * first_arg,
                                        ...);
+void script_execute_trace_statistics (void);
 
 #endif /* SCRIPT_EXECUTE_H */
@@ -150,6 +150,27 @@ static script_return_t image_crop (script_state_t *state,
         return script_return_obj_null ();
 }
 
+static script_return_t image_sub_image (script_state_t *state,
+                                        void           *user_data)
+{
+        script_lib_image_data_t *data = user_data;
+        ply_pixel_buffer_t *image = script_obj_as_native_of_class (state->this, data->class);
+        int x = script_obj_hash_get_number (state->local, "x");
+        int y = script_obj_hash_get_number (state->local, "y");
+        int width = script_obj_hash_get_number (state->local, "width");
+        int height = script_obj_hash_get_number (state->local, "height");
+
+        /* Unlike Crop, this shares the pixels, so it stops at the edges */
+        if (image && width > 0 && height > 0) {
+                ply_rectangle_t area = { x, y, width, height };
+                ply_pixel_buffer_t *new_image = ply_pixel_buffer_new_view (image, &area);
+                ply_pixel_buffer_find_opaque_area (new_image);
+                ply_pixel_buffer_find_spans (new_image);
+                return script_return_obj (script_obj_new_native (new_image, data->class));
+        }
+        return script_return_obj_null ();
+}
+
 static script_return_t image_scale (script_state_t *state,
                                     void           *user_data)
 {
@@ -291,6 +312,15 @@ script_lib_image_data_t *script_lib_image_setup (script_state_t *state,
                                     "width",
                                     "height",
                                     NULL);
+        script_add_native_function (image_hash,
+                                    "_SubImage",
+                                    image_sub_image,
+                                    data,
+                                    "x",
+                                    "y",
+                                    "width",
+                                    "height",
+                                    NULL);
         script_add_native_function (image_hash,
                                     "_Scale",
                                     image_scale,
@@ -33,7 +33,9 @@
 #include "script-lib-image.h"
 #include "script-lib-sprite.h"
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include "script-lib-sprite.script.h"
@@ -41,8 +43,10 @@
 static void sprite_free (script_obj_t *obj)
 {
         sprite_t *sprite = obj->data.native.object_data;
+        script_lib_sprite_data_t *data = obj->data.native.class->user_data;
 
         sprite->remove_me = true;
+        data->grid.rebuild = true;
 }
 
 static script_return_t sprite_new (script_state_t *state,
@@ -68,6 +72,8 @@ static script_return_t sprite_new (script_state_t *state,
         sprite->image = NULL;
         sprite->image_obj = NULL;
         ply_list_append_data (data->sprite_list, sprite);
+        data->z_order_changed = true;
+        data->grid.rebuild = true;
 
         reply = script_obj_new_native (sprite, data->class);
         return script_return_obj (reply);
@@ -104,6 +110,7 @@ static script_return_t sprite_set_image (script_state_t *state,
                 sprite->image = image;
                 sprite->image_obj = script_obj_image;
                 sprite->refresh_me = true;
+                data->grid.stale = true;
         }
         script_obj_unref (script_obj_image);
 
@@ -160,8 +167,10 @@ static script_return_t sprite_set_x (script_state_t *state,
         script_lib_sprite_data_t *data = user_data;
         sprite_t *sprite = script_obj_as_native_of_class (state->this, data->class);
 
-        if (sprite)
+        if (sprite) {
                 sprite->x = script_obj_hash_get_number (state->local, "value");
+                data->grid.stale = true;
+        }
         return script_return_obj_null ();
 }
 
@@ -171,8 +180,10 @@ static script_return_t sprite_set_y (script_state_t *state,
         script_lib_sprite_data_t *data = user_data;
         sprite_t *sprite = script_obj_as_native_of_class (state->this, data->class);
 
-        if (sprite)
+        if (sprite) {
                 sprite->y = script_obj_hash_get_number (state->local, "value");
+                data->grid.stale = true;
+        }
         return script_return_obj_null ();
 }
 
@@ -182,8 +193,15 @@ static script_return_t sprite_set_z (script_state_t *state,
         script_lib_sprite_data_t *data = user_data;
         sprite_t *sprite = script_obj_as_native_of_class (state->this, data->class);
 
-        if (sprite)
-                sprite->z = script_obj_hash_get_number (state->local, "value");
+        if (sprite) {
+                int z = script_obj_hash_get_number (state->local, "value");
+                if (sprite->z != z) {
+                        sprite->z = z;
+                        data->z_order_changed = true;
+                        data->grid.rebuild = true;
+                        data->grid.stale = true;
+                }
+        }
         return script_return_obj_null ();
 }
 
@@ -360,6 +378,8 @@ static script_return_t sprite_window_set_x (script_state_t *state,
                 if (display->x != x) {
                         display->x = x;
                         data->full_refresh = true;
+                        data->grid.rebuild = true;
+                        data->grid.stale = true;
                 }
         }
         return script_return_obj_null ();
@@ -382,6 +402,8 @@ static script_return_t sprite_window_set_y (script_state_t *state,
                 if (display->y != y) {
                         display->y = y;
                         data->full_refresh = true;
+                        data->grid.rebuild = true;
+                        data->grid.stale = true;
                 }
         }
         return script_return_obj_null ();
@@ -432,6 +454,279 @@ static void script_lib_draw_brackground (ply_pixel_buffer_t *pixel_buffer,
         }
 }
 
+/* Gets the part of the clip area an opaque sprite paints over completely.
+ * Sprites at a different scale from the display get interpolated, which
+ * blurs the edges of their opaque area, so those never occlude anything.
+ */
+static bool script_lib_sprite_get_occluding_area (script_lib_display_t *display,
+                                                  ply_pixel_buffer_t   *pixel_buffer,
+                                                  ply_rectangle_t      *clip_area,
+                                                  sprite_t             *sprite,
+                                                  ply_rectangle_t      *occluding_area)
+{
+        if (!sprite->image) return false;
+        if (sprite->remove_me) return false;
+        if (sprite->opacity != 1.0) return false;
+        if (ply_pixel_buffer_get_device_scale (sprite->image) !=
+            ply_pixel_buffer_get_device_scale (pixel_buffer)) return false;
+
+        ply_pixel_buffer_get_opaque_area (sprite->image, occluding_area);
+        occluding_area->x += sprite->x - display->x;
+        occluding_area->y += sprite->y - display->y;
+        ply_rectangle_intersect (occluding_area, clip_area, occluding_area);
+
+        return occluding_area->width > 0 && occluding_area->height > 0;
+}
+
+static void script_lib_sprite_queue_occluding_area (script_lib_display_t *display,
+                                                    ply_pixel_buffer_t   *pixel_buffer,
+                                                    ply_rectangle_t      *clip_area,
+                                                    sprite_t             *sprite)
+{
+        ply_rectangle_t occluding_area;
+
+        if (script_lib_sprite_get_occluding_area (display, pixel_buffer, clip_area, sprite, &occluding_area))
+                ply_pixel_buffer_queue_occluding_area (pixel_buffer, &occluding_area);
+}
+
+static void script_lib_sprite_draw_sprite (script_lib_display_t *display,
+                                           ply_pixel_buffer_t   *pixel_buffer,
+                                           ply_rectangle_t      *clip_area,
+                                           sprite_t             *sprite)
+{
+        ply_rectangle_t occluding_area;
+        int position_x, position_y;
+
+        /* This sprite's own area was queued with the ones below it */
+        if (script_lib_sprite_get_occluding_area (display, pixel_buffer, clip_area, sprite, &occluding_area))
+                ply_pixel_buffer_dequeue_occluding_area (pixel_buffer);
+
+        if (!sprite->image) return;
+        if (sprite->remove_me) return;
+        if (sprite->opacity < 0.011) return;
+
+        position_x = sprite->x - display->x;
+        position_y = sprite->y - display->y;
+
+        if (position_x >= (clip_area->x + (int) clip_area->width)) return;
+        if (position_y >= (clip_area->y + (int) clip_area->height)) return;
+
+        if ((position_x + (int) ply_pixel_buffer_get_width (sprite->image)) <= clip_area->x) return;
+        if ((position_y + (int) ply_pixel_buffer_get_height (sprite->image)) <= clip_area->y) return;
+        ply_pixel_buffer_fill_with_buffer_at_opacity_with_clip (pixel_buffer,
+                                                                sprite->image,
+                                                                position_x,
+                                                                position_y,
+                                                                clip_area,
+                                                                sprite->opacity);
+}
+
+/* Gets the range of cells covering an area, returns false if none do */
+static bool script_lib_sprite_grid_get_cells (script_lib_sprite_grid_t *grid,
+                                              long                      x,
+                                              long                      y,
+                                              long                      width,
+                                              long                      height,
+                                              int                      *first_column,
+                                              int                      *first_row,
+                                              int                      *last_column,
+                                              int                      *last_row)
+{
+        long start_x = x - grid->x;
+        long start_y = y - grid->y;
+        long end_x = start_x + width;
+        long end_y = start_y + height;
+
+        if (width <= 0 || height <= 0) return false;
+        if (end_x <= 0 || end_y <= 0) return false;
+        if (start_x >= (long) grid->columns * SCRIPT_LIB_SPRITE_GRID_CELL_SIZE) return false;
+        if (start_y >= (long) grid->rows * SCRIPT_LIB_SPRITE_GRID_CELL_SIZE) return false;
+
+        *first_column = MAX (start_x, 0) / SCRIPT_LIB_SPRITE_GRID_CELL_SIZE;
+        *first_row = MAX (start_y, 0) / SCRIPT_LIB_SPRITE_GRID_CELL_SIZE;
+        *last_column = MIN ((end_x - 1) / SCRIPT_LIB_SPRITE_GRID_CELL_SIZE, grid->columns - 1);
+        *last_row = MIN ((end_y - 1) / SCRIPT_LIB_SPRITE_GRID_CELL_SIZE, grid->rows - 1);
+        return true;
+}
+
+/* Cells list their sprites in z order */
+static void script_lib_sprite_grid_insert_sprite (script_lib_sprite_grid_t *grid,
+                                                  sprite_t                 *sprite)
+{
+        int column, row;
+
+        sprite->in_grid = false;
+        if (!sprite->image) return;
+        if (sprite->remove_me) return;
+        if (!script_lib_sprite_grid_get_cells (grid,
+                                               sprite->x,
+                                               sprite->y,
+                                               ply_pixel_buffer_get_width (sprite->image),
+                                               ply_pixel_buffer_get_height (sprite->image),
+                                               &sprite->first_column, &sprite->first_row,
+                                               &sprite->last_column, &sprite->last_row))
+                return;
+        sprite->in_grid = true;
+
+        for (row = sprite->first_row; row <= sprite->last_row; row++) {
+                for (column = sprite->first_column; column <= sprite->last_column; column++) {
+                        script_lib_sprite_cell_t *cell = &grid->cells[row * grid->columns + column];
+                        int low = 0;
+                        int high = cell->count;
+
+                        while (low < high) {
+                                int middle = (low + high) / 2;
+                                if (cell->sprites[middle]->order < sprite->order)
+                                        low = middle + 1;
+                                else
+                                        high = middle;
+                        }
+
+                        if (cell->count == cell->size) {
+                                cell->size = cell->size ? cell->size * 2 : 8;
+                                cell->sprites = realloc (cell->sprites, cell->size * sizeof(sprite_t *));
+                        }
+                        memmove (&cell->sprites[low + 1], &cell->sprites[low],
+                                 (cell->count - low) * sizeof(sprite_t *));
+                        cell->sprites[low] = sprite;
+                        cell->count++;
+                }
+        }
+}
+
+static void script_lib_sprite_grid_remove_sprite (script_lib_sprite_grid_t *grid,
+                                                  sprite_t                 *sprite)
+{
+        int column, row;
+
+        if (!sprite->in_grid) return;
+
+        for (row = sprite->first_row; row <= sprite->last_row; row++) {
+                for (column = sprite->first_column; column <= sprite->last_column; column++) {
+                        script_lib_sprite_cell_t *cell = &grid->cells[row * grid->columns + column];
+                        int index;
+
+                        for (index = 0; index < cell->count; index++) {
+                                if (cell->sprites[index] == sprite) break;
+                        }
+                        assert (index < cell->count);
+                        cell->count--;
+                        memmove (&cell->sprites[index], &cell->sprites[index + 1],
+                                 (cell->count - index) * sizeof(sprite_t *));
+                }
+        }
+        sprite->in_grid = false;
+}
+
+static void script_lib_sprite_grid_fill (script_lib_sprite_data_t *data)
+{
+        script_lib_sprite_grid_t *grid = &data->grid;
+        ply_list_node_t *node;
+        int x1, y1, x2, y2;
+        int columns, rows;
+        int order;
+        int index;
+
+        x1 = y1 = INT_MAX;
+        x2 = y2 = INT_MIN;
+        for (node = ply_list_get_first_node (data->displays);
+             node;
+             node = ply_list_get_next_node (data->displays, node)) {
+                script_lib_display_t *display = ply_list_node_get_data (node);
+                x1 = MIN (x1, display->x);
+                y1 = MIN (y1, display->y);
+                x2 = MAX (x2, display->x + (int) ply_pixel_display_get_width (display->pixel_display));
+                y2 = MAX (y2, display->y + (int) ply_pixel_display_get_height (display->pixel_display));
+        }
+        if (x2 <= x1 || y2 <= y1) {
+                x1 = x2 = 0;
+                y1 = y2 = 0;
+        }
+
+        columns = (x2 - x1 + SCRIPT_LIB_SPRITE_GRID_CELL_SIZE - 1) / SCRIPT_LIB_SPRITE_GRID_CELL_SIZE;
+        rows = (y2 - y1 + SCRIPT_LIB_SPRITE_GRID_CELL_SIZE - 1) / SCRIPT_LIB_SPRITE_GRID_CELL_SIZE;
+        if (columns * rows != grid->columns * grid->rows) {
+                for (index = 0; index < grid->columns * grid->rows; index++) {
+                        free (grid->cells[index].sprites);
+                }
+                free (grid->cells);
+                grid->cells = calloc (columns * rows, sizeof(script_lib_sprite_cell_t));
+        } else {
+                for (index = 0; index < columns * rows; index++) {
+                        grid->cells[index].count = 0;
+                }
+        }
+        grid->x = x1;
+        grid->y = y1;
+        grid->columns = columns;
+        grid->rows = rows;
+
+        /* Sprites are added in list order, so always at the end of the cells */
+        order = 0;
+        for (node = ply_list_get_first_node (data->sprite_list);
+             node;
+             node = ply_list_get_next_node (data->sprite_list, node)) {
+                sprite_t *sprite = ply_list_node_get_data (node);
+
+                sprite->order = order++;
+                script_lib_sprite_grid_insert_sprite (grid, sprite);
+        }
+        grid->rebuild = false;
+}
+
+static int
+sprite_compare_order (const void *data_a, const void *data_b)
+{
+        sprite_t *const *sprite_a = data_a;
+        sprite_t *const *sprite_b = data_b;
+
+        return (*sprite_a)->order - (*sprite_b)->order;
+}
+
+/* Collects the sprites from all cells overlapping the area into
+ * grid->area_sprites in z order, and returns how many there are.
+ */
+static int script_lib_sprite_grid_get_area_sprites (script_lib_sprite_grid_t *grid,
+                                                    int                       x,
+                                                    int                       y,
+                                                    int                       width,
+                                                    int                       height)
+{
+        int first_column, first_row, last_column, last_row;
+        int column, row;
+        int count = 0;
+
+        if (!script_lib_sprite_grid_get_cells (grid, x, y, width, height,
+                                               &first_column, &first_row,
+                                               &last_column, &last_row))
+                return 0;
+
+        grid->area_serial++;
+        for (row = first_row; row <= last_row; row++) {
+                for (column = first_column; column <= last_column; column++) {
+                        script_lib_sprite_cell_t *cell = &grid->cells[row * grid->columns + column];
+                        int index;
+
+                        for (index = 0; index < cell->count; index++) {
+                                sprite_t *sprite = cell->sprites[index];
+
+                                if (sprite->area_serial == grid->area_serial) continue;
+                                sprite->area_serial = grid->area_serial;
+                                if (count == grid->area_sprites_size) {
+                                        grid->area_sprites_size = grid->area_sprites_size ? grid->area_sprites_size * 2 : 64;
+                                        grid->area_sprites = realloc (grid->area_sprites,
+                                                                      grid->area_sprites_size * sizeof(sprite_t *));
+                                }
+                                grid->area_sprites[count++] = sprite;
+                        }
+                }
+        }
+
+        if (first_column != last_column || first_row != last_row)
+                qsort (grid->area_sprites, count, sizeof(sprite_t *), sprite_compare_order);
+        return count;
+}
+
 static void script_lib_sprite_draw_area (script_lib_display_t *display,
                                          ply_pixel_buffer_t   *pixel_buffer,
                                          int                   x,
@@ -449,51 +744,44 @@ static void script_lib_sprite_draw_area (script_lib_display_t *display,
         clip_area.width = width;
         clip_area.height = height;
 
+        /* Opaque sprites are queued as occluding areas first, so the
+         * background and sprites below them skip what they'll cover */
+        if (data->grid.stale) {
+                for (node = ply_list_get_first_node (data->sprite_list);
+                     node;
+                     node = ply_list_get_next_node (data->sprite_list, node)) {
+                        sprite = ply_list_node_get_data (node);
+                        script_lib_sprite_queue_occluding_area (display, pixel_buffer, &clip_area, sprite);
+                }
 
-        node = ply_list_get_first_node (data->sprite_list);
-        sprite = ply_list_node_get_data (node);
-
-        /* Check If the first sprite should be rendered opaque */
-        if (sprite->image && !sprite->remove_me &&
-            ply_pixel_buffer_is_opaque (sprite->image) && sprite->opacity == 1.0)  {
-                int position_x = sprite->x - display->x;
-                int position_y = sprite->y - display->y;
-
-                /* In that case only draw the background if the sprite doesn't
-                 * cover the complete area */
-                if (position_x > x || position_y > y ||
-                    ((int)ply_pixel_buffer_get_width (sprite->image) + position_x) < (x + width) ||
-                    ((int)ply_pixel_buffer_get_height (sprite->image) + position_y) < (y + height))
-                        script_lib_draw_brackground (pixel_buffer, &clip_area, data);
-        } else {
                 script_lib_draw_brackground (pixel_buffer, &clip_area, data);
-        }
-
-        for (node = ply_list_get_first_node (data->sprite_list);
-             node;
-             node = ply_list_get_next_node (data->sprite_list, node)) {
-                int position_x, position_y;
 
-                sprite = ply_list_node_get_data (node);
+                for (node = ply_list_get_first_node (data->sprite_list);
+                     node;
+                     node = ply_list_get_next_node (data->sprite_list, node)) {
+                        sprite = ply_list_node_get_data (node);
+                        script_lib_sprite_draw_sprite (display, pixel_buffer, &clip_area, sprite);
+                }
+                return;
+        }
 
-                if (!sprite->image) continue;
-                if (sprite->remove_me) continue;
-                if (sprite->opacity < 0.011) continue;
+        int sprite_count = script_lib_sprite_grid_get_area_sprites (&data->grid,
+                                                                    x + display->x,
+                                                                    y + display->y,
+                                                                    width,
+                                                                    height);
+        int index;
 
-                position_x = sprite->x - display->x;
-                position_y = sprite->y - display->y;
+        for (index = 0; index < sprite_count; index++) {
+                script_lib_sprite_queue_occluding_area (display, pixel_buffer, &clip_area,
+                                                        data->grid.area_sprites[index]);
+        }
 
-                if (position_x >= (x + width)) continue;
-                if (position_y >= (y + height)) continue;
+        script_lib_draw_brackground (pixel_buffer, &clip_area, data);
 
-                if ((position_x + (int) ply_pixel_buffer_get_width (sprite->image)) <= x) continue;
-                if ((position_y + (int) ply_pixel_buffer_get_height (sprite->image)) <= y) continue;
-                ply_pixel_buffer_fill_with_buffer_at_opacity_with_clip (pixel_buffer,
-                                                                        sprite->image,
-                                                                        position_x,
-                                                                        position_y,
-                                                                        &clip_area,
-                                                                        sprite->opacity);
+        for (index = 0; index < sprite_count; index++) {
+                script_lib_sprite_draw_sprite (display, pixel_buffer, &clip_area,
+                                               data->grid.area_sprites[index]);
         }
 }
 
@@ -684,6 +972,10 @@ script_lib_sprite_data_t *script_lib_sprite_setup (script_state_t *state,
         data->background_color_start = 0x000000;
         data->background_color_end = 0x000000;
         data->full_refresh = true;
+        data->z_order_changed = false;
+        memset (&data->grid, 0, sizeof(script_lib_sprite_grid_t));
+        data->grid.rebuild = true;
+        data->grid.stale = true;
         script_return_t ret = script_execute (state, data->script_main_op);
         script_obj_unref (ret.object);
         return data;
@@ -732,6 +1024,8 @@ void script_lib_sprite_pixel_display_removed (script_lib_sprite_data_t *data, pl
         if (display->pixel_display == pixel_display)
         {
             ply_list_remove_node (data->displays, node);
+            data->grid.rebuild = true;
+            data->grid.stale = true;
         }
         node = next_node;
     }
@@ -749,7 +1043,11 @@ script_lib_sprite_refresh (script_lib_sprite_data_t *data)
 
         region = ply_region_new ();
 
-        ply_list_sort_stable (data->sprite_list, &sprite_compare_z);
+        /* Sorting only moves sprites whose z changed, so skip it otherwise */
+        if (data->z_order_changed) {
+                ply_list_sort_stable (data->sprite_list, &sprite_compare_z);
+                data->z_order_changed = false;
+        }
 
         node = ply_list_get_first_node (data->sprite_list);
 
@@ -800,6 +1098,10 @@ script_lib_sprite_refresh (script_lib_sprite_data_t *data)
                     || sprite->refresh_me) {
                         ply_rectangle_t size;
                         ply_pixel_buffer_get_size (sprite->image, &size);
+                        if (!data->grid.rebuild) {
+                                script_lib_sprite_grid_remove_sprite (&data->grid, sprite);
+                                script_lib_sprite_grid_insert_sprite (&data->grid, sprite);
+                        }
                         region_add_area (region,
                                          sprite->x,
                                          sprite->y,
@@ -821,6 +1123,10 @@ script_lib_sprite_refresh (script_lib_sprite_data_t *data)
                 }
         }
 
+        if (data->grid.rebuild)
+                script_lib_sprite_grid_fill (data);
+        data->grid.stale = false;
+
         rectable_list = ply_region_get_rectangle_list (region);
 
         for (node = ply_list_get_first_node (rectable_list);
@@ -840,6 +1146,7 @@ script_lib_sprite_refresh (script_lib_sprite_data_t *data)
 void script_lib_sprite_destroy (script_lib_sprite_data_t *data)
 {
         ply_list_node_t *node;
+        int index;
 
         for (node = ply_list_get_first_node (data->displays);
              node;
@@ -861,6 +1168,11 @@ void script_lib_sprite_destroy (script_lib_sprite_data_t *data)
         }
 
         ply_list_free (data->sprite_list);
+        for (index = 0; index < data->grid.columns * data->grid.rows; index++) {
+                free (data->grid.cells[index].sprites);
+        }
+        free (data->grid.cells);
+        free (data->grid.area_sprites);
         script_parse_op_free (data->script_main_op);
         script_obj_native_class_destroy (data->class);
         free (data);
@@ -26,6 +26,57 @@
 #include "ply-pixel-buffer.h"
 #include "ply-pixel-display.h"
 
+typedef struct
+{
+        int                 x;
+        int                 y;
+        int                 z;
+        double              opacity;
+        int                 old_x;
+        int                 old_y;
+        int                 old_z;
+        int                 old_width;
+        int                 old_height;
+        double              old_opacity;
+        bool                refresh_me;
+        bool                remove_me;
+        ply_pixel_buffer_t *image;
+        script_obj_t       *image_obj;
+        int                 order;      /* position in the z sorted sprite list */
+        bool                in_grid;
+        int                 first_column;
+        int                 first_row;
+        int                 last_column;
+        int                 last_row;
+        unsigned int        area_serial;
+} sprite_t;
+
+/* Sprites are binned into fixed size cells covering all displays so drawing
+ * an area only visits the sprites which may overlap it.
+ */
+#define SCRIPT_LIB_SPRITE_GRID_CELL_SIZE 128
+
+typedef struct
+{
+        sprite_t **sprites;
+        int        count;
+        int        size;
+} script_lib_sprite_cell_t;
+
+typedef struct
+{
+        script_lib_sprite_cell_t *cells;
+        int                       x;
+        int                       y;
+        int                       columns;
+        int                       rows;
+        bool                      stale;        /* sprites changed since the cells were updated */
+        bool                      rebuild;      /* sprites were added, removed or reordered */
+        unsigned int              area_serial;
+        sprite_t                **area_sprites;
+        int                       area_sprites_size;
+} script_lib_sprite_grid_t;
+
 typedef struct
 {
         ply_list_t                *displays;
@@ -35,6 +86,8 @@ typedef struct
         uint32_t                   background_color_start;
         uint32_t                   background_color_end;
         bool                       full_refresh;
+        bool                       z_order_changed;
+        script_lib_sprite_grid_t   grid;
 } script_lib_sprite_data_t;
 
 typedef struct
@@ -45,24 +98,6 @@ typedef struct
         int                       y;
 } script_lib_display_t;
 
-typedef struct
-{
-        int                 x;
-        int                 y;
-        int                 z;
-        double              opacity;
-        int                 old_x;
-        int                 old_y;
-        int                 old_z;
-        int                 old_width;
-        int                 old_height;
-        double              old_opacity;
-        bool                refresh_me;
-        bool                remove_me;
-        ply_pixel_buffer_t *image;
-        script_obj_t       *image_obj;
-} sprite_t;
-
 script_lib_sprite_data_t *script_lib_sprite_setup (script_state_t *state,
                                                    ply_list_t     *displays);
 void script_lib_sprite_pixel_display_removed (script_lib_sprite_data_t *data, ply_pixel_display_t *pixel_display);
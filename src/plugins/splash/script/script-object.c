@@ -27,6 +27,7 @@
 #include "ply-hashtable.h"
 #include "ply-list.h"
 #include "ply-bitarray.h"
+#include "ply-logger.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -40,13 +41,55 @@
 #include "script.h"
 #include "script-object.h"
 
+#define SCRIPT_OBJ_FREE_LIST_MAX 256
+
 void script_obj_reset (script_obj_t *obj);
 
+/* Scripts create and drop short lived objects (mostly numbers) at a high rate,
+ * so keep a bounded list of freed objects around rather than going back to
+ * malloc each time. Free objects are chained through data.obj.
+ */
+static script_obj_t *script_obj_free_list = NULL;
+static int script_obj_free_list_length = 0;
+static unsigned long script_obj_allocated_count = 0;
+static unsigned long script_obj_reused_count = 0;
+static unsigned long script_obj_live_count = 0;
+
+static script_obj_t *script_obj_alloc (void)
+{
+        script_obj_t *obj = script_obj_free_list;
+
+        script_obj_allocated_count++;
+        script_obj_live_count++;
+        if (obj) {
+                script_obj_free_list = obj->data.obj;
+                script_obj_free_list_length--;
+                script_obj_reused_count++;
+                return obj;
+        }
+        return malloc (sizeof(script_obj_t));
+}
+
 void script_obj_free (script_obj_t *obj)
 {
         assert (!obj->refcount);
         script_obj_reset (obj);
-        free (obj);
+        script_obj_live_count--;
+        if (script_obj_free_list_length >= SCRIPT_OBJ_FREE_LIST_MAX) {
+                free (obj);
+                return;
+        }
+        obj->data.obj = script_obj_free_list;
+        script_obj_free_list = obj;
+        script_obj_free_list_length++;
+}
+
+void script_obj_trace_statistics (void)
+{
+        ply_trace ("script objects: %lu allocated, %lu of them from the free list, %lu still live",
+                   script_obj_allocated_count,
+                   script_obj_reused_count,
+                   script_obj_live_count);
 }
 
 void script_obj_ref (script_obj_t *obj)
@@ -148,7 +191,7 @@ void script_obj_deref (script_obj_t **obj_ptr)
 
 script_obj_t *script_obj_new_null (void)
 {
-        script_obj_t *obj = malloc (sizeof(script_obj_t));
+        script_obj_t *obj = script_obj_alloc ();
 
         obj->type = SCRIPT_OBJ_TYPE_NULL;
         obj->refcount = 1;
@@ -157,7 +200,7 @@ script_obj_t *script_obj_new_null (void)
 
 script_obj_t *script_obj_new_number (script_number_t number)
 {
-        script_obj_t *obj = malloc (sizeof(script_obj_t));
+        script_obj_t *obj = script_obj_alloc ();
 
         obj->type = SCRIPT_OBJ_TYPE_NUMBER;
         obj->refcount = 1;
@@ -168,7 +211,7 @@ script_obj_t *script_obj_new_number (script_number_t number)
 script_obj_t *script_obj_new_string (const char *string)
 {
         if (!string) return script_obj_new_null ();
-        script_obj_t *obj = malloc (sizeof(script_obj_t));
+        script_obj_t *obj = script_obj_alloc ();
         obj->type = SCRIPT_OBJ_TYPE_STRING;
         obj->refcount = 1;
         obj->data.string = strdup (string);
@@ -177,7 +220,7 @@ script_obj_t *script_obj_new_string (const char *string)
 
 script_obj_t *script_obj_new_hash (void)
 {
-        script_obj_t *obj = malloc (sizeof(script_obj_t));
+        script_obj_t *obj = script_obj_alloc ();
 
         obj->type = SCRIPT_OBJ_TYPE_HASH;
         obj->data.hash = ply_hashtable_new (ply_hashtable_string_hash,
@@ -188,7 +231,7 @@ script_obj_t *script_obj_new_hash (void)
 
 script_obj_t *script_obj_new_function (script_function_t *function)
 {
-        script_obj_t *obj = malloc (sizeof(script_obj_t));
+        script_obj_t *obj = script_obj_alloc ();
 
         obj->type = SCRIPT_OBJ_TYPE_FUNCTION;
         obj->data.function = function;
@@ -198,7 +241,7 @@ script_obj_t *script_obj_new_function (script_function_t *function)
 
 script_obj_t *script_obj_new_ref (script_obj_t *sub_obj)
 {
-        script_obj_t *obj = malloc (sizeof(script_obj_t));
+        script_obj_t *obj = script_obj_alloc ();
 
         sub_obj = script_obj_deref_direct (sub_obj);
         script_obj_ref (sub_obj);
@@ -210,7 +253,7 @@ script_obj_t *script_obj_new_ref (script_obj_t *sub_obj)
 
 script_obj_t *script_obj_new_extend (script_obj_t *obj_a, script_obj_t *obj_b)
 {
-        script_obj_t *obj = malloc (sizeof(script_obj_t));
+        script_obj_t *obj = script_obj_alloc ();
 
         obj_a = script_obj_deref_direct (obj_a);
         obj_b = script_obj_deref_direct (obj_b);
@@ -227,7 +270,7 @@ script_obj_t *script_obj_new_native (void                      *object_data,
                                      script_obj_native_class_t *class)
 {
         if (!object_data) return script_obj_new_null ();
-        script_obj_t *obj = malloc (sizeof(script_obj_t));
+        script_obj_t *obj = script_obj_alloc ();
         obj->type = SCRIPT_OBJ_TYPE_NATIVE;
         obj->data.native.class = class;
         obj->data.native.object_data = object_data;
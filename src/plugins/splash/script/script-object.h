@@ -40,6 +40,7 @@ typedef void *(*script_obj_direct_func_t)(script_obj_t *,
 
 
 void script_obj_free (script_obj_t *obj);
+void script_obj_trace_statistics (void);
 void script_obj_ref (script_obj_t *obj);
 void script_obj_unref (script_obj_t *obj);
 void script_obj_reset (script_obj_t *obj);
@@ -28,6 +28,7 @@
 #include "ply-list.h"
 #include "ply-bitarray.h"
 #include "ply-logger.h"
+#include "ply-utils.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -40,6 +41,8 @@
 #include "script-debug.h"
 #include "script-scan.h"
 #include "script-parse.h"
+#include "script-compile.h"
+#include "script-cache.h"
 
 #define WITH_SEMIES
 
@@ -150,6 +153,7 @@ static script_op_t *script_parse_new_op (script_op_type_t         type,
         script_op_t *op = malloc (sizeof(script_op_t));
 
         op->type = type;
+        op->code = NULL;
         script_debug_add_element (op, location);
         return op;
 }
@@ -1006,6 +1010,7 @@ void script_parse_op_free (script_op_t *op)
         case SCRIPT_OP_TYPE_CONTINUE:
                 break;
         }
+        script_code_free (op->code);
         script_debug_remove_element (op);
         free (op);
 }
@@ -1026,12 +1031,24 @@ static void script_parse_op_list_free (ply_list_t *op_list)
 
 script_op_t *script_parse_file (const char *filename)
 {
+        double start_time = ply_get_timestamp ();
         script_scan_t *scan = script_scan_file (filename);
 
         if (!scan) {
                 ply_error ("Parser error : Error opening file %s\n", filename);
                 return NULL;
         }
+
+        char *cache_filename = script_cache_get_filename (filename);
+        script_op_t *cached_op = script_cache_load (cache_filename, scan);
+        free (cache_filename);
+        if (cached_op) {
+                ply_trace ("loaded %s from its cache in %.2fms",
+                           filename, (ply_get_timestamp () - start_time) * 1000);
+                script_scan_free (scan);
+                return cached_op;
+        }
+
         script_scan_token_t *curtoken = script_scan_get_current_token (scan);
         script_debug_location_t location = curtoken->location;
         ply_list_t *list = script_parse_op_list (scan);
@@ -1043,6 +1060,10 @@ script_op_t *script_parse_file (const char *filename)
                 return NULL;
         }
         script_op_t *op = script_parse_new_op_block (list, &location);
+        double elapsed = ply_get_timestamp () - start_time;
+        ply_trace ("parsed %s: %zu bytes in %.2fms, %.3fms per KB",
+                   filename, scan->source_size, elapsed * 1000,
+                   scan->source_size ? elapsed * 1000 * 1024 / scan->source_size : 0);
         script_scan_free (scan);
         return op;
 }
@@ -31,15 +31,46 @@
 #include <unistd.h>
 #include <string.h>
 #include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#include "ply-bitarray.h"
 #include "script-scan.h"
 
 #define COLUMN_START_INDEX 0
 
+typedef enum
+{
+        SCRIPT_SCAN_CHAR_CLASS_IDENTIFIER_START = 1 << 0,
+        SCRIPT_SCAN_CHAR_CLASS_IDENTIFIER = 1 << 1,
+        SCRIPT_SCAN_CHAR_CLASS_DIGIT = 1 << 2,
+        SCRIPT_SCAN_CHAR_CLASS_WHITESPACE = 1 << 3,
+} script_scan_char_class_t;
+
+static unsigned char script_scan_char_classes[256];
+
+static void script_scan_init_char_classes (void)
+{
+        int c;
+
+        if (script_scan_char_classes['_']) return;
+
+        for (c = 0; c < 256; c++) {
+                unsigned char classes = 0;
+                if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_')
+                        classes |= SCRIPT_SCAN_CHAR_CLASS_IDENTIFIER_START | SCRIPT_SCAN_CHAR_CLASS_IDENTIFIER;
+                if (c >= '0' && c <= '9')
+                        classes |= SCRIPT_SCAN_CHAR_CLASS_DIGIT | SCRIPT_SCAN_CHAR_CLASS_IDENTIFIER;
+                if (c == ' ' || c == '\n' || c == '\t')
+                        classes |= SCRIPT_SCAN_CHAR_CLASS_WHITESPACE;
+                script_scan_char_classes[c] = classes;
+        }
+}
+
+#define script_scan_char_is(__char, __class) \
+        (script_scan_char_classes[(unsigned char) (__char)] & SCRIPT_SCAN_CHAR_CLASS_ ## __class)
+
 static script_scan_t *script_scan_new (void)
 {
-        unsigned char *chars;
         script_scan_t *scan = calloc (1, sizeof(script_scan_t));
 
         scan->tokens = NULL;
@@ -48,22 +79,51 @@ static script_scan_t *script_scan_new (void)
         scan->line_index = 1;           /* According to Nedit the first line is 1 but first column is 0 */
         scan->column_index = COLUMN_START_INDEX;
 
-        scan->identifier_1st_char = ply_bitarray_new (256);
-        scan->identifier_nth_char = ply_bitarray_new (256);
+        script_scan_init_char_classes ();
+        return scan;
+}
 
-        for (chars =
-                     (unsigned char *) "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz_";
-             *chars;
-             chars++) {
-                ply_bitarray_set (scan->identifier_1st_char, *chars);
+/* The whole file is mapped (or read if it cannot be) up front, rather than
+ * reading it one character at a time.
+ */
+static bool script_scan_load_file (script_scan_t *scan,
+                                   int            fd)
+{
+        struct stat file_info;
+        size_t size = 0;
+        size_t buffer_size = 4096;
+        char *buffer;
+
+        if (fstat (fd, &file_info) == 0 && S_ISREG (file_info.st_mode) && file_info.st_size > 0) {
+                void *data = mmap (NULL, file_info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data != MAP_FAILED) {
+                        scan->source_data = data;
+                        scan->source_size = file_info.st_size;
+                        scan->source_is_mapped = true;
+                        return true;
+                }
         }
-        for (chars =
-                     (unsigned char *) "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz_0123456789";
-             *chars;
-             chars++) {
-                ply_bitarray_set (scan->identifier_nth_char, *chars);
+
+        buffer = malloc (buffer_size);
+        while (true) {
+                ssize_t got;
+
+                if (size == buffer_size) {
+                        buffer_size *= 2;
+                        buffer = realloc (buffer, buffer_size);
+                }
+                got = read (fd, buffer + size, buffer_size - size);
+                if (got == 0) break;
+                if (got < 0) {
+                        free (buffer);
+                        return false;
+                }
+                size += got;
         }
-        return scan;
+        scan->source_data = buffer;
+        scan->source_size = size;
+        scan->source_is_mapped = false;
+        return true;
 }
 
 script_scan_t *script_scan_file (const char *filename)
@@ -72,9 +132,15 @@ script_scan_t *script_scan_file (const char *filename)
 
         if (fd < 0) return NULL;
         script_scan_t *scan = script_scan_new ();
+        if (!script_scan_load_file (scan, fd)) {
+                close (fd);
+                free (scan);
+                return NULL;
+        }
+        close (fd);
         scan->name = strdup (filename);
-        scan->source.fd = fd;
-        scan->source_is_file = true;
+        scan->source = scan->source_data;
+        scan->source_end = scan->source + scan->source_size;
         script_scan_get_next_char (scan);
         return scan;
 }
@@ -85,8 +151,9 @@ script_scan_t *script_scan_string (const char *string,
         script_scan_t *scan = script_scan_new ();
 
         scan->name = strdup (name);
-        scan->source.string = string;
-        scan->source_is_file = false;
+        scan->source = (const unsigned char *) string;
+        scan->source_end = scan->source + strlen (string);
+        scan->source_size = scan->source_end - scan->source;
         script_scan_get_next_char (scan);
         return scan;
 }
@@ -115,13 +182,14 @@ void script_scan_free (script_scan_t *scan)
 {
         int i;
 
-        if (scan->source_is_file) close (scan->source.fd);
+        if (scan->source_is_mapped)
+                munmap (scan->source_data, scan->source_size);
+        else
+                free (scan->source_data);
         for (i = 0; i < scan->tokencount; i++) {
                 script_scan_token_clean (scan->tokens[i]);
                 free (scan->tokens[i]);
         }
-        ply_bitarray_free (scan->identifier_1st_char);
-        ply_bitarray_free (scan->identifier_nth_char);
         free (scan->name);
         free (scan->tokens);
         free (scan);
@@ -140,16 +208,29 @@ unsigned char script_scan_get_next_char (script_scan_t *scan)
         } else if (scan->cur_char != '\0') {
                 scan->column_index++;
         }
-        if (scan->source_is_file) {
-                int got = read (scan->source.fd, &scan->cur_char, 1);
-                if (!got) scan->cur_char = 0;          /* FIXME a better way of doing EOF etc */
-        } else {
-                scan->cur_char = *scan->source.string;
-                if (scan->cur_char) scan->source.string++;
-        }
+        if (scan->source < scan->source_end)
+                scan->cur_char = *scan->source++;
+        else
+                scan->cur_char = 0;
         return scan->cur_char;
 }
 
+/* Appends a character to a string of length *index, growing the allocation
+ * of *size bytes as needed.
+ */
+static void script_scan_string_append (char        **string,
+                                       int          *index,
+                                       int          *size,
+                                       unsigned char c)
+{
+        if (*index + 2 > *size) {
+                *size = *size < 8 ? 16 : *size * 2;
+                *string = realloc (*string, *size);
+        }
+        (*string)[(*index)++] = c;
+        (*string)[*index] = '\0';
+}
+
 void script_scan_read_next_token (script_scan_t       *scan,
                                   script_scan_token_t *token)
 {
@@ -157,50 +238,32 @@ void script_scan_read_next_token (script_scan_t       *scan,
         unsigned char nextchar;
 
         token->whitespace = 0;
-        while (true) {
-                if (curchar == ' ') {
-                        curchar = script_scan_get_next_char (scan);
-                        token->whitespace++;
-                        continue;
-                }                                                                                   /* FIXME restrcuture */
-                if (curchar == '\n') {
-                        curchar = script_scan_get_next_char (scan);
-                        token->whitespace++;
-                        continue;
-                }
-                if (curchar == '\t') {
-                        curchar = script_scan_get_next_char (scan);
-                        token->whitespace++;
-                        continue;
-                }
-                break;
+        while (script_scan_char_is (curchar, WHITESPACE)) {
+                curchar = script_scan_get_next_char (scan);
+                token->whitespace++;
         }
         token->location.line_index = scan->line_index;
         token->location.column_index = scan->column_index;
         token->location.name = scan->name;
         nextchar = script_scan_get_next_char (scan);
 
-        if (ply_bitarray_lookup (scan->identifier_1st_char, curchar)) {
-                int index = 1;
+        if (script_scan_char_is (curchar, IDENTIFIER_START)) {
+                int index = 0;
+                int size = 0;
                 token->type = SCRIPT_SCAN_TOKEN_TYPE_IDENTIFIER;
-                token->data.string = malloc (2 * sizeof(char));
-                token->data.string[0] = curchar;
-                token->data.string[1] = '\0';
+                token->data.string = NULL;
+                script_scan_string_append (&token->data.string, &index, &size, curchar);
                 curchar = nextchar;
-                while (ply_bitarray_lookup (scan->identifier_nth_char, curchar)) {
-                        token->data.string = realloc (token->data.string,
-                                                      (index + 2) * sizeof(char));
-                        token->data.string[index] = curchar;
-                        token->data.string[index + 1] = '\0';
-                        index++;
+                while (script_scan_char_is (curchar, IDENTIFIER)) {
+                        script_scan_string_append (&token->data.string, &index, &size, curchar);
                         curchar = script_scan_get_next_char (scan);
                 }
                 return;
         }
-        if ((curchar >= '0') && (curchar <= '9')) {
+        if (script_scan_char_is (curchar, DIGIT)) {
                 long long int int_value = curchar - '0';
                 curchar = nextchar;
-                while (curchar >= '0' && curchar <= '9') {
+                while (script_scan_char_is (curchar, DIGIT)) {
                         int_value *= 10;
                         int_value += curchar - '0';
                         curchar = script_scan_get_next_char (scan);
@@ -211,7 +274,7 @@ void script_scan_read_next_token (script_scan_t       *scan,
                         double scalar = 1;
 
                         curchar = script_scan_get_next_char (scan);
-                        while (curchar >= '0' && curchar <= '9') {
+                        while (script_scan_char_is (curchar, DIGIT)) {
                                 scalar /= 10;
                                 floatpoint += scalar * (curchar - '0');
                                 curchar = script_scan_get_next_char (scan);
@@ -231,17 +294,20 @@ void script_scan_read_next_token (script_scan_t       *scan,
         if (curchar == '\"') {
                 token->type = SCRIPT_SCAN_TOKEN_TYPE_STRING;
                 int index = 0;
+                int size = 1;
                 token->data.string = malloc (sizeof(char));
                 token->data.string[0] = '\0';
                 curchar = nextchar;
 
                 while (curchar != '\"') {
                         if (curchar == '\0') {
+                                free (token->data.string);
                                 token->data.string = strdup ("End of file before end of string");
                                 token->type = SCRIPT_SCAN_TOKEN_TYPE_ERROR;
                                 return;
                         }
                         if (curchar == '\n') {
+                                free (token->data.string);
                                 token->data.string = strdup ("Line terminator before end of string");
                                 token->type = SCRIPT_SCAN_TOKEN_TYPE_ERROR;
                                 return;
@@ -265,11 +331,7 @@ void script_scan_read_next_token (script_scan_t       *scan,
                                         break;
                                 }
                         }
-                        token->data.string = realloc (token->data.string,
-                                                      (index + 2) * sizeof(char));
-                        token->data.string[index] = curchar;
-                        token->data.string[index + 1] = '\0';
-                        index++;
+                        script_scan_string_append (&token->data.string, &index, &size, curchar);
                         curchar = script_scan_get_next_char (scan);
                 }
                 script_scan_get_next_char (scan);
@@ -284,17 +346,14 @@ void script_scan_read_next_token (script_scan_t       *scan,
                 }
                 if (linecomment) {
                         int index = 0;
+                        int size = 1;
                         token->data.string = malloc (sizeof(char));
                         token->data.string[0] = '\0';
                         curchar = nextchar;
                         for (curchar = nextchar;
                              curchar != '\n' && curchar != '\0';
                              curchar = script_scan_get_next_char (scan)) {
-                                token->data.string = realloc (token->data.string,
-                                                              (index + 2) * sizeof(char));
-                                token->data.string[index] = curchar;
-                                token->data.string[index + 1] = '\0';
-                                index++;
+                                script_scan_string_append (&token->data.string, &index, &size, curchar);
                         }
                         token->type = SCRIPT_SCAN_TOKEN_TYPE_COMMENT;
                         return;
@@ -303,6 +362,7 @@ void script_scan_read_next_token (script_scan_t       *scan,
 
         if ((curchar == '/') && (nextchar == '*')) {
                 int index = 0;
+                int size = 1;
                 int depth = 1;
                 token->data.string = malloc (sizeof(char));
                 token->data.string[0] = '\0';
@@ -322,11 +382,7 @@ void script_scan_read_next_token (script_scan_t       *scan,
                                 depth--;
                                 if (!depth) break;
                         }
-                        token->data.string = realloc (token->data.string,
-                                                      (index + 2) * sizeof(char));
-                        token->data.string[index] = curchar;
-                        token->data.string[index + 1] = '\0';
-                        index++;
+                        script_scan_string_append (&token->data.string, &index, &size, curchar);
                         curchar = nextchar;
                         nextchar = script_scan_get_next_char (scan);
                 }
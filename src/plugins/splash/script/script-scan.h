@@ -23,8 +23,8 @@
 #define SCRIPT_SCAN_H
 
 #include "script-debug.h"
-#include "ply-bitarray.h"
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef enum
 {
@@ -55,20 +55,17 @@ typedef struct
 
 typedef struct
 {
-        union
-        {
-                int         fd;
-                const char *string;
-        } source;
+        const unsigned char  *source;
+        const unsigned char  *source_end;
+        void                 *source_data;      /* file contents, NULL for strings */
+        size_t                source_size;
         char                 *name;
         unsigned char         cur_char;
-        ply_bitarray_t       *identifier_1st_char;
-        ply_bitarray_t       *identifier_nth_char;
         int                   tokencount;
         script_scan_token_t **tokens;
         int                   line_index;
         int                   column_index;
-        bool                  source_is_file;
+        bool                  source_is_mapped;
 } script_scan_t;
 
 
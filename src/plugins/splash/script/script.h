@@ -216,6 +216,7 @@ typedef struct script_op_t
                         struct script_op_t *op2;
                 } cond_op;
         } data;
+        struct script_code_t *code;     /* compiled on first execution */
 } script_op_t;
 
 typedef struct
@@ -49,6 +49,7 @@
 #include "ply-list.h"
 #include "ply-logger.h"
 #include "ply-image.h"
+#include "ply-image-cache.h"
 #include "ply-key-file.h"
 #include "ply-keymap-icon.h"
 #include "ply-trigger.h"
@@ -113,6 +114,13 @@ typedef struct
         ply_trigger_t            *end_trigger;
         ply_pixel_buffer_t       *background_buffer;
         int                       animation_bottom;
+
+        /* the plugin's images at this view's device scale */
+        ply_pixel_buffer_t       *lock_buffer;
+        ply_pixel_buffer_t       *box_buffer;
+        ply_pixel_buffer_t       *corner_buffer;
+        ply_pixel_buffer_t       *header_buffer;
+        ply_pixel_buffer_t       *watermark_buffer;
 } view_t;
 
 typedef struct
@@ -161,6 +169,8 @@ struct _ply_boot_splash_plugin
         ply_progress_animation_transition_t transition;
         double                              transition_duration;
 
+        size_t                              animation_memory_budget;
+
         uint32_t                            background_start_color;
         uint32_t                            background_end_color;
         int                                 background_bgrt_raw_width;
@@ -223,6 +233,8 @@ view_new (ply_boot_splash_plugin_t *plugin,
 
         view->throbber = ply_throbber_new (plugin->animation_dir,
                                            "throbber-");
+        ply_throbber_set_memory_budget (view->throbber,
+                                        plugin->animation_memory_budget);
 
         view->label = ply_label_new ();
         ply_label_set_font (view->label, plugin->font);
@@ -239,6 +251,22 @@ view_new (ply_boot_splash_plugin_t *plugin,
         return view;
 }
 
+static void
+view_release_image_buffers (view_t *view)
+{
+        ply_image_cache_release_buffer (view->lock_buffer);
+        ply_image_cache_release_buffer (view->box_buffer);
+        ply_image_cache_release_buffer (view->corner_buffer);
+        ply_image_cache_release_buffer (view->header_buffer);
+        ply_image_cache_release_buffer (view->watermark_buffer);
+
+        view->lock_buffer = NULL;
+        view->box_buffer = NULL;
+        view->corner_buffer = NULL;
+        view->header_buffer = NULL;
+        view->watermark_buffer = NULL;
+}
+
 static void
 view_free (view_t *view)
 {
@@ -257,6 +285,8 @@ view_free (view_t *view)
         if (view->background_buffer != NULL)
                 ply_pixel_buffer_free (view->background_buffer);
 
+        view_release_image_buffers (view);
+
         free (view);
 }
 
@@ -291,6 +321,8 @@ view_load_end_animation (view_t *view)
         ply_trace ("trying prefix: %s", animation_prefix);
         view->end_animation = ply_animation_new (plugin->animation_dir,
                                                  animation_prefix);
+        ply_animation_set_memory_budget (view->end_animation,
+                                         plugin->animation_memory_budget);
 
         if (ply_animation_load (view->end_animation))
                 return;
@@ -299,6 +331,8 @@ view_load_end_animation (view_t *view)
         ply_trace ("now trying more general prefix: animation-");
         view->end_animation = ply_animation_new (plugin->animation_dir,
                                                  "animation-");
+        ply_animation_set_memory_budget (view->end_animation,
+                                         plugin->animation_memory_budget);
         if (ply_animation_load (view->end_animation))
                 return;
         ply_animation_free (view->end_animation);
@@ -306,6 +340,8 @@ view_load_end_animation (view_t *view)
         ply_trace ("now trying old compat prefix: throbber-");
         view->end_animation = ply_animation_new (plugin->animation_dir,
                                                  "throbber-");
+        ply_animation_set_memory_budget (view->end_animation,
+                                         plugin->animation_memory_budget);
         if (ply_animation_load (view->end_animation)) {
                 /* files named throbber- are for end animation, so
                  * there's no throbber */
@@ -560,6 +596,37 @@ view_set_bgrt_background (view_t *view)
         }
 }
 
+static ply_pixel_buffer_t *
+get_scaled_image_buffer (ply_image_t *image,
+                         int          device_scale)
+{
+        if (image == NULL)
+                return NULL;
+
+        return ply_image_cache_get_buffer (image,
+                                           ply_image_get_width (image),
+                                           ply_image_get_height (image),
+                                           device_scale);
+}
+
+/* Images drawn at a device scale of their own don't have to be
+ * interpolated on every frame, and views on heads with the same
+ * scale share them */
+static void
+view_scale_images (view_t *view,
+                   int     device_scale)
+{
+        ply_boot_splash_plugin_t *plugin = view->plugin;
+
+        view_release_image_buffers (view);
+
+        view->lock_buffer = get_scaled_image_buffer (plugin->lock_image, device_scale);
+        view->box_buffer = get_scaled_image_buffer (plugin->box_image, device_scale);
+        view->corner_buffer = get_scaled_image_buffer (plugin->corner_image, device_scale);
+        view->header_buffer = get_scaled_image_buffer (plugin->header_image, device_scale);
+        view->watermark_buffer = get_scaled_image_buffer (plugin->watermark_image, device_scale);
+}
+
 static bool
 view_load (view_t *view)
 {
@@ -570,6 +637,14 @@ view_load (view_t *view)
 
         plugin = view->plugin;
 
+        /* Decode the animation frames while the background and the
+         * rest of the view get set up */
+        if (view->progress_animation != NULL)
+                ply_progress_animation_start_loading (view->progress_animation);
+
+        if (view->throbber != NULL)
+                ply_throbber_start_loading (view->throbber);
+
         screen_width = ply_pixel_display_get_width (view->display);
         screen_height = ply_pixel_display_get_height (view->display);
 
@@ -579,6 +654,7 @@ view_load (view_t *view)
         screen_scale = ply_pixel_buffer_get_device_scale (buffer);
 
         view_set_bgrt_background (view);
+        view_scale_images (view, screen_scale);
 
         if (!view->background_buffer && plugin->background_tile_image != NULL) {
                 ply_trace ("tiling background to %lux%lu", screen_width, screen_height);
@@ -1117,6 +1193,12 @@ create_plugin (ply_key_file_t *key_file)
                 ply_key_file_get_double (key_file, "two-step",
                                          "TransitionDuration", 0.0);
 
+        /* In KiB, for themes with long or large animations.  Frames past
+         * the budget get decoded as they are shown rather than up front */
+        plugin->animation_memory_budget =
+                MAX (ply_key_file_get_long (key_file, "two-step",
+                                            "AnimationMemoryBudget", 0), 0) * 1024;
+
         plugin->background_start_color =
                 ply_key_file_get_long (key_file, "two-step",
                                        "BackgroundStartColor",
@@ -1383,6 +1465,72 @@ detach_from_event_loop (ply_boot_splash_plugin_t *plugin)
         plugin->loop = NULL;
 }
 
+/* Images are only copied pixel for pixel into unscaled buffers, so only
+ * then do their opaque areas occlude anything.  An empty area is queued
+ * otherwise, to keep the queue in step with draw_image ().
+ */
+static void
+queue_image_occluding_area (ply_pixel_buffer_t *pixel_buffer,
+                            ply_pixel_buffer_t *image_buffer,
+                            ply_rectangle_t    *image_area)
+{
+        ply_rectangle_t occluding_area = { 0, 0, 0, 0 };
+
+        if (ply_pixel_buffer_get_device_scale (pixel_buffer) == 1) {
+                ply_pixel_buffer_get_opaque_area (image_buffer, &occluding_area);
+                occluding_area.x += image_area->x;
+                occluding_area.y += image_area->y;
+        }
+
+        ply_pixel_buffer_queue_occluding_area (pixel_buffer, &occluding_area);
+}
+
+static void
+draw_image (ply_pixel_buffer_t *pixel_buffer,
+            ply_pixel_buffer_t *image_buffer,
+            ply_rectangle_t    *image_area)
+{
+        ply_pixel_buffer_dequeue_occluding_area (pixel_buffer);
+        ply_pixel_buffer_fill_with_buffer (pixel_buffer, image_buffer,
+                                           image_area->x, image_area->y);
+}
+
+static void
+get_corner_image_area (view_t          *view,
+                       ply_rectangle_t *screen_area,
+                       ply_rectangle_t *image_area)
+{
+        ply_boot_splash_plugin_t *plugin = view->plugin;
+
+        image_area->width = ply_image_get_width (plugin->corner_image);
+        image_area->height = ply_image_get_height (plugin->corner_image);
+        image_area->x = screen_area->width - image_area->width - 20;
+        image_area->y = screen_area->height - image_area->height - 20;
+}
+
+static void
+get_header_image_area (view_t          *view,
+                       ply_rectangle_t *screen_area,
+                       ply_rectangle_t *image_area)
+{
+        ply_boot_splash_plugin_t *plugin = view->plugin;
+        long sprite_height;
+
+        if (view->progress_animation != NULL)
+                sprite_height = ply_progress_animation_get_height (view->progress_animation);
+        else
+                sprite_height = 0;
+
+        if (view->throbber != NULL)
+                sprite_height = MAX (ply_throbber_get_height (view->throbber),
+                                     sprite_height);
+
+        image_area->width = ply_image_get_width (plugin->header_image);
+        image_area->height = ply_image_get_height (plugin->header_image);
+        image_area->x = screen_area->width / 2.0 - image_area->width / 2.0;
+        image_area->y = plugin->animation_vertical_alignment * screen_area->height - sprite_height / 2.0 - image_area->height;
+}
+
 static void
 draw_background (view_t             *view,
                  ply_pixel_buffer_t *pixel_buffer,
@@ -1429,12 +1577,8 @@ draw_background (view_t             *view,
                 ply_pixel_buffer_fill_with_hex_color (pixel_buffer, &area,
                                                       plugin->background_start_color);
 
-        if (plugin->watermark_image != NULL) {
-                uint32_t *data;
-
-                data = ply_image_get_data (plugin->watermark_image);
-                ply_pixel_buffer_fill_with_argb32_data (pixel_buffer, &view->watermark_area, data);
-        }
+        if (view->watermark_buffer != NULL)
+                draw_image (pixel_buffer, view->watermark_buffer, &view->watermark_area);
 }
 
 static void
@@ -1447,25 +1591,45 @@ on_draw (view_t             *view,
 {
         ply_boot_splash_plugin_t *plugin;
         ply_rectangle_t screen_area;
-        ply_rectangle_t image_area;
+        ply_rectangle_t corner_area;
+        ply_rectangle_t header_area;
+        bool is_dialog;
 
         plugin = view->plugin;
 
-        draw_background (view, pixel_buffer, x, y, width, height);
-
         ply_pixel_buffer_get_size (pixel_buffer, &screen_area);
 
-        if (plugin->state == PLY_BOOT_SPLASH_DISPLAY_QUESTION_ENTRY ||
-            plugin->state == PLY_BOOT_SPLASH_DISPLAY_PASSWORD_ENTRY) {
-                uint32_t *box_data, *lock_data;
+        is_dialog = plugin->state == PLY_BOOT_SPLASH_DISPLAY_QUESTION_ENTRY ||
+                    plugin->state == PLY_BOOT_SPLASH_DISPLAY_PASSWORD_ENTRY;
 
-                if (plugin->box_image) {
-                        box_data = ply_image_get_data (plugin->box_image);
-                        ply_pixel_buffer_fill_with_argb32_data (pixel_buffer,
-                                                                &view->box_area,
-                                                                box_data);
+        /* Queue the opaque parts of the images in the order they get drawn
+         * below, so nothing gets painted underneath them first */
+        if (view->watermark_buffer != NULL)
+                queue_image_occluding_area (pixel_buffer, view->watermark_buffer, &view->watermark_area);
+
+        if (is_dialog) {
+                if (view->box_buffer != NULL)
+                        queue_image_occluding_area (pixel_buffer, view->box_buffer, &view->box_area);
+                if (view->lock_buffer != NULL)
+                        queue_image_occluding_area (pixel_buffer, view->lock_buffer, &view->lock_area);
+        } else {
+                if (view->corner_buffer != NULL) {
+                        get_corner_image_area (view, &screen_area, &corner_area);
+                        queue_image_occluding_area (pixel_buffer, view->corner_buffer, &corner_area);
                 }
 
+                if (view->header_buffer != NULL) {
+                        get_header_image_area (view, &screen_area, &header_area);
+                        queue_image_occluding_area (pixel_buffer, view->header_buffer, &header_area);
+                }
+        }
+
+        draw_background (view, pixel_buffer, x, y, width, height);
+
+        if (is_dialog) {
+                if (view->box_buffer != NULL)
+                        draw_image (pixel_buffer, view->box_buffer, &view->box_area);
+
                 ply_entry_draw_area (view->entry,
                                      pixel_buffer,
                                      x, y, width, height);
@@ -1479,10 +1643,8 @@ on_draw (view_t             *view,
                                      pixel_buffer,
                                      x, y, width, height);
 
-                lock_data = ply_image_get_data (plugin->lock_image);
-                ply_pixel_buffer_fill_with_argb32_data (pixel_buffer,
-                                                        &view->lock_area,
-                                                        lock_data);
+                if (view->lock_buffer != NULL)
+                        draw_image (pixel_buffer, view->lock_buffer, &view->lock_area);
         } else {
                 if (plugin->mode_settings[plugin->mode].use_progress_bar)
                         ply_progress_bar_draw_area (view->progress_bar, pixel_buffer,
@@ -1505,35 +1667,11 @@ on_draw (view_t             *view,
                                                  pixel_buffer,
                                                  x, y, width, height);
 
-                if (plugin->corner_image != NULL) {
-                        image_area.width = ply_image_get_width (plugin->corner_image);
-                        image_area.height = ply_image_get_height (plugin->corner_image);
-                        image_area.x = screen_area.width - image_area.width - 20;
-                        image_area.y = screen_area.height - image_area.height - 20;
-
-                        ply_pixel_buffer_fill_with_argb32_data (pixel_buffer, &image_area, ply_image_get_data (plugin->corner_image));
-                }
-
-                if (plugin->header_image != NULL) {
-                        long sprite_height;
-
-
-                        if (view->progress_animation != NULL)
-                                sprite_height = ply_progress_animation_get_height (view->progress_animation);
-                        else
-                                sprite_height = 0;
+                if (view->corner_buffer != NULL)
+                        draw_image (pixel_buffer, view->corner_buffer, &corner_area);
 
-                        if (view->throbber != NULL)
-                                sprite_height = MAX (ply_throbber_get_height (view->throbber),
-                                                     sprite_height);
-
-                        image_area.width = ply_image_get_width (plugin->header_image);
-                        image_area.height = ply_image_get_height (plugin->header_image);
-                        image_area.x = screen_area.width / 2.0 - image_area.width / 2.0;
-                        image_area.y = plugin->animation_vertical_alignment * screen_area.height - sprite_height / 2.0 - image_area.height;
-
-                        ply_pixel_buffer_fill_with_argb32_data (pixel_buffer, &image_area, ply_image_get_data (plugin->header_image));
-                }
+                if (view->header_buffer != NULL)
+                        draw_image (pixel_buffer, view->header_buffer, &header_area);
                 ply_label_draw_area (view->title_label,
                                      pixel_buffer,
                                      x, y, width, height);